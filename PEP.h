@@ -17,6 +17,7 @@
 #define _PEP_H_
 
 // Optimized version with minimal dependencies:
+#include <stddef.h> // offsetof
 #include <stdint.h> // uint*_t
 #include <stdlib.h> // mem-alloc
 #include <stdio.h> // FILE
@@ -44,6 +45,26 @@ typedef enum
 }
 pep_format;
 
+// Pixels given as bytes rather than packed colors, for
+// `pep_compress_bytes()`: pep_rgba8 is R, G, B, A in memory (what most image
+// decoders and graphics APIs hand out) and pep_bgra8 is B, G, R, A, on any
+// host. `pep_byte_format()` gives the pep_format they read as.
+typedef enum
+{
+	pep_rgba8,
+	pep_bgra8
+}
+pep_byte_order;
+
+// Every conversion between two pep_formats is a byte swap and/or a rotation
+// of the 32-bit color, so it's worked out once per call rather than per color.
+typedef struct
+{
+	uint32_t bswap; // 0 or 1, applied first
+	uint32_t rotl; // 0, 8, 16 or 24
+}
+_pep_swizzle;
+
 // Palette colors can be restricted in the serialization phase to a maximum
 // amount of bits per channel.
 // The default is 8 bits per channel (standard 32 bit colors)
@@ -56,6 +77,31 @@ typedef enum
 }
 _pep_color_bits;
 
+// Which entropy coder a pep's bytes are in, see "rANS coder". The encoder
+// takes it from `pep_encode_options` and the header records it.
+typedef enum
+{
+	pep_coder_arith = 0, // adaptive PPM arithmetic coding: the smallest files
+	pep_coder_rans, // static tables and rANS: bigger files, much faster decoding
+	pep_coder_arith_recip // pep_coder_arith without divides, see "Reciprocal scaling"
+}
+pep_coder;
+
+// Why a pep came back empty (see `pep.error`). pep_compress*(),
+// pep_deserialize() and pep_load() set it instead of silently returning a
+// truncated or broken image.
+typedef enum
+{
+	pep_ok,
+	pep_error_invalid_argument, // NULL pointers, zero width/height
+	pep_error_too_large, // a dimension above PEP_MAX_DIMENSION, or too big to allocate
+	pep_error_out_of_memory,
+	pep_error_io, // pep_load() couldn't open or read the file
+	pep_error_unsupported, // written by a newer version of this header
+	pep_error_corrupt
+}
+pep_error;
+
 // This is the main struct-type that contains values for using this format.
 // The only weird one is `max_symbols`, which is a unique value per-image for
 // how many prediction-symbols were used to compress it.
@@ -67,23 +113,44 @@ typedef struct
 {
 	uint8_t* bytes;
 	uint64_t bytes_size;
-	uint16_t width;
-	uint16_t height;
+	uint32_t width;
+	uint32_t height;
+	uint16_t stripe_rows; // 0 = single stream, see "Striped container"
+	pep_coder coder;
+	uint8_t freq_step; // 0 = PEP_FREQ_STEP, see "Model tuning"
+	uint16_t freq_max; // 0 = PEP_FREQ_MAX
 	pep_format format;
 	uint32_t palette[ 256 ];
 	uint8_t palette_size;
 	uint8_t max_symbols;
 	_pep_color_bits color_bits;
+	pep_error error;
+
+	// Set when `bytes` points into memory this pep doesn't own (see
+	// `pep_deserialize_view()` and `pep_load_mapped()`), so `pep_free()`
+	// leaves it alone, or unmaps the file it came from.
+	uint8_t _bytes_borrowed;
+	void* _mapping;
+	uint64_t _mapping_size;
 }
 pep;
 
+// Largest width or height that compress/deserialize accept. The original
+// header packed both into 12 bits (4095 max); bigger images are written with
+// PEP_FLAG_WIDE_DIMS instead. Pixel counts are 64-bit throughout, so this
+// mostly guards against absurd allocations from corrupt files.
+#ifndef PEP_MAX_DIMENSION
+	#define PEP_MAX_DIMENSION ( 1u << 20 )
+#endif
+
 // This is the amount of frequencies per context, and the amount of contexts,
 // with [256] being the order0 context.
 // Originally there were 256*256 contexts, but I found the image didn't get
 // much bigger with the same amount of frequencies. Theoretically the more
 // contexts you have the smaller the image is...
+// PEP_FREQ_N is the most a context can need: 256 packed symbols and the
+// escape. Each image only lays out what its alphabet uses, see `_pep_context`.
 #define PEP_FREQ_N 257
-#define PEP_FREQ_END ( PEP_FREQ_N - 1 )
 // Optimization: Use power-of-2 contexts for fast modulo via masking
 #define PEP_CONTEXTS_MAX 256
 #define PEP_CONTEXTS_MASK (PEP_CONTEXTS_MAX - 1)
@@ -99,12 +166,40 @@ pep;
 #define PEP_ARITH_MID ( PEP_ARITH_LOW * 2 )
 #define PEP_ARITH_HIGH ( PEP_ARITH_LOW * 3 )
 
+// Optional Fenwick-tree (binary indexed) cumulative frequency model.
+// The default model sums `freq[ 0..symbol )` linearly for every coded symbol,
+// which is cheap for small palettes but dominates 8-bit-index images. With
+// `#define PEP_FENWICK` before including, images with at least
+// PEP_FENWICK_MIN_PALETTE colors keep a tree per context next to the plain
+// frequencies, making both lookups and updates O(log n). The bitstream is
+// identical either way. It adds ~265KB to `pep_codec_ctx`.
+// Below ~64 colors the symbols stay small enough that the linear scan wins.
+#ifndef PEP_FENWICK_MIN_PALETTE
+	#define PEP_FENWICK_MIN_PALETTE 65
+#endif
+
+// A tree over n frequencies is n + 1 nodes; node[ i ] holds the sum of
+// freq[ i - ( i & -i ) .. i ), 1-based.
+typedef uint32_t _pep_fenwick;
+
 // During the compression process the context per frequency-group needs to be
 // tracked, with the sum of all frequencies being stored.
+// Packed symbols only go up to the image's alphabet,
+// `1 << ( bits_per_index * indices_per_byte )`, so a context only uses that
+// many frequencies plus the escape (at `escape`), and the contexts are packed
+// that close together in the codec context (see `_pep_context_at()`). A 16
+// color image then codes out of 256 rows of 257, but a 6 color one out of 64
+// rows of 65, which stays in L1 and rescales in a quarter of the time.
+// The order0 context starts every one of PEP_FREQ_N symbols at 1; the ones
+// past the alphabet are never coded and stay 1 through every rescale, so
+// they're kept as `tail` in the sum instead, and the bitstream doesn't change.
+#define _PEP_FREQ_STRIDE( N ) ( ( ( N ) + 7u ) & ~7u )
 typedef struct
 {
-	uint16_t freq[ PEP_FREQ_N ];
 	uint32_t sum;
+	uint16_t escape;
+	uint16_t tail;
+	uint16_t freq[ _PEP_FREQ_STRIDE( PEP_FREQ_N ) ];
 }
 _pep_context;
 
@@ -119,12 +214,49 @@ _pep_context;
 // optimization of making this smaller :shrugs:
 #define PEP_FREQ_MAX ( PEP_FREQ_N << 2 )
 
+// Model tuning:
+// Every symbol a context codes adds a step to its frequency (a context's
+// first sight of a symbol, and its escape, only add 1), and once one goes
+// over the limit the context is quartered. PEP_FREQ_STEP and PEP_FREQ_MAX are
+// the defaults; an encoder can pick others per image (see
+// `pep_encode_options`), which the header then records under PEP_FLAG_MODEL.
+// Steps go up to PEP_FREQ_STEP_LIMIT and limits from PEP_FREQ_MAX_MIN to
+// PEP_FREQ_MAX_LIMIT, so frequencies stay 16-bit and a context's sum stays
+// well under the 2^24 the arithmetic coder can widen its range to.
+#define PEP_FREQ_STEP 2u
+#define PEP_FREQ_STEP_LIMIT 16u
+#define PEP_FREQ_MAX_MIN 16u
+#define PEP_FREQ_MAX_LIMIT 16384u
+
+// Reciprocal scaling:
+// Coding a value divides the range by the context's sum, and decoding one
+// divides again to find where the code falls, so every symbol (and escape)
+// pays for two hardware divides one after the other. pep_coder_arith_recip
+// rounds the sum up, and the range per unit down, to PEP_RECIP_BITS
+// significant bits, so each divide is one by d < 2^PEP_RECIP_BITS after a
+// shift, which a table turns into a multiply: floor( x / d ) is
+// ( ( ( x * magic ) >> 32 ) + x ) >> shift, exact for every 32-bit x
+// (Granlund & Montgomery), with magic = ceil( 2^( 32 + shift ) / d ) - 2^32
+// for the shift that fits d. The range left over by the rounding, under
+// 2^-( PEP_RECIP_BITS - 1 ) of it each time, goes unused, so files come out
+// a little bigger. PEP_RECIP_BITS is part of the format.
+#define PEP_RECIP_BITS 10u
+#define PEP_RECIP_N ( 1u << PEP_RECIP_BITS )
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t shift;
+}
+_pep_recip;
+
 // Arithmetic coding structures:
 typedef struct
 {
 	uint8_t* data_ref;
 	uint32_t low;
 	uint32_t range;
+	const _pep_recip* recip; // NULL to divide (pep_coder_arith)
 }
 _pep_ac_encode;
 
@@ -135,6 +267,7 @@ typedef struct
 	uint32_t low;
 	uint32_t range;
 	uint32_t code;
+	const _pep_recip* recip; // NULL to divide (pep_coder_arith)
 }
 _pep_ac_decode;
 
@@ -146,6 +279,11 @@ typedef struct
 }
 _pep_prob;
 
+// Most bytes one symbol can move through the coder: an escape codes two
+// values, and each can shift a few bytes to widen the range for its scale
+// and a few more to normalize.
+#define _PEP_SYMBOL_MAX_BYTES 32
+
 typedef struct
 {
 	_pep_prob prob;
@@ -153,35 +291,379 @@ typedef struct
 }
 _pep_sym_decode;
 
+// rANS coder:
+// The arithmetic coder adapts its model as it goes, so decoding a symbol is a
+// divide, a frequency scan and an update. With pep_coder_rans every stream
+// instead starts with static frequency tables, normalized to
+// PEP_RANS_SCALE, and is coded with a 32-bit rANS state, so decoding is a
+// slot lookup, a multiply-add and at most two byte reads per symbol. Tables
+// are per previous symbol, like the PPM contexts; the encoder gives the
+// PEP_RANS_TABLES - 1 busiest ones their own and the rest share table 0.
+// Files come out bigger, as the tables take bytes and don't adapt.
+// PEP_RANS_TABLES only limits what the encoder writes, fewer cost ratio on
+// images with more busy contexts than that. Every reader holds the format's
+// full _PEP_RANS_TABLES_MAX, so files read the same whatever either side was
+// built with. That puts ~1.3MB in `pep_codec_ctx`, of which a decode only
+// touches the tables its stream has.
+//
+// Each symbol's state update depends on the one before, so one state leaves
+// most of a core idle. A stream can instead interleave up to
+// PEP_RANS_STATES_MAX states, symbol i using state i % states, all feeding one
+// byte stream. The slot lookup for a symbol then doesn't wait on the previous
+// symbol's multiply-add and byte reads, only on the symbol itself (for its
+// table), so the CPU overlaps them. Each extra state costs 4 bytes; two
+// decode ~1.25x faster than one, and more don't add to that.
+//
+// A stream starts with a byte for its number of states, one for the number of
+// tables past table 0 and the previous symbol each of them is for. Every table follows as a byte for its
+// symbol count less one, then per symbol how many unused symbols come before
+// it (since the previous one) and its frequency less one as a varint, except
+// for the last symbol's, which is what's left of PEP_RANS_SCALE. The states
+// come next, first to last, 4 bytes little-endian each, then the
+// renormalization bytes in the order they're read.
+#define PEP_RANS_SCALE_BITS 12u
+#define PEP_RANS_SCALE ( 1u << PEP_RANS_SCALE_BITS )
+#define PEP_RANS_LOW ( 1u << 23 )
+#ifndef PEP_RANS_TABLES
+	#define PEP_RANS_TABLES 64
+#endif
+#define _PEP_RANS_TABLES_MAX 256 // table 0 and one per previous symbol at most
+#if PEP_RANS_TABLES < 1 || PEP_RANS_TABLES > _PEP_RANS_TABLES_MAX
+	#error "PEP_RANS_TABLES has to be 1..256"
+#endif
+#define PEP_RANS_STATES_MAX 4
+
+// Largest record of the tables: a symbol list takes a count, then up to a
+// distance and two varint bytes per symbol (the list of tables is shorter).
+#define _PEP_RANS_RECORD_MAX ( 1 + 256 * 3 )
+
+typedef struct
+{
+	uint16_t freq;
+	uint16_t low;
+}
+_pep_rans_symbol;
+
+typedef struct
+{
+	_pep_rans_symbol symbols[ 256 ];
+	uint8_t slots[ PEP_RANS_SCALE ]; // which symbol each slot of the scale is
+}
+_pep_rans_table;
+
+typedef struct
+{
+	uint8_t table_of[ 256 ]; // previous symbol -> table
+	uint32_t table_count;
+	uint32_t state_count;
+	_pep_rans_table tables[ _PEP_RANS_TABLES_MAX ];
+}
+_pep_rans_model;
+
 // Update the frequency table after encoding/decoding a symbol.
 // This increments the symbol's frequency and the total sum.
 // When we hit freq_max, we scale everything down to a quarter
 // to keep the frequencies manageable.
 // This dynamic part helps the compression adapt to the image's patterns.
-#define PEP_UPDATE( CONTEXT, SYMBOL )\
+// The rescale is `( f + 3 ) >> 2`, which keeps 0 at 0 and 1..2 at 1, so it
+// runs branch-free through the (vectorized) frequency kernels.
+// STEP and LIMIT are the stream's, see "Model tuning".
+#define PEP_UPDATE( CONTEXT, SYMBOL, STEP, LIMIT )\
 	do\
 	{\
-		CONTEXT->freq[ SYMBOL ] += 2;\
-		CONTEXT->sum += 2;\
-		if( CONTEXT->freq[ SYMBOL ] > PEP_FREQ_MAX )\
+		CONTEXT->freq[ SYMBOL ] += STEP;\
+		CONTEXT->sum += STEP;\
+		if( CONTEXT->freq[ SYMBOL ] > LIMIT )\
 		{\
-			CONTEXT->sum = 0;\
-			for( uint64_t f = 0; f < PEP_FREQ_N; f++ )\
-			{\
-				const uint16_t _f = CONTEXT->freq[ f ];\
-				if( _f == 0 ) continue;\
-				else if( _f <= 2 )\
-				{\
-					CONTEXT->freq[ f ] = 1;\
-					CONTEXT->sum++;\
-					continue;\
-				}\
-				CONTEXT->sum += ( CONTEXT->freq[ f ] = ( _f + 3 ) >> 2 );\
-			}\
+			CONTEXT->sum = _pep_rescale( CONTEXT->freq, CONTEXT->escape + 1u ) + CONTEXT->tail;\
 		}\
 	}\
 	while( 0 )
 
+// Colors are mapped to palette indices through an open-addressing hash, so
+// encoding doesn't slow down as the palette grows. Each slot holds index + 1
+// (0 = empty) and the color itself is compared against the palette.
+// Keep this at least twice the max palette size.
+#define PEP_PALETTE_HASH_BITS 9
+#define PEP_PALETTE_HASH_N ( 1 << PEP_PALETTE_HASH_BITS )
+#define PEP_PALETTE_HASH_MASK ( PEP_PALETTE_HASH_N - 1 )
+
+// Profiling:
+// Building with PEP_PROFILE gives every codec context a `profile`: the time
+// spent in each phase, and counters for the coder's slow paths. They add up
+// over every call made with that context until `pep_codec_ctx_reset()`.
+// Calls that spread stripes over `run` use a context per stripe, so profile
+// those serially. Without PEP_PROFILE none of this is compiled in.
+// Times come from timespec_get(); define PEP_PROFILE_NOW() to return
+// nanoseconds from another clock.
+#ifdef PEP_PROFILE
+typedef struct
+{
+	uint64_t palette_ns; // palette construction and the color hash
+	uint64_t code_ns; // color lookup, index packing and arithmetic coding (one fused loop)
+	uint64_t output_ns; // copying the coded chunks out
+	uint64_t decode_ns;
+
+	uint64_t symbols; // packed symbols coded or decoded
+	uint64_t escapes; // of those, the ones that fell back to order-0
+	uint64_t rescales; // PEP_UPDATE quarterings
+	uint64_t scans; // linear frequency scans (contexts without a Fenwick tree)
+	uint64_t scan_length; // frequencies those scans went through
+}
+pep_profile;
+#endif
+
+// How the encoder numbers the palette it builds.
+// First-seen is the original order. By-count gives the most common colors the
+// lowest indices: the coder scans frequencies from symbol 0 up, so that's
+// less work per pixel for both the encoder and the decoder. The file format
+// doesn't change, only which color is first, which matters if you decode
+// with `first_color_transparent`.
+typedef enum
+{
+	pep_palette_first_seen = 0,
+	pep_palette_by_count
+}
+pep_palette_order;
+
+// Encoder choices. They're kept on a codec context, so every call made with
+// it (and a push encoder given it) uses them. `pep_codec_ctx_reset()` sets the
+// defaults, so change them after it.
+typedef struct
+{
+	pep_palette_order palette_order;
+	pep_coder coder;
+	uint8_t rans_states; // interleaved rANS states, 1..PEP_RANS_STATES_MAX (default 2)
+	uint8_t freq_step; // the arithmetic coders' model, see "Model tuning"
+	uint16_t freq_max;
+}
+pep_encode_options;
+
+// All of the mutable state the coder needs lives in a codec context, so that
+// nothing is shared between calls. Keep one per thread and reuse it across
+// images to avoid any per-image allocation; it is reset on every call (except
+// for `options`).
+// You can also allocate it yourself (static, stack, arena...) as long as you
+// call `pep_codec_ctx_reset()` before first use.
+typedef struct
+{
+	pep_encode_options options;
+	_pep_context contexts[ PEP_CONTEXTS_MAX + 1 ]; // room for the largest alphabet
+	_pep_rans_model rans;
+	_pep_recip recip[ PEP_RECIP_N ]; // filled on first use, see `_pep_recip_prepare()`
+	uint8_t recip_ready;
+#ifdef PEP_FENWICK
+	_pep_fenwick fenwick[ ( PEP_CONTEXTS_MAX + 1 ) * ( PEP_FREQ_N + 1 ) ];
+#endif
+	uint32_t alphabet; // this image's, which is also where order0 goes
+	uint32_t context_stride; // bytes from one context to the next
+	uint32_t palette[ 256 ];
+	uint16_t palette_hash[ PEP_PALETTE_HASH_N ];
+#ifdef PEP_PROFILE
+	pep_profile profile;
+#endif
+}
+pep_codec_ctx;
+
+// Decoder state shared by the decompress entry points: one arithmetic-decoder
+// over one pep's bytes, and where it is in the PPM model.
+typedef struct
+{
+	pep_codec_ctx* ctx;
+	_pep_context* order0;
+	const _pep_rans_model* rans_model; // NULL for the arithmetic coder
+	_pep_ac_decode ac; // only data_ref and end_of_data are used with rANS
+	uint32_t rans_states[ PEP_RANS_STATES_MAX ];
+	uint32_t rans_state; // which of rans_states codes the next symbol
+	uint32_t context_id;
+	uint32_t context_stride; // copied from ctx so it stays in a register
+	uint32_t freq_step; // the pep's model, see "Model tuning"
+	uint32_t freq_max;
+	uint16_t max_symbols;
+	uint8_t use_fenwick;
+	uint8_t bits_per_index;
+	uint8_t indices_per_byte;
+	uint8_t index_mask;
+}
+_pep_decoder;
+
+// Encoder state for one stream, kept between calls so pixels can be coded a
+// batch at a time.
+typedef struct
+{
+	pep_codec_ctx* ctx;
+	_pep_context* order0;
+	_pep_ac_encode ac;
+	uint32_t context_id;
+	uint32_t context_stride; // copied from ctx so it stays in a register
+	uint32_t freq_step; // from the options, see "Model tuning"
+	uint32_t freq_max;
+	uint32_t last_p; // last pixel looked up, and its palette index
+	uint16_t index;
+	uint8_t has_last;
+	uint8_t symbol; // indices packed so far
+	uint8_t indices_in_byte;
+	uint8_t bits_per_index;
+	uint8_t indices_per_byte;
+	uint8_t use_fenwick;
+	uint8_t max_symbol;
+	uint8_t missing; // a pixel wasn't in the palette
+	uint8_t rans; // rANS states, 0 for the arithmetic coder; symbols are only
+	              // collected, see `_pep_rans_sink_code()`
+}
+_pep_encoder;
+
+// Compressed bytes are collected in fixed-size chunks, so what they take
+// follows the compressed size instead of a worst case per pixel.
+// The coder writes into `scratch`, one batch of pixels at a time sized so it
+// can't overflow, and the scratch is appended to the chunks once half full.
+#ifndef PEP_ENCODER_CHUNK_SIZE
+	#define PEP_ENCODER_CHUNK_SIZE ( 1 << 16 )
+#endif
+
+typedef struct _pep_chunk
+{
+	struct _pep_chunk* next;
+	uint8_t data[ PEP_ENCODER_CHUNK_SIZE ];
+}
+_pep_chunk;
+
+typedef struct
+{
+	_pep_chunk* first;
+	_pep_chunk* last;
+	uint64_t size;
+	uint8_t* scratch;
+}
+_pep_sink;
+
+// Striped container:
+// By default a pep is one arithmetic-coded stream over the whole image, so a
+// single core does all of the work. `pep_compress_striped()` instead cuts the
+// image into horizontal stripes of `stripe_rows` rows (the last one can be
+// shorter), each coded as its own stream from freshly reset contexts. Stripes
+// can then be encoded and decoded in parallel, or decoded on their own.
+// The palette and max_symbols are shared. `bytes` starts with a table of one
+// little-endian uint32 end offset per stripe (relative to the end of the
+// table), followed by the streams back to back. Every stripe starts with an
+// empty model, so very short stripes cost some compression.
+//
+// Serialized, bit 7 of the first header byte marks an extended header: a
+// flags byte follows it, then whatever those flags need (a varint
+// `stripe_rows` for PEP_FLAG_STRIPED, then a `freq_step` byte and a varint
+// `freq_max` for PEP_FLAG_MODEL). PEP_FLAG_WIDE_DIMS swaps the packed
+// 12-bit dimensions for a varint width and height. Peps that need neither keep
+// the old layout, so older readers still load them.
+#define PEP_HEADER_EXTENDED 0x80
+#define PEP_FLAG_STRIPED 0x01
+#define PEP_FLAG_WIDE_DIMS 0x02
+#define PEP_FLAG_RANS 0x04 // coder is pep_coder_rans
+#define PEP_FLAG_ARITH_RECIP 0x08 // coder is pep_coder_arith_recip
+#define PEP_FLAG_MODEL 0x10 // freq_step and freq_max aren't the defaults
+
+// Runs task( task_data, i ) once for every i in [ 0, count ), in any order and
+// on any threads, and returns when all of them are done. PEP doesn't do any
+// threading itself, so hook up your own thread pool / job system here.
+typedef void ( *pep_parallel_for )( void* user, const uint32_t count, void ( *task )( void* task_data, const uint32_t index ), void* task_data );
+
+// Streaming decoder:
+// `pep_decoder_init()` reads a serialized pep through a callback (or from
+// memory with `pep_decoder_init_bytes()`) and `pep_decoder_read_rows()` hands
+// the image out a few rows at a time, so neither the whole file nor the whole
+// image has to be in memory. `info` holds the header (width, height, palette,
+// format...; its `bytes` stay NULL) and `info.error` says what went wrong.
+// Everything starting with an underscore is internal.
+typedef size_t ( *pep_read_fn )( void* user, uint8_t* out_bytes, const size_t max_bytes );
+
+#ifndef PEP_DECODER_BUFFER_SIZE
+	#define PEP_DECODER_BUFFER_SIZE ( 1 << 16 )
+#endif
+
+// Largest serialized header: flags, extended flags, stripe rows, model,
+// palette size, two dimension varints, bytes_size varint, max_symbols and the
+// palette.
+#define PEP_HEADER_MAX_SIZE ( 32 + 256 * 4 )
+
+#if PEP_DECODER_BUFFER_SIZE < PEP_HEADER_MAX_SIZE
+	#error "PEP_DECODER_BUFFER_SIZE has to hold at least PEP_HEADER_MAX_SIZE bytes"
+#endif
+
+#define _PEP_DECODER_LOOKAHEAD _PEP_SYMBOL_MAX_BYTES
+
+typedef struct
+{
+	pep info;
+	uint32_t rows_read;
+
+	_pep_decoder _dec;
+	pep_codec_ctx* _ctx;
+	pep_read_fn _read;
+	void* _read_user;
+	uint8_t* _buffer;
+	uint8_t* _buffer_end;
+	uint64_t _buffer_offset; // payload offset of _buffer[ 0 ]
+	uint64_t _payload_left; // payload bytes still to come from _read
+	uint64_t _stream_end; // payload offset the current stripe's stream ends at
+	uint64_t _stripe_pixels_left;
+	uint32_t* _stripe_ends;
+	uint32_t _stripe;
+	uint32_t _palette[ 256 ];
+	int _palette_key;
+	uint8_t _owns_ctx;
+	uint8_t _more; // the current stream goes on past the buffer
+	uint8_t _pending_symbol;
+	uint8_t _pending_count;
+}
+pep_decoder;
+
+// Push encoder:
+// `pep_encoder_begin()` starts an image of a known size and
+// `pep_encoder_push_rows()` takes its rows top to bottom as they're produced,
+// so the whole image never has to be in memory. Compressed bytes are kept in
+// PEP_ENCODER_CHUNK_SIZE chunks until `pep_encoder_finish()` hands them back
+// as a pep, or `pep_encoder_finish_write()` writes the serialized file
+// through a callback. Either one releases the encoder.
+// If the palette is known up front (in in_format, at most 255 colors) rows
+// are coded as they come in, and pushing a color that isn't in it fails.
+// Without one it's learned from the rows exactly like `pep_compress()` does
+// (same output), which keeps one index byte per pixel until finish.
+typedef size_t ( *pep_write_fn )( void* user, const uint8_t* bytes, const size_t size );
+
+typedef struct
+{
+	pep info;
+	uint32_t rows_written;
+
+	_pep_encoder _enc;
+	_pep_sink _sink;
+	pep_codec_ctx* _ctx;
+	uint8_t* _indices; // only while learning the palette
+	pep_format _in_format;
+	uint8_t _owns_ctx;
+}
+pep_encoder;
+
+// Lets code that is also built against older copies of PEP.h check for the
+// newer entry points.
+#define PEP_HAS_CODEC_CTX 1
+#define PEP_HAS_DECOMPRESS_INDICES 1
+#define PEP_HAS_STRIPES 1
+#define PEP_HAS_WIDE_DIMS 1
+#define PEP_HAS_STREAMING_DECODER 1
+#define PEP_HAS_PUSH_ENCODER 1
+#define PEP_HAS_VIEWS 1
+#define PEP_HAS_BYTE_INPUT 1
+#define PEP_HAS_RECT 1
+#define PEP_HAS_DECOMPRESS_INTO 1
+#define PEP_HAS_ENCODE_OPTIONS 1
+#define PEP_HAS_RANS 1
+#define PEP_HAS_RANS_STATES 1
+#define PEP_HAS_ARITH_RECIP 1
+#define PEP_HAS_MODEL_TUNING 1
+#ifdef PEP_PROFILE
+	#define PEP_HAS_PROFILE 1
+#endif
+
 // This defines a set of macros that serve as wrappers for the standard
 // C library memory management functions: `malloc`, `realloc`, and `free`.
 // These macros can be used to easily replace the underlying memory allocation
@@ -247,6 +729,15 @@ _pep_sym_decode;
 	#endif
 #endif
 
+// The frequency scans (prefix sums, symbol search and rescale) run through
+// SIMD kernels: SSE2 is always there on x86-64, AVX2 is picked at runtime
+// when the CPU has it, and NEON is used on ARM64. Define PEP_NO_SIMD to force
+// the scalar kernels. Symbols below PEP_SIMD_SCAN_MIN are summed inline,
+// since that is cheaper than a call.
+#ifndef PEP_SIMD_SCAN_MIN
+	#define PEP_SIMD_SCAN_MIN 16
+#endif
+
 // SIMD alignment hints
 #ifndef PEP_ASSUME_ALIGNED
 	#if defined(__GNUC__) || defined(__clang__)
@@ -260,22 +751,142 @@ _pep_sym_decode;
 
 // Performance hints for critical functions - hot path optimized
 static PEP_FORCE_INLINE PEP_HOT _pep_prob _pep_get_prob_from_ctx( const _pep_context* const restrict ctx, const uint32_t symbol );
-static PEP_FORCE_INLINE PEP_HOT void _pep_arith_encode( _pep_ac_encode* const restrict ac, const _pep_prob prob );
+static PEP_FORCE_INLINE PEP_HOT void _pep_arith_encode( _pep_ac_encode* const restrict ac, const _pep_prob prob, const uint8_t recip );
 static PEP_FORCE_INLINE PEP_HOT void _pep_arith_encode_normalize( _pep_ac_encode* const restrict ac );
-static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_arith_decode_curr_freq( _pep_ac_decode* const restrict ac, const uint32_t scale );
+static inline void _pep_arith_encode_widen( _pep_ac_encode* const restrict ac, const uint32_t scale );
+static inline void _pep_arith_decode_widen( _pep_ac_decode* const restrict ac, const uint32_t scale );
+static PEP_FORCE_INLINE uint32_t _pep_recip_div( const _pep_recip* const restrict recip, const uint32_t x, const uint32_t d );
+static PEP_FORCE_INLINE uint32_t _pep_recip_exponent( const uint32_t v );
+static PEP_FORCE_INLINE uint32_t _pep_recip_scale( const uint32_t scale, uint32_t* const restrict out_exponent );
+static PEP_FORCE_INLINE uint32_t _pep_recip_unit( const _pep_recip* const restrict recip, const uint32_t range, const uint32_t mantissa, const uint32_t exponent );
+static inline void _pep_recip_prepare( pep_codec_ctx* const restrict ctx );
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_arith_decode_curr_freq( _pep_ac_decode* const restrict ac, const uint32_t scale, const uint8_t recip );
 static PEP_FORCE_INLINE PEP_HOT void _pep_arith_decode_update( _pep_ac_decode* const restrict ac, const _pep_prob prob );
 static PEP_FORCE_INLINE PEP_HOT _pep_sym_decode _pep_get_sym_from_freq( const _pep_context* const restrict ctx, const uint32_t target_freq, const uint32_t max_symbol );
 
+static inline void _pep_fenwick_build( _pep_fenwick* const restrict tree, const uint16_t* const restrict freq, const uint32_t n );
+static PEP_FORCE_INLINE PEP_HOT void _pep_fenwick_add( _pep_fenwick* const restrict tree, const uint32_t n, const uint32_t symbol, const uint32_t delta );
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_fenwick_below( const _pep_fenwick* const restrict tree, const uint32_t symbol );
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_fenwick_find( const _pep_fenwick* const restrict tree, const uint32_t n, const uint32_t target_freq, uint32_t* const restrict out_low );
+
+static PEP_FORCE_INLINE PEP_HOT _pep_context* _pep_context_at( pep_codec_ctx* const restrict ctx, const uint32_t context_stride, const uint32_t context_index );
+static PEP_FORCE_INLINE PEP_HOT _pep_fenwick* _pep_model_tree( pep_codec_ctx* const restrict ctx, const uint32_t context_index, const uint8_t use_fenwick );
+static PEP_FORCE_INLINE PEP_HOT _pep_prob _pep_model_prob( const _pep_context* const restrict ctx, const _pep_fenwick* const restrict tree, const uint32_t symbol );
+static PEP_FORCE_INLINE PEP_HOT _pep_sym_decode _pep_model_sym( const _pep_context* const restrict ctx, const _pep_fenwick* const restrict tree, const uint32_t target_freq, const uint32_t max_symbol );
+static PEP_FORCE_INLINE PEP_HOT void _pep_model_add( _pep_context* const restrict ctx, _pep_fenwick* const restrict tree, const uint32_t symbol, const uint16_t delta );
+static PEP_FORCE_INLINE PEP_HOT void _pep_model_update( _pep_context* const restrict ctx, _pep_fenwick* const restrict tree, const uint32_t symbol, const uint32_t step, const uint32_t limit );
+static inline uint32_t _pep_freq_step( const uint32_t step );
+static inline uint32_t _pep_freq_max( const uint32_t limit );
+static inline void _pep_record_options( pep* const restrict out_pep, const pep_encode_options* const restrict options );
+static inline void _pep_codec_ctx_prepare( pep_codec_ctx* const restrict ctx, const uint32_t alphabet, const uint8_t use_fenwick );
+
+static inline void _pep_decoder_begin( _pep_decoder* const restrict dec, pep_codec_ctx* const restrict ctx, const pep* const restrict in_pep, uint8_t* const restrict stream, const uint64_t stream_size );
+static inline uint8_t _pep_decoder_open( _pep_decoder* const restrict dec, pep_codec_ctx* const restrict ctx, const pep* const restrict in_pep, uint8_t* restrict stream, uint64_t stream_size );
+static PEP_FORCE_INLINE PEP_HOT uint8_t _pep_decoder_symbol( _pep_decoder* const restrict dec );
+static PEP_FORCE_INLINE PEP_HOT uint8_t _pep_decoder_ppm_symbol( _pep_decoder* const restrict dec, const uint8_t recip );
+static PEP_FORCE_INLINE PEP_HOT uint8_t _pep_rans_decode_symbol( _pep_decoder* const restrict dec );
+static inline uint64_t _pep_rans_read_record( _pep_rans_model* const restrict model, const uint32_t record, const uint8_t* const restrict bytes, const uint64_t size );
+static inline uint64_t _pep_rans_read_tables( _pep_rans_model* const restrict model, const uint8_t* const restrict bytes, const uint64_t size );
+static inline void _pep_rans_normalize( _pep_rans_table* const restrict table, const uint64_t* const restrict counts, const uint64_t total );
+static inline uint8_t* _pep_rans_write_model( _pep_rans_model* const restrict model, const uint8_t* const restrict symbols, const uint64_t count, uint32_t* const restrict counts, uint8_t* restrict out_bytes );
+static inline uint8_t _pep_rans_sink_code( _pep_sink* const restrict sink, pep_codec_ctx* const restrict ctx, const uint8_t states );
+static inline uint8_t _pep_rans_state_count( const pep_encode_options* const restrict options );
+
+static inline pep_codec_ctx* pep_codec_ctx_create( void );
+static inline void pep_codec_ctx_reset( pep_codec_ctx* const restrict ctx );
+static inline void pep_codec_ctx_destroy( pep_codec_ctx* ctx );
+
+static inline _pep_swizzle _pep_swizzle_of( const pep_format in_format, const pep_format out_format );
+static PEP_FORCE_INLINE uint32_t _pep_swizzle_apply( const uint32_t in_color, const _pep_swizzle sw );
 static inline uint32_t _pep_reformat( const uint32_t in_color, const pep_format in_format, const pep_format out_format );
-static inline pep pep_compress( const uint32_t* restrict in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_format out_format );
+static inline void pep_swizzle( uint32_t* const out_pixels, const uint32_t* const in_pixels, const uint64_t count, const pep_format in_format, const pep_format out_format );
+static inline pep_format pep_byte_format( const pep_byte_order order );
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_palette_slot( const uint16_t* const restrict hash, const uint32_t* const restrict palette, const uint32_t color );
+static inline pep pep_compress_ctx( pep_codec_ctx* const restrict ctx, const uint32_t* restrict in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format );
+static inline uint32_t* pep_decompress_ctx( pep_codec_ctx* const restrict ctx, const pep* const restrict in_pep, const pep_format out_format, const uint8_t first_color_transparent );
+static inline pep pep_compress( const uint32_t* restrict in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format );
+static inline pep pep_compress_rect_ctx( pep_codec_ctx* const restrict ctx, const uint32_t* const restrict base, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format );
+static inline pep pep_compress_rect( const uint32_t* const restrict base, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format );
+static inline pep pep_compress_bytes_ctx( pep_codec_ctx* const restrict ctx, const uint8_t* const restrict in_bytes, const uint32_t width, const uint32_t height, const pep_byte_order in_order, const pep_format out_format );
+static inline pep pep_compress_bytes( const uint8_t* const restrict in_bytes, const uint32_t width, const uint32_t height, const pep_byte_order in_order, const pep_format out_format );
 static inline uint32_t* pep_decompress( const pep* const restrict in_pep, const pep_format out_format, const uint8_t first_color_transparent );
+static inline uint8_t* pep_decompress_indices_ctx( pep_codec_ctx* const restrict ctx, const pep* const restrict in_pep );
+static inline uint8_t* pep_decompress_indices( const pep* const restrict in_pep );
+
+static inline void _pep_build_palette( pep* const restrict out_pep, uint16_t* const restrict hash, const uint32_t* const restrict in_pixels, const uint64_t stride, const pep_format in_format, const pep_format out_format, const pep_palette_order order );
+static inline void _pep_palette_by_count( pep* const restrict out_pep, const uint64_t* const restrict counts, uint8_t* const restrict out_remap );
+static inline void _pep_palette_hash_fill( uint16_t* const restrict hash, const uint32_t* const restrict palette, const uint8_t palette_size );
+static inline void _pep_encoder_begin( _pep_encoder* const restrict enc, pep_codec_ctx* const restrict ctx, const uint8_t palette_size, const pep_encode_options* const restrict options, uint8_t* const restrict out_bytes );
+static PEP_FORCE_INLINE PEP_HOT void _pep_encode_symbol( _pep_encoder* const restrict enc, const uint8_t symbol );
+static PEP_FORCE_INLINE PEP_HOT void _pep_encode_ppm_symbol( _pep_encoder* const restrict enc, uint8_t symbol, const uint8_t recip );
+static PEP_FORCE_INLINE PEP_HOT void _pep_encode_index( _pep_encoder* const restrict enc, const uint32_t index );
+static inline void _pep_encode_pixels( _pep_encoder* const restrict enc, const pep* const restrict in_pep, const uint32_t* const restrict in_pixels, const uint64_t count, const pep_format in_format );
+static inline void _pep_encode_indices( _pep_encoder* const restrict enc, const uint8_t* const restrict in_indices, const uint64_t count );
+static inline void _pep_encoder_end( _pep_encoder* const restrict enc );
+static inline uint8_t _pep_sink_init( _pep_sink* const restrict sink );
+static inline uint8_t _pep_sink_append( _pep_sink* const restrict sink, const uint8_t* restrict src, const uint8_t* const restrict end );
+static inline uint8_t _pep_sink_spill( _pep_sink* const restrict sink, const uint8_t* const restrict end );
+static inline uint8_t _pep_sink_encode( _pep_sink* const restrict sink, _pep_encoder* const restrict enc, const pep* const restrict in_pep, const uint32_t* restrict in_pixels, const uint8_t* restrict in_indices, uint64_t count, const pep_format in_format );
+static inline uint8_t _pep_sink_encode_rows( _pep_sink* const restrict sink, _pep_encoder* const restrict enc, const pep* const restrict in_pep, const uint32_t* const restrict in_pixels, const uint64_t stride, const uint32_t rows, const pep_format in_format );
+static inline uint8_t _pep_sink_end( _pep_sink* const restrict sink, _pep_encoder* const restrict enc );
+static inline void _pep_sink_copy( _pep_sink* const restrict sink, uint8_t* restrict out_bytes );
+static inline uint8_t _pep_sink_write( _pep_sink* const restrict sink, pep_write_fn write, void* write_user );
+static inline void _pep_sink_free( _pep_sink* const restrict sink );
+static inline uint8_t _pep_stripe_stream( const pep* const restrict in_pep, const uint32_t stripe, uint8_t** const restrict out_stream, uint64_t* const restrict out_size );
+static inline void _pep_output_palette( uint32_t* const restrict palette, const pep* const restrict in_pep, const pep_format out_format, const uint8_t transparent_first_color );
+static inline void _pep_decode_pixels( _pep_decoder* const restrict dec, const uint32_t* const restrict palette, uint32_t* const restrict out_pixels, const uint64_t area );
+static inline void _pep_decode_pixels_rows( _pep_decoder* const restrict dec, const uint32_t* const restrict palette, uint32_t* restrict out_row, const uint32_t width, uint32_t rows, const int64_t stride );
+static inline void _pep_decode_indices( _pep_decoder* const restrict dec, uint8_t* const restrict out_indices, const uint64_t area );
+
+static inline uint32_t pep_stripe_count( const pep* const restrict in_pep );
+static inline pep pep_compress_striped_ctx( pep_codec_ctx* const restrict ctx, const uint32_t* restrict in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format, const uint16_t stripe_rows, pep_parallel_for run, void* run_user );
+static inline pep pep_compress_striped( const uint32_t* restrict in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format, const uint16_t stripe_rows, pep_parallel_for run, void* run_user );
+static inline uint8_t pep_decompress_stripe_ctx( pep_codec_ctx* const restrict ctx, const pep* const restrict in_pep, const uint32_t stripe, const pep_format out_format, const uint8_t first_color_transparent, uint32_t* const restrict out_pixels );
+static inline uint32_t* pep_decompress_parallel( const pep* const restrict in_pep, const pep_format out_format, const uint8_t first_color_transparent, pep_parallel_for run, void* run_user );
+static inline uint8_t _pep_decompress_stripe_rows( pep_codec_ctx* const restrict ctx, const pep* const restrict in_pep, const uint32_t stripe, const pep_format out_format, const uint8_t first_color_transparent, uint32_t* const restrict out_row0, const int64_t stride );
+static inline uint32_t* _pep_decompress_into_origin( const pep* const restrict in_pep, uint32_t* const restrict out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const uint8_t flip_y, int64_t* const restrict out_stride );
+static inline uint8_t pep_decompress_into_ctx( pep_codec_ctx* const restrict ctx, const pep* const restrict in_pep, uint32_t* const restrict out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const pep_format out_format, const uint8_t first_color_transparent, const uint8_t flip_y );
+static inline uint8_t pep_decompress_into( const pep* const restrict in_pep, uint32_t* const restrict out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const pep_format out_format, const uint8_t first_color_transparent, const uint8_t flip_y );
+static inline uint8_t pep_decompress_into_parallel( const pep* const restrict in_pep, uint32_t* const restrict out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const pep_format out_format, const uint8_t first_color_transparent, const uint8_t flip_y, pep_parallel_for run, void* run_user );
 static inline void pep_free( pep* in_pep );
+static inline const char* pep_error_string( const pep_error error );
+static inline uint64_t _pep_compress_area( pep* const restrict out_pep, const pep_codec_ctx* const restrict ctx, const uint32_t* const restrict in_pixels, const uint32_t width, const uint32_t height );
+static inline uint8_t* _pep_varint_write( uint8_t* restrict out_bytes, uint64_t value );
+static inline uint64_t _pep_varint_read( const uint8_t* const restrict in_bytes, const uint64_t in_size, uint64_t* const restrict out_value );
+static inline uint64_t _pep_header_parse( pep* const restrict out_pep, const uint8_t* const restrict in_bytes, const uint64_t in_size );
 
+static inline uint64_t _pep_header_write( const pep* const restrict in_pep, uint8_t* const restrict out_bytes );
 static inline uint8_t* pep_serialize( const pep* restrict in_pep, uint32_t* const restrict out_size );
 static inline pep pep_deserialize( const uint8_t* const restrict in_bytes );
+static inline pep pep_deserialize_view( const uint8_t* const restrict in_bytes, const uint64_t in_size );
 
 static inline uint8_t pep_save( const pep* const restrict in_pep, const char* const restrict file_path );
 static inline pep pep_load( const char* const restrict file_path );
+static inline pep pep_load_mapped( const char* const restrict file_path );
+static inline void* _pep_map_file( const char* const restrict file_path, uint64_t* const restrict out_size );
+static inline void _pep_unmap_file( void* const restrict mapping, const uint64_t size );
+
+static inline size_t pep_file_reader( void* const restrict file, uint8_t* const restrict out_bytes, const size_t max_bytes );
+static inline uint8_t pep_decoder_init( pep_decoder* const restrict dec, pep_codec_ctx* const restrict ctx, pep_read_fn read, void* read_user );
+static inline uint8_t pep_decoder_init_bytes( pep_decoder* const restrict dec, pep_codec_ctx* const restrict ctx, const uint8_t* const restrict in_bytes, const uint64_t in_size );
+static inline uint32_t pep_decoder_read_rows( pep_decoder* const restrict dec, uint32_t* const restrict out_pixels, const uint32_t max_rows, const pep_format out_format, const uint8_t first_color_transparent );
+static inline void pep_decoder_free( pep_decoder* const restrict dec );
+static inline uint8_t* _pep_decoder_fill( pep_decoder* const restrict dec, uint8_t* const restrict from );
+static inline uint8_t* _pep_decoder_seek( pep_decoder* const restrict dec, const uint64_t offset, const uint64_t need );
+static inline void _pep_decoder_window( pep_decoder* const restrict dec );
+static inline void _pep_decoder_refill( pep_decoder* const restrict dec );
+static inline uint8_t _pep_decoder_start_stripe( pep_decoder* const restrict dec );
+static inline uint8_t _pep_decoder_setup( pep_decoder* const restrict dec, pep_codec_ctx* const restrict ctx );
+static inline void _pep_decoder_emit( pep_decoder* const restrict dec, uint32_t* restrict out_pixels, uint64_t count );
+
+static inline size_t pep_file_writer( void* const restrict file, const uint8_t* const restrict bytes, const size_t size );
+static inline uint8_t pep_encoder_begin( pep_encoder* const restrict enc, pep_codec_ctx* const restrict ctx, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format, const uint32_t* const restrict palette, const uint8_t palette_size );
+static inline uint8_t pep_encoder_push_rows( pep_encoder* const restrict enc, const uint32_t* const restrict in_pixels, const uint32_t row_count );
+static inline pep pep_encoder_finish( pep_encoder* const restrict enc );
+static inline uint8_t pep_encoder_finish_write( pep_encoder* const restrict enc, pep_write_fn write, void* write_user );
+static inline void pep_encoder_free( pep_encoder* const restrict enc );
+static inline void _pep_palette_learn( _pep_encoder* const restrict enc, pep* const restrict out_pep, const uint32_t* const restrict in_pixels, const uint64_t count, const pep_format in_format, uint8_t* const restrict out_indices );
+static inline uint8_t _pep_encoder_complete( pep_encoder* const restrict enc );
 
 #endif // _PEP_H_
 
@@ -292,520 +903,2643 @@ static inline pep pep_load( const char* const restrict file_path );
 	#pragma warning( disable : 4996 )
 #endif
 
-// Getting cumulative frequency of symbol - optimized hot path
-static PEP_FORCE_INLINE PEP_HOT _pep_prob _pep_get_prob_from_ctx( const _pep_context* const restrict ctx, const uint32_t symbol )
+#ifndef PEP_NO_SIMD
+	#if defined( __x86_64__ ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+		#include <immintrin.h> // SSE2, plus AVX2 via target attribute
+		#define _PEP_SIMD_SSE2
+		#define _PEP_SIMD_AVX2
+	#elif defined( __aarch64__ ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+		#include <arm_neon.h>
+		#define _PEP_SIMD_NEON
+	#endif
+#endif
+
+#ifdef PEP_PROFILE
+	#ifndef PEP_PROFILE_NOW
+		#include <time.h> // timespec_get
+		static inline uint64_t _pep_profile_now( void )
+		{
+			struct timespec ts;
+			timespec_get( &ts, TIME_UTC );
+			return ( uint64_t )ts.tv_sec * 1000000000u + ( uint64_t )ts.tv_nsec;
+		}
+		#define PEP_PROFILE_NOW() _pep_profile_now()
+	#endif
+	// Runs the statements only in profiling builds.
+	#define _PEP_PROFILE( ... ) do { __VA_ARGS__; } while( 0 )
+	// Runs the statements, adding the time they took to CTX->profile.FIELD.
+	#define _PEP_PROFILE_TIME( CTX, FIELD, ... ) do { const uint64_t _pep_t0 = PEP_PROFILE_NOW(); __VA_ARGS__; ( CTX )->profile.FIELD += PEP_PROFILE_NOW() - _pep_t0; } while( 0 )
+#else
+	#define _PEP_PROFILE( ... ) do { } while( 0 )
+	#define _PEP_PROFILE_TIME( CTX, FIELD, ... ) do { __VA_ARGS__; } while( 0 )
+#endif
+
+#ifndef PEP_NO_MMAP
+	#if defined( __unix__ ) || defined( __APPLE__ )
+		#include <fcntl.h> // open
+		#include <sys/mman.h> // mmap
+		#include <sys/stat.h> // fstat
+		#include <unistd.h> // close
+		#define _PEP_MMAP_POSIX
+	#elif defined( _WIN32 )
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#include <windows.h> // CreateFileMapping, MapViewOfFile
+		#define _PEP_MMAP_WIN32
+	#endif
+#endif
+
+///////
+// Frequency kernels. All of them work on a run of `n` 16-bit frequencies:
+// `sum_below` adds them up, `find` returns the first index whose running
+// total (starting from *cum) passes target_freq and leaves that total in
+// *cum (or returns n with the total of all of them), and `rescale` applies
+// the PEP_UPDATE quartering and returns the new sum.
+
+static inline uint32_t _pep_sum_below_scalar( const uint16_t* const freq, const uint32_t n )
 {
-	_pep_prob prob = { 0 };
-	prob.scale = ctx->sum;
+	uint32_t sum = 0;
+	for( uint32_t i = 0; i < n; i++ ) sum += freq[ i ];
+	return sum;
+}
 
-	// Optimized loop with prefetch and SIMD hints
-	const uint16_t* restrict freq = PEP_ASSUME_ALIGNED(ctx->freq, 16);
-	
-	// Prefetch next cache line if symbol is large enough
-	if( PEP_LIKELY( symbol > 8 ) )
+static inline uint32_t _pep_find_scalar( const uint16_t* const freq, const uint32_t n, const uint32_t target_freq, uint32_t* const cum )
+{
+	uint32_t c = *cum;
+	for( uint32_t i = 0; i < n; i++ )
 	{
-		PEP_PREFETCH( &freq[ symbol ], 0, 3 );
+		c += freq[ i ];
+		if( c > target_freq )
+		{
+			*cum = c;
+			return i;
+		}
 	}
-	
-	for( uint32_t i = 0; i < symbol; ++i )
+	*cum = c;
+	return n;
+}
+
+static inline uint32_t _pep_rescale_scalar( uint16_t* const freq, const uint32_t n )
+{
+	uint32_t sum = 0;
+	for( uint32_t i = 0; i < n; i++ )
 	{
-		prob.low += freq[ i ];
+		sum += ( freq[ i ] = ( uint16_t )( ( freq[ i ] + 3 ) >> 2 ) );
 	}
-
-	prob.high = prob.low + freq[ symbol ];
-	return prob;
+	return sum;
 }
 
-// This encodes a symbol into the arithmetic-coding range. It scales the
-// current range based on the symbol's frequency and total frequency count.
-static PEP_FORCE_INLINE PEP_HOT void _pep_arith_encode( _pep_ac_encode* const restrict ac, const _pep_prob prob )
+#ifdef _PEP_SIMD_SSE2
+static inline uint32_t _pep_hsum_sse2( const __m128i v )
 {
-	ac->range /= prob.scale;
-	ac->low += prob.low * ac->range;
-	ac->range *= prob.high - prob.low;
+	__m128i s = _mm_add_epi32( v, _mm_shuffle_epi32( v, 0x4E ) );
+	s = _mm_add_epi32( s, _mm_shuffle_epi32( s, 0xB1 ) );
+	return ( uint32_t )_mm_cvtsi128_si32( s );
 }
 
-// Adjusts the arithmetic-coding range by removing a boundary value
-// Main goal of this process is to keep our range from getting
-// too small.
-static PEP_FORCE_INLINE PEP_HOT void _pep_arith_encode_normalize( _pep_ac_encode* const restrict ac )
+static inline uint32_t _pep_sum_below_sse2( const uint16_t* const freq, const uint32_t n )
 {
-	while( 1 )
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	uint32_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
 	{
-		if( PEP_UNLIKELY( ( ac->low ^ ( ac->low + ac->range ) ) >= PEP_CODE_MAX_VALUE ) )
-		{
-			if( PEP_UNLIKELY( ac->range < PEP_PROB_MAX_VALUE ) )
-			{
-				ac->range = PEP_PROB_MAX_VALUE - (ac->low & (PEP_PROB_MAX_VALUE - 1));
-			}
-			else break;
-		}
-
-		uint8_t byte = ac->low >> 24;
-		ac->low <<= 8;
-		ac->range <<= 8;
-		*ac->data_ref++ = byte;
+		const __m128i v = _mm_loadu_si128( ( const __m128i* )( freq + i ) );
+		acc = _mm_add_epi32( acc, _mm_unpacklo_epi16( v, zero ) );
+		acc = _mm_add_epi32( acc, _mm_unpackhi_epi16( v, zero ) );
 	}
+	return _pep_hsum_sse2( acc ) + _pep_sum_below_scalar( freq + i, n - i );
 }
 
-// Getting current frequency by doing reverse trasformation
-static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_arith_decode_curr_freq( _pep_ac_decode* const restrict ac, const uint32_t scale )
+// Inclusive prefix sum of four lanes, plus the carried-in total.
+static inline __m128i _pep_scan4_sse2( __m128i v, const __m128i carry )
 {
-	ac->range /= scale;
-	uint32_t result = ( ac->code - ac->low ) / ( ac->range );
-	return result;
+	v = _mm_add_epi32( v, _mm_slli_si128( v, 4 ) );
+	v = _mm_add_epi32( v, _mm_slli_si128( v, 8 ) );
+	return _mm_add_epi32( v, carry );
 }
 
-// Same as with the encode_normalize, only on decode we reading in value
-static PEP_FORCE_INLINE PEP_HOT void _pep_arith_decode_update( _pep_ac_decode* const restrict ac, const _pep_prob prob )
+static inline uint32_t _pep_find_sse2( const uint16_t* const freq, const uint32_t n, const uint32_t target_freq, uint32_t* const cum )
 {
-	ac->low += ac->range * prob.low;
-	ac->range *= prob.high - prob.low;
-
-	while( 1 )
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i target = _mm_set1_epi32( ( int )target_freq );
+	__m128i carry = _mm_set1_epi32( ( int )*cum );
+	uint32_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
 	{
-		if( PEP_UNLIKELY( ( ac->low ^ ( ac->low + ac->range ) ) >= PEP_CODE_MAX_VALUE ) )
-		{
-			if( PEP_UNLIKELY( ac->range < PEP_PROB_MAX_VALUE ) )
-			{
-				ac->range = PEP_PROB_MAX_VALUE - (ac->low & (PEP_PROB_MAX_VALUE - 1));
-			}
-			else break;
-		}
-
-		uint8_t in_byte = 0;
-		if( PEP_LIKELY( ac->data_ref != ac->end_of_data ) )
+		const __m128i v = _mm_loadu_si128( ( const __m128i* )( freq + i ) );
+		const __m128i lo = _pep_scan4_sse2( _mm_unpacklo_epi16( v, zero ), carry );
+		const __m128i hi = _pep_scan4_sse2( _mm_unpackhi_epi16( v, zero ), _mm_shuffle_epi32( lo, 0xFF ) );
+		const int mask = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( lo, target ) ) ) |
+		                 ( _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( hi, target ) ) ) << 4 );
+		if( mask )
 		{
-			in_byte = *ac->data_ref++;
+			uint32_t lanes[ 8 ];
+			_mm_storeu_si128( ( __m128i* )lanes, lo );
+			_mm_storeu_si128( ( __m128i* )( lanes + 4 ), hi );
+			const uint32_t k = ( uint32_t )__builtin_ctz( ( unsigned )mask );
+			*cum = lanes[ k ];
+			return i + k;
 		}
+		carry = _mm_shuffle_epi32( hi, 0xFF );
+	}
+	*cum = ( uint32_t )_mm_cvtsi128_si32( carry );
+	return i + _pep_find_scalar( freq + i, n - i, target_freq, cum );
+}
 
-		ac->code = ( ac->code << 8 ) | in_byte;
-		ac->range <<= 8;
-		ac->low <<= 8;
+static inline uint32_t _pep_rescale_sse2( uint16_t* const freq, const uint32_t n )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i three = _mm_set1_epi16( 3 );
+	__m128i acc = zero;
+	uint32_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
+	{
+		__m128i v = _mm_loadu_si128( ( const __m128i* )( freq + i ) );
+		v = _mm_srli_epi16( _mm_add_epi16( v, three ), 2 );
+		_mm_storeu_si128( ( __m128i* )( freq + i ), v );
+		acc = _mm_add_epi32( acc, _mm_unpacklo_epi16( v, zero ) );
+		acc = _mm_add_epi32( acc, _mm_unpackhi_epi16( v, zero ) );
 	}
+	return _pep_hsum_sse2( acc ) + _pep_rescale_scalar( freq + i, n - i );
 }
+#endif
 
-static PEP_FORCE_INLINE PEP_HOT _pep_sym_decode _pep_get_sym_from_freq( const _pep_context* const restrict ctx, const uint32_t target_freq, const uint32_t max_symbol )
+#ifdef _PEP_SIMD_AVX2
+#define _PEP_AVX2 __attribute__( ( target( "avx2" ) ) )
+
+_PEP_AVX2 static inline uint32_t _pep_hsum_avx2( const __m256i v )
 {
-	_pep_sym_decode result = { };
+	__m128i s = _mm_add_epi32( _mm256_castsi256_si128( v ), _mm256_extracti128_si256( v, 1 ) );
+	s = _mm_add_epi32( s, _mm_shuffle_epi32( s, 0x4E ) );
+	s = _mm_add_epi32( s, _mm_shuffle_epi32( s, 0xB1 ) );
+	return ( uint32_t )_mm_cvtsi128_si32( s );
+}
 
-	uint32_t s = 0;
-	uint32_t freq = 0;
-	const uint16_t* restrict freq_table = PEP_ASSUME_ALIGNED(ctx->freq, 16);
-	
-	for( ; s < max_symbol; ++s )
+_PEP_AVX2 static uint32_t _pep_sum_below_avx2( const uint16_t* const freq, const uint32_t n )
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	uint32_t i = 0;
+	for( ; i + 16 <= n; i += 16 )
 	{
-		freq += freq_table[ s ];
-		if( PEP_LIKELY( freq > target_freq ) ) break;
+		const __m256i v = _mm256_loadu_si256( ( const __m256i* )( freq + i ) );
+		acc = _mm256_add_epi32( acc, _mm256_unpacklo_epi16( v, zero ) );
+		acc = _mm256_add_epi32( acc, _mm256_unpackhi_epi16( v, zero ) );
 	}
+	return _pep_hsum_avx2( acc ) + _pep_sum_below_scalar( freq + i, n - i );
+}
 
-	if( PEP_UNLIKELY( s >= max_symbol ) )
+_PEP_AVX2 static uint32_t _pep_find_avx2( const uint16_t* const freq, const uint32_t n, const uint32_t target_freq, uint32_t* const cum )
+{
+	const __m256i target = _mm256_set1_epi32( ( int )target_freq );
+	const __m256i last_lane = _mm256_set1_epi32( 7 );
+	__m256i carry = _mm256_set1_epi32( ( int )*cum );
+	uint32_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
 	{
-		s = PEP_FREQ_END;
-		freq += freq_table[ PEP_FREQ_END ];
+		__m256i v = _mm256_cvtepu16_epi32( _mm_loadu_si128( ( const __m128i* )( freq + i ) ) );
+		v = _mm256_add_epi32( v, _mm256_slli_si256( v, 4 ) );
+		v = _mm256_add_epi32( v, _mm256_slli_si256( v, 8 ) );
+		// Both 128-bit lanes are scanned separately, carry the low total up.
+		const __m256i low_total = _mm256_shuffle_epi32( v, 0xFF );
+		v = _mm256_add_epi32( v, _mm256_permute2x128_si256( low_total, low_total, 0x08 ) );
+		v = _mm256_add_epi32( v, carry );
+
+		const int mask = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( v, target ) ) );
+		if( mask )
+		{
+			uint32_t lanes[ 8 ];
+			_mm256_storeu_si256( ( __m256i* )lanes, v );
+			const uint32_t k = ( uint32_t )__builtin_ctz( ( unsigned )mask );
+			*cum = lanes[ k ];
+			return i + k;
+		}
+		carry = _mm256_permutevar8x32_epi32( v, last_lane );
 	}
-
-	result.prob.high = freq;
-	result.prob.low = freq - ctx->freq[ s ];
-	result.prob.scale = ctx->sum;
-	result.symbol = s;
-
-	return result;
+	*cum = ( uint32_t )_mm256_cvtsi256_si32( carry );
+	return i + _pep_find_scalar( freq + i, n - i, target_freq, cum );
 }
 
-// PEP supports "dynamic formats", where you can specify what the in-bytes are,
-// and reformat to a different channel-order.
-// This means two "identical" PEP files can have different formats, but you
-// can choose how to reformat it when it decompresses!
-static inline uint32_t _pep_reformat( const uint32_t in_color, const pep_format in_format, const pep_format out_format )
+_PEP_AVX2 static uint32_t _pep_rescale_avx2( uint16_t* const freq, const uint32_t n )
 {
-	if( in_format == out_format ) return in_color;
-
-	if( in_format <= pep_bgra && out_format <= pep_bgra )
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i three = _mm256_set1_epi16( 3 );
+	__m256i acc = zero;
+	uint32_t i = 0;
+	for( ; i + 16 <= n; i += 16 )
 	{
-		return( in_color & 0x00ff00ff ) | ( ( in_color & 0xff000000 ) >> 16 ) | ( ( in_color & 0x0000ff00 ) << 16 );
+		__m256i v = _mm256_loadu_si256( ( const __m256i* )( freq + i ) );
+		v = _mm256_srli_epi16( _mm256_add_epi16( v, three ), 2 );
+		_mm256_storeu_si256( ( __m256i* )( freq + i ), v );
+		acc = _mm256_add_epi32( acc, _mm256_unpacklo_epi16( v, zero ) );
+		acc = _mm256_add_epi32( acc, _mm256_unpackhi_epi16( v, zero ) );
 	}
-	else if( in_format >= pep_abgr && out_format >= pep_abgr )
+	return _pep_hsum_avx2( acc ) + _pep_rescale_scalar( freq + i, n - i );
+}
+#endif
+
+#ifdef _PEP_SIMD_NEON
+static inline uint32_t _pep_sum_below_neon( const uint16_t* const freq, const uint32_t n )
+{
+	uint32x4_t acc = vdupq_n_u32( 0 );
+	uint32_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
 	{
-		return( in_color & 0xff00ff00 ) | ( ( in_color & 0x00ff0000 ) >> 16 ) | ( ( in_color & 0x000000ff ) << 16 );
+		acc = vpadalq_u16( acc, vld1q_u16( freq + i ) );
 	}
-	else if( ( in_format ^ out_format ) == 2 )
+	return vaddvq_u32( acc ) + _pep_sum_below_scalar( freq + i, n - i );
+}
+
+// Inclusive prefix sum of four lanes, plus the carried-in total.
+static inline uint32x4_t _pep_scan4_neon( uint32x4_t v, const uint32x4_t carry )
+{
+	const uint32x4_t zero = vdupq_n_u32( 0 );
+	v = vaddq_u32( v, vextq_u32( zero, v, 3 ) );
+	v = vaddq_u32( v, vextq_u32( zero, v, 2 ) );
+	return vaddq_u32( v, carry );
+}
+
+static inline uint32_t _pep_find_neon( const uint16_t* const freq, const uint32_t n, const uint32_t target_freq, uint32_t* const cum )
+{
+	const uint32x4_t target = vdupq_n_u32( target_freq );
+	uint32x4_t carry = vdupq_n_u32( *cum );
+	uint32_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
 	{
-		return( ( in_color & 0x000000ff ) << 24 ) | ( ( in_color & 0x0000ff00 ) << 8 ) | ( ( in_color & 0x00ff0000 ) >> 8 ) | ( ( in_color & 0xff000000 ) >> 24 );
+		const uint16x8_t v = vld1q_u16( freq + i );
+		const uint32x4_t lo = _pep_scan4_neon( vmovl_u16( vget_low_u16( v ) ), carry );
+		const uint32x4_t hi = _pep_scan4_neon( vmovl_u16( vget_high_u16( v ) ), vdupq_n_u32( vgetq_lane_u32( lo, 3 ) ) );
+
+		// Narrow the 8 compare results to one byte each: there is no movemask.
+		const uint16x8_t gt = vcombine_u16( vmovn_u32( vcgtq_u32( lo, target ) ), vmovn_u32( vcgtq_u32( hi, target ) ) );
+		const uint64_t mask = vget_lane_u64( vreinterpret_u64_u8( vmovn_u16( gt ) ), 0 );
+		if( mask )
+		{
+			uint32_t lanes[ 8 ];
+			vst1q_u32( lanes, lo );
+			vst1q_u32( lanes + 4, hi );
+			const uint32_t k = ( uint32_t )__builtin_ctzll( mask ) >> 3;
+			*cum = lanes[ k ];
+			return i + k;
+		}
+		carry = vdupq_n_u32( vgetq_lane_u32( hi, 3 ) );
 	}
-	else if( in_format < out_format )
+	*cum = vgetq_lane_u32( carry, 0 );
+	return i + _pep_find_scalar( freq + i, n - i, target_freq, cum );
+}
+
+static inline uint32_t _pep_rescale_neon( uint16_t* const freq, const uint32_t n )
+{
+	const uint16x8_t three = vdupq_n_u16( 3 );
+	uint32x4_t acc = vdupq_n_u32( 0 );
+	uint32_t i = 0;
+	for( ; i + 8 <= n; i += 8 )
 	{
-		return( ( in_color & 0x000000ff ) << 24 ) | ( ( in_color & 0xffffff00 ) >> 8 );
+		const uint16x8_t v = vshrq_n_u16( vaddq_u16( vld1q_u16( freq + i ), three ), 2 );
+		vst1q_u16( freq + i, v );
+		acc = vpadalq_u16( acc, v );
 	}
-	else
+	return vaddvq_u32( acc ) + _pep_rescale_scalar( freq + i, n - i );
+}
+#endif
+
+// Runtime CPU dispatch, so one binary runs everywhere. The baseline kernels
+// for the build are called directly so they can inline; AVX2 is a direct
+// call behind a well-predicted branch rather than a function pointer.
+// What the CPU has is one byte, written whole by `_pep_kernels_init()` and
+// read with atomic loads, so codec calls on several threads can race to
+// fill it in: they all store the same value, and none sees half of it.
+// (On x86-64 the loads are plain moves.)
+#ifdef _PEP_SIMD_AVX2
+	#define _PEP_CPU_CHECKED 0x01
+	#define _PEP_CPU_AVX2 0x02
+	#define _PEP_CPU_SSSE3 0x04 // only the swizzle kernels use it
+	static uint8_t _pep_cpu = 0;
+
+	static PEP_FORCE_INLINE uint8_t _pep_cpu_has( const uint8_t feature )
 	{
-		return( ( in_color & 0xff000000 ) >> 24 ) | ( ( in_color & 0x00ffffff ) << 8 );
+		return ( __atomic_load_n( &_pep_cpu, __ATOMIC_ACQUIRE ) & feature ) != 0;
 	}
-}
+#endif
 
-// The format of the in_pixels has to be the same as in_format.
-// out_format is the one applied to the newly compressed pep
-static inline pep pep_compress( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_format out_format )
+// Called whenever a codec context is prepared; after the first call it is
+// just a load.
+static inline void _pep_kernels_init( void )
 {
-	pep out_pep = { 0 };
-	uint32_t pixels_area = width * height;
+#ifdef _PEP_SIMD_AVX2
+	if( PEP_LIKELY( __atomic_load_n( &_pep_cpu, __ATOMIC_ACQUIRE ) ) ) return;
+	uint8_t cpu = _PEP_CPU_CHECKED;
+	if( __builtin_cpu_supports( "avx2" ) ) cpu |= _PEP_CPU_AVX2;
+	if( __builtin_cpu_supports( "ssse3" ) ) cpu |= _PEP_CPU_SSSE3;
+	__atomic_store_n( &_pep_cpu, cpu, __ATOMIC_RELEASE );
+#endif
+}
 
-	if( in_pixels == NULL || pixels_area == 0 ) return out_pep;
+#if defined( _PEP_SIMD_AVX2 )
+	#define _PEP_KERNEL( NAME, ... ) ( _pep_cpu_has( _PEP_CPU_AVX2 ) ? NAME##_avx2( __VA_ARGS__ ) : NAME##_sse2( __VA_ARGS__ ) )
+#elif defined( _PEP_SIMD_SSE2 )
+	#define _PEP_KERNEL( NAME, ... ) NAME##_sse2( __VA_ARGS__ )
+#elif defined( _PEP_SIMD_NEON )
+	#define _PEP_KERNEL( NAME, ... ) NAME##_neon( __VA_ARGS__ )
+#else
+	#define _PEP_KERNEL( NAME, ... ) NAME##_scalar( __VA_ARGS__ )
+#endif
 
-	const uint32_t* p = in_pixels;
-	const uint32_t* p_end = p + pixels_area;
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_sum_below( const uint16_t* const freq, const uint32_t n )
+{
+	return _PEP_KERNEL( _pep_sum_below, freq, n );
+}
 
-	out_pep.bytes = ( uint8_t* )PEP_MALLOC( pixels_area * sizeof( uint32_t ) * 2 ); // zero chance it will be >2x the size
-	out_pep.width = width;
-	out_pep.height = height;
-	out_pep.format = out_format;
-	out_pep.color_bits = _pep_8bit;
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_find( const uint16_t* const freq, const uint32_t n, const uint32_t target_freq, uint32_t* const cum )
+{
+	return _PEP_KERNEL( _pep_find, freq, n, target_freq, cum );
+}
 
-	uint8_t* data_ref = out_pep.bytes;
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_rescale( uint16_t* const freq, const uint32_t n )
+{
+	return _PEP_KERNEL( _pep_rescale, freq, n );
+}
 
-	///////
-	// palette construction
+// Getting cumulative frequency of symbol - optimized hot path
+static PEP_FORCE_INLINE PEP_HOT _pep_prob _pep_get_prob_from_ctx( const _pep_context* const restrict ctx, const uint32_t symbol )
+{
+	_pep_prob prob = { 0 };
+	prob.scale = ctx->sum;
 
-	uint32_t last_p = 0;
-	uint32_t this_p = 0;
-	uint32_t formatted_p = 0;
+	const uint16_t* restrict freq = ctx->freq;
 
-	while( p < p_end )
+	if( PEP_LIKELY( symbol < PEP_SIMD_SCAN_MIN ) )
 	{
-		this_p = *p;
-
-		if( p > in_pixels && this_p == last_p )
+		for( uint32_t i = 0; i < symbol; ++i )
 		{
-			p++;
-			continue;
-		}
-
-		formatted_p = _pep_reformat( this_p, in_format, out_format );
-
-		uint16_t n = 0;
-		while( n < out_pep.palette_size && formatted_p != out_pep.palette[ n ] )
-		{
-			n++;
-		}
-
-		if( n >= out_pep.palette_size && ( ( uint16_t )out_pep.palette_size + 1 ) < 256 )
-		{
-			out_pep.palette[ out_pep.palette_size++ ] = formatted_p;
+			prob.low += freq[ i ];
 		}
-
-		last_p = this_p;
-		p++;
+	}
+	else
+	{
+		prob.low = _pep_sum_below( freq, symbol );
 	}
 
-	///////
-	// pixels to packed-palette-indices and PPM order-2 compression
+	prob.high = prob.low + freq[ symbol ];
+	return prob;
+}
 
-	uint8_t bits_per_index = PEP_BITS_TO_FIT( out_pep.palette_size );
-	if( bits_per_index > 8 ) bits_per_index = 8; // only 8 bits in a byte
+// floor( x / d ) for 0 < d < PEP_RECIP_N, see "Reciprocal scaling".
+static PEP_FORCE_INLINE uint32_t _pep_recip_div( const _pep_recip* const restrict recip, const uint32_t x, const uint32_t d )
+{
+	const _pep_recip r = recip[ d ];
+	return ( uint32_t )( ( ( ( ( uint64_t )x * r.magic ) >> 32 ) + x ) >> r.shift );
+}
 
-	const uint8_t indices_per_byte = 8 / bits_per_index;
-	const uint8_t index_mask = ( 1 << bits_per_index ) - 1;
+// How far v has to be shifted down to fit PEP_RECIP_BITS bits.
+static PEP_FORCE_INLINE uint32_t _pep_recip_exponent( const uint32_t v )
+{
+	const uint32_t bits = 32u - PEP_COUNT_LEADING_ZEROS( v );
+	return bits > PEP_RECIP_BITS ? bits - PEP_RECIP_BITS : 0;
+}
 
-	static _pep_context contexts[ PEP_CONTEXTS_MAX + 1 ] = { 0 };
+// scale rounded up to PEP_RECIP_BITS significant bits, as a mantissa and a
+// shift. Coding has to widen the range to this instead of scale.
+static PEP_FORCE_INLINE uint32_t _pep_recip_scale( const uint32_t scale, uint32_t* const restrict out_exponent )
+{
+	uint32_t exponent = _pep_recip_exponent( scale );
+	uint32_t mantissa = ( uint32_t )( ( ( uint64_t )scale + ( 1u << exponent ) - 1u ) >> exponent );
+	if( mantissa == PEP_RECIP_N )
+	{
+		mantissa >>= 1;
+		exponent++;
+	}
+	*out_exponent = exponent;
+	return mantissa;
+}
 
-	_pep_context* restrict order0 = &contexts[ PEP_CONTEXTS_MAX ];
-	for( uint64_t i = 0; i < PEP_FREQ_N; i++ ) order0->freq[ i ] = 1;
-	order0->sum = PEP_FREQ_N;
+// The range per unit of a scale, given a range that's at least the rounded
+// scale: range / scale, rounded down to PEP_RECIP_BITS significant bits.
+static PEP_FORCE_INLINE uint32_t _pep_recip_unit( const _pep_recip* const restrict recip, const uint32_t range, const uint32_t mantissa, const uint32_t exponent )
+{
+	const uint32_t unit = _pep_recip_div( recip, range >> exponent, mantissa );
+	const uint32_t unit_exponent = _pep_recip_exponent( unit );
+	return ( unit >> unit_exponent ) << unit_exponent;
+}
 
-	_pep_ac_encode ac = { 0 };
-	ac.range = ( uint32_t )( ( 1llu << 32 ) - 1 );
-	ac.data_ref = data_ref;
-	uint32_t context_id = 0;
+// Fills ctx->recip the first time a context codes with it.
+static inline void _pep_recip_prepare( pep_codec_ctx* const ctx )
+{
+	if( ctx->recip_ready ) return;
+	ctx->recip[ 0 ].magic = 0;
+	ctx->recip[ 0 ].shift = 0;
+	for( uint32_t d = 1; d < PEP_RECIP_N; d++ )
+	{
+		uint32_t shift = 0;
+		while( ( 1u << shift ) < d ) shift++;
+		ctx->recip[ d ].magic = ( uint32_t )( ( ( ( uint64_t )1 << ( 32 + shift ) ) + d - 1 ) / d - ( ( uint64_t )1 << 32 ) );
+		ctx->recip[ d ].shift = shift;
+	}
+	ctx->recip_ready = 1;
+}
 
-	p = in_pixels;
-	uint8_t indices_in_byte = 0;
-	uint8_t symbol = 0;
+// This encodes a symbol into the arithmetic-coding range. It scales the
+// current range based on the symbol's frequency and total frequency count.
+// recip is a constant, so each caller only gets one of the two ways.
+static PEP_FORCE_INLINE PEP_HOT void _pep_arith_encode( _pep_ac_encode* const restrict ac, const _pep_prob prob, const uint8_t recip )
+{
+	if( recip )
+	{
+		uint32_t exponent;
+		const uint32_t mantissa = _pep_recip_scale( prob.scale, &exponent );
+		if( PEP_UNLIKELY( ac->range < mantissa << exponent ) ) _pep_arith_encode_widen( ac, mantissa << exponent );
+		ac->range = _pep_recip_unit( ac->recip, ac->range, mantissa, exponent );
+	}
+	else
+	{
+		if( PEP_UNLIKELY( ac->range < prob.scale ) ) _pep_arith_encode_widen( ac, prob.scale );
+		ac->range /= prob.scale;
+	}
+	ac->low += prob.low * ac->range;
+	ac->range *= prob.high - prob.low;
+}
 
-	while( p < p_end || indices_in_byte > 0 )
+// Adjusts the arithmetic-coding range by removing a boundary value
+// Main goal of this process is to keep our range from getting
+// too small.
+static PEP_FORCE_INLINE PEP_HOT void _pep_arith_encode_normalize( _pep_ac_encode* const restrict ac )
+{
+	while( 1 )
 	{
-		if( PEP_LIKELY( p < p_end ) )
+		if( PEP_UNLIKELY( ( ac->low ^ ( ac->low + ac->range ) ) >= PEP_CODE_MAX_VALUE ) )
 		{
-			// Prefetch next pixels for better cache performance
-			if( PEP_LIKELY( p + 4 < p_end ) )
-			{
-				PEP_PREFETCH( p + 4, 0, 3 );
-			}
-			
-			this_p = _pep_reformat( *p, in_format, out_format );
-			uint16_t index = 0;
-			const uint32_t* restrict palette = PEP_ASSUME_ALIGNED(out_pep.palette, 16);
-			while( index < out_pep.palette_size && this_p != palette[ index ] )
+			if( PEP_UNLIKELY( ac->range < PEP_PROB_MAX_VALUE ) )
 			{
-				if( PEP_UNLIKELY( ++index >= 256 ) )
-				{
-					index = 0;
-					break;
-				}
+				ac->range = PEP_PROB_MAX_VALUE - (ac->low & (PEP_PROB_MAX_VALUE - 1));
 			}
-
-			symbol |= ( index << ( indices_in_byte * bits_per_index ) );
-			++indices_in_byte;
+			else break;
 		}
 
-		if( PEP_LIKELY( indices_in_byte >= indices_per_byte ) || PEP_UNLIKELY( p >= p_end && indices_in_byte > 0 ) )
-		{
-			uint64_t accum = 0;
-			if( PEP_UNLIKELY( symbol > out_pep.max_symbols ) ) out_pep.max_symbols = symbol;
-			_pep_context* const restrict context_ref = &contexts[ context_id & PEP_CONTEXTS_MASK ];
-			const uint32_t context_sum = context_ref->sum;
+		uint8_t byte = ac->low >> 24;
+		ac->low <<= 8;
+		ac->range <<= 8;
+		*ac->data_ref++ = byte;
+	}
+}
 
-			if( PEP_LIKELY( context_sum != 0 && context_ref->freq[ symbol ] != 0 ) )
-			{
-				_pep_prob prob = _pep_get_prob_from_ctx( context_ref, symbol );
-				_pep_arith_encode( &ac, prob );
-				PEP_UPDATE( context_ref, symbol );
-			}
-			else
-			{
-				if( PEP_LIKELY( context_sum != 0 ) )
-				{
-					_pep_prob prob = _pep_get_prob_from_ctx( context_ref, PEP_FREQ_END );
-					_pep_arith_encode( &ac, prob );
-					_pep_arith_encode_normalize( &ac );
-					context_ref->freq[ PEP_FREQ_END ] ++;
-					context_ref->sum++;
-				}
-
-				_pep_prob prob = _pep_get_prob_from_ctx( order0, symbol );
-				_pep_arith_encode( &ac, prob );
-
-				if( PEP_UNLIKELY( context_sum == 0 ) )
-				{
-					context_ref->freq[ PEP_FREQ_END ] = 1;
-					context_ref->sum = 1;
-				}
-				context_ref->freq[ symbol ] = 1;
-				context_ref->sum++;
-				PEP_UPDATE( order0, symbol );
-			}
+// Normalize only keeps the range above PEP_PROB_MAX_VALUE, but a busy 8-bit
+// context can sum to more than that, which would divide the range down to 0
+// (the encoder then wrote bytes forever). In that case shift out whole bytes
+// first, cutting the range at the next byte boundary when the top byte isn't
+// settled yet. Streams that never got there are unchanged.
+static inline void _pep_arith_encode_widen( _pep_ac_encode* const ac, const uint32_t scale )
+{
+	while( ac->range < scale )
+	{
+		if( ( ac->low ^ ( ac->low + ac->range - 1 ) ) > PEP_CODE_MAX_VALUE )
+		{
+			ac->range = ( ~ac->low & PEP_CODE_MAX_VALUE ) + 1;
+		}
 
-			_pep_arith_encode_normalize( &ac );
-			context_id = ( ( context_id << 8 ) | symbol );
+		uint8_t byte = ac->low >> 24;
+		ac->low <<= 8;
+		ac->range <<= 8;
+		*ac->data_ref++ = byte;
+	}
+}
 
-			symbol = 0;
-			indices_in_byte = 0;
+// Mirror of `_pep_arith_encode_widen()`.
+static inline void _pep_arith_decode_widen( _pep_ac_decode* const ac, const uint32_t scale )
+{
+	while( ac->range < scale )
+	{
+		if( ( ac->low ^ ( ac->low + ac->range - 1 ) ) > PEP_CODE_MAX_VALUE )
+		{
+			ac->range = ( ~ac->low & PEP_CODE_MAX_VALUE ) + 1;
 		}
 
-		if( PEP_LIKELY( p < p_end ) )
+		uint8_t in_byte = 0;
+		if( PEP_LIKELY( ac->data_ref != ac->end_of_data ) )
 		{
-			++p;
+			in_byte = *ac->data_ref++;
 		}
+
+		ac->code = ( ac->code << 8 ) | in_byte;
+		ac->range <<= 8;
+		ac->low <<= 8;
 	}
+}
 
-	for( uint8_t i = 0; i < 4; i++ )
+// Getting current frequency by doing reverse trasformation
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_arith_decode_curr_freq( _pep_ac_decode* const restrict ac, const uint32_t scale, const uint8_t recip )
+{
+	if( recip )
 	{
-		uint8_t byte = ac.low >> 24;
-		ac.low <<= 8;
-		*ac.data_ref++ = byte;
+		uint32_t exponent;
+		const uint32_t mantissa = _pep_recip_scale( scale, &exponent );
+		if( PEP_UNLIKELY( ac->range < mantissa << exponent ) ) _pep_arith_decode_widen( ac, mantissa << exponent );
+		ac->range = _pep_recip_unit( ac->recip, ac->range, mantissa, exponent );
+
+		// The unit is a mantissa under PEP_RECIP_N and a shift too.
+		const uint32_t unit_exponent = _pep_recip_exponent( ac->range );
+		return _pep_recip_div( ac->recip, ( ac->code - ac->low ) >> unit_exponent, ac->range >> unit_exponent );
 	}
 
-	out_pep.bytes_size = ac.data_ref - out_pep.bytes;
-	out_pep.bytes = ( uint8_t* )PEP_REALLOC( out_pep.bytes, out_pep.bytes_size );
-
-	return out_pep;
+	if( PEP_UNLIKELY( ac->range < scale ) ) _pep_arith_decode_widen( ac, scale );
+	ac->range /= scale;
+	uint32_t result = ( ac->code - ac->low ) / ( ac->range );
+	return result;
 }
 
-// You can decompress a pep into any format via out_format, it will correctly
-// do it for you via in_pep->format.
-// If you want the first color to be 0 alpha, set transparent_first_color to 1
-// otherwise just make it 0
-static inline uint32_t* pep_decompress( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color )
+// Same as with the encode_normalize, only on decode we reading in value
+static PEP_FORCE_INLINE PEP_HOT void _pep_arith_decode_update( _pep_ac_decode* const restrict ac, const _pep_prob prob )
 {
-	if( in_pep == NULL ) return NULL;
-	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 || in_pep->height == 0 ) return NULL;
-
-	const uint32_t area = in_pep->width * in_pep->height;
-	uint8_t* data_ref = in_pep->bytes;
-	uint32_t* out_pixels = ( uint32_t* )PEP_MALLOC( area * sizeof( uint32_t ) );
+	ac->low += ac->range * prob.low;
+	ac->range *= prob.high - prob.low;
 
-	uint64_t canvas_pos = 0;
+	// Only corrupt or truncated data lands on a zero-width symbol. Keep going
+	// (with garbage) rather than spinning forever on an empty range.
+	if( PEP_UNLIKELY( ac->range == 0 ) ) ac->range = 1;
 
-	uint8_t bits_per_index = PEP_BITS_TO_FIT( in_pep->palette_size );
-	if( bits_per_index > 8 ) bits_per_index = 8; // only 8 bits in a byte
+	while( 1 )
+	{
+		if( PEP_UNLIKELY( ( ac->low ^ ( ac->low + ac->range ) ) >= PEP_CODE_MAX_VALUE ) )
+		{
+			if( PEP_UNLIKELY( ac->range < PEP_PROB_MAX_VALUE ) )
+			{
+				ac->range = PEP_PROB_MAX_VALUE - (ac->low & (PEP_PROB_MAX_VALUE - 1));
+			}
+			else break;
+		}
 
-	const uint8_t indices_per_byte = 8 / bits_per_index;
-	const uint8_t index_mask = ( 1 << bits_per_index ) - 1;
+		uint8_t in_byte = 0;
+		if( PEP_LIKELY( ac->data_ref != ac->end_of_data ) )
+		{
+			in_byte = *ac->data_ref++;
+		}
 
-	static _pep_context contexts[ PEP_CONTEXTS_MAX + 1 ] = { 0 };
+		ac->code = ( ac->code << 8 ) | in_byte;
+		ac->range <<= 8;
+		ac->low <<= 8;
+	}
+}
 
-	_pep_context* restrict order0 = &contexts[ PEP_CONTEXTS_MAX ];
-	for( uint64_t i = 0; i < PEP_FREQ_N; i++ ) order0->freq[ i ] = 1;
-	order0->sum = PEP_FREQ_N;
+static PEP_FORCE_INLINE PEP_HOT _pep_sym_decode _pep_get_sym_from_freq( const _pep_context* const restrict ctx, const uint32_t target_freq, const uint32_t max_symbol )
+{
+	_pep_sym_decode result = { };
 
-	///////
-	// decompress PPM order-2 structure into packed-palette-indices
+	uint32_t s = 0;
+	uint32_t freq = 0;
+	const uint16_t* restrict freq_table = ctx->freq;
 
-	uint32_t context_id = 0;
-	const uint16_t max_symbols = in_pep->max_symbols + 1;
+	// The first few symbols are by far the most common, check those inline
+	// and hand the rest of the table to the kernel.
+	const uint32_t head = max_symbol < PEP_SIMD_SCAN_MIN ? max_symbol : PEP_SIMD_SCAN_MIN;
+	for( ; s < head; ++s )
+	{
+		freq += freq_table[ s ];
+		if( PEP_LIKELY( freq > target_freq ) ) break;
+	}
 
-	static uint32_t palette[ 256 ];
-	// Pre-reformat the palette once to the desired output format
-	const uint32_t* restrict src_palette = in_pep->palette;
-	for( uint32_t i = 0; i < in_pep->palette_size; ++i )
+	if( s == head && s < max_symbol )
 	{
-		palette[ i ] = _pep_reformat( src_palette[ i ], in_pep->format, out_format );
+		s += _pep_find( freq_table + s, max_symbol - s, target_freq, &freq );
 	}
-	const uint64_t packed_indices_size = area / indices_per_byte;
 
-	if( transparent_first_color != 0 )
+	if( PEP_UNLIKELY( s >= max_symbol ) )
 	{
-		if( in_pep->format <= pep_bgra )
-		{
-			palette[ 0 ] = palette[ 0 ] & 0xffffff00;
-		}
-		else
-		{
-			palette[ 0 ] = palette[ 0 ] & 0x00ffffff;
-		}
+		s = ctx->escape;
+		freq += freq_table[ s ];
 	}
 
-	_pep_ac_decode ac = { 0 };
-	ac.range = ( uint32_t )( ( 1llu << 32 ) - 1 );
-	ac.data_ref = data_ref;
-	ac.end_of_data = data_ref + in_pep->bytes_size;
+	result.prob.high = freq;
+	result.prob.low = freq - ctx->freq[ s ];
+	result.prob.scale = ctx->sum;
+	result.symbol = s;
 
-	for( uint8_t i = 0; i < 4; ++i )
+	return result;
+}
+
+// Rebuilds a tree from n plain frequencies in O(n), used after a rescale.
+static inline void _pep_fenwick_build( _pep_fenwick* const tree, const uint16_t* const freq, const uint32_t n )
+{
+	tree[ 0 ] = 0;
+	for( uint32_t i = 1; i <= n; i++ ) tree[ i ] = freq[ i - 1 ];
+	for( uint32_t i = 1; i <= n; i++ )
 	{
-		uint8_t in_byte = 0;
-		if( ac.data_ref != ac.end_of_data )
-		{
-			in_byte = *ac.data_ref++;
-		}
+		const uint32_t parent = i + ( i & ( 0u - i ) );
+		if( parent <= n ) tree[ parent ] += tree[ i ];
+	}
+}
 
-		ac.code = ( ac.code << 8 ) | in_byte;
+static PEP_FORCE_INLINE PEP_HOT void _pep_fenwick_add( _pep_fenwick* const restrict tree, const uint32_t n, const uint32_t symbol, const uint32_t delta )
+{
+	for( uint32_t i = symbol + 1; i <= n; i += i & ( 0u - i ) )
+	{
+		tree[ i ] += delta;
 	}
+}
 
-	_pep_sym_decode decode_result;
-	for( uint64_t b = 0; b < packed_indices_size; b++ )
+// Sum of freq[ 0..symbol ).
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_fenwick_below( const _pep_fenwick* const restrict tree, const uint32_t symbol )
+{
+	uint32_t sum = 0;
+	for( uint32_t i = symbol; i > 0; i &= i - 1 )
 	{
-		_pep_context* const restrict context_ref = &contexts[ context_id & PEP_CONTEXTS_MASK ];
-		const uint32_t context_sum = context_ref->sum;
+		sum += tree[ i ];
+	}
+	return sum;
+}
 
-		uint8_t symbol_found = 0;
-		if( context_sum != 0 )
+// Finds the first symbol whose cumulative frequency passes target_freq, the
+// same one the linear scan stops at, by descending the implicit tree. n is
+// an alphabet plus the escape, so n - 1 is its top power of two.
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_fenwick_find( const _pep_fenwick* const restrict tree, const uint32_t n, const uint32_t target_freq, uint32_t* const restrict out_low )
+{
+	uint32_t pos = 0;
+	uint32_t low = 0;
+	for( uint32_t step = n - 1; step > 0; step >>= 1 )
+	{
+		const uint32_t next = pos + step;
+		if( next <= n && low + tree[ next ] <= target_freq )
 		{
-			uint32_t decode_freq = _pep_arith_decode_curr_freq( &ac, context_sum );
-			decode_result = _pep_get_sym_from_freq( context_ref, decode_freq, max_symbols );
-			_pep_arith_decode_update( &ac, decode_result.prob );
-
-			if( decode_result.symbol != PEP_FREQ_END )
-			{
-				symbol_found = 1;
-				PEP_UPDATE( context_ref, decode_result.symbol );
-			}
-			else
-			{
-				context_ref->freq[ PEP_FREQ_END ] ++;
-				context_ref->sum++;
-			}
+			pos = next;
+			low += tree[ next ];
 		}
+	}
+	*out_low = low;
+	return pos;
+}
 
-		if( !symbol_found )
-		{
-			uint32_t decode_freq = _pep_arith_decode_curr_freq( &ac, order0->sum );
-			decode_result = _pep_get_sym_from_freq( order0, decode_freq, max_symbols );
-			_pep_arith_decode_update( &ac, decode_result.prob );
+///////
+// The frequency model used by the coder: plain frequencies, optionally
+// mirrored into a Fenwick tree. `tree` is NULL whenever the linear path is in
+// use, so without PEP_FENWICK these collapse to the original code.
+
+// Context `context_index` of the current image (`ctx->alphabet` is order0),
+// given its `ctx->context_stride`. A context only spans its alphabet's
+// frequencies, the rest of the struct overlaps the next one (and the pool is
+// sized for the last to fit).
+static PEP_FORCE_INLINE PEP_HOT _pep_context* _pep_context_at( pep_codec_ctx* const restrict ctx, const uint32_t context_stride, const uint32_t context_index )
+{
+	return ( _pep_context* )( ( uint8_t* )ctx->contexts + ( size_t )context_index * context_stride );
+}
 
-			if( context_sum == 0 )
-			{
-				context_ref->freq[ PEP_FREQ_END ] = 1;
-				context_ref->sum = 1;
-			}
-			context_ref->freq[ decode_result.symbol ] = 1;
-			context_ref->sum++;
-			PEP_UPDATE( order0, decode_result.symbol );
-		}
+static PEP_FORCE_INLINE PEP_HOT _pep_fenwick* _pep_model_tree( pep_codec_ctx* const restrict ctx, const uint32_t context_index, const uint8_t use_fenwick )
+{
+#ifdef PEP_FENWICK
+	return use_fenwick ? ctx->fenwick + ( size_t )context_index * ( ctx->alphabet + 2 ) : NULL;
+#else
+	( void )ctx; ( void )context_index; ( void )use_fenwick;
+	return NULL;
+#endif
+}
 
-		///////
-		// convert packed-palette-indices to pixels
+static PEP_FORCE_INLINE PEP_HOT _pep_prob _pep_model_prob( const _pep_context* const restrict ctx, const _pep_fenwick* const restrict tree, const uint32_t symbol )
+{
+	if( tree )
+	{
+		_pep_prob prob;
+		prob.scale = ctx->sum;
+		prob.low = _pep_fenwick_below( tree, symbol );
+		prob.high = prob.low + ctx->freq[ symbol ];
+		return prob;
+	}
+	return _pep_get_prob_from_ctx( ctx, symbol );
+}
 
-		if( indices_per_byte > 1 )
-		{
-			uint8_t indices_in_byte = 0;
-			while( indices_in_byte < indices_per_byte && canvas_pos < area )
-			{
-				const uint8_t palette_idx = ( decode_result.symbol >> ( indices_in_byte * bits_per_index ) ) & index_mask;
-				out_pixels[ canvas_pos ] = palette[ palette_idx ];
-				++canvas_pos;
-				++indices_in_byte;
-			}
-		}
-		else
+static PEP_FORCE_INLINE PEP_HOT _pep_sym_decode _pep_model_sym( const _pep_context* const restrict ctx, const _pep_fenwick* const restrict tree, const uint32_t target_freq, const uint32_t max_symbol )
+{
+	if( tree )
+	{
+		_pep_sym_decode result;
+		uint32_t s = _pep_fenwick_find( tree, ctx->escape + 1u, target_freq, &result.prob.low );
+
+		// Symbols past max_symbol never occur in the order-2 contexts, so their
+		// cumulative frequency is the same as the linear scan's.
+		if( PEP_UNLIKELY( s >= max_symbol ) )
 		{
-			if( canvas_pos < area )
-			{
-				out_pixels[ canvas_pos ] = palette[ decode_result.symbol ];
-				++canvas_pos;
-			}
+			s = ctx->escape;
+			result.prob.low = _pep_fenwick_below( tree, s );
 		}
 
-		context_id = ( ( context_id << 8 ) | decode_result.symbol );
+		result.prob.high = result.prob.low + ctx->freq[ s ];
+		result.prob.scale = ctx->sum;
+		result.symbol = s;
+		return result;
 	}
+	return _pep_get_sym_from_freq( ctx, target_freq, max_symbol );
+}
 
-	return out_pixels;
+static PEP_FORCE_INLINE PEP_HOT void _pep_model_add( _pep_context* const restrict ctx, _pep_fenwick* const restrict tree, const uint32_t symbol, const uint16_t delta )
+{
+	ctx->freq[ symbol ] += delta;
+	ctx->sum += delta;
+	if( tree ) _pep_fenwick_add( tree, ctx->escape + 1u, symbol, delta );
 }
 
-static inline void pep_free( pep* in_pep )
+static PEP_FORCE_INLINE PEP_HOT void _pep_model_update( _pep_context* const restrict ctx, _pep_fenwick* const restrict tree, const uint32_t symbol, const uint32_t step, const uint32_t limit )
 {
-	if( in_pep && in_pep->bytes )
+	const uint8_t rescales = ctx->freq[ symbol ] + step > limit;
+	PEP_UPDATE( ctx, symbol, step, limit );
+	if( tree )
 	{
-		free( in_pep->bytes );
-		in_pep->bytes = NULL;
-		in_pep->bytes_size = 0;
+		if( PEP_UNLIKELY( rescales ) ) _pep_fenwick_build( tree, ctx->freq, ctx->escape + 1u );
+		else _pep_fenwick_add( tree, ctx->escape + 1u, symbol, step );
 	}
 }
 
-///////
+// The frequency step and limit a stream codes with, from a pep's or the
+// options' (0 picks the default), kept to what "Model tuning" allows.
+static inline uint32_t _pep_freq_step( const uint32_t step )
+{
+	if( step == 0 ) return PEP_FREQ_STEP;
+	return step < PEP_FREQ_STEP_LIMIT ? step : PEP_FREQ_STEP_LIMIT;
+}
 
-static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_size )
+static inline uint32_t _pep_freq_max( const uint32_t limit )
 {
-	if( !in_pep || !in_pep->width || !in_pep->height || !in_pep->bytes_size || !in_pep->bytes )
+	if( limit == 0 ) return PEP_FREQ_MAX;
+	if( limit < PEP_FREQ_MAX_MIN ) return PEP_FREQ_MAX_MIN;
+	return limit < PEP_FREQ_MAX_LIMIT ? limit : PEP_FREQ_MAX_LIMIT;
+}
+
+// Sets what the header has to say about how out_pep was coded with options.
+// rANS doesn't use the adaptive model, so its peps keep the defaults.
+static inline void _pep_record_options( pep* const out_pep, const pep_encode_options* const options )
+{
+	out_pep->coder = options->coder;
+	out_pep->freq_step = ( uint8_t )( options->coder == pep_coder_rans ? PEP_FREQ_STEP : _pep_freq_step( options->freq_step ) );
+	out_pep->freq_max = ( uint16_t )( options->coder == pep_coder_rans ? PEP_FREQ_MAX : _pep_freq_max( options->freq_max ) );
+}
+
+#ifdef PEP_PROFILE
+// Counts a lookup of `length` frequencies, which is only a scan without a tree.
+static inline void _pep_profile_scan( pep_codec_ctx* const ctx, const _pep_fenwick* const tree, const uint32_t length )
+{
+	if( tree ) return;
+	ctx->profile.scans++;
+	ctx->profile.scan_length += length;
+}
+
+// Counts whether updating `symbol` in context_ref is going to rescale it.
+static inline void _pep_profile_update( pep_codec_ctx* const ctx, const _pep_context* const context_ref, const uint32_t symbol, const uint32_t step, const uint32_t limit )
+{
+	ctx->profile.rescales += context_ref->freq[ symbol ] + step > limit;
+}
+#endif
+
+// Allocates a fresh codec context, ready to use.
+// Returns NULL if the allocation failed.
+static inline pep_codec_ctx* pep_codec_ctx_create( void )
+{
+	pep_codec_ctx* ctx = ( pep_codec_ctx* )PEP_MALLOC( sizeof( pep_codec_ctx ) );
+	if( ctx ) pep_codec_ctx_reset( ctx );
+	return ctx;
+}
+
+// Clears every context back to "never seen", as if the process just started.
+// The compress/decompress calls do this themselves, so this is only needed
+// once for a context you allocated yourself.
+static inline void pep_codec_ctx_reset( pep_codec_ctx* const ctx )
+{
+	if( ctx == NULL ) return;
+	pep_encode_options defaults = { pep_palette_first_seen, pep_coder_arith, 2, PEP_FREQ_STEP, PEP_FREQ_MAX };
+	ctx->options = defaults;
+	_pep_codec_ctx_prepare( ctx, PEP_CONTEXTS_MAX, 1 );
+	ctx->recip_ready = 0;
+#ifdef PEP_PROFILE
+	pep_profile empty = { 0 };
+	ctx->profile = empty;
+#endif
+}
+
+static inline void pep_codec_ctx_destroy( pep_codec_ctx* ctx )
+{
+	if( ctx ) PEP_FREE( ctx );
+}
+
+// Per-image reset: packs alphabet contexts of alphabet + 1 frequencies (and
+// the order0 one after them) at the start of the pool, so only those get
+// cleared. The trees are only touched when this image uses them.
+static inline void _pep_codec_ctx_prepare( pep_codec_ctx* const ctx, const uint32_t alphabet, const uint8_t use_fenwick )
+{
+	_pep_kernels_init();
+
+	const uint32_t n = alphabet + 1;
+	ctx->alphabet = alphabet;
+	ctx->context_stride = ( uint32_t )( offsetof( _pep_context, freq ) + _PEP_FREQ_STRIDE( n ) * sizeof( uint16_t ) );
+	for( uint32_t c = 0; c < alphabet; c++ )
 	{
-		*out_size = 0;
-		return NULL;
+		_pep_context* const context_ref = _pep_context_at( ctx, ctx->context_stride, c );
+		for( uint32_t i = 0; i < n; i++ ) context_ref->freq[ i ] = 0;
+		context_ref->sum = 0;
+		context_ref->escape = ( uint16_t )alphabet;
+		context_ref->tail = 0;
 	}
-	
-	uint16_t palette_count = in_pep->palette_size ? in_pep->palette_size : ( in_pep->palette[ 0 ] ? 256 : 0 );
-	
-	if( !palette_count )
+
+	_pep_context* const order0 = _pep_context_at( ctx, ctx->context_stride, alphabet );
+	for( uint32_t i = 0; i < n; i++ ) order0->freq[ i ] = 1;
+	order0->sum = PEP_FREQ_N;
+	order0->escape = ( uint16_t )alphabet;
+	order0->tail = ( uint16_t )( PEP_FREQ_N - n );
+
+#ifdef PEP_FENWICK
+	if( use_fenwick )
+	{
+		for( uint32_t i = 0; i < alphabet * ( n + 1 ); i++ ) ctx->fenwick[ i ] = 0;
+		_pep_fenwick_build( _pep_model_tree( ctx, alphabet, 1 ), order0->freq, n );
+	}
+#else
+	( void )use_fenwick;
+#endif
+}
+
+// Returns the hash slot that holds `color`, or the empty slot it would go in.
+static PEP_FORCE_INLINE PEP_HOT uint32_t _pep_palette_slot( const uint16_t* const restrict hash, const uint32_t* const restrict palette, const uint32_t color )
+{
+	uint32_t slot = ( color * 0x9E3779B1u ) >> ( 32 - PEP_PALETTE_HASH_BITS );
+	while( hash[ slot ] != 0 && palette[ hash[ slot ] - 1 ] != color )
+	{
+		slot = ( slot + 1 ) & PEP_PALETTE_HASH_MASK;
+	}
+	return slot;
+}
+
+// PEP supports "dynamic formats", where you can specify what the in-bytes are,
+// and reformat to a different channel-order.
+// This means two "identical" PEP files can have different formats, but you
+// can choose how to reformat it when it decompresses!
+static inline _pep_swizzle _pep_swizzle_of( const pep_format in_format, const pep_format out_format )
+{
+	_pep_swizzle sw = { 0, 0 };
+	if( in_format == out_format ) return sw;
+
+	if( in_format <= pep_bgra && out_format <= pep_bgra ) { sw.bswap = 1; sw.rotl = 8; } // swaps bytes 1 and 3
+	else if( in_format >= pep_abgr && out_format >= pep_abgr ) { sw.bswap = 1; sw.rotl = 24; } // swaps bytes 0 and 2
+	else if( ( in_format ^ out_format ) == 2 ) sw.bswap = 1;
+	else if( in_format < out_format ) sw.rotl = 24; // alpha from the bottom byte to the top
+	else sw.rotl = 8;
+	return sw;
+}
+
+static PEP_FORCE_INLINE uint32_t _pep_swizzle_apply( const uint32_t in_color, const _pep_swizzle sw )
+{
+	if( PEP_LIKELY( ( sw.bswap | sw.rotl ) == 0 ) ) return in_color; // the same format, by far the most common
+	const uint32_t swapped = ( in_color >> 24 ) | ( ( in_color >> 8 ) & 0x0000ff00 ) | ( ( in_color << 8 ) & 0x00ff0000 ) | ( in_color << 24 );
+	const uint32_t c = sw.bswap ? swapped : in_color;
+	return ( c << sw.rotl ) | ( c >> ( ( 32 - sw.rotl ) & 31 ) );
+}
+
+static inline uint32_t _pep_reformat( const uint32_t in_color, const pep_format in_format, const pep_format out_format )
+{
+	return _pep_swizzle_apply( in_color, _pep_swizzle_of( in_format, out_format ) );
+}
+
+// Bulk swizzle kernels. `perm` is the swizzle applied to 0x03020100, so its
+// byte j (in memory order) is the source byte of output byte j, which is
+// exactly a per-color byte shuffle. They return how many colors they did and
+// leave the rest to the scalar loop.
+#ifdef _PEP_SIMD_AVX2
+#define _PEP_SSSE3 __attribute__( ( target( "ssse3" ) ) )
+
+_PEP_SSSE3 static inline uint64_t _pep_swizzle_ssse3( uint32_t* const out, const uint32_t* const in, const uint64_t count, const uint32_t perm )
+{
+	const __m128i shuffle = _mm_set_epi32( ( int )( perm + 0x0c0c0c0c ), ( int )( perm + 0x08080808 ), ( int )( perm + 0x04040404 ), ( int )perm );
+	uint64_t i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		const __m128i v = _mm_loadu_si128( ( const __m128i* )( in + i ) );
+		_mm_storeu_si128( ( __m128i* )( out + i ), _mm_shuffle_epi8( v, shuffle ) );
+	}
+	return i;
+}
+
+_PEP_AVX2 static inline uint64_t _pep_swizzle_avx2( uint32_t* const out, const uint32_t* const in, const uint64_t count, const uint32_t perm )
+{
+	// vpshufb works within each 128-bit lane, so both lanes use the same mask.
+	const __m256i shuffle = _mm256_set_epi32( ( int )( perm + 0x0c0c0c0c ), ( int )( perm + 0x08080808 ), ( int )( perm + 0x04040404 ), ( int )perm, ( int )( perm + 0x0c0c0c0c ), ( int )( perm + 0x08080808 ), ( int )( perm + 0x04040404 ), ( int )perm );
+	uint64_t i = 0;
+	for( ; i + 8 <= count; i += 8 )
+	{
+		const __m256i v = _mm256_loadu_si256( ( const __m256i* )( in + i ) );
+		_mm256_storeu_si256( ( __m256i* )( out + i ), _mm256_shuffle_epi8( v, shuffle ) );
+	}
+	return i;
+}
+#endif
+
+#if defined( _PEP_SIMD_NEON ) && !defined( __AARCH64EB__ )
+static inline uint64_t _pep_swizzle_neon( uint32_t* const out, const uint32_t* const in, const uint64_t count, const uint32_t perm )
+{
+	const uint32_t lanes[ 4 ] = { perm, perm + 0x04040404, perm + 0x08080808, perm + 0x0c0c0c0c };
+	const uint8x16_t shuffle = vreinterpretq_u8_u32( vld1q_u32( lanes ) );
+	uint64_t i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		const uint8x16_t v = vreinterpretq_u8_u32( vld1q_u32( in + i ) );
+		vst1q_u32( out + i, vreinterpretq_u32_u8( vqtbl1q_u8( v, shuffle ) ) );
+	}
+	return i;
+}
+#endif
+
+// Converts count colors from in_format to out_format. in_pixels can be
+// out_pixels (in place), but mustn't otherwise overlap it.
+static inline void pep_swizzle( uint32_t* const out_pixels, const uint32_t* const in_pixels, const uint64_t count, const pep_format in_format, const pep_format out_format )
+{
+	uint64_t i = 0;
+	if( in_format == out_format )
+	{
+		if( out_pixels != in_pixels ) for( ; i < count; i++ ) out_pixels[ i ] = in_pixels[ i ];
+		return;
+	}
+
+	const _pep_swizzle sw = _pep_swizzle_of( in_format, out_format );
+#if defined( _PEP_SIMD_AVX2 ) && !( defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ )
+	_pep_kernels_init();
+	if( _pep_cpu_has( _PEP_CPU_AVX2 ) ) i = _pep_swizzle_avx2( out_pixels, in_pixels, count, _pep_swizzle_apply( 0x03020100, sw ) );
+	else if( _pep_cpu_has( _PEP_CPU_SSSE3 ) ) i = _pep_swizzle_ssse3( out_pixels, in_pixels, count, _pep_swizzle_apply( 0x03020100, sw ) );
+#elif defined( _PEP_SIMD_NEON ) && !defined( __AARCH64EB__ )
+	i = _pep_swizzle_neon( out_pixels, in_pixels, count, _pep_swizzle_apply( 0x03020100, sw ) );
+#endif
+	for( ; i < count; i++ ) out_pixels[ i ] = _pep_swizzle_apply( in_pixels[ i ], sw );
+}
+
+// The pep_format that 4 bytes in `order` read as, as a uint32_t on this host.
+static inline pep_format pep_byte_format( const pep_byte_order order )
+{
+#if defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return order == pep_bgra8 ? pep_bgra : pep_rgba;
+#else
+	return order == pep_bgra8 ? pep_argb : pep_abgr;
+#endif
+}
+
+// Builds out_pep's palette (in out_format) from every distinct color in its
+// width * height pixels, whose rows start `stride` pixels apart, leaving
+// `hash` mapping each color to its index + 1. The indices follow `order`.
+static inline void _pep_build_palette( pep* const out_pep, uint16_t* const hash, const uint32_t* const in_pixels, const uint64_t stride, const pep_format in_format, const pep_format out_format, const pep_palette_order order )
+{
+	// Packed rows are one long row.
+	const uint8_t packed = stride == out_pep->width;
+	const uint64_t row_pixels = packed ? ( uint64_t )out_pep->width * out_pep->height : out_pep->width;
+	const uint32_t rows = packed ? 1 : out_pep->height;
+	uint32_t last_p = 0;
+	uint32_t this_p = 0;
+	uint32_t formatted_p = 0;
+	const _pep_swizzle sw = _pep_swizzle_of( in_format, out_format );
+
+	// Pixels per hash entry (index + 1, 0 for colors that didn't fit), added
+	// up a run at a time.
+	uint64_t counts[ 256 ];
+	uint64_t* const counts_ref = order == pep_palette_by_count ? counts : NULL;
+	uint16_t last_entry = 0;
+	if( counts_ref ) for( uint32_t i = 0; i < 256; i++ ) counts[ i ] = 0;
+
+	for( uint32_t i = 0; i < PEP_PALETTE_HASH_N; i++ ) hash[ i ] = 0;
+
+	for( uint32_t row = 0; row < rows; row++ )
+	{
+		const uint32_t* p = in_pixels + row * stride;
+		const uint32_t* const p_end = p + row_pixels;
+		const uint32_t* run = p;
+		while( p < p_end )
+		{
+			this_p = *p;
+
+			if( p > in_pixels && this_p == last_p )
+			{
+				p++;
+				continue;
+			}
+
+			formatted_p = _pep_swizzle_apply( this_p, sw );
+
+			const uint32_t slot = _pep_palette_slot( hash, out_pep->palette, formatted_p );
+			if( hash[ slot ] == 0 && ( ( uint16_t )out_pep->palette_size + 1 ) < 256 )
+			{
+				out_pep->palette[ out_pep->palette_size++ ] = formatted_p;
+				hash[ slot ] = out_pep->palette_size;
+			}
+
+			if( counts_ref )
+			{
+				counts_ref[ last_entry ] += ( uint64_t )( p - run );
+				run = p;
+				last_entry = hash[ slot ];
+			}
+			last_p = this_p;
+			p++;
+		}
+		if( counts_ref ) counts_ref[ last_entry ] += ( uint64_t )( p - run );
+	}
+
+	if( counts_ref )
+	{
+		uint8_t remap[ 256 ];
+		_pep_palette_by_count( out_pep, counts + 1, remap );
+		_pep_palette_hash_fill( hash, out_pep->palette, out_pep->palette_size );
+	}
+}
+
+// Renumbers out_pep's palette so the colors with the highest counts (one per
+// index) come first, ties keeping their order. out_remap[ old ] = new.
+static inline void _pep_palette_by_count( pep* const out_pep, const uint64_t* const counts, uint8_t* const out_remap )
+{
+	const uint8_t size = out_pep->palette_size;
+	uint8_t order[ 256 ];
+	for( uint32_t i = 0; i < size; i++ )
+	{
+		// Insertion sort; a palette is at most 255 entries and usually a few.
+		uint32_t at = i;
+		while( at > 0 && counts[ order[ at - 1 ] ] < counts[ i ] )
+		{
+			order[ at ] = order[ at - 1 ];
+			at--;
+		}
+		order[ at ] = ( uint8_t )i;
+	}
+
+	uint32_t palette[ 256 ];
+	for( uint32_t i = 0; i < size; i++ )
+	{
+		palette[ i ] = out_pep->palette[ order[ i ] ];
+		out_remap[ order[ i ] ] = ( uint8_t )i;
+	}
+	for( uint32_t i = 0; i < size; i++ ) out_pep->palette[ i ] = palette[ i ];
+}
+
+// Rebuilds the color -> index hash for an existing palette.
+static inline void _pep_palette_hash_fill( uint16_t* const hash, const uint32_t* const palette, const uint8_t palette_size )
+{
+	for( uint32_t i = 0; i < PEP_PALETTE_HASH_N; i++ ) hash[ i ] = 0;
+	for( uint32_t i = 0; i < palette_size; i++ )
+	{
+		const uint32_t slot = _pep_palette_slot( hash, palette, palette[ i ] );
+		if( hash[ slot ] == 0 ) hash[ slot ] = ( uint16_t )( i + 1 );
+	}
+}
+
+// Starts a stream for a palette of palette_size colors, coded as options say,
+// into out_bytes. With pep_coder_rans the packed symbols themselves go to
+// out_bytes, for `_pep_sink_end()` to code once they're all in.
+static inline void _pep_encoder_begin( _pep_encoder* const enc, pep_codec_ctx* const ctx, const uint8_t palette_size, const pep_encode_options* const options, uint8_t* const out_bytes )
+{
+	_pep_encoder empty = { 0 };
+	*enc = empty;
+	enc->ctx = ctx;
+
+	enc->bits_per_index = PEP_BITS_TO_FIT( palette_size );
+	if( enc->bits_per_index > 8 ) enc->bits_per_index = 8; // only 8 bits in a byte
+
+	enc->indices_per_byte = 8 / enc->bits_per_index;
+
+	enc->rans = _pep_rans_state_count( options );
+	enc->use_fenwick = palette_size >= PEP_FENWICK_MIN_PALETTE;
+	if( !enc->rans )
+	{
+		_pep_codec_ctx_prepare( ctx, 1u << ( enc->bits_per_index * enc->indices_per_byte ), enc->use_fenwick );
+		enc->context_stride = ctx->context_stride;
+		enc->order0 = _pep_context_at( ctx, ctx->context_stride, ctx->alphabet );
+		enc->freq_step = _pep_freq_step( options->freq_step );
+		enc->freq_max = _pep_freq_max( options->freq_max );
+	}
+
+	enc->ac.range = ( uint32_t )( ( 1llu << 32 ) - 1 );
+	enc->ac.data_ref = out_bytes;
+	if( options->coder == pep_coder_arith_recip )
+	{
+		_pep_recip_prepare( ctx );
+		enc->ac.recip = ctx->recip;
+	}
+}
+
+// Codes one packed symbol with the PPM order-2 model.
+static PEP_FORCE_INLINE PEP_HOT void _pep_encode_symbol( _pep_encoder* const restrict enc, uint8_t symbol )
+{
+	if( enc->rans )
+	{
+		// Same clamp as `_pep_encode_ppm_symbol()`, with the alphabet's bits.
+		if( PEP_UNLIKELY( symbol >> ( enc->bits_per_index * enc->indices_per_byte ) ) ) symbol = 0;
+		if( symbol > enc->max_symbol ) enc->max_symbol = symbol;
+		_PEP_PROFILE( enc->ctx->profile.symbols++ );
+		*enc->ac.data_ref++ = symbol;
+		return;
+	}
+	if( enc->ac.recip ) _pep_encode_ppm_symbol( enc, symbol, 1 );
+	else _pep_encode_ppm_symbol( enc, symbol, 0 );
+}
+
+// `_pep_encode_symbol()` for the arithmetic coder, recip (a constant) saying
+// which way it scales.
+static PEP_FORCE_INLINE PEP_HOT void _pep_encode_ppm_symbol( _pep_encoder* const restrict enc, uint8_t symbol, const uint8_t recip )
+{
+	pep_codec_ctx* const restrict ctx = enc->ctx;
+	_pep_context* const restrict order0 = enc->order0;
+	_pep_fenwick* const restrict order0_tree = _pep_model_tree( ctx, ctx->alphabet, enc->use_fenwick );
+
+	if( PEP_UNLIKELY( symbol > enc->max_symbol ) )
+	{
+		// Only an index for a color missing from the palette can pack past the
+		// alphabet, and that fails the encode; stay inside the contexts until then.
+		if( symbol >= order0->escape ) symbol = 0;
+		else enc->max_symbol = symbol;
+	}
+	_pep_context* const restrict context_ref = _pep_context_at( ctx, enc->context_stride, enc->context_id & PEP_CONTEXTS_MASK );
+	_pep_fenwick* const restrict tree = _pep_model_tree( ctx, enc->context_id & PEP_CONTEXTS_MASK, enc->use_fenwick );
+	const uint32_t context_sum = context_ref->sum;
+	_PEP_PROFILE( ctx->profile.symbols++ );
+
+	if( PEP_LIKELY( context_sum != 0 && context_ref->freq[ symbol ] != 0 ) )
+	{
+		_pep_prob prob = _pep_model_prob( context_ref, tree, symbol );
+		_pep_arith_encode( &enc->ac, prob, recip );
+		_PEP_PROFILE( _pep_profile_scan( ctx, tree, symbol ); _pep_profile_update( ctx, context_ref, symbol, enc->freq_step, enc->freq_max ) );
+		_pep_model_update( context_ref, tree, symbol, enc->freq_step, enc->freq_max );
+	}
+	else
+	{
+		if( PEP_LIKELY( context_sum != 0 ) )
+		{
+			_pep_prob prob = _pep_model_prob( context_ref, tree, context_ref->escape );
+			_pep_arith_encode( &enc->ac, prob, recip );
+			_pep_arith_encode_normalize( &enc->ac );
+			_PEP_PROFILE( _pep_profile_scan( ctx, tree, context_ref->escape ) );
+		}
+
+		_pep_prob prob = _pep_model_prob( order0, order0_tree, symbol );
+		_pep_arith_encode( &enc->ac, prob, recip );
+		_PEP_PROFILE( ctx->profile.escapes++; _pep_profile_scan( ctx, order0_tree, symbol ); _pep_profile_update( ctx, order0, symbol, enc->freq_step, enc->freq_max ) );
+
+		// Escape count, which also opens a fresh context.
+		_pep_model_add( context_ref, tree, context_ref->escape, 1 );
+		_pep_model_add( context_ref, tree, symbol, 1 );
+		_pep_model_update( order0, order0_tree, symbol, enc->freq_step, enc->freq_max );
+	}
+
+	_pep_arith_encode_normalize( &enc->ac );
+	enc->context_id = ( ( enc->context_id << 8 ) | symbol );
+}
+
+// Packs one palette index into the current symbol, coding it once it's full.
+static PEP_FORCE_INLINE PEP_HOT void _pep_encode_index( _pep_encoder* const restrict enc, const uint32_t index )
+{
+	enc->symbol |= ( uint8_t )( index << ( enc->indices_in_byte * enc->bits_per_index ) );
+	if( ++enc->indices_in_byte >= enc->indices_per_byte )
+	{
+		_pep_encode_symbol( enc, enc->symbol );
+		enc->symbol = 0;
+		enc->indices_in_byte = 0;
+	}
+}
+
+// Codes `count` pixels, which can take up to _PEP_SYMBOL_MAX_BYTES each at
+// enc->ac.data_ref.
+// enc->ctx->palette_hash has to map in_pep's palette.
+static inline void _pep_encode_pixels( _pep_encoder* const enc, const pep* const in_pep, const uint32_t* const in_pixels, const uint64_t count, const pep_format in_format )
+{
+	_pep_encoder e = *enc; // a local copy keeps the coder state in registers
+	const _pep_swizzle sw = _pep_swizzle_of( in_format, in_pep->format );
+	const uint32_t* const restrict palette = in_pep->palette;
+	const uint8_t palette_size = in_pep->palette_size;
+	const uint16_t* const restrict palette_hash = e.ctx->palette_hash;
+	const uint32_t* p = in_pixels;
+	const uint32_t* const p_end = p + count;
+
+	for( ; p < p_end; ++p )
+	{
+		// Prefetch next pixels for better cache performance
+		if( PEP_LIKELY( p + 4 < p_end ) )
+		{
+			PEP_PREFETCH( p + 4, 0, 3 );
+		}
+
+		// Runs of the same color are the common case, so reuse the last index.
+		if( PEP_UNLIKELY( !e.has_last ) || *p != e.last_p )
+		{
+			e.has_last = 1;
+			e.last_p = *p;
+			const uint32_t this_p = _pep_swizzle_apply( e.last_p, sw );
+
+			// Colors that didn't fit in the palette map to palette_size, as before.
+			const uint16_t entry = palette_hash[ _pep_palette_slot( palette_hash, palette, this_p ) ];
+			e.index = entry ? entry - 1 : palette_size;
+			e.missing |= !entry;
+		}
+
+		_pep_encode_index( &e, e.index );
+	}
+
+	*enc = e;
+}
+
+// Same as `_pep_encode_pixels()`, for indices that are already mapped.
+static inline void _pep_encode_indices( _pep_encoder* const enc, const uint8_t* const in_indices, const uint64_t count )
+{
+	_pep_encoder e = *enc;
+	for( uint64_t i = 0; i < count; i++ ) _pep_encode_index( &e, in_indices[ i ] );
+	*enc = e;
+}
+
+// Codes a partly filled last symbol and flushes the coder.
+static inline void _pep_encoder_end( _pep_encoder* const enc )
+{
+	if( enc->indices_in_byte > 0 ) _pep_encode_symbol( enc, enc->symbol );
+	if( enc->rans ) return;
+
+	for( uint8_t i = 0; i < 4; i++ )
+	{
+		uint8_t byte = enc->ac.low >> 24;
+		enc->ac.low <<= 8;
+		*enc->ac.data_ref++ = byte;
+	}
+}
+
+static inline uint8_t _pep_sink_init( _pep_sink* const sink )
+{
+	_pep_sink empty = { 0 };
+	*sink = empty;
+	sink->scratch = ( uint8_t* )PEP_MALLOC( PEP_ENCODER_CHUNK_SIZE );
+	return sink->scratch != NULL;
+}
+
+// Appends scratch[ 0 .. end ) to the chunks. Returns 0 if out of memory.
+static inline uint8_t _pep_sink_spill( _pep_sink* const sink, const uint8_t* const end )
+{
+	return _pep_sink_append( sink, sink->scratch, end );
+}
+
+// Appends [ src, end ) to the chunks. Returns 0 if out of memory.
+static inline uint8_t _pep_sink_append( _pep_sink* const sink, const uint8_t* src, const uint8_t* const end )
+{
+	while( src < end )
+	{
+		const uint64_t used = sink->size % PEP_ENCODER_CHUNK_SIZE;
+		if( used == 0 )
+		{
+			_pep_chunk* const chunk = ( _pep_chunk* )PEP_MALLOC( sizeof( _pep_chunk ) );
+			if( chunk == NULL ) return 0;
+			chunk->next = NULL;
+			if( sink->last ) sink->last->next = chunk;
+			else sink->first = chunk;
+			sink->last = chunk;
+		}
+
+		uint64_t n = PEP_ENCODER_CHUNK_SIZE - used;
+		if( n > ( uint64_t )( end - src ) ) n = ( uint64_t )( end - src );
+		uint8_t* const restrict dst = sink->last->data + used;
+		for( uint64_t i = 0; i < n; i++ ) dst[ i ] = src[ i ];
+		src += n;
+		sink->size += n;
+	}
+	return 1;
+}
+
+// Codes `count` pixels (or indices, when in_pixels is NULL) into the sink, a
+// scratch-sized batch at a time. Returns 0 if out of memory.
+static inline uint8_t _pep_sink_encode( _pep_sink* const sink, _pep_encoder* const enc, const pep* const in_pep, const uint32_t* in_pixels, const uint8_t* in_indices, uint64_t count, const pep_format in_format )
+{
+	// Keeps room for `_pep_encoder_end()`.
+	const uint64_t room = PEP_ENCODER_CHUNK_SIZE - _PEP_SYMBOL_MAX_BYTES - 4;
+	while( count )
+	{
+		uint64_t used = ( uint64_t )( enc->ac.data_ref - sink->scratch );
+		if( used >= PEP_ENCODER_CHUNK_SIZE / 2 )
+		{
+			if( !_pep_sink_spill( sink, enc->ac.data_ref ) ) return 0;
+			enc->ac.data_ref = sink->scratch;
+			used = 0;
+		}
+
+		uint64_t n = ( room - used ) / _PEP_SYMBOL_MAX_BYTES; // every coded symbol takes at least one new pixel
+		if( n > count ) n = count;
+		if( in_pixels )
+		{
+			_pep_encode_pixels( enc, in_pep, in_pixels, n, in_format );
+			in_pixels += n;
+		}
+		else
+		{
+			_pep_encode_indices( enc, in_indices, n );
+			in_indices += n;
+		}
+		count -= n;
+	}
+	return 1;
+}
+
+// Same as `_pep_sink_encode()` for `rows` rows of in_pep->width pixels that
+// start `stride` pixels apart.
+static inline uint8_t _pep_sink_encode_rows( _pep_sink* const sink, _pep_encoder* const enc, const pep* const in_pep, const uint32_t* const in_pixels, const uint64_t stride, const uint32_t rows, const pep_format in_format )
+{
+	if( stride == in_pep->width ) return _pep_sink_encode( sink, enc, in_pep, in_pixels, NULL, ( uint64_t )rows * in_pep->width, in_format );
+	for( uint32_t row = 0; row < rows; row++ )
+	{
+		if( !_pep_sink_encode( sink, enc, in_pep, in_pixels + row * stride, NULL, in_pep->width, in_format ) ) return 0;
+	}
+	return 1;
+}
+
+// Flushes the stream into the chunks and drops the scratch.
+static inline uint8_t _pep_sink_end( _pep_sink* const sink, _pep_encoder* const enc )
+{
+	_pep_encoder_end( enc );
+	uint8_t ok = _pep_sink_spill( sink, enc->ac.data_ref );
+	PEP_FREE( sink->scratch );
+	sink->scratch = NULL;
+	if( ok && enc->rans ) ok = _pep_rans_sink_code( sink, enc->ctx, enc->rans );
+	return ok;
+}
+
+// How many rANS states a stream coded with options interleaves, 0 for the
+// arithmetic coder.
+static inline uint8_t _pep_rans_state_count( const pep_encode_options* const options )
+{
+	if( options->coder != pep_coder_rans ) return 0;
+	if( options->rans_states < 1 ) return 1;
+	return options->rans_states < PEP_RANS_STATES_MAX ? options->rans_states : PEP_RANS_STATES_MAX;
+}
+
+// Replaces the packed symbols a rANS encoder collected in the sink with
+// their coded stream, over `states` interleaved states (see "rANS coder").
+// Returns 0 if out of memory.
+static inline uint8_t _pep_rans_sink_code( _pep_sink* const sink, pep_codec_ctx* const ctx, const uint8_t states )
+{
+	const uint64_t count = sink->size;
+	const uint64_t model_max = 2 + PEP_RANS_TABLES * ( 1 + _PEP_RANS_RECORD_MAX );
+	if( count > ( SIZE_MAX - model_max ) / 3 ) return 0;
+
+	// Every symbol renormalizes at most two bytes out.
+	uint8_t* const symbols = ( uint8_t* )PEP_MALLOC( count );
+	uint8_t* const out_bytes = ( uint8_t* )PEP_MALLOC( model_max + count * 2 + 4 * PEP_RANS_STATES_MAX );
+	uint32_t* const counts = ( uint32_t* )PEP_MALLOC( 256 * 256 * sizeof( uint32_t ) );
+	uint8_t ok = symbols && out_bytes && counts;
+	if( ok )
+	{
+		_pep_sink_copy( sink, symbols );
+		sink->size = 0;
+
+		_pep_rans_model* const restrict model = &ctx->rans;
+		model->state_count = states;
+		uint8_t* const model_end = _pep_rans_write_model( model, symbols, count, counts, out_bytes );
+		uint8_t* const end = model_end + count * 2 + 4 * states;
+		uint8_t* ref = end;
+
+		// rANS decodes in the reverse order it encodes, so the bytes each
+		// state renormalizes out land where the decoder reads them back in.
+		uint32_t x[ PEP_RANS_STATES_MAX ];
+		for( uint32_t s = 0; s < states; s++ ) x[ s ] = PEP_RANS_LOW;
+		for( uint64_t i = count; i-- > 0; )
+		{
+			const uint8_t previous = i ? symbols[ i - 1 ] : 0;
+			const _pep_rans_symbol sym = model->tables[ model->table_of[ previous ] ].symbols[ symbols[ i ] ];
+			const uint32_t x_max = ( ( PEP_RANS_LOW >> PEP_RANS_SCALE_BITS ) << 8 ) * sym.freq;
+			uint32_t* const state = &x[ i % states ];
+			while( *state >= x_max )
+			{
+				*--ref = ( uint8_t )*state;
+				*state >>= 8;
+			}
+			*state = ( ( *state / sym.freq ) << PEP_RANS_SCALE_BITS ) + ( *state % sym.freq ) + sym.low;
+		}
+		for( uint32_t s = states; s-- > 0; )
+		{
+			for( uint32_t i = 4; i-- > 0; ) *--ref = ( uint8_t )( x[ s ] >> ( i * 8 ) );
+		}
+
+		ok = _pep_sink_append( sink, out_bytes, model_end ) && _pep_sink_append( sink, ref, end );
+	}
+
+	if( symbols ) PEP_FREE( symbols );
+	if( out_bytes ) PEP_FREE( out_bytes );
+	if( counts ) PEP_FREE( counts );
+	return ok;
+}
+
+// Normalizes one table's counts (total of them) to PEP_RANS_SCALE, keeping
+// every symbol that was seen. An unused table just holds symbol 0.
+static inline void _pep_rans_normalize( _pep_rans_table* const table, const uint64_t* const counts, const uint64_t total )
+{
+	_pep_rans_symbol* const restrict symbols = table->symbols;
+	uint32_t sum = 0;
+	uint32_t largest = 0;
+	for( uint32_t sym = 0; sym < 256; sym++ )
+	{
+		uint32_t freq = 0;
+		if( counts[ sym ] )
+		{
+			freq = ( uint32_t )( ( counts[ sym ] * PEP_RANS_SCALE + total / 2 ) / total );
+			if( freq == 0 ) freq = 1;
+		}
+		symbols[ sym ].freq = ( uint16_t )freq;
+		sum += freq;
+		if( freq > symbols[ largest ].freq ) largest = sym;
+	}
+	if( sum == 0 )
+	{
+		symbols[ 0 ].freq = PEP_RANS_SCALE;
+		sum = PEP_RANS_SCALE;
+	}
+
+	// Rounding leaves the sum a little off; the biggest frequencies take it,
+	// as that costs the least. At most 256 symbols can be forced up to 1, so
+	// this never runs out of room.
+	while( sum > PEP_RANS_SCALE )
+	{
+		for( uint32_t sym = 0; sym < 256; sym++ ) if( symbols[ sym ].freq > symbols[ largest ].freq ) largest = sym;
+		const uint32_t cut = sum - PEP_RANS_SCALE < symbols[ largest ].freq / 2u ? sum - PEP_RANS_SCALE : symbols[ largest ].freq / 2u;
+		symbols[ largest ].freq = ( uint16_t )( symbols[ largest ].freq - cut );
+		sum -= cut;
+	}
+	symbols[ largest ].freq = ( uint16_t )( symbols[ largest ].freq + PEP_RANS_SCALE - sum );
+
+	uint32_t low = 0;
+	for( uint32_t sym = 0; sym < 256; sym++ )
+	{
+		symbols[ sym ].low = ( uint16_t )low;
+		low += symbols[ sym ].freq;
+	}
+}
+
+// log2( x ) in 1/256ths of a bit, to within about 0.003 bits (0 for 0).
+static inline uint64_t _pep_log2_fixed( const uint64_t x )
+{
+	if( x == 0 ) return 0;
+	const uint32_t high = ( uint32_t )( x >> 32 );
+	const uint32_t bits = high ? 63u - PEP_COUNT_LEADING_ZEROS( high ) : 31u - PEP_COUNT_LEADING_ZEROS( ( uint32_t )x );
+	const uint32_t frac = ( uint32_t )( bits >= 8 ? x >> ( bits - 8 ) : x << ( 8 - bits ) ) & 0xFF;
+	return bits * 256u + frac + ( ( frac * ( 256u - frac ) * 89u ) >> 16 );
+}
+
+// Bits (in 1/256ths) that coding `counts` with the frequencies `model` (totals
+// of them) would take.
+static inline uint64_t _pep_rans_cost( const uint32_t* const counts, const uint64_t* const model, const uint64_t model_total )
+{
+	const uint64_t log_total = _pep_log2_fixed( model_total );
+	uint64_t cost = 0;
+	for( uint32_t sym = 0; sym < 256; sym++ )
+	{
+		if( counts[ sym ] ) cost += counts[ sym ] * ( log_total - _pep_log2_fixed( model[ sym ] ) );
+	}
+	return cost;
+}
+
+// Builds model from the count packed symbols and writes model->state_count
+// and its tables to out_bytes, returning where they end. A previous symbol
+// gets a table of its own when coding what follows it that way saves more
+// than the table costs, compared to the overall symbol frequencies, biggest
+// savings first while there are tables. counts is scratch for 256 * 256 of
+// them.
+static inline uint8_t* _pep_rans_write_model( _pep_rans_model* const model, const uint8_t* const symbols, const uint64_t count, uint32_t* const counts, uint8_t* out_bytes )
+{
+	// counts[ previous * 256 + symbol ], saturating (only proportions matter).
+	uint64_t totals[ 256 ] = { 0 };
+	uint32_t spread[ 256 ] = { 0 };
+	for( uint32_t i = 0; i < 256 * 256; i++ ) counts[ i ] = 0;
+	uint8_t previous = 0;
+	for( uint64_t i = 0; i < count; i++ )
+	{
+		uint32_t* const c = &counts[ previous * 256 + symbols[ i ] ];
+		if( *c != UINT32_MAX ) *c += 1;
+		previous = symbols[ i ];
+	}
+	uint64_t overall[ 256 ] = { 0 };
+	for( uint32_t p = 0; p < 256; p++ )
+	{
+		for( uint32_t sym = 0; sym < 256; sym++ )
+		{
+			totals[ p ] += counts[ p * 256 + sym ];
+			overall[ sym ] += counts[ p * 256 + sym ];
+			spread[ p ] += counts[ p * 256 + sym ] != 0;
+		}
+	}
+
+	// Insertion sort of the candidates by savings; ties keep symbol order.
+	// A table costs about two bytes a symbol.
+	uint64_t savings[ 256 ] = { 0 };
+	uint8_t order[ 256 ];
+	uint32_t candidates = 0;
+	for( uint32_t p = 0; p < 256; p++ )
+	{
+		if( totals[ p ] == 0 ) continue;
+		uint64_t row[ 256 ];
+		for( uint32_t sym = 0; sym < 256; sym++ ) row[ sym ] = counts[ p * 256 + sym ];
+		const uint64_t shared_cost = _pep_rans_cost( counts + p * 256, overall, count );
+		const uint64_t own_cost = _pep_rans_cost( counts + p * 256, row, totals[ p ] ) + ( 2 + spread[ p ] * 2 ) * 8 * 256;
+		if( own_cost >= shared_cost ) continue;
+		savings[ p ] = shared_cost - own_cost;
+
+		uint32_t at = candidates++;
+		while( at > 0 && savings[ order[ at - 1 ] ] < savings[ p ] )
+		{
+			order[ at ] = order[ at - 1 ];
+			at--;
+		}
+		order[ at ] = ( uint8_t )p;
+	}
+	const uint32_t own_count = candidates < PEP_RANS_TABLES - 1 ? candidates : PEP_RANS_TABLES - 1;
+
+	for( uint32_t p = 0; p < 256; p++ ) model->table_of[ p ] = 0;
+	for( uint32_t t = 0; t < own_count; t++ ) model->table_of[ order[ t ] ] = ( uint8_t )( t + 1 );
+	model->table_count = own_count + 1;
+
+	*out_bytes++ = ( uint8_t )model->state_count;
+	*out_bytes++ = ( uint8_t )own_count;
+	for( uint32_t t = 0; t < own_count; t++ ) *out_bytes++ = order[ t ];
+
+	for( uint32_t t = 0; t < model->table_count; t++ )
+	{
+		// Table 0 is everything else together.
+		uint64_t row[ 256 ] = { 0 };
+		uint64_t total = 0;
+		for( uint32_t p = 0; p < 256; p++ )
+		{
+			if( t ? p != order[ t - 1 ] : model->table_of[ p ] != 0 ) continue;
+			for( uint32_t sym = 0; sym < 256; sym++ ) row[ sym ] += counts[ p * 256 + sym ];
+			total += totals[ p ];
+		}
+
+		_pep_rans_table* const table = &model->tables[ t ];
+		_pep_rans_normalize( table, row, total );
+
+		uint32_t left = 0;
+		for( uint32_t sym = 0; sym < 256; sym++ ) left += table->symbols[ sym ].freq != 0;
+		*out_bytes++ = ( uint8_t )( left - 1 );
+		uint32_t next = 0;
+		for( uint32_t sym = 0; sym < 256; sym++ )
+		{
+			const uint32_t freq = table->symbols[ sym ].freq;
+			if( !freq ) continue;
+			*out_bytes++ = ( uint8_t )( sym - next );
+			next = sym + 1;
+			if( --left ) out_bytes = _pep_varint_write( out_bytes, freq - 1 );
+		}
+	}
+
+	return out_bytes;
+}
+
+
+// Copies all sink->size bytes to out_bytes, freeing chunks as it goes.
+static inline void _pep_sink_copy( _pep_sink* const sink, uint8_t* out_bytes )
+{
+	uint64_t left = sink->size;
+	while( sink->first )
+	{
+		_pep_chunk* const chunk = sink->first;
+		const uint64_t n = left < PEP_ENCODER_CHUNK_SIZE ? left : PEP_ENCODER_CHUNK_SIZE;
+		for( uint64_t i = 0; i < n; i++ ) out_bytes[ i ] = chunk->data[ i ];
+		out_bytes += n;
+		left -= n;
+		sink->first = chunk->next;
+		PEP_FREE( chunk );
+	}
+	sink->last = NULL;
+}
+
+// Same as `_pep_sink_copy()`, through a write callback. Returns 0 if it fails.
+static inline uint8_t _pep_sink_write( _pep_sink* const sink, pep_write_fn write, void* write_user )
+{
+	uint64_t left = sink->size;
+	while( sink->first )
+	{
+		_pep_chunk* const chunk = sink->first;
+		const size_t n = ( size_t )( left < PEP_ENCODER_CHUNK_SIZE ? left : PEP_ENCODER_CHUNK_SIZE );
+		if( write( write_user, chunk->data, n ) != n ) return 0;
+		left -= n;
+		sink->first = chunk->next;
+		PEP_FREE( chunk );
+	}
+	sink->last = NULL;
+	return 1;
+}
+
+static inline void _pep_sink_free( _pep_sink* const sink )
+{
+	while( sink->first )
+	{
+		_pep_chunk* const next = sink->first->next;
+		PEP_FREE( sink->first );
+		sink->first = next;
+	}
+	sink->last = NULL;
+	if( sink->scratch ) PEP_FREE( sink->scratch );
+	sink->scratch = NULL;
+}
+
+// Checks the arguments shared by the compress functions and returns the pixel
+// count, or 0 with out_pep->error set.
+static inline uint64_t _pep_compress_area( pep* const out_pep, const pep_codec_ctx* const ctx, const uint32_t* const in_pixels, const uint32_t width, const uint32_t height )
+{
+	if( ctx == NULL || in_pixels == NULL || width == 0 || height == 0 )
+	{
+		out_pep->error = pep_error_invalid_argument;
+		return 0;
+	}
+
+	const uint64_t pixels_area = ( uint64_t )width * height;
+	if( width > PEP_MAX_DIMENSION || height > PEP_MAX_DIMENSION || pixels_area > SIZE_MAX / sizeof( uint32_t ) )
+	{
+		out_pep->error = pep_error_too_large;
+		return 0;
+	}
+	return pixels_area;
+}
+
+// Compresses the width * height rectangle at (x, y) of a bigger image, in
+// place: base is its top-left pixel and its rows start stride_bytes apart (a
+// whole number of pixels, padding included). Both the palette and the coding
+// pass walk the rows directly, so a sprite out of a sheet or a dirty
+// rectangle of a framebuffer needs no copy. The result is the same as
+// compressing that rectangle packed.
+static inline pep pep_compress_rect_ctx( pep_codec_ctx* const ctx, const uint32_t* const base, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format )
+{
+	pep out_pep = { 0 };
+	const uint64_t stride = stride_bytes / sizeof( uint32_t );
+	if( base == NULL || stride_bytes % sizeof( uint32_t ) != 0 || ( uint64_t )x + width > stride )
+	{
+		out_pep.error = pep_error_invalid_argument;
+		return out_pep;
+	}
+
+	const uint32_t* const in_pixels = base + ( uint64_t )y * stride + x;
+	const uint64_t pixels_area = _pep_compress_area( &out_pep, ctx, in_pixels, width, height );
+	if( pixels_area == 0 ) return out_pep;
+
+	out_pep.width = width;
+	out_pep.height = height;
+	_pep_record_options( &out_pep, &ctx->options );
+	out_pep.format = out_format;
+	out_pep.color_bits = _pep_8bit;
+
+	///////
+	// palette construction
+
+	_PEP_PROFILE_TIME( ctx, palette_ns, _pep_build_palette( &out_pep, ctx->palette_hash, in_pixels, stride, in_format, out_format, ctx->options.palette_order ) );
+
+	///////
+	// pixels to packed-palette-indices and PPM order-2 compression, collected
+	// in chunks and copied out once the size is known
+
+	_pep_sink sink;
+	_pep_encoder enc;
+	uint8_t ok = _pep_sink_init( &sink );
+	if( ok )
+	{
+		_pep_encoder_begin( &enc, ctx, out_pep.palette_size, &ctx->options, sink.scratch );
+		_PEP_PROFILE_TIME( ctx, code_ns, ok = _pep_sink_encode_rows( &sink, &enc, &out_pep, in_pixels, stride, height, in_format ) && _pep_sink_end( &sink, &enc ) );
+	}
+	if( ok ) ok = ( out_pep.bytes = ( uint8_t* )PEP_MALLOC( sink.size ) ) != NULL;
+	if( ok )
+	{
+		out_pep.bytes_size = sink.size;
+		out_pep.max_symbols = enc.max_symbol;
+		_PEP_PROFILE_TIME( ctx, output_ns, _pep_sink_copy( &sink, out_pep.bytes ) );
+	}
+	else out_pep.error = pep_error_out_of_memory;
+	_pep_sink_free( &sink );
+
+	return out_pep;
+}
+
+// Same as `pep_compress_rect_ctx()`, using a temporary context.
+static inline pep pep_compress_rect( const uint32_t* const base, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format )
+{
+	pep out_pep = { 0 };
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx )
+	{
+		out_pep.error = pep_error_out_of_memory;
+		return out_pep;
+	}
+
+	out_pep = pep_compress_rect_ctx( ctx, base, stride_bytes, x, y, width, height, in_format, out_format );
+	pep_codec_ctx_destroy( ctx );
+	return out_pep;
+}
+
+// The format of the in_pixels has to be the same as in_format.
+// out_format is the one applied to the newly compressed pep
+static inline pep pep_compress_ctx( pep_codec_ctx* const ctx, const uint32_t* in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format )
+{
+	return pep_compress_rect_ctx( ctx, in_pixels, ( uint64_t )width * sizeof( uint32_t ), 0, 0, width, height, in_format, out_format );
+}
+
+// Same as `pep_compress_ctx()`, using a temporary context.
+static inline pep pep_compress( const uint32_t* in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format )
+{
+	pep out_pep = { 0 };
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx )
+	{
+		out_pep.error = pep_error_out_of_memory;
+		return out_pep;
+	}
+
+	out_pep = pep_compress_ctx( ctx, in_pixels, width, height, in_format, out_format );
+	pep_codec_ctx_destroy( ctx );
+	return out_pep;
+}
+
+// Same as `pep_compress_ctx()` for width * height * 4 bytes in in_order.
+// The bytes are read in place as colors of `pep_byte_format( in_order )`, so
+// the swizzle to out_format happens once per run of equal pixels while
+// coding, instead of in a conversion pass over the image. Only a buffer that
+// isn't 4-byte aligned is copied first.
+static inline pep pep_compress_bytes_ctx( pep_codec_ctx* const ctx, const uint8_t* const in_bytes, const uint32_t width, const uint32_t height, const pep_byte_order in_order, const pep_format out_format )
+{
+	const pep_format in_format = pep_byte_format( in_order );
+	if( ( ( uintptr_t )in_bytes & ( sizeof( uint32_t ) - 1 ) ) == 0 )
+	{
+		return pep_compress_ctx( ctx, ( const uint32_t* )( const void* )in_bytes, width, height, in_format, out_format );
+	}
+
+	pep out_pep = { 0 };
+	const uint64_t pixels_area = _pep_compress_area( &out_pep, ctx, ( const uint32_t* )( const void* )in_bytes, width, height );
+	if( pixels_area == 0 ) return out_pep;
+	uint32_t* const pixels = ( uint32_t* )PEP_MALLOC( pixels_area * sizeof( uint32_t ) );
+	if( pixels == NULL )
+	{
+		out_pep.error = pep_error_out_of_memory;
+		return out_pep;
+	}
+	uint8_t* const restrict dst = ( uint8_t* )pixels;
+	for( uint64_t i = 0; i < pixels_area * sizeof( uint32_t ); i++ ) dst[ i ] = in_bytes[ i ];
+	out_pep = pep_compress_ctx( ctx, pixels, width, height, in_format, out_format );
+	PEP_FREE( pixels );
+	return out_pep;
+}
+
+// Same as `pep_compress_bytes_ctx()`, using a temporary context.
+static inline pep pep_compress_bytes( const uint8_t* const in_bytes, const uint32_t width, const uint32_t height, const pep_byte_order in_order, const pep_format out_format )
+{
+	pep out_pep = { 0 };
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx )
+	{
+		out_pep.error = pep_error_out_of_memory;
+		return out_pep;
+	}
+
+	out_pep = pep_compress_bytes_ctx( ctx, in_bytes, width, height, in_order, out_format );
+	pep_codec_ctx_destroy( ctx );
+	return out_pep;
+}
+
+///////
+// Striped container
+
+typedef struct
+{
+	_pep_sink sink;
+	uint8_t max_symbols;
+	uint8_t ok;
+}
+_pep_stripe_output;
+
+typedef struct
+{
+	const pep* pep_ref;
+	const uint32_t* in_pixels;
+	pep_format in_format;
+	pep_encode_options options; // parallel stripes' contexts don't have them
+	pep_codec_ctx* shared_ctx; // only when running serially
+	_pep_stripe_output* streams;
+}
+_pep_stripe_encode_job;
+
+static inline void _pep_compress_stripe_task( void* task_data, const uint32_t stripe )
+{
+	_pep_stripe_encode_job* const job = ( _pep_stripe_encode_job* )task_data;
+	const pep* const in_pep = job->pep_ref;
+	const uint32_t first_row = stripe * in_pep->stripe_rows;
+	const uint32_t rows = ( in_pep->height - first_row < in_pep->stripe_rows ) ? in_pep->height - first_row : in_pep->stripe_rows;
+	const uint64_t area = ( uint64_t )rows * in_pep->width;
+
+	// Parallel stripes each get their own context.
+	pep_codec_ctx* const ctx = job->shared_ctx ? job->shared_ctx : pep_codec_ctx_create();
+	_pep_stripe_output* const stream = &job->streams[ stripe ];
+	if( ctx && _pep_sink_init( &stream->sink ) )
+	{
+		_pep_encoder enc;
+		_pep_palette_hash_fill( ctx->palette_hash, in_pep->palette, in_pep->palette_size );
+		_pep_encoder_begin( &enc, ctx, in_pep->palette_size, &job->options, stream->sink.scratch );
+		_PEP_PROFILE_TIME( ctx, code_ns, stream->ok = _pep_sink_encode( &stream->sink, &enc, in_pep, job->in_pixels + ( uint64_t )first_row * in_pep->width, NULL, area, job->in_format ) && _pep_sink_end( &stream->sink, &enc ) );
+		stream->max_symbols = enc.max_symbol;
+	}
+	if( ctx != job->shared_ctx ) pep_codec_ctx_destroy( ctx );
+}
+
+// Like `pep_compress_ctx()`, but as independent stripes of stripe_rows rows
+// (see "Striped container"). Stripes go through `run` when it's given, each
+// with a context of its own; otherwise they're coded one after another in ctx.
+// A stripe_rows of 0, or one covering the whole image, gives a normal pep.
+static inline pep pep_compress_striped_ctx( pep_codec_ctx* const ctx, const uint32_t* in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format, const uint16_t stripe_rows, pep_parallel_for run, void* run_user )
+{
+	if( stripe_rows == 0 || stripe_rows >= height ) return pep_compress_ctx( ctx, in_pixels, width, height, in_format, out_format );
+
+	pep out_pep = { 0 };
+	const uint64_t pixels_area = _pep_compress_area( &out_pep, ctx, in_pixels, width, height );
+	if( pixels_area == 0 ) return out_pep;
+
+	out_pep.width = width;
+	out_pep.height = height;
+	out_pep.stripe_rows = stripe_rows;
+	_pep_record_options( &out_pep, &ctx->options );
+	out_pep.format = out_format;
+	out_pep.color_bits = _pep_8bit;
+	_PEP_PROFILE_TIME( ctx, palette_ns, _pep_build_palette( &out_pep, ctx->palette_hash, in_pixels, width, in_format, out_format, ctx->options.palette_order ) );
+
+	const uint32_t stripe_count = pep_stripe_count( &out_pep );
+	_pep_stripe_output* streams = ( _pep_stripe_output* )PEP_MALLOC( stripe_count * sizeof( _pep_stripe_output ) );
+	uint8_t ok = streams != NULL;
+
+	if( ok )
+	{
+		_pep_stripe_output empty = { 0 };
+		for( uint32_t i = 0; i < stripe_count; i++ ) streams[ i ] = empty;
+
+		_pep_stripe_encode_job job = { &out_pep, in_pixels, in_format, ctx->options, run ? NULL : ctx, streams };
+		if( run ) run( run_user, stripe_count, _pep_compress_stripe_task, &job );
+		else for( uint32_t i = 0; i < stripe_count; i++ ) _pep_compress_stripe_task( &job, i );
+
+		uint64_t total = ( uint64_t )stripe_count * 4;
+		for( uint32_t i = 0; i < stripe_count; i++ )
+		{
+			if( !streams[ i ].ok ) ok = 0;
+			else total += streams[ i ].sink.size;
+		}
+
+		// The offset table is 32-bit.
+		if( ok && total - ( uint64_t )stripe_count * 4 > UINT32_MAX )
+		{
+			out_pep.error = pep_error_too_large;
+			ok = 0;
+		}
+
+		out_pep.bytes = ok ? ( uint8_t* )PEP_MALLOC( total ) : NULL;
+		if( out_pep.bytes )
+		{
+			uint8_t* table_ref = out_pep.bytes;
+			uint8_t* data_ref = out_pep.bytes + ( uint64_t )stripe_count * 4;
+			uint32_t end = 0;
+			for( uint32_t i = 0; i < stripe_count; i++ )
+			{
+				const uint64_t stream_size = streams[ i ].sink.size;
+				_PEP_PROFILE_TIME( ctx, output_ns, _pep_sink_copy( &streams[ i ].sink, data_ref ) );
+				data_ref += stream_size;
+				end += ( uint32_t )stream_size;
+				*table_ref++ = end;
+				*table_ref++ = end >> 8;
+				*table_ref++ = end >> 16;
+				*table_ref++ = end >> 24;
+				if( streams[ i ].max_symbols > out_pep.max_symbols ) out_pep.max_symbols = streams[ i ].max_symbols;
+			}
+			out_pep.bytes_size = total;
+		}
+
+		for( uint32_t i = 0; i < stripe_count; i++ ) _pep_sink_free( &streams[ i ].sink );
+	}
+
+	if( streams ) PEP_FREE( streams );
+	if( out_pep.bytes == NULL && out_pep.error == pep_ok ) out_pep.error = pep_error_out_of_memory;
+	return out_pep;
+}
+
+// Same as `pep_compress_striped_ctx()`, using a temporary context.
+static inline pep pep_compress_striped( const uint32_t* in_pixels, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format, const uint16_t stripe_rows, pep_parallel_for run, void* run_user )
+{
+	pep out_pep = { 0 };
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx )
+	{
+		out_pep.error = pep_error_out_of_memory;
+		return out_pep;
+	}
+
+	out_pep = pep_compress_striped_ctx( ctx, in_pixels, width, height, in_format, out_format, stripe_rows, run, run_user );
+	pep_codec_ctx_destroy( ctx );
+	return out_pep;
+}
+
+// Sets up the decoder for one of in_pep's streams (all of `bytes` unless it's
+// striped) and primes the arithmetic-decoder. Whatever the coder doesn't use
+// is left zeroed.
+static inline void _pep_decoder_begin( _pep_decoder* const dec, pep_codec_ctx* const ctx, const pep* const in_pep, uint8_t* const stream, const uint64_t stream_size )
+{
+	_pep_decoder empty = { 0 };
+	*dec = empty;
+	dec->ctx = ctx;
+
+	dec->bits_per_index = PEP_BITS_TO_FIT( in_pep->palette_size );
+	if( dec->bits_per_index > 8 ) dec->bits_per_index = 8; // only 8 bits in a byte
+	dec->indices_per_byte = 8 / dec->bits_per_index;
+	dec->index_mask = ( 1 << dec->bits_per_index ) - 1;
+
+	// A corrupt max_symbols can't send the scans past the alphabet.
+	const uint32_t alphabet = 1u << ( dec->bits_per_index * dec->indices_per_byte );
+	dec->max_symbols = in_pep->max_symbols + 1u < alphabet ? in_pep->max_symbols + 1u : alphabet;
+
+	dec->use_fenwick = in_pep->palette_size >= PEP_FENWICK_MIN_PALETTE;
+	dec->rans_model = in_pep->coder == pep_coder_rans ? &ctx->rans : NULL;
+	if( !dec->rans_model )
+	{
+		_pep_codec_ctx_prepare( ctx, alphabet, dec->use_fenwick );
+		dec->context_stride = ctx->context_stride;
+		dec->order0 = _pep_context_at( ctx, ctx->context_stride, alphabet );
+		dec->freq_step = _pep_freq_step( in_pep->freq_step );
+		dec->freq_max = _pep_freq_max( in_pep->freq_max );
+	}
+
+	_pep_ac_decode* const ac = &dec->ac;
+	ac->low = 0;
+	ac->code = 0;
+	ac->range = ( uint32_t )( ( 1llu << 32 ) - 1 );
+	ac->data_ref = stream;
+	ac->end_of_data = stream + stream_size;
+	ac->recip = NULL;
+	if( in_pep->coder == pep_coder_arith_recip )
+	{
+		_pep_recip_prepare( ctx );
+		ac->recip = ctx->recip;
+	}
+
+	if( dec->rans_model )
+	{
+		for( uint32_t s = 0; s < dec->rans_model->state_count; s++ )
+		{
+			uint32_t x = 0;
+			for( uint32_t i = 0; i < 4; i++ ) x |= ( uint32_t )( ac->data_ref != ac->end_of_data ? *ac->data_ref++ : 0u ) << ( i * 8 );
+			dec->rans_states[ s ] = x;
+		}
+		return;
+	}
+
+	for( uint8_t i = 0; i < 4; ++i )
+	{
+		uint8_t in_byte = 0;
+		if( ac->data_ref != ac->end_of_data )
+		{
+			in_byte = *ac->data_ref++;
+		}
+
+		ac->code = ( ac->code << 8 ) | in_byte;
+	}
+}
+
+// `_pep_decoder_begin()` for a stream that's all in memory, starting with the
+// rANS tables if in_pep has them. Returns 0 if those are corrupt.
+static inline uint8_t _pep_decoder_open( _pep_decoder* const dec, pep_codec_ctx* const ctx, const pep* const in_pep, uint8_t* stream, uint64_t stream_size )
+{
+	if( in_pep->coder == pep_coder_rans )
+	{
+		const uint64_t used = _pep_rans_read_tables( &ctx->rans, stream, stream_size );
+		if( !used ) return 0;
+		stream += used;
+		stream_size -= used;
+	}
+	_pep_decoder_begin( dec, ctx, in_pep, stream, stream_size );
+	return 1;
+}
+
+// Reads record `record` of a rANS stream's tables (0 is the list of tables,
+// then one per table) from the size bytes at `bytes` into model. Returns how
+// many bytes it took, or 0 if they're corrupt.
+static inline uint64_t _pep_rans_read_record( _pep_rans_model* const model, const uint32_t record, const uint8_t* const bytes, const uint64_t size )
+{
+	const uint8_t* ref = bytes;
+	const uint8_t* const end = bytes + size;
+	if( ref == end ) return 0;
+
+	if( record == 0 )
+	{
+		if( end - ref < 2 ) return 0;
+		const uint32_t state_count = *ref++;
+		const uint32_t own_count = *ref++;
+		if( state_count < 1 || state_count > PEP_RANS_STATES_MAX ) return 0;
+		if( ( uint64_t )( end - ref ) < own_count ) return 0; // a byte, so at most 255 past table 0
+		model->state_count = state_count;
+		for( uint32_t p = 0; p < 256; p++ ) model->table_of[ p ] = 0;
+		for( uint32_t t = 1; t <= own_count; t++ ) model->table_of[ *ref++ ] = ( uint8_t )t;
+		model->table_count = own_count + 1;
+		return ( uint64_t )( ref - bytes );
+	}
+
+	_pep_rans_table* const table = &model->tables[ record - 1 ];
+	uint32_t left = *ref++ + 1u;
+	uint32_t next = 0;
+	uint32_t low = 0;
+	while( left )
+	{
+		if( ref == end ) return 0;
+		const uint32_t sym = next + *ref++;
+		uint64_t freq = PEP_RANS_SCALE - low;
+		if( --left )
+		{
+			const uint64_t varint_size = _pep_varint_read( ref, ( uint64_t )( end - ref ), &freq );
+			ref += varint_size;
+			freq += 1;
+			if( !varint_size || freq >= PEP_RANS_SCALE - low ) return 0;
+		}
+		if( sym > 255 || freq == 0 ) return 0;
+
+		table->symbols[ sym ].freq = ( uint16_t )freq;
+		table->symbols[ sym ].low = ( uint16_t )low;
+		for( uint32_t slot = low; slot < low + freq; slot++ ) table->slots[ slot ] = ( uint8_t )sym;
+		low += ( uint32_t )freq;
+		next = sym + 1;
+	}
+	return ( uint64_t )( ref - bytes );
+}
+
+// Reads all of a rANS stream's tables from the size bytes at `bytes` into
+// model. Returns how many bytes they took, or 0 if they're corrupt.
+static inline uint64_t _pep_rans_read_tables( _pep_rans_model* const model, const uint8_t* const bytes, const uint64_t size )
+{
+	uint64_t offset = 0;
+	uint32_t records = 1;
+	for( uint32_t record = 0; record < records; record++ )
+	{
+		const uint64_t used = _pep_rans_read_record( model, record, bytes + offset, size - offset );
+		if( !used ) return 0;
+		offset += used;
+		if( record == 0 ) records += model->table_count;
+	}
+	return offset;
+}
+
+// Decodes the next packed symbol from a rANS stream: the low bits of the
+// next state pick a slot of the previous symbol's table, which is the symbol.
+static PEP_FORCE_INLINE PEP_HOT uint8_t _pep_rans_decode_symbol( _pep_decoder* const restrict dec )
+{
+	_pep_ac_decode* const restrict ac = &dec->ac;
+	const _pep_rans_model* const restrict model = dec->rans_model;
+	const _pep_rans_table* const restrict table = &model->tables[ model->table_of[ dec->context_id ] ];
+	_PEP_PROFILE( dec->ctx->profile.symbols++ );
+
+	const uint32_t state = dec->rans_state;
+	dec->rans_state = state + 1 < model->state_count ? state + 1 : 0;
+	uint32_t x = dec->rans_states[ state ];
+	const uint32_t slot = x & ( PEP_RANS_SCALE - 1 );
+	const uint8_t symbol = table->slots[ slot ];
+	const _pep_rans_symbol sym = table->symbols[ symbol ];
+	x = sym.freq * ( x >> PEP_RANS_SCALE_BITS ) + slot - sym.low;
+
+	// Two bytes always bring a valid state back up to PEP_RANS_LOW, and a
+	// corrupt one can't make it loop.
+	if( x < PEP_RANS_LOW )
+	{
+		x = ( x << 8 ) | ( ac->data_ref != ac->end_of_data ? *ac->data_ref++ : 0u );
+		if( x < PEP_RANS_LOW ) x = ( x << 8 ) | ( ac->data_ref != ac->end_of_data ? *ac->data_ref++ : 0u );
+	}
+
+	dec->rans_states[ state ] = x;
+	dec->context_id = symbol;
+	return symbol;
+}
+
+// Decodes the next packed-palette-indices byte from the PPM order-2 stream.
+static PEP_FORCE_INLINE PEP_HOT uint8_t _pep_decoder_symbol( _pep_decoder* const restrict dec )
+{
+	if( dec->rans_model ) return _pep_rans_decode_symbol( dec );
+	if( dec->ac.recip ) return _pep_decoder_ppm_symbol( dec, 1 );
+	return _pep_decoder_ppm_symbol( dec, 0 );
+}
+
+// `_pep_decoder_symbol()` for the arithmetic coder, recip (a constant) saying
+// which way it scales.
+static PEP_FORCE_INLINE PEP_HOT uint8_t _pep_decoder_ppm_symbol( _pep_decoder* const restrict dec, const uint8_t recip )
+{
+	pep_codec_ctx* const restrict ctx = dec->ctx;
+	_pep_ac_decode* const restrict ac = &dec->ac;
+	const uint32_t context_index = dec->context_id & PEP_CONTEXTS_MASK;
+
+	_pep_context* const restrict context_ref = _pep_context_at( ctx, dec->context_stride, context_index );
+	_pep_fenwick* const restrict tree = _pep_model_tree( ctx, context_index, dec->use_fenwick );
+	const uint32_t context_sum = context_ref->sum;
+
+	_pep_sym_decode decode_result;
+	uint8_t symbol_found = 0;
+	_PEP_PROFILE( ctx->profile.symbols++ );
+	if( context_sum != 0 )
+	{
+		uint32_t decode_freq = _pep_arith_decode_curr_freq( ac, context_sum, recip );
+		decode_result = _pep_model_sym( context_ref, tree, decode_freq, dec->max_symbols );
+		_pep_arith_decode_update( ac, decode_result.prob );
+
+		// An escape scans up to max_symbols and then jumps to the escape.
+		_PEP_PROFILE( _pep_profile_scan( ctx, tree, decode_result.symbol < dec->max_symbols ? decode_result.symbol : dec->max_symbols ) );
+		if( decode_result.symbol != context_ref->escape )
+		{
+			symbol_found = 1;
+			_PEP_PROFILE( _pep_profile_update( ctx, context_ref, decode_result.symbol, dec->freq_step, dec->freq_max ) );
+			_pep_model_update( context_ref, tree, decode_result.symbol, dec->freq_step, dec->freq_max );
+		}
+	}
+
+	if( !symbol_found )
+	{
+		_pep_context* const restrict order0 = dec->order0;
+		_pep_fenwick* const restrict order0_tree = _pep_model_tree( ctx, ctx->alphabet, dec->use_fenwick );
+
+		uint32_t decode_freq = _pep_arith_decode_curr_freq( ac, order0->sum, recip );
+		decode_result = _pep_model_sym( order0, order0_tree, decode_freq, dec->max_symbols );
+		_pep_arith_decode_update( ac, decode_result.prob );
+		_PEP_PROFILE( ctx->profile.escapes++; _pep_profile_scan( ctx, order0_tree, decode_result.symbol ); _pep_profile_update( ctx, order0, decode_result.symbol, dec->freq_step, dec->freq_max ) );
+
+		// Escape count, which also opens a fresh context.
+		_pep_model_add( context_ref, tree, context_ref->escape, 1 );
+		_pep_model_add( context_ref, tree, decode_result.symbol, 1 );
+		_pep_model_update( order0, order0_tree, decode_result.symbol, dec->freq_step, dec->freq_max );
+
+		// Only a corrupt stream decodes order0's own escape; wrap it to 0.
+		decode_result.symbol &= order0->escape - 1u;
+	}
+
+	dec->context_id = ( ( dec->context_id << 8 ) | decode_result.symbol );
+	return ( uint8_t )decode_result.symbol;
+}
+
+// Finds stripe `stripe`'s stream in a striped pep's bytes (the whole of
+// `bytes` for a single-stream pep). Returns 0 if the offset table is bad.
+static inline uint8_t _pep_stripe_stream( const pep* const in_pep, const uint32_t stripe, uint8_t** const out_stream, uint64_t* const out_size )
+{
+	if( !in_pep->stripe_rows )
+	{
+		*out_stream = in_pep->bytes;
+		*out_size = in_pep->bytes_size;
+		return stripe == 0;
+	}
+
+	const uint32_t stripe_count = pep_stripe_count( in_pep );
+	const uint64_t table_size = ( uint64_t )stripe_count * 4;
+	if( stripe >= stripe_count || in_pep->bytes_size < table_size ) return 0;
+
+	const uint8_t* const table = in_pep->bytes;
+	#define _PEP_STRIPE_END( I ) ( ( uint32_t )table[ ( I ) * 4 ] | ( ( uint32_t )table[ ( I ) * 4 + 1 ] << 8 ) | ( ( uint32_t )table[ ( I ) * 4 + 2 ] << 16 ) | ( ( uint32_t )table[ ( I ) * 4 + 3 ] << 24 ) )
+	const uint32_t begin = stripe ? _PEP_STRIPE_END( stripe - 1 ) : 0;
+	const uint32_t end = _PEP_STRIPE_END( stripe );
+	#undef _PEP_STRIPE_END
+	if( begin > end || table_size + end > in_pep->bytes_size ) return 0;
+
+	*out_stream = in_pep->bytes + table_size + begin;
+	*out_size = end - begin;
+	return 1;
+}
+
+// Fills `palette` with in_pep's colors in out_format.
+static inline void _pep_output_palette( uint32_t* const palette, const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color )
+{
+	// Pre-reformat the palette once to the desired output format
+	const uint32_t* restrict src_palette = in_pep->palette;
+	for( uint32_t i = 0; i < in_pep->palette_size; ++i )
+	{
+		palette[ i ] = _pep_reformat( src_palette[ i ], in_pep->format, out_format );
+	}
+
+	// The palette is in out_format by now, so that's where alpha is.
+	if( transparent_first_color != 0 )
+	{
+		if( out_format <= pep_bgra )
+		{
+			palette[ 0 ] = palette[ 0 ] & 0xffffff00;
+		}
+		else
+		{
+			palette[ 0 ] = palette[ 0 ] & 0x00ffffff;
+		}
+	}
+}
+
+// Decodes `area` pixels from the decoder's stream through `palette`.
+static inline void _pep_decode_pixels( _pep_decoder* const dec, const uint32_t* const palette, uint32_t* const out_pixels, const uint64_t area )
+{
+	uint64_t canvas_pos = 0;
+	const uint8_t bits_per_index = dec->bits_per_index;
+	const uint8_t indices_per_byte = dec->indices_per_byte;
+	const uint8_t index_mask = dec->index_mask;
+
+	// The last byte can be partially filled.
+	const uint64_t packed_indices_size = ( area + indices_per_byte - 1 ) / indices_per_byte;
+
+	for( uint64_t b = 0; b < packed_indices_size; b++ )
+	{
+		const uint8_t symbol = _pep_decoder_symbol( dec );
+
+		///////
+		// convert packed-palette-indices to pixels
+
+		if( indices_per_byte > 1 )
+		{
+			uint8_t indices_in_byte = 0;
+			while( indices_in_byte < indices_per_byte && canvas_pos < area )
+			{
+				const uint8_t palette_idx = ( symbol >> ( indices_in_byte * bits_per_index ) ) & index_mask;
+				out_pixels[ canvas_pos ] = palette[ palette_idx ];
+				++canvas_pos;
+				++indices_in_byte;
+			}
+		}
+		else
+		{
+			out_pixels[ canvas_pos ] = palette[ symbol ];
+			++canvas_pos;
+		}
+	}
+}
+
+// Same as `_pep_decode_pixels()` for `rows` rows of `width` pixels, row r
+// starting at out_row + r * stride (stride can be negative). A symbol's
+// indices can run on into the next row.
+static inline void _pep_decode_pixels_rows( _pep_decoder* const dec, const uint32_t* const palette, uint32_t* out_row, const uint32_t width, uint32_t rows, const int64_t stride )
+{
+	const uint8_t bits_per_index = dec->bits_per_index;
+	const uint8_t indices_per_byte = dec->indices_per_byte;
+	const uint8_t index_mask = dec->index_mask;
+	uint32_t symbol = 0;
+	uint8_t indices_left = 0;
+	uint32_t column = 0;
+
+	while( rows )
+	{
+		if( indices_left == 0 )
+		{
+			symbol = _pep_decoder_symbol( dec );
+			indices_left = indices_per_byte;
+		}
+		out_row[ column ] = palette[ symbol & index_mask ];
+		symbol >>= bits_per_index;
+		indices_left--;
+
+		if( ++column == width )
+		{
+			column = 0;
+			if( --rows ) out_row += stride;
+		}
+	}
+}
+
+// Decodes `area` palette indices from the decoder's stream.
+static inline void _pep_decode_indices( _pep_decoder* const dec, uint8_t* const out_indices, const uint64_t area )
+{
+	const uint8_t bits_per_index = dec->bits_per_index;
+	const uint8_t indices_per_byte = dec->indices_per_byte;
+	const uint8_t index_mask = dec->index_mask;
+
+	uint8_t* restrict out_ref = out_indices;
+	uint8_t* const out_end = out_indices + area;
+
+	if( indices_per_byte == 1 )
+	{
+		while( out_ref < out_end ) *out_ref++ = _pep_decoder_symbol( dec );
+		return;
+	}
+
+	while( out_ref < out_end )
+	{
+		uint8_t symbol = _pep_decoder_symbol( dec );
+		for( uint8_t i = 0; i < indices_per_byte && out_ref < out_end; i++ )
+		{
+			*out_ref++ = symbol & index_mask;
+			symbol >>= bits_per_index;
+		}
+	}
+}
+
+// How many independently coded stripes in_pep has (1 unless it's striped).
+static inline uint32_t pep_stripe_count( const pep* const in_pep )
+{
+	if( !in_pep || !in_pep->height ) return 0;
+	if( !in_pep->stripe_rows ) return 1;
+	return ( in_pep->height - 1 ) / in_pep->stripe_rows + 1;
+}
+
+// Decodes one stripe into out_pixels, which is the whole width * height image:
+// only that stripe's rows are written, so a viewer can decode just the stripes
+// it shows. For a single-stream pep, stripe 0 is the whole image.
+// Returns 0 on failure.
+static inline uint8_t pep_decompress_stripe_ctx( pep_codec_ctx* const ctx, const pep* const in_pep, const uint32_t stripe, const pep_format out_format, const uint8_t transparent_first_color, uint32_t* const out_pixels )
+{
+	if( in_pep == NULL ) return 0;
+	return _pep_decompress_stripe_rows( ctx, in_pep, stripe, out_format, transparent_first_color, out_pixels, in_pep->width );
+}
+
+// Decodes one stripe with image row r going to out_row0 + r * stride.
+static inline uint8_t _pep_decompress_stripe_rows( pep_codec_ctx* const ctx, const pep* const in_pep, const uint32_t stripe, const pep_format out_format, const uint8_t transparent_first_color, uint32_t* const out_row0, const int64_t stride )
+{
+	if( ctx == NULL || in_pep == NULL || out_row0 == NULL ) return 0;
+	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 || in_pep->height == 0 ) return 0;
+
+	uint8_t* stream;
+	uint64_t stream_size;
+	if( !_pep_stripe_stream( in_pep, stripe, &stream, &stream_size ) ) return 0;
+
+	const uint32_t rows_per_stripe = in_pep->stripe_rows ? in_pep->stripe_rows : in_pep->height;
+	const uint32_t first_row = stripe * rows_per_stripe;
+	const uint32_t rows = ( in_pep->height - first_row < rows_per_stripe ) ? in_pep->height - first_row : rows_per_stripe;
+
+	_pep_output_palette( ctx->palette, in_pep, out_format, transparent_first_color );
+
+	_pep_decoder dec;
+	if( !_pep_decoder_open( &dec, ctx, in_pep, stream, stream_size ) ) return 0;
+	uint32_t* const out_row = out_row0 + ( int64_t )first_row * stride;
+	if( stride == in_pep->width ) _PEP_PROFILE_TIME( ctx, decode_ns, _pep_decode_pixels( &dec, ctx->palette, out_row, ( uint64_t )rows * in_pep->width ) );
+	else _PEP_PROFILE_TIME( ctx, decode_ns, _pep_decode_pixels_rows( &dec, ctx->palette, out_row, in_pep->width, rows, stride ) );
+	return 1;
+}
+
+// Checks the destination of the decompress_into functions and returns where
+// image row 0 goes (with the row step in *out_stride), or NULL.
+static inline uint32_t* _pep_decompress_into_origin( const pep* const in_pep, uint32_t* const out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const uint8_t flip_y, int64_t* const out_stride )
+{
+	if( in_pep == NULL || out_pixels == NULL || in_pep->width == 0 || in_pep->height == 0 ) return NULL;
+	const uint64_t stride = stride_bytes / sizeof( uint32_t );
+	if( stride_bytes % sizeof( uint32_t ) != 0 || stride_bytes > ( uint64_t )INT64_MAX || ( uint64_t )x + in_pep->width > stride ) return NULL;
+
+	*out_stride = flip_y ? -( int64_t )stride : ( int64_t )stride;
+	return out_pixels + ( ( uint64_t )y + ( flip_y ? in_pep->height - 1 : 0 ) ) * stride + x;
+}
+
+// Decodes in_pep straight into a surface the caller owns (a staging buffer,
+// a texture atlas...) without allocating: pixel (0, 0) lands at (x, y) of
+// out_pixels, whose rows start stride_bytes apart (a whole number of pixels,
+// padding included). With flip_y the image is written bottom row first, the
+// way bottom-up BMPs and GL textures want it. Returns 0 on failure.
+static inline uint8_t pep_decompress_into_ctx( pep_codec_ctx* const ctx, const pep* const in_pep, uint32_t* const out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const pep_format out_format, const uint8_t transparent_first_color, const uint8_t flip_y )
+{
+	int64_t stride;
+	uint32_t* const out_row0 = _pep_decompress_into_origin( in_pep, out_pixels, stride_bytes, x, y, flip_y, &stride );
+	if( ctx == NULL || out_row0 == NULL ) return 0;
+
+	const uint32_t stripe_count = pep_stripe_count( in_pep );
+	for( uint32_t stripe = 0; stripe < stripe_count; stripe++ )
 	{
-		*out_size = 0;
+		if( !_pep_decompress_stripe_rows( ctx, in_pep, stripe, out_format, transparent_first_color, out_row0, stride ) ) return 0;
+	}
+	return 1;
+}
+
+// Same as `pep_decompress_into_ctx()`, using a temporary context.
+static inline uint8_t pep_decompress_into( const pep* const in_pep, uint32_t* const out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const pep_format out_format, const uint8_t transparent_first_color, const uint8_t flip_y )
+{
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx ) return 0;
+
+	const uint8_t ok = pep_decompress_into_ctx( ctx, in_pep, out_pixels, stride_bytes, x, y, out_format, transparent_first_color, flip_y );
+	pep_codec_ctx_destroy( ctx );
+	return ok;
+}
+
+// You can decompress a pep into any format via out_format, it will correctly
+// do it for you via in_pep->format.
+// If you want the first color to be 0 alpha, set transparent_first_color to 1
+// otherwise just make it 0
+static inline uint32_t* pep_decompress_ctx( pep_codec_ctx* const ctx, const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color )
+{
+	if( ctx == NULL || in_pep == NULL ) return NULL;
+	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 || in_pep->height == 0 ) return NULL;
+
+	const uint64_t area = ( uint64_t )in_pep->width * in_pep->height;
+	if( area > SIZE_MAX / sizeof( uint32_t ) ) return NULL;
+	uint32_t* out_pixels = ( uint32_t* )PEP_MALLOC( area * sizeof( uint32_t ) );
+	if( out_pixels == NULL ) return NULL;
+
+	if( !pep_decompress_into_ctx( ctx, in_pep, out_pixels, ( uint64_t )in_pep->width * sizeof( uint32_t ), 0, 0, out_format, transparent_first_color, 0 ) )
+	{
+		PEP_FREE( out_pixels );
 		return NULL;
 	}
-	
-	uint64_t palette_bytes = 0;
-	switch( in_pep->color_bits )
+
+	return out_pixels;
+}
+
+// Decompresses straight to one palette index per pixel (row-major, 1 byte
+// each), skipping the color expansion. Useful for indexed outputs, e.g. 8-bit
+// BMP, or for doing the palette lookup yourself.
+static inline uint8_t* pep_decompress_indices_ctx( pep_codec_ctx* const ctx, const pep* const in_pep )
+{
+	if( ctx == NULL || in_pep == NULL ) return NULL;
+	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 || in_pep->height == 0 ) return NULL;
+
+	const uint64_t area = ( uint64_t )in_pep->width * in_pep->height;
+	if( area > SIZE_MAX ) return NULL;
+	uint8_t* out_indices = ( uint8_t* )PEP_MALLOC( area );
+	if( out_indices == NULL ) return NULL;
+
+	const uint32_t rows_per_stripe = in_pep->stripe_rows ? in_pep->stripe_rows : in_pep->height;
+	const uint32_t stripe_count = pep_stripe_count( in_pep );
+	for( uint32_t stripe = 0; stripe < stripe_count; stripe++ )
 	{
-		case _pep_1bit: palette_bytes = ( palette_count + 1 ) >> 1; break;
-		case _pep_2bit: palette_bytes = palette_count; break;
-		case _pep_4bit: palette_bytes = palette_count << 1; break;
-		case _pep_8bit: palette_bytes = palette_count << 2; break;
+		uint8_t* stream;
+		uint64_t stream_size;
+		if( !_pep_stripe_stream( in_pep, stripe, &stream, &stream_size ) )
+		{
+			PEP_FREE( out_indices );
+			return NULL;
+		}
+
+		const uint32_t first_row = stripe * rows_per_stripe;
+		const uint32_t rows = ( in_pep->height - first_row < rows_per_stripe ) ? in_pep->height - first_row : rows_per_stripe;
+
+		_pep_decoder dec;
+		if( !_pep_decoder_open( &dec, ctx, in_pep, stream, stream_size ) )
+		{
+			PEP_FREE( out_indices );
+			return NULL;
+		}
+		_PEP_PROFILE_TIME( ctx, decode_ns, _pep_decode_indices( &dec, out_indices + ( uint64_t )first_row * in_pep->width, ( uint64_t )rows * in_pep->width ) );
 	}
-	
-	uint8_t* out_bytes = ( uint8_t* )PEP_MALLOC( 15 + palette_bytes + in_pep->bytes_size );
+
+	return out_indices;
+}
+
+// Same as `pep_decompress_indices_ctx()`, using a temporary context.
+static inline uint8_t* pep_decompress_indices( const pep* const in_pep )
+{
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx ) return NULL;
+
+	uint8_t* out_indices = pep_decompress_indices_ctx( ctx, in_pep );
+	pep_codec_ctx_destroy( ctx );
+	return out_indices;
+}
+
+// Same as `pep_decompress_ctx()`, using a temporary context.
+static inline uint32_t* pep_decompress( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color )
+{
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx ) return NULL;
+
+	uint32_t* out_pixels = pep_decompress_ctx( ctx, in_pep, out_format, transparent_first_color );
+	pep_codec_ctx_destroy( ctx );
+	return out_pixels;
+}
+
+typedef struct
+{
+	const pep* pep_ref;
+	pep_format out_format;
+	uint8_t transparent_first_color;
+	uint32_t* out_row0;
+	int64_t stride;
+	uint8_t* stripe_ok;
+}
+_pep_stripe_decode_job;
+
+static inline void _pep_decompress_stripe_task( void* task_data, const uint32_t stripe )
+{
+	_pep_stripe_decode_job* const job = ( _pep_stripe_decode_job* )task_data;
+	pep_codec_ctx* const ctx = pep_codec_ctx_create();
+	job->stripe_ok[ stripe ] = ctx && _pep_decompress_stripe_rows( ctx, job->pep_ref, stripe, job->out_format, job->transparent_first_color, job->out_row0, job->stride );
+	pep_codec_ctx_destroy( ctx );
+}
+
+// Same as `pep_decompress_into()`, with the stripes of a striped pep decoded
+// through `run`, each with its own context. Single-stream peps just decode
+// normally.
+static inline uint8_t pep_decompress_into_parallel( const pep* const in_pep, uint32_t* const out_pixels, const uint64_t stride_bytes, const uint32_t x, const uint32_t y, const pep_format out_format, const uint8_t transparent_first_color, const uint8_t flip_y, pep_parallel_for run, void* run_user )
+{
+	const uint32_t stripe_count = pep_stripe_count( in_pep );
+	if( run == NULL || stripe_count <= 1 ) return pep_decompress_into( in_pep, out_pixels, stride_bytes, x, y, out_format, transparent_first_color, flip_y );
+	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 ) return 0;
+
+	int64_t stride;
+	uint32_t* const out_row0 = _pep_decompress_into_origin( in_pep, out_pixels, stride_bytes, x, y, flip_y, &stride );
+	if( out_row0 == NULL ) return 0;
+
+	uint8_t* stripe_ok = ( uint8_t* )PEP_MALLOC( stripe_count );
+	if( stripe_ok == NULL ) return 0;
+	_pep_stripe_decode_job job = { in_pep, out_format, transparent_first_color, out_row0, stride, stripe_ok };
+	run( run_user, stripe_count, _pep_decompress_stripe_task, &job );
+	uint8_t ok = 1;
+	for( uint32_t i = 0; i < stripe_count; i++ ) ok &= stripe_ok[ i ];
+	PEP_FREE( stripe_ok );
+	return ok;
+}
+
+// Same as `pep_decompress()`, with the stripes of a striped pep decoded through
+// `run`, each with its own context. Single-stream peps just decode normally.
+static inline uint32_t* pep_decompress_parallel( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color, pep_parallel_for run, void* run_user )
+{
+	const uint32_t stripe_count = pep_stripe_count( in_pep );
+	if( run == NULL || stripe_count <= 1 ) return pep_decompress( in_pep, out_format, transparent_first_color );
+	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 ) return NULL;
+
+	const uint64_t area = ( uint64_t )in_pep->width * in_pep->height;
+	if( area > SIZE_MAX / sizeof( uint32_t ) ) return NULL;
+	uint32_t* out_pixels = ( uint32_t* )PEP_MALLOC( area * sizeof( uint32_t ) );
+	if( out_pixels && !pep_decompress_into_parallel( in_pep, out_pixels, ( uint64_t )in_pep->width * sizeof( uint32_t ), 0, 0, out_format, transparent_first_color, 0, run, run_user ) )
+	{
+		PEP_FREE( out_pixels );
+		out_pixels = NULL;
+	}
+	return out_pixels;
+}
+
+static inline void pep_free( pep* in_pep )
+{
+	if( in_pep && in_pep->bytes )
+	{
+		if( in_pep->_mapping ) _pep_unmap_file( in_pep->_mapping, in_pep->_mapping_size );
+		else if( !in_pep->_bytes_borrowed ) free( in_pep->bytes );
+		in_pep->bytes = NULL;
+		in_pep->bytes_size = 0;
+		in_pep->_bytes_borrowed = 0;
+		in_pep->_mapping = NULL;
+		in_pep->_mapping_size = 0;
+	}
+}
+
+static inline const char* pep_error_string( const pep_error error )
+{
+	switch( error )
+	{
+		case pep_ok: return "ok";
+		case pep_error_invalid_argument: return "invalid argument";
+		case pep_error_too_large: return "image too large";
+		case pep_error_out_of_memory: return "out of memory";
+		case pep_error_io: return "cannot read file";
+		case pep_error_unsupported: return "unsupported .pep version";
+		case pep_error_corrupt: return "corrupt .pep data";
+	}
+	return "unknown error";
+}
+
+///////
+
+// Little-endian base-128: 7 bits per byte, high bit set while more follow.
+static inline uint8_t* _pep_varint_write( uint8_t* out_bytes, uint64_t value )
+{
+	while( value >= 0x80 )
+	{
+		*out_bytes++ = ( uint8_t )( value | 0x80 );
+		value >>= 7;
+	}
+	*out_bytes++ = ( uint8_t )value;
+	return out_bytes;
+}
+
+// Returns how many bytes the varint took, or 0 if it runs past in_size.
+static inline uint64_t _pep_varint_read( const uint8_t* const in_bytes, const uint64_t in_size, uint64_t* const out_value )
+{
+	uint64_t value = 0;
+	uint64_t i = 0;
+	uint8_t shift = 0;
+	do
+	{
+		if( i == in_size ) return 0;
+		const uint8_t byte = in_bytes[ i++ ];
+		value |= ( uint64_t )( byte & 0x7F ) << shift;
+		shift += 7;
+		if( !( byte & 0x80 ) ) break;
+	} while( shift < 64 );
+	*out_value = value;
+	return i;
+}
+
+// Writes in_pep's serialized header (at most PEP_HEADER_MAX_SIZE bytes, up
+// to and including the palette) and returns its size.
+static inline uint64_t _pep_header_write( const pep* const in_pep, uint8_t* const out_bytes )
+{
+	const uint16_t palette_count = in_pep->palette_size ? in_pep->palette_size : ( in_pep->palette[ 0 ] ? 256 : 0 );
 	uint8_t* bytes_ref = out_bytes;
 	
-	*bytes_ref++ = ( in_pep->format & 0x07 ) | ( ( in_pep->color_bits & 0x03 ) << 3 );
+	uint8_t header_flags = 0;
+	if( in_pep->stripe_rows ) header_flags |= PEP_FLAG_STRIPED;
+	if( in_pep->width > 0xFFF || in_pep->height > 0xFFF ) header_flags |= PEP_FLAG_WIDE_DIMS;
+	if( in_pep->coder == pep_coder_rans ) header_flags |= PEP_FLAG_RANS;
+	if( in_pep->coder == pep_coder_arith_recip ) header_flags |= PEP_FLAG_ARITH_RECIP;
+	const uint32_t freq_step = _pep_freq_step( in_pep->freq_step );
+	const uint32_t freq_max = _pep_freq_max( in_pep->freq_max );
+	if( in_pep->coder != pep_coder_rans && ( freq_step != PEP_FREQ_STEP || freq_max != PEP_FREQ_MAX ) ) header_flags |= PEP_FLAG_MODEL;
 	
-	*bytes_ref++ = in_pep->palette_size;
+	*bytes_ref++ = ( in_pep->format & 0x07 ) | ( ( in_pep->color_bits & 0x03 ) << 3 ) | ( header_flags ? PEP_HEADER_EXTENDED : 0 );
+	
+	if( header_flags )
+	{
+		*bytes_ref++ = header_flags;
+		if( header_flags & PEP_FLAG_STRIPED ) bytes_ref = _pep_varint_write( bytes_ref, in_pep->stripe_rows );
+		if( header_flags & PEP_FLAG_MODEL )
+		{
+			*bytes_ref++ = ( uint8_t )freq_step;
+			bytes_ref = _pep_varint_write( bytes_ref, freq_max );
+		}
+	}
 	
-	uint32_t packed_dims = ( ( in_pep->width & 0xFFF ) << 12 ) | ( in_pep->height & 0xFFF );
-	*bytes_ref++ = packed_dims >> 16;
-	*bytes_ref++ = packed_dims >> 8;
-	*bytes_ref++ = packed_dims;
+	*bytes_ref++ = in_pep->palette_size;
 	
-	uint32_t size = in_pep->bytes_size;
-	while( size >= 0x80 )
+	if( header_flags & PEP_FLAG_WIDE_DIMS )
+	{
+		bytes_ref = _pep_varint_write( bytes_ref, in_pep->width );
+		bytes_ref = _pep_varint_write( bytes_ref, in_pep->height );
+	}
+	else
 	{
-		*bytes_ref++ = ( size | 0x80 ) & 0xFF;
-		size >>= 7;
+		uint32_t packed_dims = ( in_pep->width << 12 ) | in_pep->height;
+		*bytes_ref++ = packed_dims >> 16;
+		*bytes_ref++ = packed_dims >> 8;
+		*bytes_ref++ = packed_dims;
 	}
-	*bytes_ref++ = size;
+	
+	bytes_ref = _pep_varint_write( bytes_ref, in_pep->bytes_size );
 	
 	*bytes_ref++ = in_pep->max_symbols;
 	
@@ -853,72 +3587,198 @@ static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_siz
 			}
 			break;
 	}
+
+	return ( uint64_t )( bytes_ref - out_bytes );
+}
+
+static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_size )
+{
+	if( !in_pep || !in_pep->width || !in_pep->height || !in_pep->bytes_size || !in_pep->bytes )
+	{
+		*out_size = 0;
+		return NULL;
+	}
+	
+	uint16_t palette_count = in_pep->palette_size ? in_pep->palette_size : ( in_pep->palette[ 0 ] ? 256 : 0 );
+	
+	if( !palette_count )
+	{
+		*out_size = 0;
+		return NULL;
+	}
+	
+	uint64_t palette_bytes = 0;
+	switch( in_pep->color_bits )
+	{
+		case _pep_1bit: palette_bytes = ( palette_count + 1 ) >> 1; break;
+		case _pep_2bit: palette_bytes = palette_count; break;
+		case _pep_4bit: palette_bytes = palette_count << 1; break;
+		case _pep_8bit: palette_bytes = palette_count << 2; break;
+	}
+	
+	// Worst case header: flags, extended flags, stripe rows, palette size,
+	// two dimension varints, bytes_size varint and max_symbols.
+	const uint64_t max_size = 32 + palette_bytes + in_pep->bytes_size;
+	if( in_pep->width > PEP_MAX_DIMENSION || in_pep->height > PEP_MAX_DIMENSION || max_size > UINT32_MAX )
+	{
+		*out_size = 0;
+		return NULL;
+	}
+	
+	uint8_t* out_bytes = ( uint8_t* )PEP_MALLOC( max_size );
+	if( !out_bytes )
+	{
+		*out_size = 0;
+		return NULL;
+	}
+	uint8_t* const bytes_ref = out_bytes + _pep_header_write( in_pep, out_bytes );
 	
 	// Optimized final byte copy
 	const uint8_t* restrict src_bytes = in_pep->bytes;
-	for( uint32_t i = 0; i < in_pep->bytes_size; ++i )
+	for( uint64_t i = 0; i < in_pep->bytes_size; ++i )
 	{
 		bytes_ref[ i ] = src_bytes[ i ];
 	}
 	
-	*out_size = bytes_ref - out_bytes + in_pep->bytes_size;
+	*out_size = ( uint32_t )( bytes_ref - out_bytes + in_pep->bytes_size );
 	return out_bytes;
 }
 
-static inline pep pep_deserialize( const uint8_t* const in_bytes )
+// Reads a serialized header (everything before the compressed bytes) into
+// out_pep, leaving its bytes NULL. Returns the header size, or 0 with
+// out_pep->error set. Pass UINT64_MAX as in_size if the size isn't known.
+static inline uint64_t _pep_header_parse( pep* const out_pep, const uint8_t* const in_bytes, const uint64_t in_size )
 {
-	pep out_pep = { 0 };
-	
-	if( !in_bytes )
-		return out_pep;
-	
+	#define _PEP_HEADER_NEED( N ) if( in_size - ( uint64_t )( bytes_ref - in_bytes ) < ( N ) ) { out_pep->error = pep_error_corrupt; return 0; }
 	const uint8_t* bytes_ref = in_bytes;
-	
+	uint64_t varint_size = 0;
+
+	_PEP_HEADER_NEED( 1 );
 	uint8_t packed_flags = *bytes_ref++;
-	out_pep.format = ( pep_format )( packed_flags & 0x07 );
-	out_pep.color_bits = ( _pep_color_bits )( ( packed_flags >> 3 ) & 0x03 );
-	
-	out_pep.palette_size = *bytes_ref++;
-	
-	uint32_t packed_dims = ( *bytes_ref++ << 16 ) | ( *bytes_ref++ << 8 ) | *bytes_ref++;
-	out_pep.width = packed_dims >> 12;
-	out_pep.height = packed_dims & 0xFFF;
-	
-	if( !out_pep.width || !out_pep.height )
-		return out_pep;
-	
-	uint8_t shift = 0;
-	do
+	out_pep->format = ( pep_format )( packed_flags & 0x07 );
+	out_pep->color_bits = ( _pep_color_bits )( ( packed_flags >> 3 ) & 0x03 );
+
+	out_pep->freq_step = PEP_FREQ_STEP;
+	out_pep->freq_max = PEP_FREQ_MAX;
+
+	uint8_t header_flags = 0;
+	if( packed_flags & PEP_HEADER_EXTENDED )
 	{
-		uint8_t byte = *bytes_ref++;
-		out_pep.bytes_size |= ( uint32_t )( byte & 0x7F ) << shift;
-		shift += 7;
-		if( !( byte & 0x80 ) ) break;
-	} while( shift < 32 );
-	
-	if( !out_pep.bytes_size )
-		return out_pep;
-	
-	out_pep.max_symbols = *bytes_ref++;
-	
+		_PEP_HEADER_NEED( 1 );
+		header_flags = *bytes_ref++;
+		const uint8_t coders = PEP_FLAG_RANS | PEP_FLAG_ARITH_RECIP;
+		if( ( header_flags & ~( PEP_FLAG_STRIPED | PEP_FLAG_WIDE_DIMS | coders | PEP_FLAG_MODEL ) ) || ( header_flags & coders ) == coders )
+		{
+			out_pep->error = pep_error_unsupported;
+			return 0;
+		}
+
+		if( header_flags & PEP_FLAG_STRIPED )
+		{
+			uint64_t rows = 0;
+			varint_size = _pep_varint_read( bytes_ref, in_size - ( uint64_t )( bytes_ref - in_bytes ), &rows );
+			bytes_ref += varint_size;
+			if( !varint_size || !rows || rows > 0xFFFF )
+			{
+				out_pep->error = pep_error_corrupt;
+				return 0;
+			}
+			out_pep->stripe_rows = ( uint16_t )rows;
+		}
+
+		if( header_flags & PEP_FLAG_MODEL )
+		{
+			_PEP_HEADER_NEED( 1 );
+			const uint8_t step = *bytes_ref++;
+			uint64_t limit = 0;
+			varint_size = _pep_varint_read( bytes_ref, in_size - ( uint64_t )( bytes_ref - in_bytes ), &limit );
+			bytes_ref += varint_size;
+			if( !varint_size || step < 1 || step > PEP_FREQ_STEP_LIMIT || limit < PEP_FREQ_MAX_MIN || limit > PEP_FREQ_MAX_LIMIT )
+			{
+				out_pep->error = pep_error_corrupt;
+				return 0;
+			}
+			out_pep->freq_step = step;
+			out_pep->freq_max = ( uint16_t )limit;
+		}
+	}
+	out_pep->coder = header_flags & PEP_FLAG_RANS ? pep_coder_rans : header_flags & PEP_FLAG_ARITH_RECIP ? pep_coder_arith_recip : pep_coder_arith;
+
+	_PEP_HEADER_NEED( 1 );
+	out_pep->palette_size = *bytes_ref++;
+
+	uint64_t width = 0;
+	uint64_t height = 0;
+	if( header_flags & PEP_FLAG_WIDE_DIMS )
+	{
+		varint_size = _pep_varint_read( bytes_ref, in_size - ( uint64_t )( bytes_ref - in_bytes ), &width );
+		bytes_ref += varint_size;
+		if( varint_size )
+		{
+			varint_size = _pep_varint_read( bytes_ref, in_size - ( uint64_t )( bytes_ref - in_bytes ), &height );
+			bytes_ref += varint_size;
+		}
+	}
+	else
+	{
+		_PEP_HEADER_NEED( 3 );
+		const uint32_t packed_dims = ( ( uint32_t )bytes_ref[ 0 ] << 16 ) | ( ( uint32_t )bytes_ref[ 1 ] << 8 ) | bytes_ref[ 2 ];
+		bytes_ref += 3;
+		width = packed_dims >> 12;
+		height = packed_dims & 0xFFF;
+	}
+
+	if( !width || !height )
+	{
+		out_pep->error = pep_error_corrupt;
+		return 0;
+	}
+	if( width > PEP_MAX_DIMENSION || height > PEP_MAX_DIMENSION )
+	{
+		out_pep->error = pep_error_too_large;
+		return 0;
+	}
+
+	varint_size = _pep_varint_read( bytes_ref, in_size - ( uint64_t )( bytes_ref - in_bytes ), &out_pep->bytes_size );
+	bytes_ref += varint_size;
+	if( !varint_size || !out_pep->bytes_size )
+	{
+		out_pep->error = pep_error_corrupt;
+		return 0;
+	}
+
+	_PEP_HEADER_NEED( 1 );
+	out_pep->max_symbols = *bytes_ref++;
+
+	uint64_t palette_bytes = 0;
+	switch( out_pep->color_bits )
+	{
+		case _pep_1bit: palette_bytes = ( out_pep->palette_size + 1 ) >> 1; break;
+		case _pep_2bit: palette_bytes = out_pep->palette_size; break;
+		case _pep_4bit: palette_bytes = out_pep->palette_size << 1; break;
+		case _pep_8bit: palette_bytes = out_pep->palette_size << 2; break;
+	}
+	_PEP_HEADER_NEED( palette_bytes );
+	#undef _PEP_HEADER_NEED
+
 	// Zero-initialize palette efficiently
 	for( uint32_t i = 0; i < 256; ++i )
 	{
-		out_pep.palette[ i ] = 0;
+		out_pep->palette[ i ] = 0;
 	}
-	
-	switch( out_pep.color_bits )
+
+	switch( out_pep->color_bits )
 	{
 		case _pep_1bit:
-			for( uint16_t i = 0; i < out_pep.palette_size; i += 2 )
+			for( uint16_t i = 0; i < out_pep->palette_size; i += 2 )
 			{
 				uint8_t b = *bytes_ref++;
-				out_pep.palette[ i ] = ( ( b & 0x80 ) ? 0xFF000000 : 0 ) | 
+				out_pep->palette[ i ] = ( ( b & 0x80 ) ? 0xFF000000 : 0 ) | 
 				                       ( ( b & 0x40 ) ? 0x00FF0000 : 0 ) |
 				                       ( ( b & 0x20 ) ? 0x0000FF00 : 0 ) | 
 				                       ( ( b & 0x10 ) ? 0x000000FF : 0 );
-				if( i + 1 < out_pep.palette_size )
-					out_pep.palette[ i + 1 ] = ( ( b & 0x08 ) ? 0xFF000000 : 0 ) | 
+				if( i + 1 < out_pep->palette_size )
+					out_pep->palette[ i + 1 ] = ( ( b & 0x08 ) ? 0xFF000000 : 0 ) | 
 					                           ( ( b & 0x04 ) ? 0x00FF0000 : 0 ) |
 					                           ( ( b & 0x02 ) ? 0x0000FF00 : 0 ) | 
 					                           ( ( b & 0x01 ) ? 0x000000FF : 0 );
@@ -926,10 +3786,10 @@ static inline pep pep_deserialize( const uint8_t* const in_bytes )
 			break;
 
 		case _pep_2bit:
-			for( uint16_t i = 0; i < out_pep.palette_size; i++ )
+			for( uint16_t i = 0; i < out_pep->palette_size; i++ )
 			{
 				uint8_t b = *bytes_ref++;
-				out_pep.palette[ i ] = ( ( uint32_t )( ( b >> 6 ) * 0x55 ) << 24 ) | 
+				out_pep->palette[ i ] = ( ( uint32_t )( ( b >> 6 ) * 0x55 ) << 24 ) | 
 				                       ( ( uint32_t )( ( ( b >> 4 ) & 0x03 ) * 0x55 ) << 16 ) |
 				                       ( ( uint32_t )( ( ( b >> 2 ) & 0x03 ) * 0x55 ) << 8 ) | 
 				                       ( ( ( b & 0x03 ) * 0x55 ) );
@@ -937,11 +3797,11 @@ static inline pep pep_deserialize( const uint8_t* const in_bytes )
 			break;
 
 		case _pep_4bit:
-			for( uint16_t i = 0; i < out_pep.palette_size; i++ )
+			for( uint16_t i = 0; i < out_pep->palette_size; i++ )
 			{
 				uint8_t b1 = *bytes_ref++;
 				uint8_t b2 = *bytes_ref++;
-				out_pep.palette[ i ] = ( ( uint32_t )( ( b1 & 0x0F ) | ( ( b1 & 0x0F ) << 4 ) ) << 24 ) |
+				out_pep->palette[ i ] = ( ( uint32_t )( ( b1 & 0x0F ) | ( ( b1 & 0x0F ) << 4 ) ) << 24 ) |
 				                       ( ( uint32_t )( ( b1 & 0xF0 ) | ( ( b1 & 0xF0 ) >> 4 ) ) << 16 ) |
 				                       ( ( uint32_t )( ( b2 & 0x0F ) | ( ( b2 & 0x0F ) << 4 ) ) << 8 ) |
 				                       ( ( b2 & 0xF0 ) | ( ( b2 & 0xF0 ) >> 4 ) );
@@ -950,27 +3810,84 @@ static inline pep pep_deserialize( const uint8_t* const in_bytes )
 
 		case _pep_8bit:
 			// Optimized palette read
-			for( uint16_t i = 0; i < out_pep.palette_size; ++i )
+			for( uint16_t i = 0; i < out_pep->palette_size; ++i )
 			{
 				uint32_t c = (uint32_t)bytes_ref[ 0 ] |
 				           ( (uint32_t)bytes_ref[ 1 ] << 8 ) |
 				           ( (uint32_t)bytes_ref[ 2 ] << 16 ) |
 				           ( (uint32_t)bytes_ref[ 3 ] << 24 );
-				out_pep.palette[ i ] = c;
+				out_pep->palette[ i ] = c;
 				bytes_ref += 4;
 			}
 			break;
 	}
-	
-	out_pep.bytes = ( uint8_t* )PEP_MALLOC( out_pep.bytes_size );
-	// Optimized byte copy
-	uint8_t* restrict dst = out_pep.bytes;
-	const uint8_t* restrict src = bytes_ref;
-	for( uint32_t i = 0; i < out_pep.bytes_size; ++i )
+
+	out_pep->width = ( uint32_t )width;
+	out_pep->height = ( uint32_t )height;
+	return ( uint64_t )( bytes_ref - in_bytes );
+}
+
+static inline pep pep_deserialize( const uint8_t* const in_bytes )
+{
+	pep out_pep = { 0 };
+
+	if( !in_bytes )
+	{
+		out_pep.error = pep_error_invalid_argument;
+		return out_pep;
+	}
+
+	const uint64_t header_size = _pep_header_parse( &out_pep, in_bytes, UINT64_MAX );
+	if( !header_size || out_pep.bytes_size > SIZE_MAX )
+	{
+		pep failed = { 0 };
+		failed.error = header_size ? pep_error_too_large : out_pep.error;
+		return failed;
+	}
+
+	out_pep.bytes = ( uint8_t* )PEP_MALLOC( out_pep.bytes_size );
+	if( !out_pep.bytes )
+	{
+		pep failed = { 0 };
+		failed.error = pep_error_out_of_memory;
+		return failed;
+	}
+	// Optimized byte copy
+	uint8_t* restrict dst = out_pep.bytes;
+	const uint8_t* restrict src = in_bytes + header_size;
+	for( uint64_t i = 0; i < out_pep.bytes_size; ++i )
+	{
+		dst[ i ] = src[ i ];
+	}
+
+	return out_pep;
+}
+
+// Same as `pep_deserialize()`, but `bytes` points into in_bytes instead of
+// a copy of it, so there's no allocation at all. in_bytes has to stay alive
+// and unchanged until the pep is done with; `pep_free()` won't free it.
+// in_size bounds every read, so truncated data is reported as corrupt.
+static inline pep pep_deserialize_view( const uint8_t* const in_bytes, const uint64_t in_size )
+{
+	pep out_pep = { 0 };
+
+	if( !in_bytes )
+	{
+		out_pep.error = pep_error_invalid_argument;
+		return out_pep;
+	}
+
+	const uint64_t header_size = _pep_header_parse( &out_pep, in_bytes, in_size );
+	if( !header_size || out_pep.bytes_size > in_size - header_size )
 	{
-		dst[ i ] = src[ i ];
+		pep failed = { 0 };
+		failed.error = header_size ? pep_error_corrupt : out_pep.error;
+		return failed;
 	}
-	
+
+	// Nothing ever writes through a pep's bytes.
+	out_pep.bytes = ( uint8_t* )( in_bytes + header_size );
+	out_pep._bytes_borrowed = 1;
 	return out_pep;
 }
 
@@ -1018,42 +3935,709 @@ static inline pep pep_load( const char* const file_path )
 
 	if( !file_path )
 	{
+		out_pep.error = pep_error_invalid_argument;
 		return out_pep;
 	}
 
 	FILE * file = fopen( file_path, "rb" );
 	if( !file )
 	{
+		out_pep.error = pep_error_io;
 		return out_pep;
 	}
 
-	fseek( file, 0, SEEK_END );
-	long file_size = ftell( file );
-	fseek( file, 0, SEEK_SET );
+	// The header is parsed from a small prefix, so the compressed bytes are
+	// read straight into place instead of being copied out of a file buffer.
+	uint8_t header[ PEP_HEADER_MAX_SIZE ];
+	const size_t header_read = fread( header, 1, sizeof( header ), file );
+	const uint64_t header_size = _pep_header_parse( &out_pep, header, header_read );
+
+	pep_error error = pep_ok;
+	if( !header_size ) error = ferror( file ) ? pep_error_io : out_pep.error;
+	else if( out_pep.bytes_size > SIZE_MAX ) error = pep_error_too_large;
+	else if( !( out_pep.bytes = ( uint8_t* )PEP_MALLOC( out_pep.bytes_size ) ) ) error = pep_error_out_of_memory;
+	else
+	{
+		uint64_t have = header_read - header_size;
+		if( have > out_pep.bytes_size ) have = out_pep.bytes_size;
+		for( uint64_t i = 0; i < have; ++i )
+		{
+			out_pep.bytes[ i ] = header[ header_size + i ];
+		}
+
+		const uint64_t rest = out_pep.bytes_size - have;
+		if( rest && fread( out_pep.bytes + have, 1, rest, file ) != rest )
+		{
+			error = ferror( file ) ? pep_error_io : pep_error_corrupt;
+			PEP_FREE( out_pep.bytes );
+		}
+	}
+	fclose( file );
+
+	if( error != pep_ok )
+	{
+		pep failed = { 0 };
+		failed.error = error;
+		return failed;
+	}
+	return out_pep;
+}
+
+// Maps the whole file read-only. Returns NULL if that isn't possible (no
+// mmap on this platform, an empty file, a pipe...).
+static inline void* _pep_map_file( const char* const file_path, uint64_t* const out_size )
+{
+	void* mapping = NULL;
+#if defined( _PEP_MMAP_POSIX )
+	const int fd = open( file_path, O_RDONLY );
+	if( fd < 0 ) return NULL;
+	struct stat st;
+	if( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 && ( uint64_t )st.st_size <= SIZE_MAX )
+	{
+		mapping = mmap( NULL, ( size_t )st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( mapping == MAP_FAILED ) mapping = NULL;
+		else *out_size = ( uint64_t )st.st_size;
+	}
+	close( fd ); // the mapping keeps the file open
+#elif defined( _PEP_MMAP_WIN32 )
+	HANDLE file = CreateFileA( file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE ) return NULL;
+	LARGE_INTEGER size;
+	if( GetFileSizeEx( file, &size ) && size.QuadPart > 0 && ( uint64_t )size.QuadPart <= SIZE_MAX )
+	{
+		HANDLE map = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+		if( map )
+		{
+			mapping = MapViewOfFile( map, FILE_MAP_READ, 0, 0, 0 );
+			CloseHandle( map ); // the view keeps the mapping alive
+		}
+		if( mapping ) *out_size = ( uint64_t )size.QuadPart;
+	}
+	CloseHandle( file );
+#else
+	( void )file_path;
+	( void )out_size;
+#endif
+	return mapping;
+}
+
+static inline void _pep_unmap_file( void* const mapping, const uint64_t size )
+{
+#if defined( _PEP_MMAP_POSIX )
+	munmap( mapping, ( size_t )size );
+#elif defined( _PEP_MMAP_WIN32 )
+	( void )size;
+	UnmapViewOfFile( mapping );
+#else
+	( void )mapping;
+	( void )size;
+#endif
+}
+
+// Loads a .pep by mapping the file and pointing `bytes` into the mapping,
+// so it's never read into or copied through the heap; `pep_free()` unmaps
+// it. Where the file can't be mapped (or with PEP_NO_MMAP) this is just
+// `pep_load()`, and the result is used and freed the same way either way.
+static inline pep pep_load_mapped( const char* const file_path )
+{
+	if( !file_path ) return pep_load( file_path );
+
+	uint64_t size = 0;
+	uint8_t* const mapping = ( uint8_t* )_pep_map_file( file_path, &size );
+	if( !mapping ) return pep_load( file_path );
 
-	if( file_size <= 0 )
+	pep out_pep = pep_deserialize_view( mapping, size );
+	if( !out_pep.bytes )
 	{
-		fclose( file );
+		_pep_unmap_file( mapping, size );
 		return out_pep;
 	}
+	out_pep._mapping = mapping;
+	out_pep._mapping_size = size;
+	return out_pep;
+}
 
-	uint8_t* bytes = ( uint8_t* )PEP_MALLOC( file_size );
+///////
+// Streaming decoder
 
-	size_t read = fread( bytes, 1, file_size, file );
-	fclose( file );
+static inline size_t pep_file_reader( void* const file, uint8_t* const out_bytes, const size_t max_bytes )
+{
+	return fread( out_bytes, 1, max_bytes, ( FILE* )file );
+}
 
-	if( read != ( size_t ) file_size )
+// Keeps the buffered bytes from `from` on, moved to the front of the buffer,
+// and tops the buffer up from the read callback. Returns where `from` ended
+// up. Without a callback the whole payload is in memory already.
+static inline uint8_t* _pep_decoder_fill( pep_decoder* const dec, uint8_t* const from )
+{
+	if( dec->_read == NULL ) return from;
+
+	const uint64_t keep = ( uint64_t )( dec->_buffer_end - from );
+	dec->_buffer_offset += ( uint64_t )( from - dec->_buffer );
+	for( uint64_t i = 0; i < keep; i++ ) dec->_buffer[ i ] = from[ i ];
+
+	uint8_t* end = dec->_buffer + keep;
+	uint64_t want = PEP_DECODER_BUFFER_SIZE - keep;
+	if( want > dec->_payload_left ) want = dec->_payload_left;
+	while( want )
 	{
-		PEP_FREE( bytes );
+		const size_t got = dec->_read( dec->_read_user, end, ( size_t )want );
+		if( got == 0 || got > want )
+		{
+			dec->info.error = pep_error_corrupt; // truncated
+			dec->_payload_left = 0;
+			break;
+		}
+		end += got;
+		want -= got;
+		dec->_payload_left -= got;
+	}
+	dec->_buffer_end = end;
+	return dec->_buffer;
+}
+
+// Returns payload bytes [ offset, offset + need ) from the buffer, reading
+// forward as needed, or NULL if the data ends first.
+static inline uint8_t* _pep_decoder_seek( pep_decoder* const dec, const uint64_t offset, const uint64_t need )
+{
+	uint64_t buffered_end = dec->_buffer_offset + ( uint64_t )( dec->_buffer_end - dec->_buffer );
+	while( buffered_end < offset + need )
+	{
+		if( dec->_read == NULL || dec->_payload_left == 0 )
+		{
+			dec->info.error = pep_error_corrupt;
+			return NULL;
+		}
+		_pep_decoder_fill( dec, offset < buffered_end ? dec->_buffer + ( offset - dec->_buffer_offset ) : dec->_buffer_end );
+		buffered_end = dec->_buffer_offset + ( uint64_t )( dec->_buffer_end - dec->_buffer );
+	}
+	return dec->_buffer + ( offset - dec->_buffer_offset );
+}
+
+// Points the arithmetic-decoder at the buffered part of the current stream.
+static inline void _pep_decoder_window( pep_decoder* const dec )
+{
+	_pep_ac_decode* const ac = &dec->_dec.ac;
+	const uint64_t stream_left = dec->_stream_end - ( dec->_buffer_offset + ( uint64_t )( ac->data_ref - dec->_buffer ) );
+	const uint64_t buffered = ( uint64_t )( dec->_buffer_end - ac->data_ref );
+	ac->end_of_data = ac->data_ref + ( buffered < stream_left ? buffered : stream_left );
+	dec->_more = buffered < stream_left;
+}
+
+static inline void _pep_decoder_refill( pep_decoder* const dec )
+{
+	_pep_ac_decode* const ac = &dec->_dec.ac;
+	ac->data_ref = _pep_decoder_fill( dec, ac->data_ref );
+	_pep_decoder_window( dec );
+}
+
+// Starts decoding stripe dec->_stripe (the whole image for a single stream).
+static inline uint8_t _pep_decoder_start_stripe( pep_decoder* const dec )
+{
+	const pep* const info = &dec->info;
+	uint64_t begin = 0;
+	uint64_t end = info->bytes_size;
+	uint32_t rows = info->height;
+	if( info->stripe_rows )
+	{
+		const uint64_t table_size = ( uint64_t )pep_stripe_count( info ) * 4;
+		const uint32_t first_row = dec->_stripe * info->stripe_rows;
+		begin = table_size + ( dec->_stripe ? dec->_stripe_ends[ dec->_stripe - 1 ] : 0 );
+		end = table_size + dec->_stripe_ends[ dec->_stripe ];
+		rows = ( info->height - first_row < info->stripe_rows ) ? info->height - first_row : info->stripe_rows;
+	}
+
+	// rANS tables are read a record at a time, as the buffer holds at least
+	// PEP_HEADER_MAX_SIZE bytes and a record is at most _PEP_RANS_RECORD_MAX.
+	if( info->coder == pep_coder_rans )
+	{
+		uint32_t records = 1;
+		for( uint32_t record = 0; record < records; record++ )
+		{
+			const uint64_t need = end - begin < _PEP_RANS_RECORD_MAX ? end - begin : _PEP_RANS_RECORD_MAX;
+			const uint8_t* const bytes = _pep_decoder_seek( dec, begin, need );
+			const uint64_t used = bytes ? _pep_rans_read_record( &dec->_ctx->rans, record, bytes, need ) : 0;
+			if( !used )
+			{
+				dec->info.error = pep_error_corrupt;
+				return 0;
+			}
+			begin += used;
+			if( record == 0 ) records += dec->_ctx->rans.table_count;
+		}
+	}
+
+	uint8_t* stream = _pep_decoder_seek( dec, begin, 0 );
+	if( stream == NULL ) return 0;
+	stream = _pep_decoder_fill( dec, stream );
+	if( dec->info.error != pep_ok ) return 0;
+
+	dec->_stream_end = end;
+	const uint64_t buffered = ( uint64_t )( dec->_buffer_end - stream );
+	_pep_decoder_begin( &dec->_dec, dec->_ctx, info, stream, buffered < end - begin ? buffered : end - begin );
+	_pep_decoder_window( dec );
+
+	dec->_stripe_pixels_left = ( uint64_t )rows * info->width;
+	dec->_pending_count = 0;
+	return 1;
+}
+
+// Reads the stripe table (if any) and starts the first stream.
+static inline uint8_t _pep_decoder_setup( pep_decoder* const dec, pep_codec_ctx* const ctx )
+{
+	pep* const info = &dec->info;
+	dec->_ctx = ctx ? ctx : pep_codec_ctx_create();
+	dec->_owns_ctx = ctx == NULL;
+	if( dec->_ctx == NULL )
+	{
+		info->error = pep_error_out_of_memory;
+		return 0;
+	}
+
+	if( info->stripe_rows )
+	{
+		const uint32_t stripe_count = pep_stripe_count( info );
+		const uint64_t table_size = ( uint64_t )stripe_count * 4;
+		dec->_stripe_ends = ( uint32_t* )PEP_MALLOC( table_size );
+		if( dec->_stripe_ends == NULL )
+		{
+			info->error = pep_error_out_of_memory;
+			return 0;
+		}
+
+		uint32_t last_end = 0;
+		for( uint32_t i = 0; i < stripe_count; i++ )
+		{
+			const uint8_t* const entry = _pep_decoder_seek( dec, ( uint64_t )i * 4, 4 );
+			if( entry == NULL ) return 0;
+			const uint32_t stripe_end = ( uint32_t )entry[ 0 ] | ( ( uint32_t )entry[ 1 ] << 8 ) | ( ( uint32_t )entry[ 2 ] << 16 ) | ( ( uint32_t )entry[ 3 ] << 24 );
+			if( stripe_end < last_end || table_size + stripe_end > info->bytes_size )
+			{
+				info->error = pep_error_corrupt;
+				return 0;
+			}
+			dec->_stripe_ends[ i ] = last_end = stripe_end;
+		}
+	}
+
+	dec->_stripe = 0;
+	dec->_palette_key = -1;
+	return _pep_decoder_start_stripe( dec );
+}
+
+// Streams a pep in through `read`, which is called for up to max_bytes at a
+// time and returns how many it got (0 at the end). `pep_file_reader` with a
+// FILE* reads from a file. Memory use is one codec context (pass NULL to have
+// one made), a PEP_DECODER_BUFFER_SIZE buffer and 4 bytes per stripe, whatever
+// the image size. Pull rows with `pep_decoder_read_rows()` and call
+// `pep_decoder_free()` when done, even if this fails.
+// Returns 0 on failure, with dec->info.error set.
+static inline uint8_t pep_decoder_init( pep_decoder* const dec, pep_codec_ctx* const ctx, pep_read_fn read, void* read_user )
+{
+	if( dec == NULL ) return 0;
+	pep_decoder empty = { 0 };
+	*dec = empty;
+	if( read == NULL )
+	{
+		dec->info.error = pep_error_invalid_argument;
+		return 0;
+	}
+
+	dec->_read = read;
+	dec->_read_user = read_user;
+	dec->_buffer = ( uint8_t* )PEP_MALLOC( PEP_DECODER_BUFFER_SIZE );
+	if( dec->_buffer == NULL )
+	{
+		dec->info.error = pep_error_out_of_memory;
+		return 0;
+	}
+
+	uint64_t header_read = 0;
+	while( header_read < PEP_HEADER_MAX_SIZE )
+	{
+		const size_t got = read( read_user, dec->_buffer + header_read, ( size_t )( PEP_HEADER_MAX_SIZE - header_read ) );
+		if( got == 0 || got > PEP_HEADER_MAX_SIZE - header_read ) break;
+		header_read += got;
+	}
+
+	const uint64_t header_size = _pep_header_parse( &dec->info, dec->_buffer, header_read );
+	if( !header_size ) return 0;
+
+	// Whatever came in past the header is the start of the payload.
+	uint64_t have = header_read - header_size;
+	if( have > dec->info.bytes_size ) have = dec->info.bytes_size;
+	dec->_buffer_end = dec->_buffer + header_size + have;
+	dec->_payload_left = dec->info.bytes_size - have;
+	_pep_decoder_fill( dec, dec->_buffer + header_size );
+	dec->_buffer_offset = 0; // payload offsets start after the header
+
+	return _pep_decoder_setup( dec, ctx );
+}
+
+// Same as `pep_decoder_init()`, for a serialized pep already in memory (from
+// `pep_serialize()`, a file mapping...). Nothing is copied, so in_bytes has to
+// stay around until `pep_decoder_free()`.
+static inline uint8_t pep_decoder_init_bytes( pep_decoder* const dec, pep_codec_ctx* const ctx, const uint8_t* const in_bytes, const uint64_t in_size )
+{
+	if( dec == NULL ) return 0;
+	pep_decoder empty = { 0 };
+	*dec = empty;
+	if( in_bytes == NULL )
+	{
+		dec->info.error = pep_error_invalid_argument;
+		return 0;
+	}
+
+	const uint64_t header_size = _pep_header_parse( &dec->info, in_bytes, in_size );
+	if( !header_size ) return 0;
+	if( in_size - header_size < dec->info.bytes_size )
+	{
+		dec->info.error = pep_error_corrupt;
+		return 0;
+	}
+
+	// The decoder only ever reads through these.
+	dec->_buffer = ( uint8_t* )( in_bytes + header_size );
+	dec->_buffer_end = dec->_buffer + dec->info.bytes_size;
+	return _pep_decoder_setup( dec, ctx );
+}
+
+// Emits `count` pixels of the current stripe, carrying a partly used packed
+// byte over to the next call.
+static inline void _pep_decoder_emit( pep_decoder* const dec, uint32_t* out_pixels, uint64_t count )
+{
+	_pep_decoder* const restrict stream = &dec->_dec;
+	const uint32_t* const restrict palette = dec->_palette;
+	const uint8_t bits_per_index = stream->bits_per_index;
+	const uint8_t indices_per_byte = stream->indices_per_byte;
+	const uint8_t index_mask = stream->index_mask;
+
+	while( count && dec->_pending_count )
+	{
+		*out_pixels++ = palette[ dec->_pending_symbol & index_mask ];
+		dec->_pending_symbol >>= bits_per_index;
+		dec->_pending_count--;
+		count--;
+	}
+
+	while( count )
+	{
+		if( PEP_UNLIKELY( dec->_more && stream->ac.end_of_data - stream->ac.data_ref < _PEP_DECODER_LOOKAHEAD ) ) _pep_decoder_refill( dec );
+
+		uint8_t symbol = _pep_decoder_symbol( stream );
+		if( indices_per_byte == 1 )
+		{
+			*out_pixels++ = palette[ symbol ];
+			count--;
+			continue;
+		}
+
+		const uint8_t used = count < indices_per_byte ? ( uint8_t )count : indices_per_byte;
+		for( uint8_t i = 0; i < used; i++ )
+		{
+			*out_pixels++ = palette[ symbol & index_mask ];
+			symbol >>= bits_per_index;
+		}
+		count -= used;
+		if( used < indices_per_byte )
+		{
+			dec->_pending_symbol = symbol;
+			dec->_pending_count = indices_per_byte - used;
+		}
+	}
+}
+
+// Decodes the next (up to) max_rows rows into out_pixels, which needs room for
+// max_rows * info.width pixels. Returns how many rows were written: 0 once the
+// image is done, or on failure (see dec->info.error).
+static inline uint32_t pep_decoder_read_rows( pep_decoder* const dec, uint32_t* const out_pixels, const uint32_t max_rows, const pep_format out_format, const uint8_t transparent_first_color )
+{
+	if( dec == NULL || out_pixels == NULL || dec->_ctx == NULL || dec->info.error != pep_ok ) return 0;
+
+	pep* const info = &dec->info;
+	uint32_t rows = info->height - dec->rows_read;
+	if( rows > max_rows ) rows = max_rows;
+	if( rows == 0 ) return 0;
+
+	const int palette_key = ( int )out_format * 2 + ( transparent_first_color != 0 );
+	if( dec->_palette_key != palette_key )
+	{
+		_pep_output_palette( dec->_palette, info, out_format, transparent_first_color );
+		dec->_palette_key = palette_key;
+	}
+
+	uint32_t* out_ref = out_pixels;
+	uint64_t left = ( uint64_t )rows * info->width;
+	while( left )
+	{
+		if( dec->_stripe_pixels_left == 0 )
+		{
+			dec->_stripe++;
+			if( !_pep_decoder_start_stripe( dec ) ) return 0;
+		}
+
+		const uint64_t count = left < dec->_stripe_pixels_left ? left : dec->_stripe_pixels_left;
+		_pep_decoder_emit( dec, out_ref, count );
+		out_ref += count;
+		left -= count;
+		dec->_stripe_pixels_left -= count;
+	}
+
+	if( info->error != pep_ok ) return 0;
+	dec->rows_read += rows;
+	return rows;
+}
+
+static inline void pep_decoder_free( pep_decoder* const dec )
+{
+	if( dec == NULL ) return;
+	if( dec->_read && dec->_buffer ) PEP_FREE( dec->_buffer );
+	if( dec->_stripe_ends ) PEP_FREE( dec->_stripe_ends );
+	if( dec->_owns_ctx ) pep_codec_ctx_destroy( dec->_ctx );
+	dec->_buffer = NULL;
+	dec->_stripe_ends = NULL;
+	dec->_ctx = NULL;
+}
+
+///////
+// Push encoder
+
+static inline size_t pep_file_writer( void* const file, const uint8_t* const bytes, const size_t size )
+{
+	return fwrite( bytes, 1, size, ( FILE* )file );
+}
+
+// Maps pixels to palette indices, adding colors to out_pep's palette as they
+// show up (the same order and overflow as `_pep_build_palette()`).
+static inline void _pep_palette_learn( _pep_encoder* const enc, pep* const out_pep, const uint32_t* const in_pixels, const uint64_t count, const pep_format in_format, uint8_t* const out_indices )
+{
+	uint16_t* const restrict hash = enc->ctx->palette_hash;
+	const _pep_swizzle sw = _pep_swizzle_of( in_format, out_pep->format );
+	for( uint64_t i = 0; i < count; i++ )
+	{
+		if( !enc->has_last || in_pixels[ i ] != enc->last_p )
+		{
+			enc->has_last = 1;
+			enc->last_p = in_pixels[ i ];
+			const uint32_t formatted_p = _pep_swizzle_apply( enc->last_p, sw );
+
+			const uint32_t slot = _pep_palette_slot( hash, out_pep->palette, formatted_p );
+			if( hash[ slot ] == 0 && ( ( uint16_t )out_pep->palette_size + 1 ) < 256 )
+			{
+				out_pep->palette[ out_pep->palette_size++ ] = formatted_p;
+				hash[ slot ] = out_pep->palette_size;
+			}
+			enc->index = hash[ slot ] ? hash[ slot ] - 1 : out_pep->palette_size;
+		}
+		out_indices[ i ] = ( uint8_t )enc->index;
+	}
+}
+
+// ctx can be NULL to have the encoder make its own. palette can be NULL to
+// learn it from the rows. Returns 0 with `info.error` set on failure; call
+// `pep_encoder_free()` either way.
+static inline uint8_t pep_encoder_begin( pep_encoder* const enc, pep_codec_ctx* const ctx, const uint32_t width, const uint32_t height, const pep_format in_format, const pep_format out_format, const uint32_t* const palette, const uint8_t palette_size )
+{
+	if( enc == NULL ) return 0;
+	pep_encoder empty = { 0 };
+	*enc = empty;
+
+	pep* const info = &enc->info;
+	info->width = width;
+	info->height = height;
+	info->format = out_format;
+	info->color_bits = _pep_8bit;
+	enc->_in_format = in_format;
+
+	if( width == 0 || height == 0 || ( palette && palette_size == 0 ) )
+	{
+		info->error = pep_error_invalid_argument;
+		return 0;
+	}
+	const uint64_t pixels_area = ( uint64_t )width * height;
+	if( width > PEP_MAX_DIMENSION || height > PEP_MAX_DIMENSION || ( !palette && pixels_area > SIZE_MAX ) )
+	{
+		info->error = pep_error_too_large;
+		return 0;
+	}
+
+	enc->_ctx = ctx ? ctx : pep_codec_ctx_create();
+	enc->_owns_ctx = ctx == NULL;
+	if( enc->_ctx == NULL || !_pep_sink_init( &enc->_sink ) )
+	{
+		info->error = pep_error_out_of_memory;
+		return 0;
+	}
+	_pep_record_options( info, &enc->_ctx->options );
+
+	if( palette )
+	{
+		for( uint32_t i = 0; i < palette_size; i++ )
+		{
+			info->palette[ i ] = _pep_reformat( palette[ i ], in_format, out_format );
+		}
+		info->palette_size = palette_size;
+		_pep_palette_hash_fill( enc->_ctx->palette_hash, info->palette, palette_size );
+		_pep_encoder_begin( &enc->_enc, enc->_ctx, palette_size, &enc->_ctx->options, enc->_sink.scratch );
+		return 1;
+	}
+
+	enc->_indices = ( uint8_t* )PEP_MALLOC( pixels_area );
+	if( enc->_indices == NULL )
+	{
+		info->error = pep_error_out_of_memory;
+		return 0;
+	}
+	for( uint32_t i = 0; i < PEP_PALETTE_HASH_N; i++ ) enc->_ctx->palette_hash[ i ] = 0;
+	enc->_enc.ctx = enc->_ctx;
+	return 1;
+}
+
+// Takes the next row_count rows (width * row_count pixels in in_format).
+// Returns 0 with `info.error` set on failure.
+static inline uint8_t pep_encoder_push_rows( pep_encoder* const enc, const uint32_t* const in_pixels, const uint32_t row_count )
+{
+	if( enc == NULL || enc->_ctx == NULL || enc->info.error != pep_ok ) return 0;
+
+	pep* const info = &enc->info;
+	if( in_pixels == NULL || row_count > info->height - enc->rows_written )
+	{
+		info->error = pep_error_invalid_argument;
+		return 0;
+	}
+
+	const uint64_t count = ( uint64_t )row_count * info->width;
+	if( enc->_indices )
+	{
+		_PEP_PROFILE_TIME( enc->_ctx, palette_ns, _pep_palette_learn( &enc->_enc, info, in_pixels, count, enc->_in_format, enc->_indices + ( uint64_t )enc->rows_written * info->width ) );
+	}
+	else
+	{
+		uint8_t ok;
+		_PEP_PROFILE_TIME( enc->_ctx, code_ns, ok = _pep_sink_encode( &enc->_sink, &enc->_enc, info, in_pixels, NULL, count, enc->_in_format ) );
+		if( !ok )
+		{
+			info->error = pep_error_out_of_memory;
+			return 0;
+		}
+		if( enc->_enc.missing )
+		{
+			info->error = pep_error_invalid_argument; // a color that isn't in the palette
+			return 0;
+		}
+	}
+
+	enc->rows_written += row_count;
+	return 1;
+}
+
+// Codes whatever is still pending and flushes the stream, leaving everything
+// but `bytes` in info and the bytes in the sink.
+static inline uint8_t _pep_encoder_complete( pep_encoder* const enc )
+{
+	pep* const info = &enc->info;
+	if( info->error != pep_ok ) return 0;
+	if( enc->_ctx == NULL || enc->rows_written != info->height )
+	{
+		info->error = pep_error_invalid_argument;
+		return 0;
+	}
+
+	if( enc->_indices )
+	{
+		const uint64_t area = ( uint64_t )info->width * info->height;
+		if( enc->_ctx->options.palette_order == pep_palette_by_count )
+		{
+			// Indices past the palette are colors that didn't fit, and stay.
+			uint64_t counts[ 256 ] = { 0 };
+			uint8_t remap[ 256 ];
+			for( uint64_t i = 0; i < area; i++ ) counts[ enc->_indices[ i ] ]++;
+			_pep_palette_by_count( info, counts, remap );
+			for( uint32_t i = info->palette_size; i < 256; i++ ) remap[ i ] = ( uint8_t )i;
+			for( uint64_t i = 0; i < area; i++ ) enc->_indices[ i ] = remap[ enc->_indices[ i ] ];
+		}
+
+		_pep_encoder_begin( &enc->_enc, enc->_ctx, info->palette_size, &enc->_ctx->options, enc->_sink.scratch );
+		uint8_t ok;
+		_PEP_PROFILE_TIME( enc->_ctx, code_ns, ok = _pep_sink_encode( &enc->_sink, &enc->_enc, info, NULL, enc->_indices, area, enc->_in_format ) );
+		PEP_FREE( enc->_indices );
+		enc->_indices = NULL;
+		if( !ok )
+		{
+			info->error = pep_error_out_of_memory;
+			return 0;
+		}
+	}
+
+	if( !_pep_sink_end( &enc->_sink, &enc->_enc ) )
+	{
+		info->error = pep_error_out_of_memory;
+		return 0;
+	}
+	info->bytes_size = enc->_sink.size;
+	info->max_symbols = enc->_enc.max_symbol;
+	return 1;
+}
+
+// Returns the finished pep (free it with `pep_free()`), or an empty one with
+// its error set.
+static inline pep pep_encoder_finish( pep_encoder* const enc )
+{
+	pep out_pep = { 0 };
+	if( enc == NULL )
+	{
+		out_pep.error = pep_error_invalid_argument;
 		return out_pep;
 	}
 
-	out_pep = pep_deserialize( bytes );
-	PEP_FREE( bytes );
+	if( _pep_encoder_complete( enc ) )
+	{
+		uint8_t* const bytes = enc->info.bytes_size <= SIZE_MAX ? ( uint8_t* )PEP_MALLOC( enc->info.bytes_size ) : NULL;
+		if( bytes )
+		{
+			_pep_sink_copy( &enc->_sink, bytes );
+			out_pep = enc->info;
+			out_pep.bytes = bytes;
+		}
+		else enc->info.error = pep_error_out_of_memory;
+	}
+	out_pep.error = enc->info.error;
 
+	pep_encoder_free( enc );
 	return out_pep;
 }
 
+// Writes the serialized pep (what `pep_serialize()` would give) through
+// `write`, without ever holding it in one piece. Returns 1 on success.
+static inline uint8_t pep_encoder_finish_write( pep_encoder* const enc, pep_write_fn write, void* write_user )
+{
+	if( enc == NULL ) return 0;
+
+	uint8_t ok = 0;
+	if( write == NULL ) enc->info.error = pep_error_invalid_argument;
+	else if( _pep_encoder_complete( enc ) )
+	{
+		uint8_t header[ PEP_HEADER_MAX_SIZE ];
+		const size_t header_size = ( size_t )_pep_header_write( &enc->info, header );
+		ok = write( write_user, header, header_size ) == header_size && _pep_sink_write( &enc->_sink, write, write_user );
+		if( !ok ) enc->info.error = pep_error_io;
+	}
+
+	pep_encoder_free( enc );
+	return ok;
+}
+
+static inline void pep_encoder_free( pep_encoder* const enc )
+{
+	if( enc == NULL ) return;
+	_pep_sink_free( &enc->_sink );
+	if( enc->_indices ) PEP_FREE( enc->_indices );
+	if( enc->_owns_ctx ) pep_codec_ctx_destroy( enc->_ctx );
+	enc->_indices = NULL;
+	enc->_ctx = NULL;
+	enc->_owns_ctx = 0;
+}
+
 #ifdef _MSC_VER
 	#pragma warning( pop )
 #endif
@@ -0,0 +1,428 @@
+// In-process microbenchmark for the PEP.h codec.
+// Every input is decoded once up front; after that only pep_compress,
+// pep_decompress, pep_serialize and pep_deserialize are timed, each call on
+// its own with the monotonic clock, so process startup and image loading
+// don't end up in the numbers. Built against either header (see Makefile:
+// pep_bench_mod / pep_bench_orig) so the two can be compared directly.
+#if defined(__APPLE__)
+	#define _DARWIN_C_SOURCE
+#elif !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200809L
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "pepr_image.h"
+#define PEP_IMPLEMENTATION
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunsequenced"
+#endif
+#include "PEP.h"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+// Upper bound on samples kept per operation and image.
+#define BENCH_MAX_SAMPLES 100000
+
+typedef struct
+{
+	char* path;
+	uint32_t* pixels;
+	uint32_t width;
+	uint32_t height;
+} bench_image;
+
+typedef struct
+{
+	bench_image* items;
+	size_t count;
+	size_t cap;
+} bench_corpus;
+
+typedef enum
+{
+	bench_compress,
+	bench_decompress,
+	bench_serialize,
+	bench_deserialize,
+	bench_op_count
+} bench_op;
+
+static const char* const bench_op_names[ bench_op_count ] = { "compress", "decompress", "serialize", "deserialize" };
+
+typedef struct
+{
+	uint64_t median_ns;
+	uint64_t p99_ns;
+	uint64_t min_ns;
+	uint32_t samples;
+} bench_result;
+
+static void print_usage( const char* prog )
+{
+	fprintf( stderr,
+		"Usage:\n"
+		"  %s [opts] <in|dir>...   Time the codec on images (PNG/BMP/PPM/PAM/TGA) or .pep files\n"
+		"\nOptions:\n"
+		"  -n <count>     at least this many timed calls per operation (default 50)\n"
+		"  -t <seconds>   and keep going until this much time was spent on it (default 0.25)\n"
+		"  -w <count>     untimed warm-up calls per operation (default 3)\n"
+		"  --coder <c>    arith, rans or recip: code with that coder, every call on one context\n"
+		"  --csv          one machine-readable line per image and operation\n",
+		prog );
+}
+
+static uint64_t now_ns( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ( uint64_t )ts.tv_sec * 1000000000u + ( uint64_t )ts.tv_nsec;
+}
+
+static int has_ext_ci( const char* const path, const char* const ext )
+{
+	const size_t n = strlen( path );
+	const size_t m = strlen( ext );
+	if( n < m ) return 0;
+	for( size_t i = 0; i < m; i++ )
+	{
+		char c = path[ n - m + i ];
+		if( c >= 'A' && c <= 'Z' ) c = ( char )( c - 'A' + 'a' );
+		if( c != ext[ i ] ) return 0;
+	}
+	return 1;
+}
+
+static int is_input_file( const char* const path )
+{
+	static const char* const exts[] = { ".pep", ".png", ".bmp", ".ppm", ".pgm", ".pam", ".tga" };
+	for( size_t i = 0; i < sizeof( exts ) / sizeof( exts[ 0 ] ); i++ )
+	{
+		if( has_ext_ci( path, exts[ i ] ) ) return 1;
+	}
+	return 0;
+}
+
+// Decodes one input to RGBA pixels: .pep through the codec, anything else
+// through pepr_image.h. Returns 0 (with a message on stderr) if it can't.
+static int corpus_add( bench_corpus* const corpus, const char* const path )
+{
+	size_t size = 0;
+	uint8_t* data = pepr_read_file( path, &size );
+	if( !data ){ fprintf( stderr, "%s: cannot read\n", path ); return 0; }
+
+	uint32_t* pixels = NULL;
+	size_t w = 0;
+	size_t h = 0;
+	if( has_ext_ci( path, ".pep" ) )
+	{
+		pep p = pep_deserialize( data );
+		if( p.bytes && p.width && p.height )
+		{
+			pixels = pep_decompress( &p, pep_rgba, 0 );
+			w = p.width;
+			h = p.height;
+		}
+		pep_free( &p );
+	}
+	else
+	{
+		const char* err = NULL;
+		pixels = pepr_image_decode( data, size, &w, &h, &err );
+	}
+	free( data );
+	if( !pixels ){ fprintf( stderr, "%s: cannot decode\n", path ); return 0; }
+#ifndef PEP_HAS_WIDE_DIMS
+	// Skipped rather than fatal, so one corpus can be run against both headers.
+	if( w > 4095 || h > 4095 ){ fprintf( stderr, "%s: too large for this PEP.h, skipped\n", path ); free( pixels ); return 1; }
+#endif
+
+	if( corpus->count == corpus->cap )
+	{
+		const size_t cap = corpus->cap ? corpus->cap * 2 : 16;
+		bench_image* grown = ( bench_image* )realloc( corpus->items, cap * sizeof( bench_image ) );
+		if( !grown ){ free( pixels ); return 0; }
+		corpus->items = grown;
+		corpus->cap = cap;
+	}
+	bench_image* const img = &corpus->items[ corpus->count++ ];
+	img->path = strdup( path );
+	img->pixels = pixels;
+	img->width = ( uint32_t )w;
+	img->height = ( uint32_t )h;
+	return 1;
+}
+
+// Adds a file, or every input file directly inside a directory (sorted, so
+// runs line up). Files found in a directory that don't decode are skipped.
+static int corpus_add_path( bench_corpus* const corpus, const char* const path )
+{
+	struct stat st;
+	if( stat( path, &st ) != 0 || !S_ISDIR( st.st_mode ) ) return corpus_add( corpus, path );
+
+	struct dirent** names = NULL;
+	const int n = scandir( path, &names, NULL, alphasort );
+	if( n < 0 ){ fprintf( stderr, "%s: cannot list\n", path ); return 0; }
+	for( int i = 0; i < n; i++ )
+	{
+		if( names[ i ]->d_name[ 0 ] != '.' && is_input_file( names[ i ]->d_name ) )
+		{
+			const size_t len = strlen( path ) + strlen( names[ i ]->d_name ) + 2;
+			char* full = ( char* )malloc( len );
+			if( full )
+			{
+				const size_t plen = strlen( path );
+				snprintf( full, len, "%s%s%s", path, plen && path[ plen - 1 ] == '/' ? "" : "/", names[ i ]->d_name );
+				corpus_add( corpus, full );
+				free( full );
+			}
+		}
+		free( names[ i ] );
+	}
+	free( names );
+	return 1;
+}
+
+static int cmp_u64( const void* a, const void* b )
+{
+	const uint64_t x = *( const uint64_t* )a;
+	const uint64_t y = *( const uint64_t* )b;
+	return ( x > y ) - ( x < y );
+}
+
+// Everything one timed call needs, prepared outside the timing.
+typedef struct
+{
+	const bench_image* img;
+	pep compressed;
+	uint8_t* serialized;
+#ifdef PEP_HAS_ENCODE_OPTIONS
+	pep_codec_ctx* ctx; // --coder, else NULL for the temporary-context calls
+#endif
+} bench_state;
+
+static pep bench_compress_image( const bench_state* const st )
+{
+#ifdef PEP_HAS_ENCODE_OPTIONS
+	if( st->ctx ) return pep_compress_ctx( st->ctx, st->img->pixels, st->img->width, st->img->height, pep_rgba, pep_rgba );
+#endif
+	return pep_compress( st->img->pixels, st->img->width, st->img->height, pep_rgba, pep_rgba );
+}
+
+static uint32_t* bench_decompress_image( const bench_state* const st )
+{
+#ifdef PEP_HAS_ENCODE_OPTIONS
+	if( st->ctx ) return pep_decompress_ctx( st->ctx, &st->compressed, pep_rgba, 0 );
+#endif
+	return pep_decompress( &st->compressed, pep_rgba, 0 );
+}
+
+// Sets up --coder's context in st. Returns 0 (with a message on stderr) if
+// this PEP.h doesn't have that coder; without encode options there's only
+// the arithmetic coder, on temporary contexts.
+static int bench_use_coder( bench_state* const st, const char* const coder )
+{
+#ifdef PEP_HAS_ENCODE_OPTIONS
+	st->ctx = pep_codec_ctx_create();
+	if( !st->ctx ){ fprintf( stderr, "alloc failed\n" ); return 0; }
+	if( strcmp( coder, "arith" ) == 0 ) st->ctx->options.coder = pep_coder_arith;
+#ifdef PEP_HAS_RANS
+	else if( strcmp( coder, "rans" ) == 0 ) st->ctx->options.coder = pep_coder_rans;
+#endif
+#ifdef PEP_HAS_ARITH_RECIP
+	else if( strcmp( coder, "recip" ) == 0 ) st->ctx->options.coder = pep_coder_arith_recip;
+#endif
+	else
+#else
+	( void )st;
+	if( strcmp( coder, "arith" ) != 0 )
+#endif
+	{
+		fprintf( stderr, "--coder %s: not in this PEP.h\n", coder );
+		return 0;
+	}
+	return 1;
+}
+
+// Runs `op` once. Returns 0 if the codec failed.
+static int bench_run( const bench_state* const st, const bench_op op )
+{
+	switch( op )
+	{
+		case bench_compress:
+		{
+			pep p = bench_compress_image( st );
+			const int ok = p.bytes != NULL;
+			pep_free( &p );
+			return ok;
+		}
+		case bench_decompress:
+		{
+			uint32_t* pixels = bench_decompress_image( st );
+			free( pixels );
+			return pixels != NULL;
+		}
+		case bench_serialize:
+		{
+			uint32_t size = 0;
+			uint8_t* bytes = pep_serialize( &st->compressed, &size );
+			free( bytes );
+			return bytes != NULL;
+		}
+		case bench_deserialize:
+		{
+			pep p = pep_deserialize( st->serialized );
+			const int ok = p.bytes != NULL;
+			pep_free( &p );
+			return ok;
+		}
+		default: return 0;
+	}
+}
+
+// Times `op` for at least min_iters calls and min_ns in total.
+static int bench_measure( const bench_state* const st, const bench_op op, uint64_t* const samples, const uint32_t warmup, const uint32_t min_iters, const uint64_t min_ns, bench_result* const out )
+{
+	for( uint32_t i = 0; i < warmup; i++ )
+	{
+		if( !bench_run( st, op ) ) return 0;
+	}
+
+	uint32_t n = 0;
+	uint64_t spent = 0;
+	while( n < BENCH_MAX_SAMPLES && ( n < min_iters || spent < min_ns ) )
+	{
+		const uint64_t t0 = now_ns();
+		const int ok = bench_run( st, op );
+		const uint64_t t = now_ns() - t0;
+		if( !ok ) return 0;
+		samples[ n++ ] = t;
+		spent += t;
+	}
+
+	qsort( samples, n, sizeof( uint64_t ), cmp_u64 );
+	out->samples = n;
+	out->min_ns = samples[ 0 ];
+	out->median_ns = samples[ n / 2 ];
+	out->p99_ns = samples[ ( uint32_t )( ( uint64_t )( n - 1 ) * 99 / 100 ) ];
+	return 1;
+}
+
+int main( int argc, char** argv )
+{
+	uint32_t min_iters = 50;
+	uint32_t warmup = 3;
+	double min_seconds = 0.25;
+	int csv = 0;
+	const char* coder = NULL;
+
+	bench_corpus corpus = { 0 };
+	for( int i = 1; i < argc; i++ )
+	{
+		if( strcmp( argv[ i ], "-n" ) == 0 && i + 1 < argc ) min_iters = ( uint32_t )strtoul( argv[ ++i ], NULL, 10 );
+		else if( strcmp( argv[ i ], "-t" ) == 0 && i + 1 < argc ) min_seconds = strtod( argv[ ++i ], NULL );
+		else if( strcmp( argv[ i ], "-w" ) == 0 && i + 1 < argc ) warmup = ( uint32_t )strtoul( argv[ ++i ], NULL, 10 );
+		else if( strcmp( argv[ i ], "--csv" ) == 0 ) csv = 1;
+		else if( strcmp( argv[ i ], "--coder" ) == 0 && i + 1 < argc ) coder = argv[ ++i ];
+		else if( argv[ i ][ 0 ] == '-' ){ print_usage( argv[ 0 ] ); return 1; }
+		else if( !corpus_add_path( &corpus, argv[ i ] ) ) return 1;
+	}
+	if( !corpus.count ){ print_usage( argv[ 0 ] ); return 1; }
+	if( min_iters < 1 ) min_iters = 1;
+	if( min_iters > BENCH_MAX_SAMPLES ) min_iters = BENCH_MAX_SAMPLES;
+
+	bench_state coded = { 0 };
+	if( coder && !bench_use_coder( &coded, coder ) ) return 1;
+
+	uint64_t* samples = ( uint64_t* )malloc( BENCH_MAX_SAMPLES * sizeof( uint64_t ) );
+	if( !samples ){ fprintf( stderr, "alloc failed\n" ); return 4; }
+	const uint64_t min_ns = ( uint64_t )( min_seconds * 1e9 );
+
+	// Corpus totals: the sum of each image's median per operation.
+	uint64_t total_ns[ bench_op_count ] = { 0 };
+	uint64_t total_pixels = 0;
+	uint64_t total_pep_bytes = 0;
+
+	if( csv ) printf( "file,width,height,pep_bytes,op,samples,median_ns,p99_ns,min_ns,ns_per_px,mb_per_s\n" );
+	else printf( "%-12s %12s %12s %12s %10s %10s\n", "op", "median us", "p99 us", "min us", "ns/px", "MB/s" );
+
+	int rc = 0;
+	for( size_t c = 0; c < corpus.count && !rc; c++ )
+	{
+		const bench_image* const img = &corpus.items[ c ];
+		const uint64_t area = ( uint64_t )img->width * img->height;
+
+		bench_state st = coded;
+		st.img = img;
+		st.compressed = bench_compress_image( &st );
+		uint32_t serialized_size = 0;
+		if( st.compressed.bytes ) st.serialized = pep_serialize( &st.compressed, &serialized_size );
+		if( !st.serialized )
+		{
+			fprintf( stderr, "%s: compression failed\n", img->path );
+			pep_free( &st.compressed );
+			rc = 2;
+			break;
+		}
+
+		// The numbers mean nothing if the round trip is broken.
+		uint32_t* check = bench_decompress_image( &st );
+		if( !check || memcmp( check, img->pixels, ( size_t )area * sizeof( uint32_t ) ) != 0 )
+		{
+			fprintf( stderr, "%s: round trip mismatch\n", img->path );
+			rc = 2;
+		}
+		free( check );
+
+		if( !csv && !rc ) printf( "%s (%ux%u, %u colors, %u bytes)\n", img->path, img->width, img->height, st.compressed.palette_size, serialized_size );
+		for( int op = 0; op < bench_op_count && !rc; op++ )
+		{
+			bench_result r;
+			if( !bench_measure( &st, ( bench_op )op, samples, warmup, min_iters, min_ns, &r ) )
+			{
+				fprintf( stderr, "%s: %s failed\n", img->path, bench_op_names[ op ] );
+				rc = 2;
+				break;
+			}
+			total_ns[ op ] += r.median_ns;
+			// Throughput is over the raw RGBA8 image for every operation.
+			const double ns_px = ( double )r.median_ns / ( double )area;
+			const double mb_s = r.median_ns ? ( double )area * 4.0 * 1e3 / ( double )r.median_ns : 0.0;
+			if( csv ) printf( "%s,%u,%u,%u,%s,%u,%llu,%llu,%llu,%.3f,%.1f\n", img->path, img->width, img->height, serialized_size, bench_op_names[ op ], r.samples, ( unsigned long long )r.median_ns, ( unsigned long long )r.p99_ns, ( unsigned long long )r.min_ns, ns_px, mb_s );
+			else printf( "  %-10s %12.1f %12.1f %12.1f %10.3f %10.1f\n", bench_op_names[ op ], r.median_ns * 1e-3, r.p99_ns * 1e-3, r.min_ns * 1e-3, ns_px, mb_s );
+		}
+		total_pixels += area;
+		total_pep_bytes += serialized_size;
+
+		free( st.serialized );
+		pep_free( &st.compressed );
+	}
+
+	if( !rc && !csv && corpus.count > 1 )
+	{
+		printf( "corpus (%zu images, %llu pixels, %llu bytes)\n", corpus.count, ( unsigned long long )total_pixels, ( unsigned long long )total_pep_bytes );
+		for( int op = 0; op < bench_op_count; op++ )
+		{
+			const double ns_px = ( double )total_ns[ op ] / ( double )total_pixels;
+			const double mb_s = total_ns[ op ] ? ( double )total_pixels * 4.0 * 1e3 / ( double )total_ns[ op ] : 0.0;
+			printf( "  %-10s %12.1f %12s %12s %10.3f %10.1f\n", bench_op_names[ op ], total_ns[ op ] * 1e-3, "", "", ns_px, mb_s );
+		}
+	}
+
+	for( size_t c = 0; c < corpus.count; c++ )
+	{
+		free( corpus.items[ c ].path );
+		free( corpus.items[ c ].pixels );
+	}
+	free( corpus.items );
+	free( samples );
+#ifdef PEP_HAS_ENCODE_OPTIONS
+	pep_codec_ctx_destroy( coded.ctx );
+#endif
+	return rc;
+}
@@ -1,9 +1,29 @@
+#if defined(__APPLE__)
+	#define _DARWIN_C_SOURCE
+#elif !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200809L
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+// Built-in readers handle BMP/PPM/PAM/TGA/PNG everywhere; on macOS, ImageIO
+// remains as a fallback for anything else (TIFF, JPEG, GIF, ...).
+#if defined(__APPLE__) && !defined(PEPR_NO_COREGRAPHICS)
+	#define PEPR_USE_COREGRAPHICS
+#endif
+#ifdef PEPR_USE_COREGRAPHICS
 #include <CoreFoundation/CoreFoundation.h>
 #include <ImageIO/ImageIO.h>
 #include <CoreGraphics/CoreGraphics.h>
+#endif
+#include "pepr_image.h"
+#include "pepr_gen.h"
 #define PEP_IMPLEMENTATION
 #if defined(__clang__)
 #pragma clang diagnostic push
@@ -19,13 +39,66 @@ static void print_usage(const char* prog){
 		"Usage:\n"
 		"  %s --demo <out.pep>                Generate a 32x32 demo image.\n"
 		"  %s --rgba <w> <h> <in.rgba> <out.pep>  Convert raw RGBA32 to .pep\n"
-		"  %s --image <in.img> <out.pep>       Convert image (PNG/TIFF/etc) to .pep\n"
+		"  %s --image <in.img> <out.pep> [--stripe-rows <n>] [--sort-palette] [--rans] [--rans-states <n>] [--arith-recip]\n"
+		"                    [--best] [--budget <seconds>]\n"
+		"                                      Convert image (PNG/BMP/PPM/PAM/TGA; +ImageIO on macOS) to .pep,\n"
+		"                                      optionally as independently coded stripes of <n> rows\n"
 		"  %s --dry-run <in.img>               Encode image to memory only (benchmark)\n"
-		"  %s --to-bmp <in.pep> <out.bmp>      Convert .pep to 32-bit BMP\n"
+		"  %s --to-bmp <in.pep> <out.bmp> [--top-down]\n"
+		"                                      Convert .pep to 32-bit BMP (optionally stored top-down)\n"
 		"  %s --to-rle-bmp <in.pep> <out.rle>  Convert .pep to 8-bit RLE BMP (.rle)\n"
+		"  %s --batch [opts] <in|dir>...        Convert many files in one process\n"
+		"  %s --gen <dir> [--seed <n>] [--count <n>] [--max-dim <n>]\n"
+		"                                      Write a seeded synthetic pixel-art corpus (PNG) for benchmarks\n"
+		"  %s --profile [--json] [--stripe-rows <n>] [--sort-palette] [--rans] [--rans-states <n>] [--arith-recip] <in>...\n"
+		"                                      Per-phase timings and coder counters (PEP_PROFILE builds)\n"
 		"  %s <in> [out]                        Auto: .pep→.bmp, else img→.pep\n"
-		"\nNotes:\n  - <in.rgba> must be width*height*4 bytes (RGBA8).\n",
-		prog, prog, prog, prog, prog, prog, prog);
+		"\nBatch options:\n"
+		"  -j <n>             worker threads (default: core count)\n"
+		"  --out-dir <dir>    write outputs to <dir> instead of next to the inputs\n"
+		"  --manifest <file>  read inputs from <file> ('-' for stdin), one per line, optional <TAB>out\n"
+		"  --to-bmp           directories contribute .pep files (→.bmp) instead of images (→.pep)\n"
+		"  --top-down         write BMPs top-down (negative height) instead of bottom-up\n"
+		"  --stripe-rows <n>  encode as independently coded stripes of <n> rows\n"
+		"  --sort-palette     number palettes most common color first (smaller coder scans, same format)\n"
+		"  --rans             entropy code with static rANS tables (faster decode, slightly larger files)\n"
+		"  --rans-states <n>  --rans over <n> interleaved coder states, 1..4 (default 2)\n"
+		"  --arith-recip      arithmetic coding with table multiplies instead of divides (slightly larger files)\n"
+		"\n--image options:\n"
+		"  --best             encode with every candidate model setting on all cores, keep the smallest\n"
+		"  --budget <s>       --best stops starting candidates after <s> seconds (default 30)\n"
+		"\nNotes:\n  - <in.rgba> must be width*height*4 bytes (RGBA8).\n"
+		"  - --sort-palette changes which color is palette entry 0.\n"
+		"  - --rans and --arith-recip files need a decoder that supports that coder.\n"
+		"  - --best files that don't use the default model need a decoder that reads it from the header.\n",
+		prog, prog, prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+// Checks a --rans-states value (0 when it wasn't given), saying what's wrong.
+static int rans_states_ok( const long rans_states )
+{
+	if( rans_states == 0 ) return 1;
+#ifdef PEP_HAS_RANS_STATES
+	if( rans_states >= 1 && rans_states <= PEP_RANS_STATES_MAX ) return 1;
+	fprintf( stderr, "--rans-states must be 1..%d\n", PEP_RANS_STATES_MAX );
+#else
+	fprintf( stderr, "--rans-states needs a PEP.h with interleaved rANS states\n" );
+#endif
+	return 0;
+}
+
+// Checks --arith-recip against this PEP.h and the other coder flags.
+static int arith_recip_ok( const int arith_recip, const int rans )
+{
+	if( !arith_recip ) return 1;
+#ifdef PEP_HAS_ARITH_RECIP
+	if( !rans ) return 1;
+	fprintf( stderr, "--arith-recip and --rans pick different coders\n" );
+#else
+	( void )rans;
+	fprintf( stderr, "--arith-recip needs a PEP.h with the reciprocal arithmetic coder\n" );
+#endif
+	return 0;
 }
 
 static int has_ext_ci( const char* const path, const char* const ext )
@@ -64,47 +137,1207 @@ static uint32_t make_color_rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a){
 	return ((uint32_t)r << 24) | ((uint32_t)g << 16) | ((uint32_t)b << 8) | (uint32_t)a;
 }
 
-int main(int argc, char** argv){
-	if(argc < 2){ print_usage(argv[0]); return 1; }
+#ifdef PEPR_USE_COREGRAPHICS
+static uint32_t* load_image_pixels_cg(const char* path, size_t* out_w, size_t* out_h){
+	CFStringRef pathStr = CFStringCreateWithCString(kCFAllocatorDefault, path, kCFStringEncodingUTF8);
+	if(!pathStr){ fprintf(stderr, "CFStringCreateWithCString failed\n"); return NULL; }
+	CFURLRef url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, pathStr, kCFURLPOSIXPathStyle, false);
+	CFRelease(pathStr);
+	if(!url){ fprintf(stderr, "CFURLCreateWithFileSystemPath failed\n"); return NULL; }
 
-	// Auto-mode: if first arg is not an option, infer conversion by extension
-	if( argv[1][0] != '-' )
+	CGImageSourceRef src = CGImageSourceCreateWithURL(url, NULL);
+	CFRelease(url);
+	if(!src){ fprintf(stderr, "CGImageSourceCreateWithURL failed\n"); return NULL; }
+	CGImageRef img = CGImageSourceCreateImageAtIndex(src, 0, NULL);
+	CFRelease(src);
+	if(!img){ fprintf(stderr, "CGImageSourceCreateImageAtIndex failed\n"); return NULL; }
+
+	size_t w = CGImageGetWidth(img);
+	size_t h = CGImageGetHeight(img);
+	if(w == 0 || h == 0){ CFRelease(img); fprintf(stderr, "invalid image size\n"); return NULL; }
+
+	const size_t bytesPerPixel = 4;
+	const size_t bytesPerRow = w * bytesPerPixel;
+	uint8_t* raw = (uint8_t*)malloc(h * bytesPerRow);
+	if(!raw){ CFRelease(img); fprintf(stderr, "alloc failed\n"); return NULL; }
+
+	CGColorSpaceRef cs = CGColorSpaceCreateDeviceRGB();
+	CGBitmapInfo info = kCGImageAlphaPremultipliedLast | kCGBitmapByteOrderDefault; // RGBA8
+	CGContextRef ctx = CGBitmapContextCreate(raw, w, h, 8, bytesPerRow, cs, info);
+	CGColorSpaceRelease(cs);
+	if(!ctx){ free(raw); CFRelease(img); fprintf(stderr, "CGBitmapContextCreate failed\n"); return NULL; }
+
+	CGRect rect = CGRectMake(0, 0, (CGFloat)w, (CGFloat)h);
+	CGContextDrawImage(ctx, rect, img);
+	CGContextRelease(ctx);
+	CFRelease(img);
+
+#ifdef PEP_HAS_BYTE_INPUT
+	// Swizzle the RGBA8 bytes to pep_rgba in place instead of copying them.
+	uint32_t* pixels = (uint32_t*)(void*)raw;
+	pep_swizzle(pixels, pixels, (uint64_t)w * h, pep_byte_format(pep_rgba8), pep_rgba);
+#else
+	uint32_t* pixels = (uint32_t*)malloc(w * h * sizeof(uint32_t));
+	if(!pixels){ free(raw); fprintf(stderr, "alloc failed\n"); return NULL; }
+	for(size_t i=0;i<w*h;i++){
+		uint8_t r = raw[i*4+0];
+		uint8_t g = raw[i*4+1];
+		uint8_t b = raw[i*4+2];
+		uint8_t a = raw[i*4+3];
+		pixels[i] = make_color_rgba(r,g,b,a);
+	}
+	free(raw);
+#endif
+	*out_w = w;
+	*out_h = h;
+	return pixels;
+}
+#endif
+
+// Loads an image file as packed RGBA pixels; prints the error and returns NULL on failure.
+// The .pep header limits each side: 12 bits before PEP_FLAG_WIDE_DIMS.
+#ifdef PEP_HAS_WIDE_DIMS
+#define PEPR_MAX_DIM PEP_MAX_DIMENSION
+#else
+#define PEPR_MAX_DIM 4095u
+#endif
+
+static int dims_fit_pep(size_t w, size_t h){
+	return w > 0 && h > 0 && w <= PEPR_MAX_DIM && h <= PEPR_MAX_DIM;
+}
+
+// Why a compress/load came back empty, when the header can say.
+static const char* pep_failure(const pep* p, const char* fallback){
+#ifdef PEP_HAS_WIDE_DIMS
+	if(p->error != pep_ok) return pep_error_string(p->error);
+#endif
+	(void)p;
+	return fallback;
+}
+
+static uint32_t* load_image_pixels(const char* path, size_t* out_w, size_t* out_h){
+	size_t size = 0;
+	uint8_t* data = pepr_read_file(path, &size);
+	if(!data){ fprintf(stderr, "failed to read %s\n", path); return NULL; }
+	const char* err = NULL;
+	uint32_t* pixels = pepr_image_decode(data, size, out_w, out_h, &err);
+	free(data);
+	if(pixels) return pixels;
+	if(err){ fprintf(stderr, "%s: %s\n", path, err); return NULL; }
+#ifdef PEPR_USE_COREGRAPHICS
+	return load_image_pixels_cg(path, out_w, out_h);
+#else
+	fprintf(stderr, "%s: unsupported image format (BMP, PNG, PPM/PAM and TGA are supported)\n", path);
+	return NULL;
+#endif
+}
+
+// Fills the 54-byte BITMAPFILEHEADER + BITMAPINFOHEADER of a 32-bit BGRA BMP;
+// the pixel rows follow at offset 54. top_down stores a negative height, so
+// rows run first to last instead of bottom-up.
+static void bmp32_header(unsigned char out[54], const uint32_t w, const uint32_t h, const int top_down){
+	const uint32_t rowBytes = w * 4u;
+	const uint32_t pixelBytes = rowBytes * h;
+	const uint32_t fileHeaderSize = 14;
+	const uint32_t infoHeaderSize = 40;
+	const uint32_t dataOffset = fileHeaderSize + infoHeaderSize;
+	const uint32_t fileSize = dataOffset + pixelBytes;
+	const uint32_t height = top_down ? (uint32_t)0 - h : h;
+
+	// BITMAPFILEHEADER (14 bytes)
+	unsigned char* bf = out;
+	bf[0] = 'B'; bf[1] = 'M';
+	bf[2] = (unsigned char)(fileSize & 0xFF);
+	bf[3] = (unsigned char)((fileSize >> 8) & 0xFF);
+	bf[4] = (unsigned char)((fileSize >> 16) & 0xFF);
+	bf[5] = (unsigned char)((fileSize >> 24) & 0xFF);
+	bf[6] = bf[7] = 0; // reserved1
+	bf[8] = bf[9] = 0; // reserved2
+	bf[10] = (unsigned char)(dataOffset & 0xFF);
+	bf[11] = (unsigned char)((dataOffset >> 8) & 0xFF);
+	bf[12] = (unsigned char)((dataOffset >> 16) & 0xFF);
+	bf[13] = (unsigned char)((dataOffset >> 24) & 0xFF);
+
+	// BITMAPINFOHEADER (40 bytes)
+	unsigned char* bi = out + 14;
+	memset(bi, 0, 40);
+	bi[0] = 40; // biSize
+	bi[4] = (unsigned char)(w & 0xFF);
+	bi[5] = (unsigned char)((w >> 8) & 0xFF);
+	bi[6] = (unsigned char)((w >> 16) & 0xFF);
+	bi[7] = (unsigned char)((w >> 24) & 0xFF);
+	// biHeight positive => bottom-up, negative => top-down
+	bi[8]  = (unsigned char)(height & 0xFF);
+	bi[9]  = (unsigned char)((height >> 8) & 0xFF);
+	bi[10] = (unsigned char)((height >> 16) & 0xFF);
+	bi[11] = (unsigned char)((height >> 24) & 0xFF);
+	bi[12] = 1; // planes
+	bi[14] = 32; // bitCount
+	bi[16] = 0; // BI_RGB (no compression)
+	bi[20] = (unsigned char)(pixelBytes & 0xFF);
+	bi[21] = (unsigned char)((pixelBytes >> 8) & 0xFF);
+	bi[22] = (unsigned char)((pixelBytes >> 16) & 0xFF);
+	bi[23] = (unsigned char)((pixelBytes >> 24) & 0xFF);
+	// 72 DPI ≈ 2835 pixels/meter
+	const uint32_t ppm = 2835;
+	bi[24] = (unsigned char)(ppm & 0xFF);
+	bi[25] = (unsigned char)((ppm >> 8) & 0xFF);
+	bi[26] = (unsigned char)((ppm >> 16) & 0xFF);
+	bi[27] = (unsigned char)((ppm >> 24) & 0xFF);
+	bi[28] = (unsigned char)(ppm & 0xFF);
+	bi[29] = (unsigned char)((ppm >> 8) & 0xFF);
+	bi[30] = (unsigned char)((ppm >> 16) & 0xFF);
+	bi[31] = (unsigned char)((ppm >> 24) & 0xFF);
+}
+
+static void write_bmp32_header(FILE* f, const uint32_t w, const uint32_t h, const int top_down){
+	unsigned char header[54];
+	bmp32_header(header, w, h, top_down);
+	fwrite(header, 1, sizeof(header), f);
+}
+
+#if !defined(PEP_HAS_STREAMING_DECODER) || !defined(PEP_HAS_BYTE_INPUT)
+// Emits one row of pep_rgba pixels as BGRA bytes.
+static void bmp32_row(unsigned char* dst, const uint32_t* src, const uint32_t w){
+	for(uint32_t x = 0; x < w; ++x){
+		uint32_t v = src[x]; // RGBA in bits 24..0
+		dst[x*4+0] = (unsigned char)((v >> 8) & 0xFF);  // b
+		dst[x*4+1] = (unsigned char)((v >> 16) & 0xFF); // g
+		dst[x*4+2] = (unsigned char)((v >> 24) & 0xFF); // r
+		dst[x*4+3] = (unsigned char)(v & 0xFF);         // a
+	}
+}
+#endif
+
+static int grow_row_buf(unsigned char** row_buf, size_t* row_cap, const size_t need){
+	if(*row_cap >= need) return 1;
+	unsigned char* grown = (unsigned char*)realloc(*row_buf, need);
+	if(!grown) return 0;
+	*row_buf = grown;
+	*row_cap = need;
+	return 1;
+}
+
+#ifndef PEP_HAS_STREAMING_DECODER
+// Writes pixels (pep_rgba) as a 32-bit BGRA BMP, bottom-up unless top_down.
+// The row buffer is grown as needed and left to the caller so repeated writes
+// can reuse it. Returns 0 on success, 3 if the file can't be written, 4 on
+// alloc failure.
+static int write_bmp32(const char* path, const uint32_t* pixels, const uint32_t w, const uint32_t h, const int top_down, unsigned char** row_buf, size_t* row_cap){
+	const uint32_t rowBytes = w * 4u;
+
+	FILE* f = fopen(path, "wb");
+	if(!f) return 3;
+	write_bmp32_header(f, w, h, top_down);
+
+	// Pixel data, emit BGRA bytes explicitly from RGBA value
+	if(!grow_row_buf(row_buf, row_cap, rowBytes)){ fclose(f); return 4; }
+	unsigned char* tmpRow = *row_buf;
+	for(uint32_t i = 0; i < h; ++i){
+		const uint32_t y = top_down ? i : h - 1 - i;
+		bmp32_row(tmpRow, pixels + (size_t)y * w, w);
+		fwrite(tmpRow, 1, rowBytes, f);
+	}
+
+	return fclose(f) == 0 ? 0 : 3;
+}
+#endif
+
+// Rows per step when streaming pixels through the decoder or encoder.
+#define PEPR_STREAM_ROWS 64
+
+#ifdef PEP_HAS_STREAMING_DECODER
+
+// Same output as write_bmp32, but pulls the image out of an initialized
+// decoder a block of rows at a time, so only PEPR_STREAM_ROWS rows are ever
+// held. A bottom-up BMP gets each block flipped and written at its place from
+// the end of the file; a top_down one is written straight through. Returns 0,
+// 2 on a decode error, 3 or 4.
+static int write_bmp32_stream(const char* path, pep_decoder* dec, const int top_down, unsigned char** row_buf, size_t* row_cap){
+	const uint32_t w = dec->info.width;
+	const uint32_t h = dec->info.height;
+	const size_t rowBytes = (size_t)w * 4u;
+	const uint32_t block = h < PEPR_STREAM_ROWS ? h : PEPR_STREAM_ROWS;
+
+	// Decoded pixels and the flipped block share one buffer.
+	if(!grow_row_buf(row_buf, row_cap, rowBytes * block * 2)) return 4;
+	uint32_t* pixels = (uint32_t*)*row_buf;
+	unsigned char* out = *row_buf + rowBytes * block;
+
+	FILE* f = fopen(path, "wb");
+	if(!f) return 3;
+	write_bmp32_header(f, w, h, top_down);
+
+	int rc = 0;
+	while(dec->rows_read < h){
+		const uint32_t y0 = dec->rows_read;
+#ifdef PEP_HAS_BYTE_INPUT
+		// The decoder's palette is swizzled once, so rows arrive as BGRA bytes.
+		const uint32_t n = pep_decoder_read_rows(dec, pixels, block, pep_byte_format(pep_bgra8), 0);
+		if(n == 0){ rc = 2; break; }
+		if(top_down){
+			if(fwrite(pixels, rowBytes, n, f) != n){ rc = 3; break; }
+			continue;
+		}
+		for(uint32_t i = 0; i < n; ++i) memcpy(out + (size_t)(n - 1 - i) * rowBytes, pixels + (size_t)i * w, rowBytes);
+#else
+		const uint32_t n = pep_decoder_read_rows(dec, pixels, block, pep_rgba, 0);
+		if(n == 0){ rc = 2; break; }
+		for(uint32_t i = 0; i < n; ++i) bmp32_row(out + (size_t)(top_down ? i : n - 1 - i) * rowBytes, pixels + (size_t)i * w, w);
+		if(top_down){
+			if(fwrite(out, rowBytes, n, f) != n){ rc = 3; break; }
+			continue;
+		}
+#endif
+		if(fseek(f, (long)(54 + (uint64_t)(h - y0 - n) * rowBytes), SEEK_SET) != 0 || fwrite(out, rowBytes, n, f) != n){ rc = 3; break; }
+	}
+
+	if(fclose(f) != 0 && rc == 0) rc = 3;
+	return rc;
+}
+#endif
+
+static long core_count(void){
+	const long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+#ifdef PEP_HAS_STRIPES
+typedef struct {
+	uint32_t count;
+	uint32_t next;
+	pthread_mutex_t lock;
+	void (*task)(void*, const uint32_t);
+	void* task_data;
+} parallel_job;
+
+static void* parallel_worker(void* arg){
+	parallel_job* job = (parallel_job*)arg;
+	for(;;){
+		pthread_mutex_lock(&job->lock);
+		const uint32_t i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if(i >= job->count) return NULL;
+		job->task(job->task_data, i);
+	}
+}
+
+// pep_parallel_for over short-lived pthreads, one per core (the caller is one of them).
+static void pthread_parallel_for(void* user, const uint32_t count, void (*task)(void*, const uint32_t), void* task_data){
+	(void)user;
+	parallel_job job = { count, 0, PTHREAD_MUTEX_INITIALIZER, task, task_data };
+	pthread_t tids[64];
+	long threads = core_count() - 1;
+	if(threads > 63) threads = 63;
+	if(threads > (long)count - 1) threads = (long)count - 1;
+	long started = 0;
+	while(started < threads && pthread_create(&tids[started], NULL, parallel_worker, &job) == 0) started++;
+	parallel_worker(&job);
+	for(long t = 0; t < started; t++) pthread_join(tids[t], NULL);
+	pthread_mutex_destroy(&job.lock);
+}
+#endif
+
+#ifdef PEP_HAS_DECOMPRESS_INTO
+// Largest pixel payload write_bmp32_direct holds in memory; bigger images stream.
+#define PEPR_BMP_DIRECT_MAX ((uint64_t)512 << 20)
+
+static int bmp32_direct_fits(const uint32_t w, const uint32_t h){
+	return (uint64_t)w * h * 4u <= PEPR_BMP_DIRECT_MAX;
+}
+
+// Same output as write_bmp32, built whole in *file_buf and written with a
+// single unbuffered fwrite. The decoder writes BGRA (its palette is swizzled
+// once, not every pixel) straight into the file image, rows flipped unless
+// top_down, so there is no conversion pass. ctx decodes on the calling thread;
+// without one the stripes go through run. Returns 0, 2 on a decode error, 3 or 4.
+static int write_bmp32_direct(const char* path, const pep* p, const int top_down, pep_codec_ctx* ctx, pep_parallel_for run, unsigned char** file_buf, size_t* file_cap){
+	const uint32_t w = p->width;
+	const uint32_t h = p->height;
+	const size_t pixelBytes = (size_t)w * h * 4u;
+
+	// The header starts 2 bytes in so the pixels at offset 54 are 4-byte aligned.
+	if(!grow_row_buf(file_buf, file_cap, 2 + 54 + pixelBytes)) return 4;
+	unsigned char* file = *file_buf + 2;
+	bmp32_header(file, w, h, top_down);
+	uint32_t* pixels = (uint32_t*)(file + 54);
+	const pep_format bgra = pep_byte_format(pep_bgra8);
+	const uint8_t ok = ctx ? pep_decompress_into_ctx(ctx, p, pixels, (uint64_t)w * 4u, 0, 0, bgra, 0, !top_down)
+		: pep_decompress_into_parallel(p, pixels, (uint64_t)w * 4u, 0, 0, bgra, 0, !top_down, run, NULL);
+	if(!ok) return 2;
+
+	FILE* f = fopen(path, "wb");
+	if(!f) return 3;
+	setvbuf(f, NULL, _IONBF, 0);
+	int rc = fwrite(file, 1, 54 + pixelBytes, f) == 54 + pixelBytes ? 0 : 3;
+	if(fclose(f) != 0) rc = 3;
+	return rc;
+}
+#endif
+
+/////// /////// /////// /////// /////// /////// ///////
+// Batch mode: many conversions in one process, spread over a thread pool.
+
+typedef struct {
+	char* in;
+	char* out;
+} batch_job;
+
+typedef struct {
+	batch_job* jobs;
+	size_t count;
+	size_t cap;
+} batch_list;
+
+typedef struct {
+	batch_list* list;
+	size_t* next;
+	pthread_mutex_t* lock;
+	uint16_t stripe_rows;
+	int top_down;
+#ifdef PEP_HAS_CODEC_CTX
+	pep_codec_ctx* ctx;
+#endif
+	// Reused across files
+	uint8_t* io;
+	size_t io_cap;
+	unsigned char* row;
+	size_t row_cap;
+	// Totals
+	size_t done;
+	size_t failed;
+	uint64_t in_bytes;
+	uint64_t out_bytes;
+} batch_worker;
+
+static double now_seconds(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int is_batch_image( const char* const path )
+{
+	static const char* const exts[] = { ".png", ".bmp", ".ppm", ".pgm", ".pnm", ".pam", ".tga",
+#ifdef PEPR_USE_COREGRAPHICS
+		".tif", ".tiff", ".gif", ".jpg", ".jpeg",
+#endif
+	};
+	for( size_t i = 0; i < sizeof( exts ) / sizeof( exts[ 0 ] ); i++ ) if( has_ext_ci( path, exts[ i ] ) ) return 1;
+	return 0;
+}
+
+// Queues in_path; out_path may be NULL to derive it from the input (.pep -> .bmp, else -> .pep),
+// placed in out_dir when one is given.
+static int batch_add( batch_list* const list, const char* const in_path, const char* const out_path, const char* const out_dir )
+{
+	if( list->count == list->cap )
 	{
-		const char* in_path = argv[1];
-		const char* out_path = ( argc >= 3 ) ? argv[ 2 ] : NULL;
-		if( has_ext_ci( in_path, ".pep" ) )
+		size_t cap = list->cap ? list->cap * 2 : 64;
+		batch_job* grown = ( batch_job* )realloc( list->jobs, cap * sizeof( batch_job ) );
+		if( !grown ) return 0;
+		list->jobs = grown;
+		list->cap = cap;
+	}
+	char* in = strdup( in_path );
+	char* out = out_path ? strdup( out_path ) : derive_out_path( in_path, has_ext_ci( in_path, ".pep" ) ? ".bmp" : ".pep" );
+	if( out && !out_path && out_dir )
+	{
+		const char* base = strrchr( out, '/' );
+		base = base ? base + 1 : out;
+		size_t dir_len = strlen( out_dir ), base_len = strlen( base );
+		char* joined = ( char* ) malloc( dir_len + 1 + base_len + 1 );
+		if( joined )
 		{
-			if( out_path == NULL )
-			{
-				char* derived = derive_out_path( in_path, ".bmp" );
-				if( !derived ){ fprintf(stderr, "alloc failed\n"); return 1; }
-				argv[2] = derived;
-				argc = 3;
-			}
-			else
-			{
-				argc = 3;
-			}
-			argv[1] = "--to-bmp";
+			memcpy( joined, out_dir, dir_len );
+			joined[ dir_len ] = '/';
+			memcpy( joined + dir_len + 1, base, base_len + 1 );
+		}
+		free( out );
+		out = joined;
+	}
+	if( !in || !out ){ free( in ); free( out ); return 0; }
+	list->jobs[ list->count ].in = in;
+	list->jobs[ list->count ].out = out;
+	list->count++;
+	return 1;
+}
+
+static int batch_job_cmp( const void* a, const void* b )
+{
+	return strcmp( ( ( const batch_job* )a )->in, ( ( const batch_job* )b )->in );
+}
+
+// Adds every image (or every .pep when to_bmp) directly inside dir, sorted by name.
+static int batch_add_dir( batch_list* const list, const char* const dir, const int to_bmp, const char* const out_dir )
+{
+	DIR* d = opendir( dir );
+	if( !d ) return 0;
+	const size_t first = list->count;
+	const size_t dir_len = strlen( dir );
+	struct dirent* e;
+	int ok = 1;
+	while( ok && ( e = readdir( d ) ) != NULL )
+	{
+		if( e->d_name[ 0 ] == '.' ) continue;
+		if( to_bmp ? !has_ext_ci( e->d_name, ".pep" ) : !is_batch_image( e->d_name ) ) continue;
+		size_t name_len = strlen( e->d_name );
+		char* path = ( char* ) malloc( dir_len + 1 + name_len + 1 );
+		if( !path ){ ok = 0; break; }
+		memcpy( path, dir, dir_len );
+		path[ dir_len ] = '/';
+		memcpy( path + dir_len + 1, e->d_name, name_len + 1 );
+		struct stat st;
+		if( stat( path, &st ) == 0 && S_ISREG( st.st_mode ) ) ok = batch_add( list, path, NULL, out_dir );
+		free( path );
+	}
+	closedir( d );
+	qsort( list->jobs + first, list->count - first, sizeof( batch_job ), batch_job_cmp );
+	return ok;
+}
+
+// Manifest: one input per line, optionally followed by a tab and an output path.
+// Blank lines and lines starting with '#' are skipped; "-" reads stdin.
+static int batch_add_manifest( batch_list* const list, const char* const path, const char* const out_dir )
+{
+	FILE* f = strcmp( path, "-" ) == 0 ? stdin : fopen( path, "r" );
+	if( !f ) return 0;
+	char line[ 4096 ];
+	int ok = 1;
+	while( ok && fgets( line, sizeof( line ), f ) )
+	{
+		size_t len = strlen( line );
+		while( len && ( line[ len - 1 ] == '\n' || line[ len - 1 ] == '\r' ) ) line[ --len ] = '\0';
+		if( !len || line[ 0 ] == '#' ) continue;
+		char* tab = strchr( line, '\t' );
+		if( tab ) *tab++ = '\0';
+		ok = batch_add( list, line, ( tab && *tab ) ? tab : NULL, out_dir );
+	}
+	if( f != stdin ) fclose( f );
+	return ok;
+}
+
+// Converts one job using the worker's buffers and codec state.
+// Returns NULL on success or a short error message.
+static const char* batch_convert( batch_worker* const wk, const batch_job* const job, uint32_t* out_w, uint32_t* out_h, size_t* in_size, size_t* out_size )
+{
+	if( !pepr_read_file_into( job->in, &wk->io, &wk->io_cap, in_size ) ) return "cannot read input";
+
+	if( has_ext_ci( job->in, ".pep" ) )
+	{
+#ifdef PEP_HAS_DECOMPRESS_INTO
+		pep view = pep_deserialize_view( wk->io, *in_size );
+		if( view.bytes != NULL && view.bytes_size != 0 && view.width != 0 && view.height != 0 && bmp32_direct_fits( view.width, view.height ) )
+		{
+			*out_w = view.width;
+			*out_h = view.height;
+			const int rc = write_bmp32_direct( job->out, &view, wk->top_down, wk->ctx, NULL, &wk->row, &wk->row_cap );
+			pep_free( &view );
+			if( rc ) return rc == 2 ? "decompress failed" : rc == 3 ? "cannot write output" : "alloc failed";
+			*out_size = 54 + ( size_t )*out_w * *out_h * 4;
+			return NULL;
+		}
+		pep_free( &view );
+#endif
+#ifdef PEP_HAS_STREAMING_DECODER
+		pep_decoder dec;
+		if( !pep_decoder_init_bytes( &dec, wk->ctx, wk->io, *in_size ) )
+		{
+			const char* err = pep_failure( &dec.info, "not a valid .pep" );
+			pep_decoder_free( &dec );
+			return err;
+		}
+		*out_w = dec.info.width;
+		*out_h = dec.info.height;
+		const int rc = write_bmp32_stream( job->out, &dec, wk->top_down, &wk->row, &wk->row_cap );
+		const char* err = rc == 2 ? pep_failure( &dec.info, "decompress failed" ) : rc == 3 ? "cannot write output" : "alloc failed";
+		pep_decoder_free( &dec );
+		if( rc ) return err;
+		*out_size = 54 + ( size_t )*out_w * *out_h * 4;
+		return NULL;
+#else
+		pep p = pep_deserialize( wk->io );
+		if( p.bytes == NULL || p.bytes_size == 0 || p.width == 0 || p.height == 0 ){ pep_free( &p ); return pep_failure( &p, "not a valid .pep" ); }
+#ifdef PEP_HAS_CODEC_CTX
+		uint32_t* pixels = pep_decompress_ctx( wk->ctx, &p, pep_rgba, 0 );
+#else
+		uint32_t* pixels = pep_decompress( &p, pep_rgba, 0 );
+#endif
+		*out_w = p.width;
+		*out_h = p.height;
+		pep_free( &p );
+		if( !pixels ) return "decompress failed";
+		const int rc = write_bmp32( job->out, pixels, *out_w, *out_h, wk->top_down, &wk->row, &wk->row_cap );
+		free( pixels );
+		if( rc ) return rc == 3 ? "cannot write output" : "alloc failed";
+		*out_size = 54 + ( size_t )*out_w * *out_h * 4;
+		return NULL;
+#endif
+	}
+
+	size_t w = 0, h = 0;
+	const char* err = NULL;
+	uint32_t* pixels = pepr_image_decode( wk->io, *in_size, &w, &h, &err );
+#ifdef PEPR_USE_COREGRAPHICS
+	if( !pixels && !err ) pixels = load_image_pixels_cg( job->in, &w, &h );
+#endif
+	if( !pixels ) return err ? err : "unsupported image format";
+	if( !dims_fit_pep( w, h ) ){ free( pixels ); return "image too large for .pep"; }
+	*out_w = ( uint32_t )w;
+	*out_h = ( uint32_t )h;
+#if defined(PEP_HAS_STRIPES)
+	pep p = pep_compress_striped_ctx( wk->ctx, pixels, ( uint32_t )w, ( uint32_t )h, pep_rgba, pep_rgba, wk->stripe_rows, NULL, NULL );
+#elif defined(PEP_HAS_CODEC_CTX)
+	pep p = pep_compress_ctx( wk->ctx, pixels, ( uint32_t )w, ( uint32_t )h, pep_rgba, pep_rgba );
+#else
+	pep p = pep_compress( pixels, ( uint32_t )w, ( uint32_t )h, pep_rgba, pep_rgba );
+#endif
+	free( pixels );
+	if( p.bytes == NULL || p.bytes_size == 0 ){ pep_free( &p ); return pep_failure( &p, ".pep compression failed" ); }
+	uint32_t bytes_size = 0;
+	uint8_t* bytes = pep_serialize( &p, &bytes_size );
+	pep_free( &p );
+	if( !bytes ) return "serialize failed";
+	FILE* f = fopen( job->out, "wb" );
+	int written = f && fwrite( bytes, 1, bytes_size, f ) == bytes_size;
+	if( f && fclose( f ) != 0 ) written = 0;
+	free( bytes );
+	if( !written ) return "cannot write output";
+	*out_size = bytes_size;
+	return NULL;
+}
+
+static void* batch_worker_main( void* arg )
+{
+	batch_worker* const wk = ( batch_worker* )arg;
+	for( ;; )
+	{
+		pthread_mutex_lock( wk->lock );
+		const size_t i = ( *wk->next )++;
+		pthread_mutex_unlock( wk->lock );
+		if( i >= wk->list->count ) break;
+
+		const batch_job* job = &wk->list->jobs[ i ];
+		uint32_t w = 0, h = 0;
+		size_t in_size = 0, out_size = 0;
+		const double t0 = now_seconds();
+		const char* err = batch_convert( wk, job, &w, &h, &in_size, &out_size );
+		const double ms = ( now_seconds() - t0 ) * 1e3;
+
+		pthread_mutex_lock( wk->lock );
+		if( err ){
+			wk->failed++;
+			fprintf( stderr, "FAIL %s: %s\n", job->in, err );
+		}else{
+			wk->done++;
+			wk->in_bytes += in_size;
+			wk->out_bytes += out_size;
+			printf( "%s -> %s  %ux%u  %zu -> %zu bytes  %.3f ms\n", job->in, job->out, w, h, in_size, out_size, ms );
 		}
-		else
+		pthread_mutex_unlock( wk->lock );
+	}
+	return NULL;
+}
+
+static int batch_out_cmp( const void* a, const void* b )
+{
+	return strcmp( ( *( const batch_job* const* )a )->out, ( *( const batch_job* const* )b )->out );
+}
+
+// Two jobs writing the same file (a.png and a.bmp both make a.pep) would race
+// and one result would be lost, so that's refused up front, naming each pair.
+// Returns 0 when every output is distinct, 1 if not, 4 on alloc failure.
+static int batch_check_outputs( const batch_list* const list )
+{
+	const batch_job** by_out = ( const batch_job** )malloc( list->count * sizeof( *by_out ) );
+	if( !by_out ){ fprintf( stderr, "alloc failed\n" ); return 4; }
+	for( size_t i = 0; i < list->count; i++ ) by_out[ i ] = &list->jobs[ i ];
+	qsort( by_out, list->count, sizeof( *by_out ), batch_out_cmp );
+	int rc = 0;
+	for( size_t i = 1; i < list->count; i++ )
+	{
+		if( strcmp( by_out[ i - 1 ]->out, by_out[ i ]->out ) != 0 ) continue;
+		fprintf( stderr, "--batch: %s and %s both write %s\n", by_out[ i - 1 ]->in, by_out[ i ]->in, by_out[ i ]->out );
+		rc = 1;
+	}
+	free( by_out );
+	return rc;
+}
+
+// Frees the job list and whatever of the workers was set up; workers and
+// tids may be NULL.
+static void batch_free( batch_list* const list, batch_worker* const workers, pthread_t* const tids, const long threads )
+{
+	for( long t = 0; workers && t < threads; t++ )
+	{
+#ifdef PEP_HAS_CODEC_CTX
+		pep_codec_ctx_destroy( workers[ t ].ctx );
+#endif
+		free( workers[ t ].io );
+		free( workers[ t ].row );
+	}
+	free( tids );
+	free( workers );
+	for( size_t i = 0; i < list->count; i++ ){ free( list->jobs[ i ].in ); free( list->jobs[ i ].out ); }
+	free( list->jobs );
+}
+
+// pepr --batch [-j N] [--out-dir DIR] [--to-bmp] [--top-down] [--manifest FILE] [--stripe-rows N] [--sort-palette] [--rans] [--rans-states N] [--arith-recip] [inputs...]
+static int run_batch( int argc, char** argv )
+{
+	batch_list list = { 0 };
+	const char* out_dir = NULL;
+	const char* manifest = NULL;
+	long threads = 0;
+	long stripe_rows = 0;
+	int to_bmp = 0;
+	int top_down = 0;
+	int sort_palette = 0;
+	int rans = 0;
+	long rans_states = 0;
+	int arith_recip = 0;
+	int arg = 2;
+	for( ; arg < argc && argv[ arg ][ 0 ] == '-' && argv[ arg ][ 1 ]; arg++ )
+	{
+		if( strcmp( argv[ arg ], "-j" ) == 0 && arg + 1 < argc ) threads = atol( argv[ ++arg ] );
+		else if( strcmp( argv[ arg ], "--out-dir" ) == 0 && arg + 1 < argc ) out_dir = argv[ ++arg ];
+		else if( strcmp( argv[ arg ], "--manifest" ) == 0 && arg + 1 < argc ) manifest = argv[ ++arg ];
+		else if( strcmp( argv[ arg ], "--to-bmp" ) == 0 ) to_bmp = 1;
+		else if( strcmp( argv[ arg ], "--top-down" ) == 0 ) top_down = 1;
+		else if( strcmp( argv[ arg ], "--stripe-rows" ) == 0 && arg + 1 < argc ) stripe_rows = atol( argv[ ++arg ] );
+		else if( strcmp( argv[ arg ], "--sort-palette" ) == 0 ) sort_palette = 1;
+		else if( strcmp( argv[ arg ], "--rans" ) == 0 ) rans = 1;
+		else if( strcmp( argv[ arg ], "--rans-states" ) == 0 && arg + 1 < argc ){ rans = 1; rans_states = atol( argv[ ++arg ] ); }
+		else if( strcmp( argv[ arg ], "--arith-recip" ) == 0 ) arith_recip = 1;
+		else if( strcmp( argv[ arg ], "--" ) == 0 ){ arg++; break; }
+		else { fprintf( stderr, "unknown --batch option %s\n", argv[ arg ] ); return 1; }
+	}
+
+	if( stripe_rows < 0 || stripe_rows > 0xFFFF ){ fprintf( stderr, "--stripe-rows must be 0..65535\n" ); return 1; }
+#ifndef PEP_HAS_ENCODE_OPTIONS
+	if( sort_palette ){ fprintf( stderr, "--sort-palette needs a PEP.h with encode options\n" ); return 1; }
+#endif
+#ifndef PEP_HAS_RANS
+	if( rans ){ fprintf( stderr, "--rans needs a PEP.h with the rANS coder\n" ); return 1; }
+#endif
+	if( !rans_states_ok( rans_states ) ) return 1;
+	if( !arith_recip_ok( arith_recip, rans ) ) return 1;
+
+	if( manifest && !batch_add_manifest( &list, manifest, out_dir ) ){ fprintf( stderr, "cannot read manifest %s\n", manifest ); batch_free( &list, NULL, NULL, 0 ); return 1; }
+	for( ; arg < argc; arg++ )
+	{
+		struct stat st;
+		const int is_dir = stat( argv[ arg ], &st ) == 0 && S_ISDIR( st.st_mode );
+		const int ok = is_dir ? batch_add_dir( &list, argv[ arg ], to_bmp, out_dir ) : batch_add( &list, argv[ arg ], NULL, out_dir );
+		if( !ok ){ fprintf( stderr, "cannot add %s\n", argv[ arg ] ); batch_free( &list, NULL, NULL, 0 ); return 1; }
+	}
+	if( list.count == 0 ){ fprintf( stderr, "--batch: no inputs\n" ); batch_free( &list, NULL, NULL, 0 ); return 1; }
+	const int outputs_rc = batch_check_outputs( &list );
+	if( outputs_rc ){ batch_free( &list, NULL, NULL, 0 ); return outputs_rc; }
+
+	if( threads <= 0 ) threads = core_count();
+#ifndef PEP_HAS_CODEC_CTX
+	threads = 1; // this PEP.h keeps its coder state in statics
+#endif
+	if( ( size_t )threads > list.count ) threads = ( long )list.count;
+
+	pthread_mutex_t lock;
+	size_t next = 0;
+	batch_worker* workers = ( batch_worker* )calloc( ( size_t )threads, sizeof( batch_worker ) );
+	pthread_t* tids = ( pthread_t* )calloc( ( size_t )threads, sizeof( pthread_t ) );
+	if( !workers || !tids ){ fprintf( stderr, "alloc failed\n" ); batch_free( &list, workers, tids, threads ); return 4; }
+
+	for( long t = 0; t < threads; t++ )
+	{
+		workers[ t ].list = &list;
+		workers[ t ].next = &next;
+		workers[ t ].lock = &lock;
+		workers[ t ].stripe_rows = ( uint16_t )stripe_rows;
+		workers[ t ].top_down = top_down;
+#ifdef PEP_HAS_CODEC_CTX
+		workers[ t ].ctx = pep_codec_ctx_create();
+		if( !workers[ t ].ctx ){ fprintf( stderr, "alloc failed\n" ); batch_free( &list, workers, tids, threads ); return 4; }
+#endif
+#ifdef PEP_HAS_ENCODE_OPTIONS
+		if( sort_palette ) workers[ t ].ctx->options.palette_order = pep_palette_by_count;
+#endif
+#ifdef PEP_HAS_RANS
+		if( rans ) workers[ t ].ctx->options.coder = pep_coder_rans;
+#endif
+#ifdef PEP_HAS_RANS_STATES
+		if( rans_states ) workers[ t ].ctx->options.rans_states = ( uint8_t )rans_states;
+#endif
+#ifdef PEP_HAS_ARITH_RECIP
+		if( arith_recip ) workers[ t ].ctx->options.coder = pep_coder_arith_recip;
+#endif
+	}
+
+	// The calling thread runs the last worker; if a thread can't be started,
+	// its share just goes to the ones that did.
+	pthread_mutex_init( &lock, NULL );
+	const double t0 = now_seconds();
+	long started = 0;
+	while( started < threads - 1 && pthread_create( &tids[ started ], NULL, batch_worker_main, &workers[ started ] ) == 0 ) started++;
+	batch_worker_main( &workers[ threads - 1 ] );
+	for( long t = 0; t < started; t++ ) pthread_join( tids[ t ], NULL );
+	const double elapsed = now_seconds() - t0;
+
+	size_t done = 0, failed = 0;
+	uint64_t in_bytes = 0, out_bytes = 0;
+	for( long t = 0; t < threads; t++ )
+	{
+		done += workers[ t ].done;
+		failed += workers[ t ].failed;
+		in_bytes += workers[ t ].in_bytes;
+		out_bytes += workers[ t ].out_bytes;
+	}
+	printf( "batch: %zu converted, %zu failed, %ld threads, %.3f s (%.1f files/s), %llu -> %llu bytes\n",
+		done, failed, started + 1, elapsed, elapsed > 0 ? ( double )( done + failed ) / elapsed : 0.0,
+		( unsigned long long )in_bytes, ( unsigned long long )out_bytes );
+
+	pthread_mutex_destroy( &lock );
+	batch_free( &list, workers, tids, threads );
+	return failed ? 2 : 0;
+}
+
+// --profile: where one image's time goes, and how often the coder takes its
+// slow paths. Needs a PEP_PROFILE build (make PROFILE=1). Everything runs
+// serially in one codec context so all of it is counted there.
+#ifdef PEP_HAS_PROFILE
+typedef struct
+{
+	double read_ms; // reading the input file
+	double input_ms; // decoding it to pixels (the codec's share is in decode)
+	double serialize_ms;
+	double write_ms; // writing the .pep to a temporary file
+	pep_profile decode; // .pep inputs only
+	pep_profile encode;
+	int decode_rans; // the rANS coder has no escapes, rescales or scans
+	int encode_rans;
+} profile_report;
+
+static void json_string( const char* s )
+{
+	putchar( '"' );
+	for( ; *s; s++ )
+	{
+		if( *s == '"' || *s == '\\' ) printf( "\\%c", *s );
+		else if( ( unsigned char )*s < 0x20 ) printf( "\\u%04x", ( unsigned )( unsigned char )*s );
+		else putchar( *s );
+	}
+	putchar( '"' );
+}
+
+// The escape, rescale and scan counters are the adaptive model's; with rANS
+// they're printed as not applicable rather than as zeroes.
+static void profile_print_counters( const char* const name, const pep_profile* const p, const int rans, const int json )
+{
+	const double escape_rate = p->symbols ? ( double )p->escapes / ( double )p->symbols : 0.0;
+	const double scan_avg = p->scans ? ( double )p->scan_length / ( double )p->scans : 0.0;
+	if( rans )
+	{
+		if( json ) printf( ", \"%s\": { \"symbols\": %llu, \"escapes\": null, \"escape_rate\": null, \"rescales\": null, \"scans\": null, \"scan_avg\": null }", name, ( unsigned long long )p->symbols );
+		else printf( "  %-8s symbols %llu, escapes/rescales/scans n/a (rANS)\n", name, ( unsigned long long )p->symbols );
+	}
+	else if( json )
+	{
+		printf( ", \"%s\": { \"symbols\": %llu, \"escapes\": %llu, \"escape_rate\": %.4f, \"rescales\": %llu, \"scans\": %llu, \"scan_avg\": %.2f }",
+			name, ( unsigned long long )p->symbols, ( unsigned long long )p->escapes, escape_rate,
+			( unsigned long long )p->rescales, ( unsigned long long )p->scans, scan_avg );
+	}
+	else
+	{
+		printf( "  %-8s symbols %llu, escapes %llu (%.1f%%), rescales %llu, scans %llu (avg %.1f)\n",
+			name, ( unsigned long long )p->symbols, ( unsigned long long )p->escapes, escape_rate * 100.0,
+			( unsigned long long )p->rescales, ( unsigned long long )p->scans, scan_avg );
+	}
+}
+
+static void profile_print( const char* const path, const pep* const p, const uint32_t out_size, const profile_report* const r, const int json, const int first )
+{
+	const pep_profile* const e = &r->encode;
+	if( json )
+	{
+		printf( "%s  { \"file\": ", first ? "" : ",\n" );
+		json_string( path );
+		printf( ", \"width\": %u, \"height\": %u, \"colors\": %u, \"bytes\": %u", p->width, p->height, p->palette_size, out_size );
+		printf( ", \"ms\": { \"read\": %.3f, \"input\": %.3f, \"decode\": %.3f, \"palette\": %.3f, \"code\": %.3f, \"output\": %.3f, \"serialize\": %.3f, \"write\": %.3f }",
+			r->read_ms, r->input_ms, r->decode.decode_ns * 1e-6, e->palette_ns * 1e-6, e->code_ns * 1e-6, e->output_ns * 1e-6, r->serialize_ms, r->write_ms );
+		profile_print_counters( "encode", e, r->encode_rans, 1 );
+		if( r->decode.symbols ) profile_print_counters( "decode", &r->decode, r->decode_rans, 1 );
+		printf( " }" );
+		return;
+	}
+	printf( "%s: %ux%u, %u colors, %u bytes\n", path, p->width, p->height, p->palette_size, out_size );
+	printf( "  ms       read %.3f, input %.3f", r->read_ms, r->input_ms );
+	if( r->decode.symbols ) printf( " (decode %.3f)", r->decode.decode_ns * 1e-6 );
+	printf( ", palette %.3f, code %.3f, output %.3f, serialize %.3f, write %.3f\n",
+		e->palette_ns * 1e-6, e->code_ns * 1e-6, e->output_ns * 1e-6, r->serialize_ms, r->write_ms );
+	profile_print_counters( "encode", e, r->encode_rans, 0 );
+	if( r->decode.symbols ) profile_print_counters( "decode", &r->decode, r->decode_rans, 0 );
+}
+
+// Profiles one input: read, decode to pixels, compress, serialize, write.
+// Returns 0 on success.
+// Zeroes the counters for the next phase, keeping the encode options.
+static void profile_reset( pep_codec_ctx* const ctx )
+{
+#ifdef PEP_HAS_ENCODE_OPTIONS
+	const pep_encode_options options = ctx->options;
+	pep_codec_ctx_reset( ctx );
+	ctx->options = options;
+#else
+	pep_codec_ctx_reset( ctx );
+#endif
+}
+
+static int profile_one( pep_codec_ctx* const ctx, const char* const path, const uint16_t stripe_rows, const int json, const int first )
+{
+	profile_report r;
+	memset( &r, 0, sizeof( r ) );
+
+	double t0 = now_seconds();
+	size_t size = 0;
+	uint8_t* data = pepr_read_file( path, &size );
+	r.read_ms = ( now_seconds() - t0 ) * 1e3;
+	if( !data ){ fprintf( stderr, "failed to read %s\n", path ); return 1; }
+
+	t0 = now_seconds();
+	uint32_t* pixels = NULL;
+	size_t w = 0, h = 0;
+	if( has_ext_ci( path, ".pep" ) )
+	{
+		pep src = pep_deserialize( data );
+		profile_reset( ctx );
+		if( src.bytes ) pixels = pep_decompress_ctx( ctx, &src, pep_rgba, 0 );
+		if( !pixels ) fprintf( stderr, "%s: %s\n", path, pep_failure( &src, "not a valid .pep" ) );
+		w = src.width;
+		h = src.height;
+		r.decode = ctx->profile;
+		r.decode_rans = src.coder == pep_coder_rans;
+		pep_free( &src );
+	}
+	else
+	{
+		const char* err = NULL;
+		pixels = pepr_image_decode( data, size, &w, &h, &err );
+		if( !pixels && err ) fprintf( stderr, "%s: %s\n", path, err );
+		else if( !pixels ) pixels = load_image_pixels( path, &w, &h );
+	}
+	r.input_ms = ( now_seconds() - t0 ) * 1e3;
+	free( data );
+	if( !pixels ) return 1;
+	if( !dims_fit_pep( w, h ) ){ fprintf( stderr, "%s: %zux%zu is too large for .pep (max %u per side)\n", path, w, h, ( unsigned )PEPR_MAX_DIM ); free( pixels ); return 1; }
+
+	profile_reset( ctx );
+	pep p = pep_compress_striped_ctx( ctx, pixels, ( uint32_t )w, ( uint32_t )h, pep_rgba, pep_rgba, stripe_rows, NULL, NULL );
+	free( pixels );
+	r.encode = ctx->profile;
+	r.encode_rans = p.coder == pep_coder_rans;
+	if( p.bytes == NULL || p.bytes_size == 0 ){ fprintf( stderr, "%s: %s\n", path, pep_failure( &p, ".pep compression failed" ) ); return 2; }
+
+	t0 = now_seconds();
+	uint32_t out_size = 0;
+	uint8_t* bytes = pep_serialize( &p, &out_size );
+	r.serialize_ms = ( now_seconds() - t0 ) * 1e3;
+	if( !bytes ){ fprintf( stderr, "alloc failed\n" ); pep_free( &p ); return 4; }
+
+	// A real file, so the write goes through the filesystem; it's removed on close.
+	t0 = now_seconds();
+	FILE* out = tmpfile();
+	const int written = out && fwrite( bytes, 1, out_size, out ) == out_size && fflush( out ) == 0;
+	if( out ) fclose( out );
+	r.write_ms = ( now_seconds() - t0 ) * 1e3;
+	free( bytes );
+	if( !written ){ fprintf( stderr, "%s: cannot write temporary file\n", path ); pep_free( &p ); return 3; }
+
+	profile_print( path, &p, out_size, &r, json, first );
+	pep_free( &p );
+	return 0;
+}
+#endif
+
+#ifdef PEP_HAS_MODEL_TUNING
+// --best: the image is encoded once per candidate setting of the coder's model
+// (see "Model tuning" in PEP.h) and palette order, spread over
+// pthread_parallel_for, and the smallest file wins. The settings are in its
+// header, so any decoder reads it. Candidates start nearest the defaults,
+// which go first, so a budget that cuts the search short has still tried the
+// likely winners and never ends up bigger than a plain encode.
+static const uint8_t best_steps[] = { 1, PEP_FREQ_STEP, 3, 4, 6, 8 };
+static const uint16_t best_limits[] = { 128, 256, 512, PEP_FREQ_MAX, 2048, 4096, 8192, 16384 };
+#define BEST_DEFAULT_STEP 1 // where the defaults are in those
+#define BEST_DEFAULT_LIMIT 3
+#define BEST_CANDIDATES_MAX ( 2 * ( sizeof( best_steps ) / sizeof( best_steps[ 0 ] ) ) * ( sizeof( best_limits ) / sizeof( best_limits[ 0 ] ) ) )
+
+typedef struct {
+	const uint32_t* pixels;
+	uint32_t width;
+	uint32_t height;
+	uint16_t stripe_rows;
+	double deadline;
+	pep_encode_options candidates[ BEST_CANDIDATES_MAX ];
+	uint32_t count;
+	pthread_mutex_t lock;
+	// Guarded by lock
+	pep best;
+	uint32_t best_size; // serialized, 0 until one finished
+	uint32_t best_index;
+	uint32_t default_size; // candidate 0's
+	pep_error default_error;
+	uint32_t tried;
+} best_search;
+
+static uint32_t best_distance( const uint32_t a, const uint32_t b ){ return a > b ? a - b : b - a; }
+
+// Fills s->candidates from base, nearest the defaults first. rANS doesn't
+// use the model, so then only the palette order varies.
+static void best_fill( best_search* const s, const pep_encode_options* const base )
+{
+	const uint32_t step_count = sizeof( best_steps ) / sizeof( best_steps[ 0 ] );
+	const uint32_t limit_count = sizeof( best_limits ) / sizeof( best_limits[ 0 ] );
+	const uint32_t model_count = base->coder == pep_coder_rans ? 1 : step_count * limit_count;
+	uint32_t keys[ BEST_CANDIDATES_MAX ];
+	s->count = 0;
+	for( uint32_t order = 0; order < 2; order++ )
+	{
+		for( uint32_t m = 0; m < model_count; m++ )
 		{
-			if( out_path == NULL )
+			pep_encode_options o = *base;
+			uint32_t key = order ? 1000 : 0; // the palette order rarely matters, so it goes last
+			if( order ) o.palette_order = base->palette_order == pep_palette_by_count ? pep_palette_first_seen : pep_palette_by_count;
+			if( model_count > 1 )
 			{
-				char* derived = derive_out_path( in_path, ".pep" );
-				if( !derived ){ fprintf(stderr, "alloc failed\n"); return 1; }
-				argv[2] = derived;
-				argc = 3;
+				const uint32_t step = m / limit_count;
+				const uint32_t limit = m % limit_count;
+				o.freq_step = best_steps[ step ];
+				o.freq_max = best_limits[ limit ];
+				key += best_distance( step, BEST_DEFAULT_STEP ) + best_distance( limit, BEST_DEFAULT_LIMIT );
 			}
-			else
+
+			// Insertion sort; equal keys keep the grid order.
+			uint32_t i = s->count++;
+			for( ; i > 0 && keys[ i - 1 ] > key; i-- )
 			{
-				argc = 3;
+				keys[ i ] = keys[ i - 1 ];
+				s->candidates[ i ] = s->candidates[ i - 1 ];
 			}
-			argv[1] = "--image";
+			keys[ i ] = key;
+			s->candidates[ i ] = o;
 		}
 	}
+}
+
+static void best_task( void* data, const uint32_t index )
+{
+	best_search* const s = ( best_search* )data;
+	if( index > 0 && now_seconds() > s->deadline ) return;
+
+	pep_codec_ctx* const ctx = pep_codec_ctx_create();
+	if( !ctx ) return;
+	ctx->options = s->candidates[ index ];
+	pep p = pep_compress_striped_ctx( ctx, s->pixels, s->width, s->height, pep_rgba, pep_rgba, s->stripe_rows, NULL, NULL );
+	pep_codec_ctx_destroy( ctx );
+	uint32_t size = 0;
+	uint8_t* bytes = p.bytes && p.bytes_size ? pep_serialize( &p, &size ) : NULL;
+	free( bytes );
+
+	pthread_mutex_lock( &s->lock );
+	s->tried++;
+	if( index == 0 ){ s->default_size = size; s->default_error = p.error; }
+	if( bytes && ( s->best_size == 0 || size < s->best_size || ( size == s->best_size && index < s->best_index ) ) )
+	{
+		pep_free( &s->best );
+		s->best = p;
+		s->best_size = size;
+		s->best_index = index;
+	}
+	else pep_free( &p );
+	pthread_mutex_unlock( &s->lock );
+}
+
+// Encodes pixels with the smallest candidate around options that the budget
+// leaves time for, and says which it was. The pep has no bytes if even the
+// defaults failed.
+static pep compress_best( const uint32_t* const pixels, const uint32_t w, const uint32_t h, const pep_encode_options* const options, const uint16_t stripe_rows, const double budget_seconds )
+{
+	best_search* const s = ( best_search* )calloc( 1, sizeof( best_search ) );
+	if( !s ){ pep none; memset( &none, 0, sizeof( none ) ); none.error = pep_error_out_of_memory; return none; }
+	s->pixels = pixels;
+	s->width = w;
+	s->height = h;
+	s->stripe_rows = stripe_rows;
+	s->deadline = now_seconds() + budget_seconds;
+	pthread_mutex_init( &s->lock, NULL );
+	best_fill( s, options );
 
-	if(strcmp(argv[1], "--demo") == 0){
+	const double t0 = now_seconds();
+	pthread_parallel_for( NULL, s->count, best_task, s );
+	pthread_mutex_destroy( &s->lock );
+
+	pep best = s->best;
+	if( s->best_size )
+	{
+		const pep_encode_options* const o = &s->candidates[ s->best_index ];
+		printf( "Best of %u/%u candidates in %.1f s: freq step %u, freq max %u, palette %s; %u bytes",
+			s->tried, s->count, now_seconds() - t0, best.freq_step, best.freq_max,
+			o->palette_order == pep_palette_by_count ? "by count" : "first seen", s->best_size );
+		if( s->default_size ) printf( " vs %u (%.2f%%)", s->default_size, 100.0 * s->best_size / s->default_size - 100.0 );
+		printf( "\n" );
+	}
+	else best.error = s->default_error ? s->default_error : pep_error_out_of_memory;
+	free( s );
+	return best;
+}
+#endif
+
+// --gen: writes images 0..count-1 of a seeded corpus (see pepr_gen.h) into
+// dir. The same seed and --max-dim give byte-identical files anywhere.
+static int run_gen( int argc, char** argv )
+{
+	if( argc < 3 || argv[ 2 ][ 0 ] == '-' ){ print_usage( argv[ 0 ] ); return 1; }
+	const char* const dir = argv[ 2 ];
+	unsigned long long seed = 1;
+	unsigned long count = 24;
+	unsigned long max_dim = 1024;
+	for( int i = 3; i < argc; i++ )
+	{
+		if( i + 1 < argc && strcmp( argv[ i ], "--seed" ) == 0 ) seed = strtoull( argv[ ++i ], NULL, 10 );
+		else if( i + 1 < argc && strcmp( argv[ i ], "--count" ) == 0 ) count = strtoul( argv[ ++i ], NULL, 10 );
+		else if( i + 1 < argc && strcmp( argv[ i ], "--max-dim" ) == 0 ) max_dim = strtoul( argv[ ++i ], NULL, 10 );
+		else { print_usage( argv[ 0 ] ); return 1; }
+	}
+	// Anything bigger couldn't be read back or compressed.
+	const unsigned long dim_limit = PEPR_MAX_DIM < PEPR_IMAGE_MAX_DIM ? PEPR_MAX_DIM : PEPR_IMAGE_MAX_DIM;
+	if( max_dim < 8 || max_dim > dim_limit ){ fprintf( stderr, "--max-dim must be 8..%lu\n", dim_limit ); return 1; }
+	if( count == 0 || count > 100000 ){ fprintf( stderr, "--count must be 1..100000\n" ); return 1; }
+	if( mkdir( dir, 0755 ) != 0 && errno != EEXIST ){ fprintf( stderr, "cannot create %s\n", dir ); return 3; }
+
+	const size_t path_cap = strlen( dir ) + 96;
+	char* path = ( char* )malloc( path_cap );
+	if( !path ){ fprintf( stderr, "alloc failed\n" ); return 4; }
+	uint64_t total_pixels = 0;
+	for( unsigned long i = 0; i < count; i++ )
+	{
+		pepr_gen_spec spec;
+		pepr_gen_plan( ( uint64_t )seed, ( uint32_t )i, ( uint32_t )max_dim, &spec );
+		uint32_t* pixels = pepr_gen_image( &spec );
+		if( !pixels ){ fprintf( stderr, "alloc failed\n" ); free( path ); return 4; }
+
+		snprintf( path, path_cap, "%s/s%llu_%05lu_%s_c%u_%ux%u.png", dir, seed, i, pepr_gen_style_names[ spec.style ], spec.colors, spec.width, spec.height );
+		const int rc = pepr_write_png( path, pixels, spec.width, spec.height );
+		free( pixels );
+		if( rc ){ fprintf( stderr, rc == 3 ? "cannot write %s\n" : "alloc failed (%s)\n", path ); free( path ); return rc; }
+		printf( "Wrote %s (noise %u/1000%s)\n", path, spec.noise_pm, spec.transparent ? ", transparent" : "" );
+		total_pixels += ( uint64_t )spec.width * spec.height;
+	}
+	printf( "corpus: %lu images, %llu pixels, seed %llu\n", count, ( unsigned long long )total_pixels, seed );
+	free( path );
+	return 0;
+}
+
+static int run_profile( int argc, char** argv )
+{
+#ifdef PEP_HAS_PROFILE
+	int json = 0;
+	int sort_palette = 0;
+	int rans = 0;
+	long rans_states = 0;
+	int arith_recip = 0;
+	unsigned long stripe_rows = 0;
+	int inputs = 0;
+	for( int i = 2; i < argc; i++ )
+	{
+		if( strcmp( argv[ i ], "--json" ) == 0 ) json = 1;
+		else if( strcmp( argv[ i ], "--sort-palette" ) == 0 ) sort_palette = 1;
+		else if( strcmp( argv[ i ], "--rans" ) == 0 ) rans = 1;
+		else if( strcmp( argv[ i ], "--rans-states" ) == 0 && i + 1 < argc ){ rans = 1; rans_states = atol( argv[ ++i ] ); }
+		else if( strcmp( argv[ i ], "--arith-recip" ) == 0 ) arith_recip = 1;
+		else if( strcmp( argv[ i ], "--stripe-rows" ) == 0 && i + 1 < argc ) stripe_rows = strtoul( argv[ ++i ], NULL, 10 );
+		else if( argv[ i ][ 0 ] == '-' ){ print_usage( argv[ 0 ] ); return 1; }
+		else inputs++;
+	}
+	if( !inputs || stripe_rows > 0xFFFF ){ print_usage( argv[ 0 ] ); return 1; }
+	if( !rans_states_ok( rans_states ) ) return 1;
+	if( !arith_recip_ok( arith_recip, rans ) ) return 1;
+
+	pep_codec_ctx* ctx = pep_codec_ctx_create();
+	if( !ctx ){ fprintf( stderr, "alloc failed\n" ); return 4; }
+#ifdef PEP_HAS_ENCODE_OPTIONS
+	if( sort_palette ) ctx->options.palette_order = pep_palette_by_count;
+#else
+	if( sort_palette ){ fprintf( stderr, "--sort-palette needs a PEP.h with encode options\n" ); pep_codec_ctx_destroy( ctx ); return 1; }
+#endif
+#ifdef PEP_HAS_RANS
+	if( rans ) ctx->options.coder = pep_coder_rans;
+#endif
+#ifdef PEP_HAS_RANS_STATES
+	if( rans_states ) ctx->options.rans_states = ( uint8_t )rans_states;
+#endif
+#ifdef PEP_HAS_ARITH_RECIP
+	if( arith_recip ) ctx->options.coder = pep_coder_arith_recip;
+#endif
+#ifndef PEP_HAS_RANS
+	if( rans ){ fprintf( stderr, "--rans needs a PEP.h with the rANS coder\n" ); pep_codec_ctx_destroy( ctx ); return 1; }
+#endif
+	if( json ) printf( "[\n" );
+	int rc = 0;
+	int first = 1;
+	for( int i = 2; i < argc; i++ )
+	{
+		if( strcmp( argv[ i ], "--stripe-rows" ) == 0 || strcmp( argv[ i ], "--rans-states" ) == 0 ) i++;
+		else if( argv[ i ][ 0 ] != '-' )
+		{
+			const int one = profile_one( ctx, argv[ i ], ( uint16_t )stripe_rows, json, first );
+			if( !one ) first = 0;
+			else if( !rc ) rc = one;
+		}
+	}
+	if( json ) printf( "\n]\n" );
+	pep_codec_ctx_destroy( ctx );
+	return rc;
+#else
+	( void )argc;
+	fprintf( stderr, "%s: --profile needs a PEP_PROFILE build (make PROFILE=1)\n", argv[ 0 ] );
+	return 1;
+#endif
+}
+
+int main(int argc, char** argv){
+	if(argc < 2){ print_usage(argv[0]); return 1; }
+
+	// Auto-mode: if first arg is not an option, infer conversion by extension.
+	// The mode is kept apart from argv, which becomes "<prog> <in> <in> <out>"
+	// so the mode's code finds the paths where it would for "<prog> <mode> <in> <out>".
+	const char* mode = argv[1];
+	char* auto_argv[4];
+	if( argv[1][0] != '-' )
+	{
+		const int to_bmp = has_ext_ci( argv[1], ".pep" );
+		char* out_path = ( argc >= 3 ) ? argv[2] : derive_out_path( argv[1], to_bmp ? ".bmp" : ".pep" );
+		if( !out_path ){ fprintf(stderr, "alloc failed\n"); return 1; }
+		mode = to_bmp ? "--to-bmp" : "--image";
+		auto_argv[0] = argv[0];
+		auto_argv[1] = argv[1];
+		auto_argv[2] = argv[1];
+		auto_argv[3] = out_path;
+		argv = auto_argv;
+		argc = 4;
+	}
+
+	if(strcmp(mode, "--batch") == 0){
+		return run_batch(argc, argv);
+	}
+
+	if(strcmp(mode, "--gen") == 0){
+		return run_gen(argc, argv);
+	}
+
+	if(strcmp(mode, "--profile") == 0){
+		return run_profile(argc, argv);
+	}
+
+	if(strcmp(mode, "--demo") == 0){
 		if(argc != 3){ print_usage(argv[0]); return 1; }
 		const char* out_path = argv[2];
 		const uint16_t w = 32, h = 32;
@@ -137,10 +1370,12 @@ int main(int argc, char** argv){
 		return 0;
 	}
 
-	if(strcmp(argv[1], "--rgba") == 0){
+	if(strcmp(mode, "--rgba") == 0){
 		if(argc != 6){ print_usage(argv[0]); return 1; }
-		uint16_t w = (uint16_t)atoi(argv[2]);
-		uint16_t h = (uint16_t)atoi(argv[3]);
+		const long lw = atol(argv[2]);
+		const long lh = atol(argv[3]);
+		if(lw <= 0 || lh <= 0 || !dims_fit_pep((size_t)lw, (size_t)lh)){ fprintf(stderr, "dimensions must be 1..%u\n", (unsigned)PEPR_MAX_DIM); return 1; }
+		const uint32_t w = (uint32_t)lw, h = (uint32_t)lh;
 		const char* in_path = argv[4];
 		const char* out_path = argv[5];
 
@@ -155,6 +1390,51 @@ int main(int argc, char** argv){
 			fclose(f);
 			return 1;
 		}
+#ifdef PEP_HAS_PUSH_ENCODER
+		// Feed the encoder a block of rows at a time and let it write the
+		// file, so neither the raw image nor the .pep is ever held whole.
+		const uint32_t block = h < PEPR_STREAM_ROWS ? h : PEPR_STREAM_ROWS;
+		uint32_t* pixels = (uint32_t*)malloc((size_t)w * block * sizeof(uint32_t));
+#ifdef PEP_HAS_BYTE_INPUT
+		// The file's RGBA8 bytes are read straight into pixels and swizzled
+		// by the encoder as it codes them.
+		uint8_t* raw = (uint8_t*)pixels;
+		const pep_format raw_format = pep_byte_format(pep_rgba8);
+#else
+		uint8_t* raw = (uint8_t*)malloc((size_t)w * block * 4u);
+		const pep_format raw_format = pep_rgba;
+#endif
+		pep_encoder enc;
+		if(!raw || !pixels || !pep_encoder_begin(&enc, NULL, w, h, raw_format, pep_rgba, NULL, 0)){
+			fprintf(stderr, "%s\n", raw && pixels ? pep_failure(&enc.info, ".pep compression failed") : "alloc failed");
+			if(raw && pixels) pep_encoder_free(&enc);
+			if(raw != (uint8_t*)pixels) free(raw);
+			free(pixels); fclose(f);
+			return raw && pixels ? 2 : 1;
+		}
+		int rc = 0;
+		for(uint32_t y = 0; y < h && !rc; y += block){
+			const uint32_t n = h - y < block ? h - y : block;
+			const size_t count = (size_t)w * n;
+			if(fread(raw, 1, count * 4u, f) != count * 4u){ fprintf(stderr, "read failed\n"); rc = 1; break; }
+#ifndef PEP_HAS_BYTE_INPUT
+			for(size_t i=0;i<count;i++) pixels[i] = make_color_rgba(raw[i*4+0], raw[i*4+1], raw[i*4+2], raw[i*4+3]);
+#endif
+			if(!pep_encoder_push_rows(&enc, pixels, n)) rc = 2; // reported below
+		}
+		if(raw != (uint8_t*)pixels) free(raw);
+		free(pixels);
+		fclose(f);
+		FILE* out = rc ? NULL : fopen(out_path, "wb");
+		if(!rc && !out) rc = 3;
+		if(out && !pep_encoder_finish_write(&enc, pep_file_writer, out)) rc = enc.info.error == pep_error_io ? 3 : 2;
+		if(out && fclose(out) != 0 && !rc) rc = 3;
+		if(rc == 2) fprintf(stderr, "%s\n", pep_failure(&enc.info, ".pep compression failed"));
+		if(rc == 3) fprintf(stderr, "failed to save %s\n", out_path);
+		if(out && rc) remove(out_path);
+		pep_encoder_free(&enc);
+		if(rc) return rc;
+#else
 		uint8_t* raw = (uint8_t*)malloc(expected);
 		if(!raw){ fclose(f); fprintf(stderr, "alloc failed\n"); return 1; }
 		if(fread(raw, 1, expected, f) != expected){ free(raw); fclose(f); fprintf(stderr, "read failed\n"); return 1; }
@@ -173,124 +1453,100 @@ int main(int argc, char** argv){
 
 		pep p = pep_compress(pixels, w, h, pep_rgba, pep_rgba);
 		free(pixels);
-		if(p.bytes == NULL || p.bytes_size == 0){ fprintf(stderr, ".pep compression failed\n"); return 2; }
+		if(p.bytes == NULL || p.bytes_size == 0){ fprintf(stderr, "%s\n", pep_failure(&p, ".pep compression failed")); return 2; }
 		if(!pep_save(&p, out_path)){ fprintf(stderr, "failed to save %s\n", out_path); pep_free(&p); return 3; }
 		pep_free(&p);
+#endif
 		printf("Wrote %s (%ux%u)\n", out_path, w, h);
 		return 0;
 	}
 
-	if(strcmp(argv[1], "--image") == 0){
-		if(argc != 4){ print_usage(argv[0]); return 1; }
+	if(strcmp(mode, "--image") == 0){
+		long stripe_rows = 0;
+		int sort_palette = 0;
+		int rans = 0;
+		long rans_states = 0;
+		int arith_recip = 0;
+		int best = 0;
+		double budget = 30.0;
+		if(argc < 4){ print_usage(argv[0]); return 1; }
+		for(int i = 4; i < argc; i++){
+			if(strcmp(argv[i], "--stripe-rows") == 0 && i + 1 < argc) stripe_rows = atol(argv[++i]);
+			else if(strcmp(argv[i], "--sort-palette") == 0) sort_palette = 1;
+			else if(strcmp(argv[i], "--rans") == 0) rans = 1;
+			else if(strcmp(argv[i], "--rans-states") == 0 && i + 1 < argc){ rans = 1; rans_states = atol(argv[++i]); }
+			else if(strcmp(argv[i], "--arith-recip") == 0) arith_recip = 1;
+			else if(strcmp(argv[i], "--best") == 0) best = 1;
+			else if(strcmp(argv[i], "--budget") == 0 && i + 1 < argc){ best = 1; budget = atof(argv[++i]); }
+			else { print_usage(argv[0]); return 1; }
+		}
+		if(stripe_rows < 0 || stripe_rows > 0xFFFF){ fprintf(stderr, "--stripe-rows must be 0..65535\n"); return 1; }
+#ifndef PEP_HAS_ENCODE_OPTIONS
+		if(sort_palette){ fprintf(stderr, "--sort-palette needs a PEP.h with encode options\n"); return 1; }
+#endif
+#ifndef PEP_HAS_RANS
+		if(rans){ fprintf(stderr, "--rans needs a PEP.h with the rANS coder\n"); return 1; }
+#endif
+		if(!rans_states_ok(rans_states)) return 1;
+		if(!arith_recip_ok(arith_recip, rans)) return 1;
+#ifndef PEP_HAS_MODEL_TUNING
+		if(best){ fprintf(stderr, "--best needs a PEP.h with model tuning\n"); return 1; }
+#endif
+		if(!(budget >= 0)){ fprintf(stderr, "--budget must be at least 0 seconds\n"); return 1; }
 		const char* in_png = argv[2];
 		const char* out_path = argv[3];
 
-		CFStringRef pathStr = CFStringCreateWithCString(kCFAllocatorDefault, in_png, kCFStringEncodingUTF8);
-		if(!pathStr){ fprintf(stderr, "CFStringCreateWithCString failed\n"); return 1; }
-		CFURLRef url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, pathStr, kCFURLPOSIXPathStyle, false);
-		CFRelease(pathStr);
-		if(!url){ fprintf(stderr, "CFURLCreateWithFileSystemPath failed\n"); return 1; }
-
-		CGImageSourceRef src = CGImageSourceCreateWithURL(url, NULL);
-		CFRelease(url);
-		if(!src){ fprintf(stderr, "CGImageSourceCreateWithURL failed\n"); return 1; }
-		CGImageRef img = CGImageSourceCreateImageAtIndex(src, 0, NULL);
-		CFRelease(src);
-		if(!img){ fprintf(stderr, "CGImageSourceCreateImageAtIndex failed\n"); return 1; }
-
-		size_t w = CGImageGetWidth(img);
-		size_t h = CGImageGetHeight(img);
-		if(w == 0 || h == 0){ CFRelease(img); fprintf(stderr, "invalid image size\n"); return 1; }
-
-		const size_t bytesPerPixel = 4;
-		const size_t bytesPerRow = w * bytesPerPixel;
-		uint8_t* raw = (uint8_t*)malloc(h * bytesPerRow);
-		if(!raw){ CFRelease(img); fprintf(stderr, "alloc failed\n"); return 1; }
-
-		CGColorSpaceRef cs = CGColorSpaceCreateDeviceRGB();
-		CGBitmapInfo info = kCGImageAlphaPremultipliedLast | kCGBitmapByteOrderDefault; // RGBA8
-		CGContextRef ctx = CGBitmapContextCreate(raw, w, h, 8, bytesPerRow, cs, info);
-		CGColorSpaceRelease(cs);
-		if(!ctx){ free(raw); CFRelease(img); fprintf(stderr, "CGBitmapContextCreate failed\n"); return 1; }
-
-		CGRect rect = CGRectMake(0, 0, (CGFloat)w, (CGFloat)h);
-		CGContextDrawImage(ctx, rect, img);
-		CGContextRelease(ctx);
-		CFRelease(img);
-
-		// Compress
-		uint32_t* pixels = (uint32_t*)malloc(w * h * sizeof(uint32_t));
-		if(!pixels){ free(raw); fprintf(stderr, "alloc failed\n"); return 1; }
-		for(size_t i=0;i<w*h;i++){
-			uint8_t r = raw[i*4+0];
-			uint8_t g = raw[i*4+1];
-			uint8_t b = raw[i*4+2];
-			uint8_t a = raw[i*4+3];
-			pixels[i] = make_color_rgba(r,g,b,a);
-		}
-		free(raw);
+		size_t w = 0, h = 0;
+		uint32_t* pixels = load_image_pixels(in_png, &w, &h);
+		if(!pixels) return 1;
+		if(!dims_fit_pep(w, h)){ fprintf(stderr, "%s: %zux%zu is too large for .pep (max %u per side)\n", in_png, w, h, (unsigned)PEPR_MAX_DIM); free(pixels); return 1; }
 
-		pep p = pep_compress(pixels, (uint16_t)w, (uint16_t)h, pep_rgba, pep_rgba);
+#if defined(PEP_HAS_ENCODE_OPTIONS)
+		pep_codec_ctx* ctx = pep_codec_ctx_create();
+		if(!ctx){ fprintf(stderr, "alloc failed\n"); free(pixels); return 4; }
+		if(sort_palette) ctx->options.palette_order = pep_palette_by_count;
+#ifdef PEP_HAS_RANS
+		if(rans) ctx->options.coder = pep_coder_rans;
+#endif
+#ifdef PEP_HAS_RANS_STATES
+		if(rans_states) ctx->options.rans_states = (uint8_t)rans_states;
+#endif
+#ifdef PEP_HAS_ARITH_RECIP
+		if(arith_recip) ctx->options.coder = pep_coder_arith_recip;
+#endif
+#ifdef PEP_HAS_MODEL_TUNING
+		pep p = best ? compress_best(pixels, (uint32_t)w, (uint32_t)h, &ctx->options, (uint16_t)stripe_rows, budget)
+			: pep_compress_striped_ctx(ctx, pixels, (uint32_t)w, (uint32_t)h, pep_rgba, pep_rgba, (uint16_t)stripe_rows, pthread_parallel_for, NULL);
+#else
+		pep p = pep_compress_striped_ctx(ctx, pixels, (uint32_t)w, (uint32_t)h, pep_rgba, pep_rgba, (uint16_t)stripe_rows, pthread_parallel_for, NULL);
+#endif
+		pep_codec_ctx_destroy(ctx);
+#elif defined(PEP_HAS_STRIPES)
+		pep p = pep_compress_striped(pixels, (uint32_t)w, (uint32_t)h, pep_rgba, pep_rgba, (uint16_t)stripe_rows, pthread_parallel_for, NULL);
+#else
+		if(stripe_rows){ fprintf(stderr, "--stripe-rows needs a PEP.h with striped container support\n"); free(pixels); return 1; }
+		pep p = pep_compress(pixels, (uint32_t)w, (uint32_t)h, pep_rgba, pep_rgba);
+#endif
 		free(pixels);
-		if(p.bytes == NULL || p.bytes_size == 0){ fprintf(stderr, ".pep compression failed\n"); return 2; }
+		if(p.bytes == NULL || p.bytes_size == 0){ fprintf(stderr, "%s\n", pep_failure(&p, ".pep compression failed")); return 2; }
 		if(!pep_save(&p, out_path)){ fprintf(stderr, "failed to save %s\n", out_path); pep_free(&p); return 3; }
 		pep_free(&p);
 		printf("Wrote %s (%zux%zu)\n", out_path, w, h);
 		return 0;
 	}
 
-	if(strcmp(argv[1], "--dry-run") == 0){
+	if(strcmp(mode, "--dry-run") == 0){
 		if(argc != 3){ print_usage(argv[0]); return 1; }
 		const char* in_png = argv[2];
 
-		CFStringRef pathStr = CFStringCreateWithCString(kCFAllocatorDefault, in_png, kCFStringEncodingUTF8);
-		if(!pathStr){ fprintf(stderr, "CFStringCreateWithCString failed\n"); return 1; }
-		CFURLRef url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, pathStr, kCFURLPOSIXPathStyle, false);
-		CFRelease(pathStr);
-		if(!url){ fprintf(stderr, "CFURLCreateWithFileSystemPath failed\n"); return 1; }
-
-		CGImageSourceRef src = CGImageSourceCreateWithURL(url, NULL);
-		CFRelease(url);
-		if(!src){ fprintf(stderr, "CGImageSourceCreateWithURL failed\n"); return 1; }
-		CGImageRef img = CGImageSourceCreateImageAtIndex(src, 0, NULL);
-		CFRelease(src);
-		if(!img){ fprintf(stderr, "CGImageSourceCreateImageAtIndex failed\n"); return 1; }
-
-		size_t w = CGImageGetWidth(img);
-		size_t h = CGImageGetHeight(img);
-		if(w == 0 || h == 0){ CFRelease(img); fprintf(stderr, "invalid image size\n"); return 1; }
-
-		const size_t bytesPerPixel = 4;
-		const size_t bytesPerRow = w * bytesPerPixel;
-		uint8_t* raw = (uint8_t*)malloc(h * bytesPerRow);
-		if(!raw){ CFRelease(img); fprintf(stderr, "alloc failed\n"); return 1; }
-
-		CGColorSpaceRef cs = CGColorSpaceCreateDeviceRGB();
-		CGBitmapInfo info = kCGImageAlphaPremultipliedLast | kCGBitmapByteOrderDefault; // RGBA8
-		CGContextRef ctx = CGBitmapContextCreate(raw, w, h, 8, bytesPerRow, cs, info);
-		CGColorSpaceRelease(cs);
-		if(!ctx){ free(raw); CFRelease(img); fprintf(stderr, "CGBitmapContextCreate failed\n"); return 1; }
-
-		CGRect rect = CGRectMake(0, 0, (CGFloat)w, (CGFloat)h);
-		CGContextDrawImage(ctx, rect, img);
-		CGContextRelease(ctx);
-		CFRelease(img);
-
-		// Compress to memory only (no file I/O)
-		uint32_t* pixels = (uint32_t*)malloc(w * h * sizeof(uint32_t));
-		if(!pixels){ free(raw); fprintf(stderr, "alloc failed\n"); return 1; }
-		for(size_t i=0;i<w*h;i++){
-			uint8_t r = raw[i*4+0];
-			uint8_t g = raw[i*4+1];
-			uint8_t b = raw[i*4+2];
-			uint8_t a = raw[i*4+3];
-			pixels[i] = make_color_rgba(r,g,b,a);
-		}
-		free(raw);
+		size_t w = 0, h = 0;
+		uint32_t* pixels = load_image_pixels(in_png, &w, &h);
+		if(!pixels) return 1;
+		if(!dims_fit_pep(w, h)){ fprintf(stderr, "%s: %zux%zu is too large for .pep (max %u per side)\n", in_png, w, h, (unsigned)PEPR_MAX_DIM); free(pixels); return 1; }
 
-		pep p = pep_compress(pixels, (uint16_t)w, (uint16_t)h, pep_rgba, pep_rgba);
+		pep p = pep_compress(pixels, (uint32_t)w, (uint32_t)h, pep_rgba, pep_rgba);
 		free(pixels);
-		if(p.bytes == NULL || p.bytes_size == 0){ fprintf(stderr, ".pep compression failed\n"); return 2; }
+		if(p.bytes == NULL || p.bytes_size == 0){ fprintf(stderr, "%s\n", pep_failure(&p, ".pep compression failed")); return 2; }
 		
 		// Optionally serialize to get final byte size (still in memory)
 		uint32_t serialized_size = 0;
@@ -304,123 +1560,117 @@ int main(int argc, char** argv){
 		return 0;
 	}
 
-	if(strcmp(argv[1], "--to-bmp") == 0){
-		if(argc != 4){ print_usage(argv[0]); return 1; }
+	if(strcmp(mode, "--to-bmp") == 0){
+		const int top_down = argc == 5 && strcmp(argv[4], "--top-down") == 0;
+		if(argc != 4 && !top_down){ print_usage(argv[0]); return 1; }
 		const char* in_pep = argv[2];
 		const char* out_bmp = argv[3];
 
+#ifdef PEP_HAS_DECOMPRESS_INTO
+		// Images that fit are decoded in parallel straight into the file
+		// image and written in one go; bigger ones stream below.
+		pep p = pep_load_mapped(in_pep);
+		if(p.bytes != NULL && p.bytes_size != 0 && p.width != 0 && p.height != 0 && bmp32_direct_fits(p.width, p.height)){
+			const uint32_t w = p.width;
+			const uint32_t h = p.height;
+			unsigned char* file = NULL;
+			size_t file_cap = 0;
+			const int rc = write_bmp32_direct(out_bmp, &p, top_down, NULL, pthread_parallel_for, &file, &file_cap);
+			free(file);
+			pep_free(&p);
+			if(rc == 2){ fprintf(stderr, "decompress failed\n"); return rc; }
+			if(rc == 3){ fprintf(stderr, "cannot write %s\n", out_bmp); return rc; }
+			if(rc){ fprintf(stderr, "alloc failed\n"); return rc; }
+			printf("Wrote %s (%ux%u 32bpp BGRA%s)\n", out_bmp, w, h, top_down ? ", top-down" : "");
+			return 0;
+		}
+		pep_free(&p);
+#endif
+#ifdef PEP_HAS_STREAMING_DECODER
+		// Stream the file through the decoder: memory stays at one codec
+		// context plus a few rows, however large the image is.
+		FILE* in = fopen(in_pep, "rb");
+		if(!in){ fprintf(stderr, "failed to load %s: cannot open\n", in_pep); return 1; }
+		pep_decoder dec;
+		if(!pep_decoder_init(&dec, NULL, pep_file_reader, in)){
+			fprintf(stderr, "failed to load %s: %s\n", in_pep, pep_failure(&dec.info, "not a valid .pep"));
+			pep_decoder_free(&dec);
+			fclose(in);
+			return 1;
+		}
+		const uint32_t w = dec.info.width;
+		const uint32_t h = dec.info.height;
+		unsigned char* row = NULL;
+		size_t row_cap = 0;
+		const int rc = write_bmp32_stream(out_bmp, &dec, top_down, &row, &row_cap);
+		if(rc == 2) fprintf(stderr, "decompress failed: %s\n", pep_failure(&dec.info, "corrupt .pep"));
+		free(row);
+		pep_decoder_free(&dec);
+		fclose(in);
+		if(rc == 2) return rc;
+#else
+#ifdef PEP_HAS_VIEWS
+		pep p = pep_load_mapped(in_pep);
+#else
 		pep p = pep_load(in_pep);
+#endif
 		if(p.bytes == NULL || p.bytes_size == 0 || p.width == 0 || p.height == 0){
-			fprintf(stderr, "failed to load %s\n", in_pep);
+			fprintf(stderr, "failed to load %s: %s\n", in_pep, pep_failure(&p, "not a valid .pep"));
 			return 1;
 		}
+#ifdef PEP_HAS_STRIPES
+		uint32_t* pixels = pep_decompress_parallel(&p, pep_rgba, 0, pthread_parallel_for, NULL);
+#else
 		uint32_t* pixels = pep_decompress(&p, pep_rgba, 0);
+#endif
 		if(!pixels){ pep_free(&p); fprintf(stderr, "decompress failed\n"); return 2; }
 
 		const uint32_t w = p.width;
 		const uint32_t h = p.height;
-		const uint32_t rowBytes = w * 4u;
-		const uint32_t pixelBytes = rowBytes * h;
-		const uint32_t fileHeaderSize = 14;
-		const uint32_t infoHeaderSize = 40;
-		const uint32_t dataOffset = fileHeaderSize + infoHeaderSize;
-		const uint32_t fileSize = dataOffset + pixelBytes;
-
-		FILE* f = fopen(out_bmp, "wb");
-		if(!f){ free(pixels); pep_free(&p); fprintf(stderr, "cannot write %s\n", out_bmp); return 3; }
-
-		// BITMAPFILEHEADER (14 bytes)
-		unsigned char bf[14];
-		bf[0] = 'B'; bf[1] = 'M';
-		bf[2] = (unsigned char)(fileSize & 0xFF);
-		bf[3] = (unsigned char)((fileSize >> 8) & 0xFF);
-		bf[4] = (unsigned char)((fileSize >> 16) & 0xFF);
-		bf[5] = (unsigned char)((fileSize >> 24) & 0xFF);
-		bf[6] = bf[7] = 0; // reserved1
-		bf[8] = bf[9] = 0; // reserved2
-		bf[10] = (unsigned char)(dataOffset & 0xFF);
-		bf[11] = (unsigned char)((dataOffset >> 8) & 0xFF);
-		bf[12] = (unsigned char)((dataOffset >> 16) & 0xFF);
-		bf[13] = (unsigned char)((dataOffset >> 24) & 0xFF);
-		fwrite(bf, 1, 14, f);
-
-		// BITMAPINFOHEADER (40 bytes)
-		unsigned char bi[40];
-		memset(bi, 0, sizeof(bi));
-		bi[0] = 40; // biSize
-		bi[4] = (unsigned char)(w & 0xFF);
-		bi[5] = (unsigned char)((w >> 8) & 0xFF);
-		bi[6] = (unsigned char)((w >> 16) & 0xFF);
-		bi[7] = (unsigned char)((w >> 24) & 0xFF);
-		// biHeight positive => bottom-up
-		bi[8]  = (unsigned char)(h & 0xFF);
-		bi[9]  = (unsigned char)((h >> 8) & 0xFF);
-		bi[10] = (unsigned char)((h >> 16) & 0xFF);
-		bi[11] = (unsigned char)((h >> 24) & 0xFF);
-		bi[12] = 1; // planes
-		bi[14] = 32; // bitCount
-		bi[16] = 0; // BI_RGB (no compression)
-		bi[20] = (unsigned char)(pixelBytes & 0xFF);
-		bi[21] = (unsigned char)((pixelBytes >> 8) & 0xFF);
-		bi[22] = (unsigned char)((pixelBytes >> 16) & 0xFF);
-		bi[23] = (unsigned char)((pixelBytes >> 24) & 0xFF);
-		// 72 DPI ≈ 2835 pixels/meter
-		const uint32_t ppm = 2835;
-		bi[24] = (unsigned char)(ppm & 0xFF);
-		bi[25] = (unsigned char)((ppm >> 8) & 0xFF);
-		bi[26] = (unsigned char)((ppm >> 16) & 0xFF);
-		bi[27] = (unsigned char)((ppm >> 24) & 0xFF);
-		bi[28] = (unsigned char)(ppm & 0xFF);
-		bi[29] = (unsigned char)((ppm >> 8) & 0xFF);
-		bi[30] = (unsigned char)((ppm >> 16) & 0xFF);
-		bi[31] = (unsigned char)((ppm >> 24) & 0xFF);
-		fwrite(bi, 1, 40, f);
-
-		// Pixel data bottom-up, emit BGRA bytes explicitly from RGBA value
-		unsigned char* tmpRow = (unsigned char*)malloc(rowBytes);
-		if(!tmpRow){ fclose(f); free(pixels); pep_free(&p); fprintf(stderr, "alloc failed\n"); return 4; }
-		for(int y = (int)h - 1; y >= 0; --y){
-			for(uint32_t x = 0; x < w; ++x){
-				uint32_t v = pixels[(size_t)y * w + x]; // RGBA in bits 24..0
-				unsigned char r = (unsigned char)((v >> 24) & 0xFF);
-				unsigned char g = (unsigned char)((v >> 16) & 0xFF);
-				unsigned char b = (unsigned char)((v >> 8) & 0xFF);
-				unsigned char a = (unsigned char)(v & 0xFF);
-				tmpRow[x*4+0] = b;
-				tmpRow[x*4+1] = g;
-				tmpRow[x*4+2] = r;
-				tmpRow[x*4+3] = a;
-			}
-			fwrite(tmpRow, 1, rowBytes, f);
-		}
-		free(tmpRow);
-
-		fclose(f);
+		unsigned char* row = NULL;
+		size_t row_cap = 0;
+		const int rc = write_bmp32(out_bmp, pixels, w, h, top_down, &row, &row_cap);
+		free(row);
 		free(pixels);
 		pep_free(&p);
-		printf("Wrote %s (%ux%u 32bpp BGRA)\n", out_bmp, w, h);
+#endif
+		if(rc == 3){ fprintf(stderr, "cannot write %s\n", out_bmp); return rc; }
+		if(rc){ fprintf(stderr, "alloc failed\n"); return rc; }
+		printf("Wrote %s (%ux%u 32bpp BGRA%s)\n", out_bmp, w, h, top_down ? ", top-down" : "");
 		return 0;
 	}
 
-	if(strcmp(argv[1], "--to-rle-bmp") == 0){
+	if(strcmp(mode, "--to-rle-bmp") == 0){
 		if(argc != 4){ print_usage(argv[0]); return 1; }
 		const char* in_pep = argv[2];
 		const char* out_rle = argv[3];
 
+#ifdef PEP_HAS_VIEWS
+		pep p = pep_load_mapped(in_pep);
+#else
 		pep p = pep_load(in_pep);
+#endif
 		if(p.bytes == NULL || p.bytes_size == 0 || p.width == 0 || p.height == 0){
-			fprintf(stderr, "failed to load %s\n", in_pep);
+			fprintf(stderr, "failed to load %s: %s\n", in_pep, pep_failure(&p, "not a valid .pep"));
 			return 1;
 		}
 
-		// Decompress in original stored format so pixels match palette entries
-		uint32_t* pixels = pep_decompress(&p, p.format, 0);
-		if(!pixels){ pep_free(&p); fprintf(stderr, "decompress failed\n"); return 2; }
-
 		const uint32_t w = p.width;
 		const uint32_t h = p.height;
 		const uint8_t palette_size = p.palette_size ? p.palette_size : 1;
-		if(palette_size > 255){ free(pixels); pep_free(&p); fprintf(stderr, "palette too large for 8-bit BMP\n"); return 3; }
+
+#ifdef PEP_HAS_DECOMPRESS_INDICES
+		// Decode straight to palette indices
+		uint32_t* pixels = NULL;
+		uint8_t* indices = pep_decompress_indices(&p);
+		if(!indices){ pep_free(&p); fprintf(stderr, "decompress failed\n"); return 2; }
+		for(uint32_t i = 0; i < w * h; ++i){
+			if(indices[i] >= palette_size) indices[i] = 0; // fallback
+		}
+#else
+		// Decompress in original stored format so pixels match palette entries
+		uint32_t* pixels = pep_decompress(&p, p.format, 0);
+		if(!pixels){ pep_free(&p); fprintf(stderr, "decompress failed\n"); return 2; }
 
 		// Map RGBA values (in p.format order) to palette indices
 		// Linear search per pixel; acceptable for our use-case
@@ -433,6 +1683,7 @@ int main(int argc, char** argv){
 			if(idx >= palette_size) idx = 0; // fallback
 			indices[i] = (uint8_t)idx;
 		}
+#endif
 
 		// Prepare RLE8 encoding buffer (worst-case ~2x + control codes)
 		size_t cap = (size_t)w * h * 2u + (size_t)h * 2u + 2u;
@@ -468,9 +1719,15 @@ int main(int argc, char** argv){
 						if(x + 2 < w && row[x] == row[x+1] && row[x] == row[x+2]) break;
 						x++; count++;
 					}
-					EMIT8(0); EMIT8((uint8_t)count);
-					for(uint32_t i = 0; i < count; ++i) EMIT8(row[start + i]);
-					if(count & 1) EMIT8(0); // pad to word
+					if(count < 3){
+						// Absolute counts 0..2 are the end-of-line/bitmap and
+						// delta escapes, so short literals go out as runs of one
+						for(uint32_t i = 0; i < count; ++i){ EMIT8(1); EMIT8(row[start + i]); }
+					}else{
+						EMIT8(0); EMIT8((uint8_t)count);
+						for(uint32_t i = 0; i < count; ++i) EMIT8(row[start + i]);
+						if(count & 1) EMIT8(0); // pad to word
+					}
 				}
 			}
 			// End of line
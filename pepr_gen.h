@@ -0,0 +1,466 @@
+// Seeded synthetic pixel-art for benchmarks (`pepr --gen`), with no
+// dependencies beyond libc.
+// Image `index` of seed `seed` is always the same pixels on every machine:
+// all of the randomness is a splitmix64 stream, and there's no floating point.
+// Images cycle through the palette-size classes that give 1, 2, 4 and 8 bits
+// per index (2, 3-4, 5-16 and 17-255 colors) and through the styles below,
+// with random sizes, noise levels and transparency on top.
+// They're written as PNG, so the existing image targets can use them as-is.
+
+#ifndef PEPR_GEN_H
+#define PEPR_GEN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct
+{
+	uint64_t state;
+} pepr_rng;
+
+static inline uint64_t pepr_rng_next( pepr_rng* r )
+{
+	uint64_t z = ( r->state += 0x9E3779B97F4A7C15ull );
+	z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+	z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBull;
+	return z ^ ( z >> 31 );
+}
+
+// Uniform in [ 0, n ).
+static inline uint32_t pepr_rng_below( pepr_rng* r, const uint32_t n )
+{
+	return ( uint32_t )( ( ( pepr_rng_next( r ) >> 32 ) * n ) >> 32 );
+}
+
+// Uniform in [ lo, hi ].
+static inline uint32_t pepr_rng_range( pepr_rng* r, const uint32_t lo, const uint32_t hi )
+{
+	return lo + pepr_rng_below( r, hi - lo + 1 );
+}
+
+typedef enum
+{
+	pepr_gen_flat, // large flat rectangles over a background
+	pepr_gen_dither, // ordered-dithered gradient through the palette
+	pepr_gen_tiles, // a few small tiles repeated over a grid
+	pepr_gen_sprites, // mirrored random sprites on a grid
+	pepr_gen_noise, // every pixel random (worst case)
+	pepr_gen_mixed, // bands of flat, dither and tiles
+	pepr_gen_style_count
+} pepr_gen_style;
+
+static const char* const pepr_gen_style_names[ pepr_gen_style_count ] = { "flat", "dither", "tiles", "sprites", "noise", "mixed" };
+
+typedef struct
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t colors; // all of them are used
+	pepr_gen_style style;
+	uint32_t noise_pm; // per mille of pixels overwritten with a random color
+	int transparent; // color 0 is fully transparent
+	uint64_t seed; // drives the pixels
+} pepr_gen_spec;
+
+// Picks the parameters of image `index` of a corpus.
+static void pepr_gen_plan( const uint64_t seed, const uint32_t index, uint32_t max_dim, pepr_gen_spec* out )
+{
+	pepr_rng r = { seed * 0x100000001B3ull + index };
+	if( max_dim < 8 ) max_dim = 8;
+
+	// One bits-per-index class per image in turn, and every so often the
+	// largest palette there is.
+	static const uint32_t class_lo[ 4 ] = { 2, 3, 5, 17 };
+	static const uint32_t class_hi[ 4 ] = { 2, 4, 16, 255 };
+	const uint32_t c = index % 4;
+	out->colors = ( index % 16 == 3 ) ? 255 : pepr_rng_range( &r, class_lo[ c ], class_hi[ c ] );
+	out->style = ( pepr_gen_style )( ( index / 4 ) % pepr_gen_style_count );
+
+	static const uint32_t noise_levels[ 5 ] = { 0, 0, 5, 50, 250 };
+	out->noise_pm = out->style == pepr_gen_noise ? 0 : noise_levels[ pepr_rng_below( &r, 5 ) ];
+	out->transparent = ( int )pepr_rng_below( &r, 2 );
+
+	// Mostly small and medium sprites and scenes, plus full-size and strip
+	// images to reach the dimension limit.
+	const uint32_t medium = max_dim < 512 ? max_dim : 512;
+	switch( pepr_rng_below( &r, 6 ) )
+	{
+		case 0: out->width = pepr_rng_range( &r, 8, 64 ); out->height = pepr_rng_range( &r, 8, 64 ); break;
+		case 1:
+		case 2: out->width = pepr_rng_range( &r, 8, medium ); out->height = pepr_rng_range( &r, 8, medium ); break;
+		case 3: out->width = max_dim; out->height = max_dim; break;
+		case 4: out->width = max_dim; out->height = pepr_rng_range( &r, 1, 64 ); break;
+		default: out->width = pepr_rng_range( &r, 1, 64 ); out->height = max_dim; break;
+	}
+	if( out->width > max_dim ) out->width = max_dim;
+	if( out->height > max_dim ) out->height = max_dim;
+	if( ( uint64_t )out->width * out->height < out->colors ) out->colors = out->width * out->height;
+	out->seed = pepr_rng_next( &r );
+}
+
+// The styles draw palette indices into idx (row stride `stride`) inside the
+// rectangle x0, y0, w, h.
+
+static void pepr_gen_fill( uint8_t* idx, const size_t stride, const uint32_t x0, const uint32_t y0, const uint32_t w, const uint32_t h, const uint8_t color )
+{
+	for( uint32_t y = y0; y < y0 + h; y++ ) memset( idx + y * stride + x0, color, w );
+}
+
+static void pepr_gen_draw_flat( pepr_rng* r, uint8_t* idx, const size_t stride, const uint32_t x0, const uint32_t y0, const uint32_t w, const uint32_t h, const uint32_t colors )
+{
+	pepr_gen_fill( idx, stride, x0, y0, w, h, ( uint8_t )pepr_rng_below( r, colors ) );
+	const uint32_t rects = pepr_rng_range( r, 4, 40 );
+	for( uint32_t i = 0; i < rects; i++ )
+	{
+		const uint32_t rw = pepr_rng_range( r, 1, w / 2 + 1 );
+		const uint32_t rh = pepr_rng_range( r, 1, h / 2 + 1 );
+		const uint32_t rx = pepr_rng_below( r, w - ( rw < w ? rw : w ) + 1 );
+		const uint32_t ry = pepr_rng_below( r, h - ( rh < h ? rh : h ) + 1 );
+		pepr_gen_fill( idx, stride, x0 + rx, y0 + ry, rw < w ? rw : w, rh < h ? rh : h, ( uint8_t )pepr_rng_below( r, colors ) );
+	}
+}
+
+static void pepr_gen_draw_dither( pepr_rng* r, uint8_t* idx, const size_t stride, const uint32_t x0, const uint32_t y0, const uint32_t w, const uint32_t h, const uint32_t colors )
+{
+	static const uint8_t bayer[ 4 ][ 4 ] = { { 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 } };
+	// The gradient runs diagonally, through all of the palette or part of it.
+	const uint32_t span = pepr_rng_range( r, colors > 8 ? 8 : colors, colors );
+	const uint32_t first = pepr_rng_below( r, colors - span + 1 );
+	const uint64_t extent = ( uint64_t )w + h;
+	for( uint32_t y = 0; y < h; y++ )
+	{
+		uint8_t* row = idx + ( y0 + y ) * stride + x0;
+		for( uint32_t x = 0; x < w; x++ )
+		{
+			const uint64_t pos = ( ( uint64_t )x + y ) * ( span - 1 ) * 16 / extent;
+			uint32_t i = ( uint32_t )( pos >> 4 ) + ( ( pos & 15 ) > bayer[ y & 3 ][ x & 3 ] );
+			if( i > span - 1 ) i = span - 1;
+			row[ x ] = ( uint8_t )( first + i );
+		}
+	}
+}
+
+static void pepr_gen_draw_tiles( pepr_rng* r, uint8_t* idx, const size_t stride, const uint32_t x0, const uint32_t y0, const uint32_t w, const uint32_t h, const uint32_t colors )
+{
+	const uint32_t tw = pepr_rng_range( r, 4, 32 );
+	const uint32_t th = pepr_rng_range( r, 4, 32 );
+	const uint32_t variants = pepr_rng_range( r, 1, 4 );
+	uint8_t tiles[ 4 ][ 32 * 32 ];
+	for( uint32_t v = 0; v < variants; v++ )
+	{
+		// A base color with a few flat blocks and speckles.
+		memset( tiles[ v ], ( int )pepr_rng_below( r, colors ), sizeof( tiles[ v ] ) );
+		const uint32_t blocks = pepr_rng_range( r, 1, 4 );
+		for( uint32_t b = 0; b < blocks; b++ )
+		{
+			const uint32_t bx = pepr_rng_below( r, tw ), by = pepr_rng_below( r, th );
+			const uint32_t bw = pepr_rng_range( r, 1, tw - bx ), bh = pepr_rng_range( r, 1, th - by );
+			const uint8_t color = ( uint8_t )pepr_rng_below( r, colors );
+			for( uint32_t y = by; y < by + bh; y++ ) memset( tiles[ v ] + y * 32 + bx, color, bw );
+		}
+		const uint32_t specks = pepr_rng_below( r, tw * th / 8 + 1 );
+		for( uint32_t s = 0; s < specks; s++ ) tiles[ v ][ pepr_rng_below( r, th ) * 32 + pepr_rng_below( r, tw ) ] = ( uint8_t )pepr_rng_below( r, colors );
+	}
+
+	for( uint32_t ty = 0; ty < h; ty += th )
+	{
+		for( uint32_t tx = 0; tx < w; tx += tw )
+		{
+			const uint8_t* tile = tiles[ pepr_rng_below( r, variants ) ];
+			for( uint32_t y = ty; y < ty + th && y < h; y++ )
+			{
+				for( uint32_t x = tx; x < tx + tw && x < w; x++ ) idx[ ( y0 + y ) * stride + x0 + x ] = tile[ ( y - ty ) * 32 + ( x - tx ) ];
+			}
+		}
+	}
+}
+
+static void pepr_gen_draw_sprites( pepr_rng* r, uint8_t* idx, const size_t stride, const uint32_t x0, const uint32_t y0, const uint32_t w, const uint32_t h, const uint32_t colors )
+{
+	const uint8_t background = ( uint8_t )pepr_rng_below( r, colors );
+	pepr_gen_fill( idx, stride, x0, y0, w, h, background );
+	const uint32_t cell = pepr_rng_range( r, 8, 24 );
+	for( uint32_t cy = 0; cy + cell <= h; cy += cell )
+	{
+		for( uint32_t cx = 0; cx + cell <= w; cx += cell )
+		{
+			// A 2-4 color sprite, mirrored left to right, with a 1 pixel margin.
+			uint8_t inks[ 4 ];
+			const uint32_t ink_count = pepr_rng_range( r, 2, 4 );
+			for( uint32_t i = 0; i < ink_count; i++ ) inks[ i ] = ( uint8_t )pepr_rng_below( r, colors );
+			const uint32_t size = cell - 2;
+			for( uint32_t y = 0; y < size; y++ )
+			{
+				uint8_t* row = idx + ( y0 + cy + 1 + y ) * stride + x0 + cx + 1;
+				for( uint32_t x = 0; x < ( size + 1 ) / 2; x++ )
+				{
+					const uint8_t color = pepr_rng_below( r, 2 ) ? inks[ pepr_rng_below( r, ink_count ) ] : background;
+					row[ x ] = color;
+					row[ size - 1 - x ] = color;
+				}
+			}
+		}
+	}
+}
+
+static void pepr_gen_draw( pepr_rng* r, const pepr_gen_style style, uint8_t* idx, const size_t stride, const uint32_t x0, const uint32_t y0, const uint32_t w, const uint32_t h, const uint32_t colors )
+{
+	if( w == 0 || h == 0 ) return;
+	switch( style )
+	{
+		case pepr_gen_flat: pepr_gen_draw_flat( r, idx, stride, x0, y0, w, h, colors ); break;
+		case pepr_gen_dither: pepr_gen_draw_dither( r, idx, stride, x0, y0, w, h, colors ); break;
+		case pepr_gen_tiles: pepr_gen_draw_tiles( r, idx, stride, x0, y0, w, h, colors ); break;
+		case pepr_gen_sprites: pepr_gen_draw_sprites( r, idx, stride, x0, y0, w, h, colors ); break;
+		case pepr_gen_noise:
+			for( uint32_t y = y0; y < y0 + h; y++ )
+			{
+				for( uint32_t x = x0; x < x0 + w; x++ ) idx[ y * stride + x ] = ( uint8_t )pepr_rng_below( r, colors );
+			}
+			break;
+		default:
+		{
+			const uint32_t band = h / 3;
+			pepr_gen_draw_flat( r, idx, stride, x0, y0, w, band ? band : h, colors );
+			if( band )
+			{
+				pepr_gen_draw_dither( r, idx, stride, x0, y0 + band, w, band, colors );
+				pepr_gen_draw_tiles( r, idx, stride, x0, y0 + 2 * band, w, h - 2 * band, colors );
+			}
+			break;
+		}
+	}
+}
+
+// Renders spec into packed 0xRRGGBBAA pixels, or NULL if out of memory.
+// Colors are opaque, or 0 for the transparent one, so they're the same
+// premultiplied or not and survive a PNG round trip exactly.
+static uint32_t* pepr_gen_image( const pepr_gen_spec* spec )
+{
+	const size_t w = spec->width, h = spec->height, area = w * h;
+	uint8_t* idx = ( uint8_t* )malloc( area );
+	uint32_t* pixels = ( uint32_t* )malloc( area * sizeof( uint32_t ) );
+	if( !idx || !pixels ){ free( idx ); free( pixels ); return NULL; }
+
+	pepr_rng r = { spec->seed };
+	uint32_t palette[ 256 ];
+	for( uint32_t i = 0; i < spec->colors; i++ )
+	{
+		uint32_t color;
+		int dup;
+		do
+		{
+			color = ( ( uint32_t )pepr_rng_next( &r ) << 8 ) | 0xFF;
+			dup = 0;
+			for( uint32_t j = 0; j < i; j++ ) dup |= palette[ j ] == color;
+		} while( dup );
+		palette[ i ] = color;
+	}
+	if( spec->transparent ) palette[ 0 ] = 0;
+
+	pepr_gen_draw( &r, spec->style, idx, w, 0, 0, spec->width, spec->height, spec->colors );
+
+	if( spec->noise_pm )
+	{
+		for( size_t i = 0; i < area; i++ )
+		{
+			if( pepr_rng_below( &r, 1000 ) < spec->noise_pm ) idx[ i ] = ( uint8_t )pepr_rng_below( &r, spec->colors );
+		}
+	}
+
+	// Every color shows up at least once, so the image really is in its
+	// bits-per-index class: a missing one takes over a pixel from a color that
+	// has more than one (there always is one, since colors <= area).
+	size_t counts[ 256 ] = { 0 };
+	for( size_t i = 0; i < area; i++ ) counts[ idx[ i ] ]++;
+	for( uint32_t i = 0; i < spec->colors; i++ )
+	{
+		if( counts[ i ] ) continue;
+		size_t at = ( size_t )( pepr_rng_next( &r ) % area );
+		while( counts[ idx[ at ] ] < 2 ) at = ( at + 1 ) % area;
+		counts[ idx[ at ] ]--;
+		idx[ at ] = ( uint8_t )i;
+		counts[ i ] = 1;
+	}
+
+	for( size_t i = 0; i < area; i++ ) pixels[ i ] = palette[ idx[ i ] ];
+	free( idx );
+	return pixels;
+}
+
+//////// /////// /////// /////// /////// /////// ///////
+// PNG writer: one fixed-Huffman deflate block that matches against the
+// previous pixel and the previous row, which is most of what pixel art has.
+
+typedef struct
+{
+	uint8_t* out;
+	size_t pos;
+	uint64_t bits;
+	uint32_t count;
+} pepr_bit_writer;
+
+static inline void pepr_bits_put( pepr_bit_writer* b, const uint32_t value, const uint32_t n )
+{
+	b->bits |= ( uint64_t )value << b->count;
+	b->count += n;
+	while( b->count >= 8 )
+	{
+		b->out[ b->pos++ ] = ( uint8_t )b->bits;
+		b->bits >>= 8;
+		b->count -= 8;
+	}
+}
+
+// Huffman codes are sent most significant bit first.
+static inline void pepr_bits_code( pepr_bit_writer* b, const uint32_t code, const uint32_t n )
+{
+	uint32_t reversed = 0;
+	for( uint32_t i = 0; i < n; i++ ) reversed |= ( ( code >> i ) & 1 ) << ( n - 1 - i );
+	pepr_bits_put( b, reversed, n );
+}
+
+static inline void pepr_deflate_symbol( pepr_bit_writer* b, const uint32_t sym )
+{
+	if( sym < 144 ) pepr_bits_code( b, 0x30 + sym, 8 );
+	else if( sym < 256 ) pepr_bits_code( b, 0x190 + sym - 144, 9 );
+	else if( sym < 280 ) pepr_bits_code( b, sym - 256, 7 );
+	else pepr_bits_code( b, 0xC0 + sym - 280, 8 );
+}
+
+static void pepr_deflate_match( pepr_bit_writer* b, const uint32_t length, const uint32_t distance )
+{
+	static const uint16_t len_base[ 29 ] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t len_extra[ 29 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const uint16_t dist_base[ 30 ] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	static const uint8_t dist_extra[ 30 ] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	uint32_t l = 28;
+	while( len_base[ l ] > length ) l--;
+	pepr_deflate_symbol( b, 257 + l );
+	pepr_bits_put( b, length - len_base[ l ], len_extra[ l ] );
+
+	uint32_t d = 29;
+	while( dist_base[ d ] > distance ) d--;
+	pepr_bits_code( b, d, 5 );
+	pepr_bits_put( b, distance - dist_base[ d ], dist_extra[ d ] );
+}
+
+static uint32_t pepr_crc32( uint32_t crc, const uint8_t* data, const size_t size )
+{
+	static uint32_t table[ 256 ];
+	if( !table[ 1 ] )
+	{
+		for( uint32_t i = 0; i < 256; i++ )
+		{
+			uint32_t c = i;
+			for( int k = 0; k < 8; k++ ) c = ( c & 1 ) ? 0xEDB88320u ^ ( c >> 1 ) : c >> 1;
+			table[ i ] = c;
+		}
+	}
+	crc = ~crc;
+	for( size_t i = 0; i < size; i++ ) crc = table[ ( crc ^ data[ i ] ) & 0xFF ] ^ ( crc >> 8 );
+	return ~crc;
+}
+
+static void pepr_wr32be( uint8_t* p, const uint32_t v )
+{
+	p[ 0 ] = ( uint8_t )( v >> 24 ); p[ 1 ] = ( uint8_t )( v >> 16 ); p[ 2 ] = ( uint8_t )( v >> 8 ); p[ 3 ] = ( uint8_t )v;
+}
+
+static int pepr_png_chunk( FILE* f, const char* type, const uint8_t* data, const uint32_t size )
+{
+	uint8_t head[ 8 ], tail[ 4 ];
+	pepr_wr32be( head, size );
+	memcpy( head + 4, type, 4 );
+	pepr_wr32be( tail, pepr_crc32( pepr_crc32( 0, head + 4, 4 ), data, size ) );
+	return fwrite( head, 1, 8, f ) == 8 && ( size == 0 || fwrite( data, 1, size, f ) == size ) && fwrite( tail, 1, 4, f ) == 4;
+}
+
+// Writes packed 0xRRGGBBAA pixels as an 8-bit RGBA PNG. Returns 0 on success,
+// 3 if the file can't be written and 4 if out of memory.
+static int pepr_write_png( const char* path, const uint32_t* pixels, const uint32_t w, const uint32_t h )
+{
+	const size_t stride = ( size_t )w * 4 + 1;
+	const size_t raw_size = stride * h;
+	uint8_t* raw = ( uint8_t* )malloc( raw_size );
+	// Literals take at most 9 bits, and matches less per byte.
+	uint8_t* z = ( uint8_t* )malloc( raw_size + raw_size / 8 + 64 );
+	if( !raw || !z ){ free( raw ); free( z ); return 4; }
+
+	for( uint32_t y = 0; y < h; y++ )
+	{
+		uint8_t* row = raw + y * stride;
+		row[ 0 ] = 0; // no filter
+		for( uint32_t x = 0; x < w; x++ )
+		{
+			const uint32_t p = pixels[ ( size_t )y * w + x ];
+			row[ 1 + x * 4 ] = ( uint8_t )( p >> 24 );
+			row[ 2 + x * 4 ] = ( uint8_t )( p >> 16 );
+			row[ 3 + x * 4 ] = ( uint8_t )( p >> 8 );
+			row[ 4 + x * 4 ] = ( uint8_t )p;
+		}
+	}
+
+	pepr_bit_writer b = { z, 0, 0, 0 };
+	b.out[ b.pos++ ] = 0x78; // zlib: deflate, 32K window
+	b.out[ b.pos++ ] = 0x01;
+	pepr_bits_put( &b, 1, 1 ); // final block
+	pepr_bits_put( &b, 1, 2 ); // fixed Huffman
+	const size_t up = stride <= 32768 ? stride : 0;
+	for( size_t i = 0; i < raw_size; )
+	{
+		const size_t max = raw_size - i < 258 ? raw_size - i : 258;
+		size_t best = 0, best_dist = 0;
+		const size_t dists[ 2 ] = { 4, up };
+		for( int c = 0; c < 2; c++ )
+		{
+			const size_t d = dists[ c ];
+			if( !d || d > i ) continue;
+			size_t n = 0;
+			while( n < max && raw[ i + n ] == raw[ i + n - d ] ) n++;
+			if( n > best ){ best = n; best_dist = d; }
+		}
+		if( best >= 3 )
+		{
+			pepr_deflate_match( &b, ( uint32_t )best, ( uint32_t )best_dist );
+			i += best;
+		}
+		else pepr_deflate_symbol( &b, raw[ i++ ] );
+	}
+	pepr_deflate_symbol( &b, 256 );
+	if( b.count ) pepr_bits_put( &b, 0, 8 - b.count );
+
+	uint32_t s1 = 1, s2 = 0;
+	for( size_t i = 0; i < raw_size; i++ )
+	{
+		s1 = ( s1 + raw[ i ] ) % 65521;
+		s2 = ( s2 + s1 ) % 65521;
+	}
+	pepr_wr32be( b.out + b.pos, ( s2 << 16 ) | s1 );
+	b.pos += 4;
+	free( raw );
+
+	FILE* f = fopen( path, "wb" );
+	if( !f ){ free( z ); return 3; }
+	uint8_t ihdr[ 13 ];
+	pepr_wr32be( ihdr, w );
+	pepr_wr32be( ihdr + 4, h );
+	ihdr[ 8 ] = 8; // bits per channel
+	ihdr[ 9 ] = 6; // RGBA
+	ihdr[ 10 ] = ihdr[ 11 ] = ihdr[ 12 ] = 0;
+	int ok = fwrite( "\x89PNG\r\n\x1a\n", 1, 8, f ) == 8 && pepr_png_chunk( f, "IHDR", ihdr, 13 );
+	for( size_t at = 0; ok && at < b.pos; at += 1u << 20 )
+	{
+		const size_t n = b.pos - at < ( 1u << 20 ) ? b.pos - at : ( 1u << 20 );
+		ok = pepr_png_chunk( f, "IDAT", z + at, ( uint32_t )n );
+	}
+	ok = ok && pepr_png_chunk( f, "IEND", NULL, 0 );
+	ok = fclose( f ) == 0 && ok;
+	free( z );
+	return ok ? 0 : 3;
+}
+
+#endif // PEPR_GEN_H
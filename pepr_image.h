@@ -0,0 +1,855 @@
+// Built-in image readers for pepr, with no dependencies beyond libc.
+// Supports BMP (1/4/8/16/24/32-bit, RLE4/RLE8, bitfields), PPM/PGM (P2/P3/P5/P6),
+// PAM (P7), TGA (color-mapped, true-color, grayscale and their RLE variants)
+// and PNG (every color type and bit depth, interlaced or not).
+//
+// Every reader decodes straight into the packed 0xRRGGBBAA uint32_t buffer
+// that `pep_compress( ..., pep_rgba, ... )` takes, so there's no intermediate
+// RGBA8 byte buffer. Color is premultiplied by alpha, the same as the
+// CoreGraphics path (kCGImageAlphaPremultipliedLast), so a file encodes to the
+// same .pep on every platform.
+
+#ifndef PEPR_IMAGE_H
+#define PEPR_IMAGE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Images larger than this in either dimension are rejected before allocating.
+#ifndef PEPR_IMAGE_MAX_DIM
+	#define PEPR_IMAGE_MAX_DIM 65535u
+#endif
+
+static inline uint32_t pepr_rgba( uint32_t r, uint32_t g, uint32_t b, const uint32_t a )
+{
+	if( a != 255 )
+	{
+		r = ( r * a + 127 ) / 255;
+		g = ( g * a + 127 ) / 255;
+		b = ( b * a + 127 ) / 255;
+	}
+	return ( r << 24 ) | ( g << 16 ) | ( b << 8 ) | a;
+}
+
+static inline uint32_t pepr_rd16le( const uint8_t* p ){ return ( uint32_t )p[ 0 ] | ( ( uint32_t )p[ 1 ] << 8 ); }
+static inline uint32_t pepr_rd32le( const uint8_t* p ){ return pepr_rd16le( p ) | ( pepr_rd16le( p + 2 ) << 16 ); }
+static inline uint32_t pepr_rd32be( const uint8_t* p ){ return ( ( uint32_t )p[ 0 ] << 24 ) | ( ( uint32_t )p[ 1 ] << 16 ) | ( ( uint32_t )p[ 2 ] << 8 ) | p[ 3 ]; }
+
+static uint32_t* pepr_alloc_pixels( const size_t w, const size_t h, const char** err )
+{
+	if( w == 0 || h == 0 || w > PEPR_IMAGE_MAX_DIM || h > PEPR_IMAGE_MAX_DIM ){ *err = "invalid image size"; return NULL; }
+	uint32_t* pixels = ( uint32_t* )calloc( w * h, sizeof( uint32_t ) );
+	if( !pixels ) *err = "alloc failed";
+	return pixels;
+}
+
+/////// /////// /////// /////// /////// /////// ///////
+// BMP
+
+// Extracts a channel through a bitfield mask, scaled to 8 bits.
+static inline uint32_t pepr_bmp_field( const uint32_t v, const uint32_t mask )
+{
+	if( !mask ) return 0;
+	uint32_t shift = 0;
+	while( !( ( mask >> shift ) & 1 ) ) shift++;
+	const uint32_t bits_mask = mask >> shift;
+	const uint32_t x = ( v & mask ) >> shift;
+	return bits_mask == 255 ? x : ( x * 255 + bits_mask / 2 ) / bits_mask;
+}
+
+static uint32_t* pepr_load_bmp( const uint8_t* data, const size_t size, size_t* out_w, size_t* out_h, const char** err )
+{
+	if( size < 26 ){ *err = "truncated BMP"; return NULL; }
+	const uint32_t data_offset = pepr_rd32le( data + 10 );
+	const uint32_t info_size = pepr_rd32le( data + 14 );
+	if( info_size < 12 || 14 + ( size_t )info_size > size ){ *err = "bad BMP header"; return NULL; }
+
+	int32_t w, h;
+	uint32_t bpp, compression = 0, colors_used = 0;
+	uint32_t masks[ 4 ] = { 0, 0, 0, 0 };
+	size_t palette_entry = 4;
+	if( info_size == 12 )
+	{
+		w = ( int32_t )pepr_rd16le( data + 18 );
+		h = ( int16_t )pepr_rd16le( data + 20 );
+		bpp = pepr_rd16le( data + 24 );
+		palette_entry = 3;
+	}
+	else
+	{
+		if( info_size < 40 ){ *err = "bad BMP header"; return NULL; }
+		w = ( int32_t )pepr_rd32le( data + 18 );
+		h = ( int32_t )pepr_rd32le( data + 22 );
+		bpp = pepr_rd16le( data + 28 );
+		compression = pepr_rd32le( data + 30 );
+		colors_used = pepr_rd32le( data + 46 );
+		if( info_size >= 52 ){ masks[ 0 ] = pepr_rd32le( data + 54 ); masks[ 1 ] = pepr_rd32le( data + 58 ); masks[ 2 ] = pepr_rd32le( data + 62 ); }
+		if( info_size >= 56 ) masks[ 3 ] = pepr_rd32le( data + 66 );
+		// BI_BITFIELDS masks follow a plain 40-byte header.
+		if( info_size == 40 && ( compression == 3 || compression == 6 ) && size >= 14 + 40 + 12 )
+		{
+			masks[ 0 ] = pepr_rd32le( data + 54 ); masks[ 1 ] = pepr_rd32le( data + 58 ); masks[ 2 ] = pepr_rd32le( data + 62 );
+			if( compression == 6 && size >= 14 + 40 + 16 ) masks[ 3 ] = pepr_rd32le( data + 66 );
+		}
+	}
+
+	const int top_down = h < 0;
+	if( w <= 0 || h == 0 || h == INT32_MIN ){ *err = "invalid image size"; return NULL; }
+	if( top_down ) h = -h;
+	if( data_offset >= size ){ *err = "truncated BMP"; return NULL; }
+
+	// Palette, for <= 8 bits per pixel.
+	uint32_t palette[ 256 ];
+	memset( palette, 0, sizeof( palette ) );
+	if( bpp <= 8 )
+	{
+		uint32_t count = colors_used ? colors_used : ( 1u << bpp );
+		if( count > 256 ) count = 256;
+		const uint8_t* pal = data + 14 + info_size + ( ( info_size == 40 && compression == 3 ) ? 12 : 0 );
+		for( uint32_t i = 0; i < count && pal + palette_entry <= data + data_offset; i++, pal += palette_entry )
+		{
+			palette[ i ] = pepr_rgba( pal[ 2 ], pal[ 1 ], pal[ 0 ], 255 );
+		}
+	}
+
+	uint32_t* pixels = pepr_alloc_pixels( ( size_t )w, ( size_t )h, err );
+	if( !pixels ) return NULL;
+	*out_w = ( size_t )w;
+	*out_h = ( size_t )h;
+
+	const uint8_t* src = data + data_offset;
+	const uint8_t* end = data + size;
+	#define PEPR_BMP_ROW( Y ) ( pixels + ( size_t )( top_down ? ( Y ) : ( h - 1 - ( Y ) ) ) * ( size_t )w )
+
+	if( compression == 1 || compression == 2 )
+	{
+		// RLE8 / RLE4: pixels that are never written keep palette index 0.
+		const int rle4 = compression == 2;
+		for( size_t i = 0; i < ( size_t )w * ( size_t )h; i++ ) pixels[ i ] = palette[ 0 ];
+		int32_t x = 0, y = 0;
+		while( src + 2 <= end && y < h )
+		{
+			const uint8_t count = src[ 0 ], value = src[ 1 ];
+			src += 2;
+			if( count )
+			{
+				uint32_t* row = PEPR_BMP_ROW( y );
+				for( uint32_t i = 0; i < count && x < w; i++, x++ )
+				{
+					row[ x ] = palette[ rle4 ? ( ( i & 1 ) ? ( value & 0x0F ) : ( value >> 4 ) ) : value ];
+				}
+			}
+			else if( value == 0 ){ x = 0; y++; }
+			else if( value == 1 ) break;
+			else if( value == 2 )
+			{
+				if( src + 2 > end ) break;
+				x += src[ 0 ]; y += src[ 1 ];
+				src += 2;
+			}
+			else
+			{
+				const size_t bytes = rle4 ? ( value + 1u ) / 2u : value;
+				if( src + bytes > end ) break;
+				if( y < h )
+				{
+					uint32_t* row = PEPR_BMP_ROW( y );
+					for( uint32_t i = 0; i < value && x < w; i++, x++ )
+					{
+						row[ x ] = palette[ rle4 ? ( ( i & 1 ) ? ( src[ i / 2 ] & 0x0F ) : ( src[ i / 2 ] >> 4 ) ) : src[ i ] ];
+					}
+				}
+				src += ( bytes + 1 ) & ~( size_t )1; // word aligned
+			}
+		}
+		return pixels;
+	}
+
+	if( compression != 0 && compression != 3 && compression != 6 ){ free( pixels ); *err = "unsupported BMP compression"; return NULL; }
+	if( bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32 ){ free( pixels ); *err = "unsupported BMP bit depth"; return NULL; }
+
+	const size_t stride = ( ( ( size_t )w * bpp + 31 ) / 32 ) * 4;
+	if( ( size_t )( end - src ) < stride * ( size_t )h ){ free( pixels ); *err = "truncated BMP"; return NULL; }
+
+	if( bpp == 16 && !masks[ 0 ] ){ masks[ 0 ] = 0x7C00; masks[ 1 ] = 0x03E0; masks[ 2 ] = 0x001F; }
+	const int use_masks = ( bpp == 16 || bpp == 32 ) && masks[ 0 ] && ( compression == 3 || compression == 6 || bpp == 16 );
+
+	// Plain 32-bit BMPs usually leave the 4th byte at 0; only treat it as alpha
+	// when something in the image actually uses it.
+	int has_alpha = use_masks ? masks[ 3 ] != 0 : 0;
+	if( bpp == 32 && !use_masks )
+	{
+		for( int32_t y = 0; y < h && !has_alpha; y++ )
+		{
+			const uint8_t* row = src + ( size_t )y * stride;
+			for( int32_t x = 0; x < w; x++ ) if( row[ x * 4 + 3 ] ){ has_alpha = 1; break; }
+		}
+	}
+
+	for( int32_t y = 0; y < h; y++ )
+	{
+		const uint8_t* in = src + ( size_t )y * stride;
+		uint32_t* row = top_down ? pixels + ( size_t )y * w : pixels + ( size_t )( h - 1 - y ) * w;
+		switch( bpp )
+		{
+			case 1: case 4: case 8:
+			{
+				const uint32_t per_byte = 8 / bpp, mask = ( 1u << bpp ) - 1;
+				for( int32_t x = 0; x < w; x++ )
+				{
+					const uint32_t shift = 8 - bpp * ( 1 + ( x % per_byte ) );
+					row[ x ] = palette[ ( in[ x / per_byte ] >> shift ) & mask ];
+				}
+				break;
+			}
+			case 16: case 32:
+				if( use_masks )
+				{
+					for( int32_t x = 0; x < w; x++ )
+					{
+						const uint32_t v = bpp == 16 ? pepr_rd16le( in + x * 2 ) : pepr_rd32le( in + x * 4 );
+						row[ x ] = pepr_rgba( pepr_bmp_field( v, masks[ 0 ] ), pepr_bmp_field( v, masks[ 1 ] ), pepr_bmp_field( v, masks[ 2 ] ), masks[ 3 ] ? pepr_bmp_field( v, masks[ 3 ] ) : 255 );
+					}
+				}
+				else
+				{
+					for( int32_t x = 0; x < w; x++ )
+					{
+						const uint8_t* px = in + x * 4;
+						row[ x ] = pepr_rgba( px[ 2 ], px[ 1 ], px[ 0 ], has_alpha ? px[ 3 ] : 255 );
+					}
+				}
+				break;
+			case 24:
+				for( int32_t x = 0; x < w; x++ )
+				{
+					const uint8_t* px = in + x * 3;
+					row[ x ] = pepr_rgba( px[ 2 ], px[ 1 ], px[ 0 ], 255 );
+				}
+				break;
+		}
+	}
+	#undef PEPR_BMP_ROW
+	return pixels;
+}
+
+/////// /////// /////// /////// /////// /////// ///////
+// PPM / PGM / PAM
+
+// Skips whitespace and # comments, then reads an unsigned decimal.
+static int pepr_pnm_uint( const uint8_t** p, const uint8_t* end, uint32_t* out )
+{
+	const uint8_t* s = *p;
+	for( ;; )
+	{
+		while( s < end && ( *s == ' ' || *s == '\t' || *s == '\r' || *s == '\n' ) ) s++;
+		if( s < end && *s == '#' ){ while( s < end && *s != '\n' ) s++; continue; }
+		break;
+	}
+	if( s >= end || *s < '0' || *s > '9' ) return 0;
+	uint64_t v = 0;
+	while( s < end && *s >= '0' && *s <= '9' ){ v = v * 10 + ( uint64_t )( *s++ - '0' ); if( v > 0xFFFFFFFFu ) return 0; }
+	*out = ( uint32_t )v;
+	*p = s;
+	return 1;
+}
+
+static uint32_t* pepr_load_pnm( const uint8_t* data, const size_t size, size_t* out_w, size_t* out_h, const char** err )
+{
+	const uint8_t* p = data + 2;
+	const uint8_t* end = data + size;
+	const char kind = ( char )data[ 1 ];
+	uint32_t w = 0, h = 0, maxval = 255, depth = 3;
+
+	if( kind == '7' )
+	{
+		// PAM: "KEY value" lines up to ENDHDR.
+		depth = 0;
+		while( p < end )
+		{
+			while( p < end && ( *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' ) ) p++;
+			if( p < end && *p == '#' ){ while( p < end && *p != '\n' ) p++; continue; }
+			const uint8_t* key = p;
+			while( p < end && *p > ' ' ) p++;
+			const size_t key_len = ( size_t )( p - key );
+			if( key_len == 6 && !memcmp( key, "ENDHDR", 6 ) )
+			{
+				while( p < end && *p != '\n' ) p++;
+				if( p >= end ){ *err = "truncated PAM"; return NULL; }
+				p++;
+				break;
+			}
+			if( key_len == 5 && !memcmp( key, "WIDTH", 5 ) ){ if( !pepr_pnm_uint( &p, end, &w ) ) break; }
+			else if( key_len == 6 && !memcmp( key, "HEIGHT", 6 ) ){ if( !pepr_pnm_uint( &p, end, &h ) ) break; }
+			else if( key_len == 5 && !memcmp( key, "DEPTH", 5 ) ){ if( !pepr_pnm_uint( &p, end, &depth ) ) break; }
+			else if( key_len == 6 && !memcmp( key, "MAXVAL", 6 ) ){ if( !pepr_pnm_uint( &p, end, &maxval ) ) break; }
+			else while( p < end && *p != '\n' ) p++; // TUPLTYPE etc., depth says it all
+		}
+		if( depth < 1 || depth > 4 ){ *err = "unsupported PAM depth"; return NULL; }
+	}
+	else
+	{
+		if( !pepr_pnm_uint( &p, end, &w ) || !pepr_pnm_uint( &p, end, &h ) ){ *err = "bad PNM header"; return NULL; }
+		if( !pepr_pnm_uint( &p, end, &maxval ) ){ *err = "bad PNM header"; return NULL; }
+		depth = ( kind == '2' || kind == '5' ) ? 1 : 3;
+		if( kind == '5' || kind == '6' )
+		{
+			// Single whitespace before the raster.
+			if( p >= end ){ *err = "truncated PNM"; return NULL; }
+			p++;
+		}
+	}
+	if( maxval == 0 || maxval > 65535 ){ *err = "bad PNM maxval"; return NULL; }
+
+	uint32_t* pixels = pepr_alloc_pixels( w, h, err );
+	if( !pixels ) return NULL;
+	*out_w = w;
+	*out_h = h;
+
+	const int ascii = kind == '2' || kind == '3';
+	const size_t sample_bytes = maxval > 255 ? 2 : 1;
+	const size_t count = ( size_t )w * h;
+	if( !ascii && ( size_t )( end - p ) < count * depth * sample_bytes ){ free( pixels ); *err = "truncated PNM"; return NULL; }
+
+	for( size_t i = 0; i < count; i++ )
+	{
+		uint32_t s[ 4 ] = { 0, 0, 0, maxval };
+		for( uint32_t c = 0; c < depth; c++ )
+		{
+			if( ascii )
+			{
+				if( !pepr_pnm_uint( &p, end, &s[ c ] ) ){ free( pixels ); *err = "truncated PNM"; return NULL; }
+			}
+			else if( sample_bytes == 2 ){ s[ c ] = ( ( uint32_t )p[ 0 ] << 8 ) | p[ 1 ]; p += 2; }
+			else s[ c ] = *p++;
+			if( maxval != 255 ) s[ c ] = ( s[ c ] * 255 + maxval / 2 ) / maxval;
+		}
+		if( maxval != 255 && depth != 2 && depth != 4 ) s[ 3 ] = 255;
+		switch( depth )
+		{
+			case 1: pixels[ i ] = pepr_rgba( s[ 0 ], s[ 0 ], s[ 0 ], maxval == 255 ? 255 : s[ 3 ] ); break;
+			case 2: pixels[ i ] = pepr_rgba( s[ 0 ], s[ 0 ], s[ 0 ], s[ 1 ] ); break;
+			case 3: pixels[ i ] = pepr_rgba( s[ 0 ], s[ 1 ], s[ 2 ], maxval == 255 ? 255 : s[ 3 ] ); break;
+			default: pixels[ i ] = pepr_rgba( s[ 0 ], s[ 1 ], s[ 2 ], s[ 3 ] ); break;
+		}
+	}
+	return pixels;
+}
+
+/////// /////// /////// /////// /////// /////// ///////
+// TGA
+
+static inline uint32_t pepr_tga_color( const uint8_t* px, const uint32_t bpp, const int has_alpha )
+{
+	switch( bpp )
+	{
+		case 8: return pepr_rgba( px[ 0 ], px[ 0 ], px[ 0 ], 255 );
+		case 15: case 16:
+		{
+			const uint32_t v = pepr_rd16le( px );
+			const uint32_t r = ( v >> 10 ) & 31, g = ( v >> 5 ) & 31, b = v & 31;
+			return pepr_rgba( ( r << 3 ) | ( r >> 2 ), ( g << 3 ) | ( g >> 2 ), ( b << 3 ) | ( b >> 2 ), ( bpp == 16 && has_alpha ) ? ( ( v & 0x8000 ) ? 255 : 0 ) : 255 );
+		}
+		case 24: return pepr_rgba( px[ 2 ], px[ 1 ], px[ 0 ], 255 );
+		default: return pepr_rgba( px[ 2 ], px[ 1 ], px[ 0 ], has_alpha ? px[ 3 ] : 255 );
+	}
+}
+
+static uint32_t* pepr_load_tga( const uint8_t* data, const size_t size, size_t* out_w, size_t* out_h, const char** err )
+{
+	if( size < 18 ){ *err = "truncated TGA"; return NULL; }
+	const uint32_t id_len = data[ 0 ], cmap_type = data[ 1 ], type = data[ 2 ];
+	const uint32_t cmap_first = pepr_rd16le( data + 3 ), cmap_len = pepr_rd16le( data + 5 ), cmap_bpp = data[ 7 ];
+	const uint32_t w = pepr_rd16le( data + 12 ), h = pepr_rd16le( data + 14 );
+	const uint32_t bpp = data[ 16 ], desc = data[ 17 ];
+	const int rle = type >= 9;
+	const uint32_t base_type = rle ? type - 8 : type;
+	if( base_type < 1 || base_type > 3 ){ *err = "unsupported TGA type"; return NULL; }
+
+	const uint8_t* p = data + 18 + id_len;
+	const uint8_t* end = data + size;
+
+	// The color map is expanded up front so indexed pixels are a table lookup.
+	uint32_t* cmap = NULL;
+	if( cmap_type == 1 )
+	{
+		if( cmap_bpp != 15 && cmap_bpp != 16 && cmap_bpp != 24 && cmap_bpp != 32 ){ *err = "unsupported TGA color map depth"; return NULL; }
+		const size_t entry = ( cmap_bpp + 7 ) / 8;
+		if( p + entry * cmap_len > end ){ *err = "truncated TGA"; return NULL; }
+		if( base_type == 1 )
+		{
+			cmap = ( uint32_t* )calloc( cmap_first + cmap_len + 1, sizeof( uint32_t ) );
+			if( !cmap ){ *err = "alloc failed"; return NULL; }
+			for( uint32_t i = 0; i < cmap_len; i++ ) cmap[ cmap_first + i ] = pepr_tga_color( p + i * entry, cmap_bpp == 15 ? 15 : cmap_bpp, ( desc & 0x0F ) != 0 || cmap_bpp == 32 );
+		}
+		p += entry * cmap_len;
+	}
+	if( base_type == 1 && ( !cmap || ( bpp != 8 && bpp != 16 ) ) ){ free( cmap ); *err = "bad TGA color map"; return NULL; }
+	if( base_type == 2 && bpp != 15 && bpp != 16 && bpp != 24 && bpp != 32 ){ *err = "unsupported TGA bit depth"; return NULL; }
+	if( base_type == 3 && bpp != 8 ){ *err = "unsupported TGA bit depth"; return NULL; }
+
+	uint32_t* pixels = pepr_alloc_pixels( w, h, err );
+	if( !pixels ){ free( cmap ); return NULL; }
+	*out_w = w;
+	*out_h = h;
+
+	const size_t pixel_bytes = ( bpp + 7 ) / 8;
+	const int has_alpha = ( desc & 0x0F ) != 0 || bpp == 32;
+	const size_t cmap_size = cmap_first + cmap_len;
+	const size_t count = ( size_t )w * h;
+	size_t i = 0;
+	while( i < count )
+	{
+		size_t run = 1;
+		int repeat = 0;
+		if( rle )
+		{
+			if( p >= end ){ free( pixels ); free( cmap ); *err = "truncated TGA"; return NULL; }
+			repeat = ( *p & 0x80 ) != 0;
+			run = ( size_t )( *p & 0x7F ) + 1;
+			p++;
+		}
+		for( size_t k = 0; k < run && i < count; k++, i++ )
+		{
+			if( p + pixel_bytes > end ){ free( pixels ); free( cmap ); *err = "truncated TGA"; return NULL; }
+			uint32_t c;
+			if( base_type == 1 )
+			{
+				const uint32_t index = pixel_bytes == 2 ? pepr_rd16le( p ) : p[ 0 ];
+				c = index < cmap_size ? cmap[ index ] : 0;
+			}
+			else c = pepr_tga_color( p, bpp, has_alpha );
+
+			// Pixels are stored bottom-up unless the descriptor says otherwise.
+			const size_t x = i % w, y = i / w;
+			const size_t out_x = ( desc & 0x10 ) ? w - 1 - x : x;
+			const size_t out_y = ( desc & 0x20 ) ? y : h - 1 - y;
+			pixels[ out_y * w + out_x ] = c;
+
+			if( !repeat || k + 1 == run ) p += pixel_bytes;
+		}
+	}
+	free( cmap );
+	return pixels;
+}
+
+/////// /////// /////// /////// /////// /////// ///////
+// PNG, with a small inflate (stored, fixed and dynamic Huffman blocks)
+
+typedef struct
+{
+	const uint8_t* in;
+	size_t in_size;
+	size_t in_pos;
+	uint32_t bit_buf;
+	uint32_t bit_count;
+	uint8_t* out;
+	size_t out_size;
+	size_t out_pos;
+	int error;
+}
+pepr_inflate;
+
+typedef struct
+{
+	uint16_t count[ 16 ];
+	uint16_t symbol[ 288 ];
+}
+pepr_huffman;
+
+static inline uint32_t pepr_inflate_bits( pepr_inflate* s, const uint32_t n )
+{
+	while( s->bit_count < n )
+	{
+		if( s->in_pos >= s->in_size ){ s->error = 1; return 0; }
+		s->bit_buf |= ( uint32_t )s->in[ s->in_pos++ ] << s->bit_count;
+		s->bit_count += 8;
+	}
+	const uint32_t v = s->bit_buf & ( ( 1u << n ) - 1 );
+	s->bit_buf >>= n;
+	s->bit_count -= n;
+	return v;
+}
+
+// Canonical Huffman table from code lengths. Returns 0 if over-subscribed.
+static int pepr_huffman_build( pepr_huffman* hm, const uint8_t* lengths, const uint32_t n )
+{
+	uint16_t offsets[ 16 ];
+	memset( hm->count, 0, sizeof( hm->count ) );
+	for( uint32_t i = 0; i < n; i++ ) hm->count[ lengths[ i ] ]++;
+	int left = 1;
+	for( uint32_t len = 1; len < 16; len++ )
+	{
+		left = ( left << 1 ) - hm->count[ len ];
+		if( left < 0 ) return 0;
+	}
+	offsets[ 1 ] = 0;
+	for( uint32_t len = 1; len < 15; len++ ) offsets[ len + 1 ] = offsets[ len ] + hm->count[ len ];
+	for( uint32_t i = 0; i < n; i++ ) if( lengths[ i ] ) hm->symbol[ offsets[ lengths[ i ] ]++ ] = ( uint16_t )i;
+	return 1;
+}
+
+static int pepr_huffman_decode( pepr_inflate* s, const pepr_huffman* hm )
+{
+	int code = 0, first = 0, index = 0;
+	for( uint32_t len = 1; len < 16; len++ )
+	{
+		code |= ( int )pepr_inflate_bits( s, 1 );
+		if( s->error ) return -1;
+		const int count = hm->count[ len ];
+		if( code - count < first ) return hm->symbol[ index + ( code - first ) ];
+		index += count;
+		first = ( first + count ) << 1;
+		code <<= 1;
+	}
+	s->error = 1;
+	return -1;
+}
+
+static int pepr_inflate_codes( pepr_inflate* s, const pepr_huffman* lencode, const pepr_huffman* distcode )
+{
+	static const uint16_t len_base[ 29 ] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t len_extra[ 29 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const uint16_t dist_base[ 30 ] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	static const uint8_t dist_extra[ 30 ] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	for( ;; )
+	{
+		int symbol = pepr_huffman_decode( s, lencode );
+		if( symbol < 0 ) return 0;
+		if( symbol < 256 )
+		{
+			if( s->out_pos >= s->out_size ) return 0;
+			s->out[ s->out_pos++ ] = ( uint8_t )symbol;
+		}
+		else if( symbol == 256 ) return 1;
+		else
+		{
+			symbol -= 257;
+			if( symbol >= 29 ) return 0;
+			const size_t len = len_base[ symbol ] + pepr_inflate_bits( s, len_extra[ symbol ] );
+			const int dist_symbol = pepr_huffman_decode( s, distcode );
+			if( dist_symbol < 0 || dist_symbol >= 30 ) return 0;
+			const size_t dist = dist_base[ dist_symbol ] + pepr_inflate_bits( s, dist_extra[ dist_symbol ] );
+			if( s->error || dist > s->out_pos || s->out_pos + len > s->out_size ) return 0;
+			for( size_t i = 0; i < len; i++, s->out_pos++ ) s->out[ s->out_pos ] = s->out[ s->out_pos - dist ];
+		}
+	}
+}
+
+// Inflates a zlib stream into out[ out_size ]; returns the bytes written, or
+// 0 on a malformed stream.
+static size_t pepr_zlib_inflate( const uint8_t* in, const size_t in_size, uint8_t* out, const size_t out_size )
+{
+	if( in_size < 2 || ( in[ 0 ] & 0x0F ) != 8 || ( ( in[ 0 ] << 8 ) | in[ 1 ] ) % 31 != 0 || ( in[ 1 ] & 0x20 ) ) return 0;
+
+	pepr_inflate s;
+	memset( &s, 0, sizeof( s ) );
+	s.in = in;
+	s.in_size = in_size;
+	s.in_pos = 2;
+	s.out = out;
+	s.out_size = out_size;
+
+	pepr_huffman lencode, distcode;
+	uint8_t lengths[ 320 ];
+	uint32_t last = 0;
+	while( !last )
+	{
+		last = pepr_inflate_bits( &s, 1 );
+		const uint32_t type = pepr_inflate_bits( &s, 2 );
+		if( s.error ) return 0;
+		if( type == 0 )
+		{
+			s.bit_buf = 0;
+			s.bit_count = 0;
+			if( s.in_pos + 4 > s.in_size ) return 0;
+			const uint32_t len = pepr_rd16le( s.in + s.in_pos );
+			if( ( len ^ 0xFFFF ) != pepr_rd16le( s.in + s.in_pos + 2 ) ) return 0;
+			s.in_pos += 4;
+			if( s.in_pos + len > s.in_size || s.out_pos + len > s.out_size ) return 0;
+			memcpy( s.out + s.out_pos, s.in + s.in_pos, len );
+			s.in_pos += len;
+			s.out_pos += len;
+			continue;
+		}
+		if( type == 1 )
+		{
+			uint32_t i = 0;
+			for( ; i < 144; i++ ) lengths[ i ] = 8;
+			for( ; i < 256; i++ ) lengths[ i ] = 9;
+			for( ; i < 280; i++ ) lengths[ i ] = 7;
+			for( ; i < 288; i++ ) lengths[ i ] = 8;
+			pepr_huffman_build( &lencode, lengths, 288 );
+			for( i = 0; i < 30; i++ ) lengths[ i ] = 5;
+			pepr_huffman_build( &distcode, lengths, 30 );
+		}
+		else if( type == 2 )
+		{
+			static const uint8_t order[ 19 ] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			const uint32_t nlen = pepr_inflate_bits( &s, 5 ) + 257;
+			const uint32_t ndist = pepr_inflate_bits( &s, 5 ) + 1;
+			const uint32_t ncode = pepr_inflate_bits( &s, 4 ) + 4;
+			if( s.error || nlen > 286 || ndist > 30 ) return 0;
+			memset( lengths, 0, 19 );
+			for( uint32_t i = 0; i < ncode; i++ ) lengths[ order[ i ] ] = ( uint8_t )pepr_inflate_bits( &s, 3 );
+			if( !pepr_huffman_build( &lencode, lengths, 19 ) ) return 0;
+			for( uint32_t i = 0; i < nlen + ndist; )
+			{
+				int symbol = pepr_huffman_decode( &s, &lencode );
+				if( symbol < 0 ) return 0;
+				if( symbol < 16 ){ lengths[ i++ ] = ( uint8_t )symbol; continue; }
+				uint8_t value = 0;
+				uint32_t repeat;
+				if( symbol == 16 ){ if( i == 0 ) return 0; value = lengths[ i - 1 ]; repeat = 3 + pepr_inflate_bits( &s, 2 ); }
+				else if( symbol == 17 ) repeat = 3 + pepr_inflate_bits( &s, 3 );
+				else repeat = 11 + pepr_inflate_bits( &s, 7 );
+				if( s.error || i + repeat > nlen + ndist ) return 0;
+				while( repeat-- ) lengths[ i++ ] = value;
+			}
+			if( !pepr_huffman_build( &lencode, lengths, nlen ) || !pepr_huffman_build( &distcode, lengths + nlen, ndist ) ) return 0;
+		}
+		else return 0;
+
+		if( !pepr_inflate_codes( &s, &lencode, &distcode ) ) return 0;
+	}
+	return s.out_pos;
+}
+
+static inline uint8_t pepr_paeth( const int a, const int b, const int c )
+{
+	const int p = a + b - c;
+	const int pa = abs( p - a ), pb = abs( p - b ), pc = abs( p - c );
+	return ( uint8_t )( ( pa <= pb && pa <= pc ) ? a : ( pb <= pc ? b : c ) );
+}
+
+// Undoes the per-row filters of one (sub)image in place.
+static int pepr_png_unfilter( uint8_t* data, const size_t rows, const size_t row_bytes, const size_t bpp_bytes )
+{
+	uint8_t* prev = NULL;
+	for( size_t y = 0; y < rows; y++ )
+	{
+		uint8_t* row = data + y * ( row_bytes + 1 );
+		const uint8_t filter = row[ 0 ];
+		row++;
+		for( size_t i = 0; i < row_bytes; i++ )
+		{
+			const int a = i >= bpp_bytes ? row[ i - bpp_bytes ] : 0;
+			const int b = prev ? prev[ i ] : 0;
+			const int c = ( prev && i >= bpp_bytes ) ? prev[ i - bpp_bytes ] : 0;
+			switch( filter )
+			{
+				case 0: break;
+				case 1: row[ i ] += ( uint8_t )a; break;
+				case 2: row[ i ] += ( uint8_t )b; break;
+				case 3: row[ i ] += ( uint8_t )( ( a + b ) >> 1 ); break;
+				case 4: row[ i ] += pepr_paeth( a, b, c ); break;
+				default: return 0;
+			}
+		}
+		prev = row;
+	}
+	return 1;
+}
+
+static uint32_t* pepr_load_png( const uint8_t* data, const size_t size, size_t* out_w, size_t* out_h, const char** err )
+{
+	if( size < 33 || pepr_rd32be( data + 12 ) != 0x49484452u ){ *err = "bad PNG header"; return NULL; } // IHDR
+	const uint32_t w = pepr_rd32be( data + 16 ), h = pepr_rd32be( data + 20 );
+	const uint32_t depth = data[ 24 ], color_type = data[ 25 ], interlace = data[ 28 ];
+	if( data[ 26 ] != 0 || data[ 27 ] != 0 || interlace > 1 ){ *err = "unsupported PNG"; return NULL; }
+
+	uint32_t channels;
+	switch( color_type )
+	{
+		case 0: channels = 1; break;
+		case 2: channels = 3; break;
+		case 3: channels = 1; break;
+		case 4: channels = 2; break;
+		case 6: channels = 4; break;
+		default: *err = "bad PNG color type"; return NULL;
+	}
+	if( depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16 ){ *err = "bad PNG bit depth"; return NULL; }
+	if( w == 0 || h == 0 || w > PEPR_IMAGE_MAX_DIM || h > PEPR_IMAGE_MAX_DIM ){ *err = "invalid image size"; return NULL; }
+
+	// Gather palette, transparency and the concatenated IDAT payload.
+	uint32_t palette[ 256 ];
+	for( uint32_t i = 0; i < 256; i++ ) palette[ i ] = 0x000000FF;
+	uint8_t palette_alpha[ 256 ];
+	memset( palette_alpha, 255, sizeof( palette_alpha ) );
+	int has_key = 0;
+	uint32_t key[ 3 ] = { 0, 0, 0 };
+
+	uint8_t* idat = NULL;
+	size_t idat_size = 0, idat_cap = 0;
+	const uint8_t* p = data + 8;
+	const uint8_t* end = data + size;
+	while( p + 12 <= end )
+	{
+		const uint32_t len = pepr_rd32be( p );
+		const uint32_t type = pepr_rd32be( p + 4 );
+		const uint8_t* chunk = p + 8;
+		if( len > ( size_t )( end - chunk ) - 4 ){ free( idat ); *err = "truncated PNG"; return NULL; }
+		if( type == 0x504C5445u ) // PLTE
+		{
+			for( uint32_t i = 0; i < len / 3 && i < 256; i++ ) palette[ i ] = ( ( uint32_t )chunk[ i * 3 ] << 24 ) | ( ( uint32_t )chunk[ i * 3 + 1 ] << 16 ) | ( ( uint32_t )chunk[ i * 3 + 2 ] << 8 );
+		}
+		else if( type == 0x74524E53u ) // tRNS
+		{
+			if( color_type == 3 ) for( uint32_t i = 0; i < len && i < 256; i++ ) palette_alpha[ i ] = chunk[ i ];
+			else if( color_type == 0 && len >= 2 ){ has_key = 1; key[ 0 ] = ( ( uint32_t )chunk[ 0 ] << 8 ) | chunk[ 1 ]; }
+			else if( color_type == 2 && len >= 6 ){ has_key = 1; for( int c = 0; c < 3; c++ ) key[ c ] = ( ( uint32_t )chunk[ c * 2 ] << 8 ) | chunk[ c * 2 + 1 ]; }
+		}
+		else if( type == 0x49444154u && len ) // IDAT
+		{
+			if( idat_size + len > idat_cap )
+			{
+				idat_cap = ( idat_size + len ) * 2;
+				uint8_t* grown = ( uint8_t* )realloc( idat, idat_cap );
+				if( !grown ){ free( idat ); *err = "alloc failed"; return NULL; }
+				idat = grown;
+			}
+			memcpy( idat + idat_size, chunk, len );
+			idat_size += len;
+		}
+		else if( type == 0x49454E44u ) break; // IEND
+		p = chunk + len + 4; // skip CRC
+	}
+	if( !idat ){ *err = "PNG has no image data"; return NULL; }
+	if( color_type == 0 ) key[ 1 ] = key[ 2 ] = key[ 0 ];
+
+	// Sub-image layout: one pass, or the 7 Adam7 passes.
+	static const uint8_t adam7[ 7 ][ 4 ] = { { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } };
+	const uint32_t passes = interlace ? 7 : 1;
+	const size_t bits_per_pixel = ( size_t )channels * depth;
+	const size_t bpp_bytes = ( bits_per_pixel + 7 ) / 8;
+	size_t raw_size = 0;
+	for( uint32_t pass = 0; pass < passes; pass++ )
+	{
+		const size_t pw = interlace ? ( w + adam7[ pass ][ 2 ] - 1 - adam7[ pass ][ 0 ] ) / adam7[ pass ][ 2 ] : w;
+		const size_t ph = interlace ? ( h + adam7[ pass ][ 3 ] - 1 - adam7[ pass ][ 1 ] ) / adam7[ pass ][ 3 ] : h;
+		if( pw && ph ) raw_size += ph * ( 1 + ( pw * bits_per_pixel + 7 ) / 8 );
+	}
+
+	uint8_t* raw = ( uint8_t* )malloc( raw_size );
+	if( !raw ){ free( idat ); *err = "alloc failed"; return NULL; }
+	const size_t inflated = pepr_zlib_inflate( idat, idat_size, raw, raw_size );
+	free( idat );
+	if( inflated != raw_size ){ free( raw ); *err = "corrupt PNG data"; return NULL; }
+
+	uint32_t* pixels = pepr_alloc_pixels( w, h, err );
+	if( !pixels ){ free( raw ); return NULL; }
+	*out_w = w;
+	*out_h = h;
+
+	const uint32_t max_sample = ( 1u << depth ) - 1;
+	uint8_t* sub = raw;
+	for( uint32_t pass = 0; pass < passes; pass++ )
+	{
+		const size_t x0 = interlace ? adam7[ pass ][ 0 ] : 0, y0 = interlace ? adam7[ pass ][ 1 ] : 0;
+		const size_t dx = interlace ? adam7[ pass ][ 2 ] : 1, dy = interlace ? adam7[ pass ][ 3 ] : 1;
+		const size_t pw = ( w + dx - 1 - x0 ) / dx;
+		const size_t ph = ( h + dy - 1 - y0 ) / dy;
+		if( !pw || !ph ) continue;
+		const size_t row_bytes = ( pw * bits_per_pixel + 7 ) / 8;
+		if( !pepr_png_unfilter( sub, ph, row_bytes, bpp_bytes ) ){ free( raw ); free( pixels ); *err = "bad PNG filter"; return NULL; }
+
+		for( size_t y = 0; y < ph; y++ )
+		{
+			const uint8_t* row = sub + y * ( row_bytes + 1 ) + 1;
+			uint32_t* out = pixels + ( y0 + y * dy ) * w + x0;
+			for( size_t x = 0; x < pw; x++, out += dx )
+			{
+				uint32_t s[ 4 ];
+				for( uint32_t c = 0; c < channels; c++ )
+				{
+					if( depth == 16 ) s[ c ] = ( ( uint32_t )row[ ( x * channels + c ) * 2 ] << 8 ) | row[ ( x * channels + c ) * 2 + 1 ];
+					else if( depth == 8 ) s[ c ] = row[ x * channels + c ];
+					else
+					{
+						const size_t bit = ( x * channels + c ) * depth;
+						s[ c ] = ( row[ bit >> 3 ] >> ( 8 - depth - ( bit & 7 ) ) ) & max_sample;
+					}
+				}
+
+				if( color_type == 3 )
+				{
+					const uint32_t c = palette[ s[ 0 ] & 0xFF ];
+					*out = pepr_rgba( c >> 24, ( c >> 16 ) & 0xFF, ( c >> 8 ) & 0xFF, palette_alpha[ s[ 0 ] & 0xFF ] );
+					continue;
+				}
+
+				const int keyed = has_key && s[ 0 ] == key[ 0 ] && ( channels < 3 || ( s[ 1 ] == key[ 1 ] && s[ 2 ] == key[ 2 ] ) );
+				for( uint32_t c = 0; c < channels; c++ ) s[ c ] = depth == 16 ? s[ c ] >> 8 : ( s[ c ] * 255 ) / max_sample;
+				switch( color_type )
+				{
+					case 0: *out = pepr_rgba( s[ 0 ], s[ 0 ], s[ 0 ], keyed ? 0 : 255 ); break;
+					case 2: *out = pepr_rgba( s[ 0 ], s[ 1 ], s[ 2 ], keyed ? 0 : 255 ); break;
+					case 4: *out = pepr_rgba( s[ 0 ], s[ 0 ], s[ 0 ], s[ 1 ] ); break;
+					default: *out = pepr_rgba( s[ 0 ], s[ 1 ], s[ 2 ], s[ 3 ] ); break;
+				}
+			}
+		}
+		sub += ph * ( row_bytes + 1 );
+	}
+
+	free( raw );
+	return pixels;
+}
+
+/////// /////// /////// /////// /////// /////// ///////
+
+// Decodes an in-memory image by sniffing its signature.
+// Returns NULL with *err set when the format is unknown or the data is bad;
+// *err is NULL only if the format simply isn't one of ours.
+static uint32_t* pepr_image_decode( const uint8_t* data, const size_t size, size_t* out_w, size_t* out_h, const char** err )
+{
+	*err = NULL;
+	if( size >= 8 && !memcmp( data, "\x89PNG\r\n\x1a\n", 8 ) ) return pepr_load_png( data, size, out_w, out_h, err );
+	if( size >= 2 && data[ 0 ] == 'B' && data[ 1 ] == 'M' ) return pepr_load_bmp( data, size, out_w, out_h, err );
+	if( size >= 3 && data[ 0 ] == 'P' && ( ( data[ 1 ] >= '2' && data[ 1 ] <= '3' ) || ( data[ 1 ] >= '5' && data[ 1 ] <= '7' ) ) ) return pepr_load_pnm( data, size, out_w, out_h, err );
+	// TGA has no signature; accept it when the header is self-consistent.
+	if( size >= 18 && data[ 1 ] <= 1 && ( ( data[ 2 ] >= 1 && data[ 2 ] <= 3 ) || ( data[ 2 ] >= 9 && data[ 2 ] <= 11 ) ) &&
+	    pepr_rd16le( data + 12 ) && pepr_rd16le( data + 14 ) && ( data[ 16 ] == 8 || data[ 16 ] == 15 || data[ 16 ] == 16 || data[ 16 ] == 24 || data[ 16 ] == 32 ) )
+	{
+		return pepr_load_tga( data, size, out_w, out_h, err );
+	}
+	return NULL;
+}
+
+// Reads a whole file into *buf, growing it (and *cap) when it's too small, so a
+// caller converting many files can keep one buffer. Returns *buf, or NULL on failure.
+static uint8_t* pepr_read_file_into( const char* path, uint8_t** buf, size_t* cap, size_t* out_size )
+{
+	FILE* f = fopen( path, "rb" );
+	if( !f ) return NULL;
+	fseek( f, 0, SEEK_END );
+	const long sz = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	if( sz <= 0 ){ fclose( f ); return NULL; }
+	if( *cap < ( size_t )sz )
+	{
+		uint8_t* grown = ( uint8_t* )realloc( *buf, ( size_t )sz );
+		if( !grown ){ fclose( f ); return NULL; }
+		*buf = grown;
+		*cap = ( size_t )sz;
+	}
+	const size_t got = fread( *buf, 1, ( size_t )sz, f );
+	fclose( f );
+	if( got != ( size_t )sz ) return NULL;
+	*out_size = ( size_t )sz;
+	return *buf;
+}
+
+// Reads a whole file into a new buffer. Returns NULL on failure.
+static uint8_t* pepr_read_file( const char* path, size_t* out_size )
+{
+	uint8_t* data = NULL;
+	size_t cap = 0;
+	if( !pepr_read_file_into( path, &data, &cap, out_size ) ){ free( data ); return NULL; }
+	return data;
+}
+
+#endif // PEPR_IMAGE_H
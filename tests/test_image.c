@@ -0,0 +1,71 @@
+// Regression tests for the pepr_image.h readers on short and malformed input.
+// Every input is copied into a heap buffer of exactly its size, so a reader
+// that runs past the end shows up under AddressSanitizer (`make test`).
+
+#include "../pepr_image.h"
+
+static int failures = 0;
+static int checks = 0;
+
+// Decodes size bytes of data and checks that it fails with an error, or that
+// it gives w x h pixels starting with first_pixel when expect_ok.
+static void check_decode( const char* const name, const void* const data, const size_t size, const int expect_ok, const size_t w, const size_t h, const uint32_t first_pixel )
+{
+	uint8_t* const copy = ( uint8_t* )malloc( size );
+	memcpy( copy, data, size );
+	size_t out_w = 0, out_h = 0;
+	const char* err = NULL;
+	uint32_t* const pixels = pepr_image_decode( copy, size, &out_w, &out_h, &err );
+	checks++;
+	if( expect_ok && ( !pixels || out_w != w || out_h != h || pixels[ 0 ] != first_pixel ) )
+	{
+		printf( "FAIL %s: expected a %zux%zu image (%s)\n", name, w, h, err ? err : "no error" );
+		failures++;
+	}
+	else if( !expect_ok && ( pixels || !err ) )
+	{
+		printf( "FAIL %s: expected an error\n", name );
+		failures++;
+	}
+	free( pixels );
+	free( copy );
+}
+
+#define CHECK_FAILS( NAME, TEXT ) check_decode( NAME, TEXT, sizeof( TEXT ) - 1, 0, 0, 0, 0 )
+
+int main( void )
+{
+	( void )pepr_read_file; // only the in-memory readers are tested
+
+	// PNM headers that end the file right where the raster starts.
+	CHECK_FAILS( "P5 header only", "P5 1 1 255" );
+	CHECK_FAILS( "P6 header only", "P6 1 1 255" );
+	CHECK_FAILS( "P6 header, no raster", "P6 1 1 255\n" );
+	CHECK_FAILS( "PAM ENDHDR at end", "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nENDHDR" );
+	CHECK_FAILS( "PAM header only", "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nENDHDR\n" );
+	check_decode( "P6 1x1", "P6 1 1 255\n\x10\x20\x30", sizeof( "P6 1 1 255\n\x10\x20\x30" ) - 1, 1, 1, 1, pepr_rgba( 0x10, 0x20, 0x30, 255 ) );
+	const char pam[] = "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nENDHDR\n\x10\x20\x30";
+	check_decode( "PAM 1x1", pam, sizeof( pam ) - 1, 1, 1, 1, pepr_rgba( 0x10, 0x20, 0x30, 255 ) );
+
+	// TGA: an 18 byte header, then the color map and the pixels.
+	const uint8_t tga_cmap8[] = { 0, 1, 1, 0, 0, 1, 0, 8, 0, 0, 0, 0, 1, 0, 1, 0, 8, 0, 0xAA, 0 };
+	check_decode( "TGA 8-bit color map", tga_cmap8, sizeof( tga_cmap8 ), 0, 0, 0, 0 );
+	const uint8_t tga_cmap1[] = { 0, 1, 1, 0, 0, 1, 0, 1, 0, 0, 0, 0, 1, 0, 1, 0, 8, 0, 0xAA, 0 };
+	check_decode( "TGA 1-bit color map", tga_cmap1, sizeof( tga_cmap1 ), 0, 0, 0, 0 );
+	const uint8_t tga_cmap24[] = { 0, 1, 1, 0, 0, 1, 0, 24, 0, 0, 0, 0, 1, 0, 1, 0, 8, 0x20, 0x30, 0x20, 0x10, 0 };
+	check_decode( "TGA 24-bit color map", tga_cmap24, sizeof( tga_cmap24 ), 1, 1, 1, pepr_rgba( 0x10, 0x20, 0x30, 255 ) );
+
+	const uint8_t tga_raw[] = { 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 1, 0, 24, 0x20, 0x30, 0x20, 0x10, 0x30, 0x20, 0x10 };
+	check_decode( "TGA raw 2x1", tga_raw, sizeof( tga_raw ), 1, 2, 1, pepr_rgba( 0x10, 0x20, 0x30, 255 ) );
+	check_decode( "TGA raw, one pixel short", tga_raw, sizeof( tga_raw ) - 3, 0, 0, 0, 0 );
+	check_decode( "TGA raw, no pixels", tga_raw, 18, 0, 0, 0, 0 );
+
+	const uint8_t tga_rle[] = { 0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 1, 0, 24, 0x20, 0x81, 0x30, 0x20, 0x10 };
+	check_decode( "TGA RLE 2x1", tga_rle, sizeof( tga_rle ), 1, 2, 1, pepr_rgba( 0x10, 0x20, 0x30, 255 ) );
+	check_decode( "TGA RLE, run cut short", tga_rle, sizeof( tga_rle ) - 1, 0, 0, 0, 0 );
+	const uint8_t tga_rle_short[] = { 0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 1, 0, 24, 0x20, 0x00, 0x30, 0x20, 0x10 };
+	check_decode( "TGA RLE, missing packet", tga_rle_short, sizeof( tga_rle_short ), 0, 0, 0, 0 );
+
+	printf( "%s: %d/%d image reader checks passed\n", failures ? "FAILED" : "OK", checks - failures, checks );
+	return failures != 0;
+}
@@ -0,0 +1,170 @@
+// Checks every SIMD kernel compiled into PEP.h against its scalar version:
+// the frequency kernels (`sum_below`, `find`, `rescale`) and the bulk
+// swizzles, on random input and on lengths around the vector widths, so the
+// scalar tails are covered too. AVX2 and SSSE3 are only run when the CPU has
+// them; on a build without SIMD there is nothing to compare.
+
+#define PEP_IMPLEMENTATION
+#include "../PEP.h"
+
+static int failures = 0;
+static int checks = 0;
+
+static uint32_t rng_state = 0x9E3779B9u;
+static uint32_t rng( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static const uint32_t lengths[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 23, 24, 31, 32, 33, 255, 256, 257 };
+#define LENGTH_COUNT ( sizeof lengths / sizeof lengths[ 0 ] )
+#define LENGTH_MAX 257
+
+static void check( const int ok, const char* const kernel, const char* const variant, const uint32_t n, const char* const what )
+{
+	checks++;
+	if( ok ) return;
+	printf( "FAIL %s_%s, n = %u: %s differs from scalar\n", kernel, variant, n, what );
+	failures++;
+}
+
+// The largest count one symbol can reach: the biggest freq_max plus the
+// step that pushed it over.
+#define FREQ_TOP ( PEP_FREQ_MAX_LIMIT + PEP_FREQ_STEP_LIMIT )
+
+// Fills freq with one of a few shapes: random model frequencies, all zeroes
+// (what most of a fresh model is) or every symbol at FREQ_TOP.
+static void fill_freq( uint16_t* const freq, const uint32_t n, const uint32_t shape )
+{
+	for( uint32_t i = 0; i < n; i++ )
+	{
+		if( shape == 0 ) freq[ i ] = ( uint16_t )( rng() % ( FREQ_TOP + 1 ) );
+		else if( shape == 1 ) freq[ i ] = 0;
+		else freq[ i ] = ( uint16_t )FREQ_TOP;
+	}
+}
+
+typedef uint32_t ( *sum_below_fn )( const uint16_t*, uint32_t );
+typedef uint32_t ( *find_fn )( const uint16_t*, uint32_t, uint32_t, uint32_t* );
+typedef uint32_t ( *rescale_fn )( uint16_t*, uint32_t );
+
+static void check_freq_kernels( const char* const variant, const sum_below_fn sum_below, const find_fn find, const rescale_fn rescale )
+{
+	uint16_t freq[ LENGTH_MAX ], expect[ LENGTH_MAX ];
+	for( uint32_t l = 0; l < LENGTH_COUNT; l++ )
+	for( uint32_t shape = 0; shape < 3; shape++ )
+	for( uint32_t round = 0; round < ( shape ? 1 : 8 ); round++ )
+	{
+		const uint32_t n = lengths[ l ];
+		fill_freq( freq, n, shape );
+
+		const uint32_t total = _pep_sum_below_scalar( freq, n );
+		check( sum_below( freq, n ) == total, "_pep_sum_below", variant, n, "sum" );
+
+		// Targets before the first symbol, inside the run, on its last
+		// symbol and past all of it, each from a zero and a nonzero start.
+		const uint32_t start = rng() % 1024;
+		const uint32_t targets[] = { 0, rng() % ( total + 1 ), total ? total - 1 : 0, total, total + 1 };
+		for( uint32_t t = 0; t < sizeof targets / sizeof targets[ 0 ]; t++ )
+		for( uint32_t s = 0; s < 2; s++ )
+		{
+			const uint32_t target = targets[ t ] + ( s ? start : 0 );
+			uint32_t cum = s ? start : 0, expect_cum = cum;
+			const uint32_t index = find( freq, n, target, &cum );
+			const uint32_t expect_index = _pep_find_scalar( freq, n, target, &expect_cum );
+			check( index == expect_index, "_pep_find", variant, n, "index" );
+			check( cum == expect_cum, "_pep_find", variant, n, "cum" );
+		}
+
+		for( uint32_t i = 0; i < n; i++ ) expect[ i ] = freq[ i ];
+		const uint32_t sum = rescale( freq, n );
+		const uint32_t expect_sum = _pep_rescale_scalar( expect, n );
+		int same = 1;
+		for( uint32_t i = 0; i < n; i++ ) same &= freq[ i ] == expect[ i ];
+		check( sum == expect_sum, "_pep_rescale", variant, n, "sum" );
+		check( same, "_pep_rescale", variant, n, "frequencies" );
+	}
+}
+
+typedef uint64_t ( *swizzle_fn )( uint32_t*, const uint32_t*, uint64_t, uint32_t );
+
+// Runs a bulk swizzle for every pair of formats and finishes its tail with
+// the scalar loop, the way `pep_swizzle()` does.
+static void check_swizzle_kernel( const char* const variant, const swizzle_fn swizzle )
+{
+	uint32_t in[ LENGTH_MAX ], out[ LENGTH_MAX ];
+	for( uint32_t l = 0; l < LENGTH_COUNT; l++ )
+	for( uint32_t from = pep_rgba; from <= pep_argb; from++ )
+	for( uint32_t to = pep_rgba; to <= pep_argb; to++ )
+	{
+		const uint32_t n = lengths[ l ];
+		const _pep_swizzle sw = _pep_swizzle_of( ( pep_format )from, ( pep_format )to );
+		for( uint32_t i = 0; i < n; i++ ) in[ i ] = rng();
+
+		uint64_t i = swizzle( out, in, n, _pep_swizzle_apply( 0x03020100, sw ) );
+		int same = i <= n;
+		for( ; i < n; i++ ) out[ i ] = _pep_swizzle_apply( in[ i ], sw );
+		for( i = 0; same && i < n; i++ ) same = out[ i ] == _pep_swizzle_apply( in[ i ], sw );
+		check( same, "_pep_swizzle", variant, n, "colors" );
+	}
+}
+
+// `pep_swizzle()` is documented to work in place, which pepr relies on.
+static void check_swizzle_in_place( void )
+{
+	uint32_t pixels[ LENGTH_MAX ], expect[ LENGTH_MAX ];
+	for( uint32_t l = 0; l < LENGTH_COUNT; l++ )
+	for( uint32_t from = pep_rgba; from <= pep_argb; from++ )
+	for( uint32_t to = pep_rgba; to <= pep_argb; to++ )
+	{
+		const uint32_t n = lengths[ l ];
+		for( uint32_t i = 0; i < n; i++ ) expect[ i ] = _pep_reformat( pixels[ i ] = rng(), ( pep_format )from, ( pep_format )to );
+		pep_swizzle( pixels, pixels, n, ( pep_format )from, ( pep_format )to );
+		int same = 1;
+		for( uint32_t i = 0; i < n; i++ ) same &= pixels[ i ] == expect[ i ];
+		check( same, "pep_swizzle", "in_place", n, "colors" );
+	}
+}
+
+int main( void )
+{
+	( void )check_freq_kernels; // neither is used without SIMD
+	( void )check_swizzle_kernel;
+	int variants = 0;
+	_pep_kernels_init();
+
+#ifdef _PEP_SIMD_SSE2
+	check_freq_kernels( "sse2", _pep_sum_below_sse2, _pep_find_sse2, _pep_rescale_sse2 );
+	variants++;
+#endif
+#ifdef _PEP_SIMD_AVX2
+	if( _pep_cpu_has( _PEP_CPU_AVX2 ) )
+	{
+		check_freq_kernels( "avx2", _pep_sum_below_avx2, _pep_find_avx2, _pep_rescale_avx2 );
+		check_swizzle_kernel( "avx2", _pep_swizzle_avx2 );
+		variants++;
+	}
+	else printf( "skipping avx2: not supported by this CPU\n" );
+	if( _pep_cpu_has( _PEP_CPU_SSSE3 ) )
+	{
+		check_swizzle_kernel( "ssse3", _pep_swizzle_ssse3 );
+		variants++;
+	}
+	else printf( "skipping ssse3: not supported by this CPU\n" );
+#endif
+#ifdef _PEP_SIMD_NEON
+	check_freq_kernels( "neon", _pep_sum_below_neon, _pep_find_neon, _pep_rescale_neon );
+	variants++;
+#endif
+#if defined( _PEP_SIMD_NEON ) && !defined( __AARCH64EB__ )
+	check_swizzle_kernel( "neon", _pep_swizzle_neon );
+#endif
+
+	check_swizzle_in_place();
+
+	printf( "%s: %d/%d kernel checks passed (%d SIMD variants)\n", failures ? "FAILED" : "OK", checks - failures, checks, variants );
+	return failures != 0;
+}